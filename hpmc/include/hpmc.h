@@ -115,7 +115,8 @@
   * HPMCsetFieldTexture3D( hpmc_h, volume_tex, GL_FALSE );
   * \endcode
   * The scalar field is assumed to be stored in the alpha channel of the
-  * texture.
+  * texture. Alpha formats are gone in the core profile, where a single-channel
+  * GL_RED texture needs GL_TEXTURE_SWIZZLE_A set to GL_RED.
   *
   * If the gradient field is known, one use
   * \code
@@ -305,6 +306,15 @@ struct HPMCTraversalHandle;
   * set of sharing contexts. Thus, it is highly likely that you only need one
   * instance of constants.
   *
+  * If the current context is a core profile context, HPMC uses its core
+  * backend: The generated shaders are versioned (330 for the GPGPU passes, 430
+  * for compute), GPGPU passes draw a full-screen triangle from a vertex array
+  * object, and the HistoPyramid texture has immutable storage when
+  * glTexStorage2D is available. The core profile has no attribute stacks, so
+  * only the viewport and the vertex array object binding are restored, not the
+  * texture bindings of the texture units HPMC uses. The core profile requires
+  * OpenGL 3.3. The traversal shader functions work with GLSL 3.30 core and up.
+  *
   * \sideeffect None.
   */
 struct HPMCConstants*
@@ -319,6 +329,101 @@ HPMCcreateConstants( GLint max_gl_major, GLint max_gl_minor );
 void
 HPMCdestroyConstants( struct HPMCConstants* c );
 
+/** Enables or disables stateless mode.
+  *
+  * By default, HPMC saves and restores the OpenGL state it touches, using
+  * glPushAttrib, glPushClientAttrib and glGetIntegerv. On threaded drivers,
+  * each query may flush the command stream. In stateless mode, HPMC does no
+  * state queries and uses direct state access, except that builds skipped
+  * when unchanged read the uniforms of HPMCaddFieldUniform back. Instead of
+  * restoring state, it only touches the following bindings:
+  * - GL_CURRENT_PROGRAM, GL_PIXEL_PACK_BUFFER_BINDING,
+  *   GL_DRAW_INDIRECT_BUFFER_BINDING and GL_VERTEX_ARRAY_BINDING are left as
+  *   zero.
+  * - The texture units given to HPMCsetFieldTexture3D or HPMCsetFieldCustom
+  *   and to HPMCsetTraversalHandleProgram are left with HPMC's textures bound.
+  * - Image units 0 to 3 (0 to 4 with separate MC codes, 0 to 7 with indexed
+  *   extraction) and shader storage buffer binding 0 are used during
+  *   construction.
+  * - HPMCextractIndicesTransformFeedback leaves GL_RASTERIZER_DISCARD
+  *   disabled.
+  * - HPMCextractToBuffer leaves GL_TRANSFORM_FEEDBACK_BINDING as zero.
+  *
+  * If the compute shader construction cannot be used, the GPGPU passes also
+  * change the viewport, the active texture unit and the vertex array state,
+  * and the framebuffer binding is left as zero. With empty-space skipping,
+  * texture unit 2 is left with the bricks bound. Incremental builds using
+  * GPGPU passes (see HPMCmarkFieldRegionDirty) also change the scissor box
+  * and leave the scissor test disabled. In release builds,
+  * glGetError is not called when building and extracting in stateless mode.
+  *
+  * Set this before creating HistoPyramid instances using the constants.
+  *
+  * \param s          Pointer to an existing constant instance.
+  * \param stateless  GL_TRUE to enable stateless mode.
+  * \return           True on success. Stateless mode requires an OpenGL 4.3
+  *                   target and ARB_direct_state_access (core in OpenGL 4.5).
+  *
+  * \sideeffect None.
+  */
+bool
+HPMCsetStateless( struct HPMCConstants* s, GLboolean stateless );
+
+/** Enables or disables the on-disk program binary cache.
+  *
+  * The shader programs HPMC generates depend on the layout and field of the
+  * HistoPyramid, and compiling them dominates the time of creating a
+  * HistoPyramid. With the cache enabled, each program HPMC builds is stored
+  * as a binary in the cache directory, using glGetProgramBinary, and later
+  * builds of the same program, also in later runs of the application, are
+  * loaded with glProgramBinary instead of being compiled.
+  *
+  * A program is identified by its generated source and the GL_VENDOR,
+  * GL_RENDERER and GL_VERSION strings, so a driver update makes the cache
+  * miss instead of loading incompatible binaries. The directory must exist,
+  * the files are named hpmc-<hash>.bin. Applications can cache their
+  * traversal programs with HPMCloadCachedProgram and HPMCstoreCachedProgram.
+  *
+  * \param s          Pointer to an existing constant instance.
+  * \param directory  The cache directory, or NULL to disable the cache.
+  * \return           True on success. The cache requires OpenGL 4.1 or
+  *                   ARB_get_program_binary, and a driver that supports at
+  *                   least one program binary format.
+  *
+  * \sideeffect None.
+  */
+bool
+HPMCsetProgramBinaryCache( struct HPMCConstants* s, const char* directory );
+
+/** Loads a program from the program binary cache.
+  *
+  * \param s    Pointer to an existing constant instance.
+  * \param key  Text that identifies the program, typically the concatenated
+  *             shader sources, along with the names of any attribute, fragment
+  *             output and transform feedback bindings set before linking.
+  * \return     A new linked program, or zero if the cache is disabled or does
+  *             not hold a usable binary for key.
+  *
+  * \sideeffect None.
+  */
+GLuint
+HPMCloadCachedProgram( struct HPMCConstants* s, const char* key );
+
+/** Stores a linked program in the program binary cache.
+  *
+  * Set GL_PROGRAM_BINARY_RETRIEVABLE_HINT on the program before linking it,
+  * some drivers do not keep the binary otherwise.
+  *
+  * \param s        Pointer to an existing constant instance.
+  * \param key      Text that identifies the program, see HPMCloadCachedProgram.
+  * \param program  A successfully linked program.
+  * \return         True if the binary was written to the cache.
+  *
+  * \sideeffect None.
+  */
+bool
+HPMCstoreCachedProgram( struct HPMCConstants* s, const char* key, GLuint program );
+
 /** Creates a new HistoPyramid instance on the current context.
   *
   * \param s  A pointer to a constant instance residing on a context sharing
@@ -340,7 +445,7 @@ HPMCcreateHistoPyramid( struct HPMCConstants* s );
   * \param y_size  The size of the lattice along the y-axis.
   * \param z_size  The size of the lattice along the z-axis.
   *
-  * \sideeffect Triggers rebuilding of shaders and textures.
+  * \sideeffect Triggers rebuilding of shaders and textures if the size changes.
   */
 void
 HPMCsetLatticeSize( struct HPMCHistoPyramid*  h,
@@ -348,6 +453,198 @@ HPMCsetLatticeSize( struct HPMCHistoPyramid*  h,
                     GLsizei                   y_size,
                     GLsizei                   z_size );
 
+/** Specify the storage format of the HistoPyramid.
+  *
+  * The default, GL_RGBA32F, stores vertex counts in floats, which are exact
+  * up to 2^24 (about 16.7 million) vertices. Above that, triangles get
+  * dropped or duplicated. GL_RGBA32UI stores counts and MC codes as unsigned
+  * integers and traverses the HistoPyramid using integer keys, which is
+  * exact up to 2^31 vertices. Integer storage requires OpenGL 3.0.
+  *
+  * \param h       Pointer to an existing HistoPyramid instance.
+  * \param format  Either GL_RGBA32F or GL_RGBA32UI.
+  *
+  * \sideeffect Triggers rebuilding of shaders and textures.
+  */
+void
+HPMCsetHistoPyramidFormat( struct HPMCHistoPyramid* h,
+                           GLenum                   format );
+
+/** Specify whether the lower levels of the HistoPyramid use 16-bit storage.
+  *
+  * A texel of the base level holds vertex counts of at most 15 and an 8-bit
+  * MC code, and the levels above the base level grow by a factor of four per
+  * level. With mixed precision, the lowest levels, which make up nearly all
+  * of the HistoPyramid, are stored as GL_RGBA16UI, and only the upper levels
+  * use 32 bits. This halves the memory traffic of construction and
+  * traversal. The upper levels are stored in a separate texture, which needs
+  * an extra texture unit during traversal, see
+  * HPMCsetTraversalHandleUpperLevelsUnit. Mixed precision requires the
+  * GL_RGBA32UI HistoPyramid format.
+  *
+  * \param h      Pointer to an existing HistoPyramid instance.
+  * \param mixed  GL_TRUE to store the lower levels in 16 bits.
+  *
+  * \sideeffect Triggers rebuilding of shaders and textures.
+  */
+void
+HPMCsetHistoPyramidMixedPrecision( struct HPMCHistoPyramid* h,
+                                   GLboolean                mixed );
+
+/** Specify whether the MC codes are stored in a separate texture.
+  *
+  * By default, the base level of the HistoPyramid packs the MC code of each
+  * cell with its vertex count, in the fractional part with GL_RGBA32F and in
+  * the bits above the count with GL_RGBA32UI. With separate codes, the codes
+  * are written to a GL_RGBA8UI texture of the size of the base level, so that
+  * all levels of the HistoPyramid hold plain vertex counts and every
+  * reduction uses the same program. The code texture needs an extra texture
+  * unit during traversal, see HPMCsetTraversalHandleCodeUnit. Separate codes
+  * require OpenGL 3.0.
+  *
+  * \param h         Pointer to an existing HistoPyramid instance.
+  * \param separate  GL_TRUE to store the MC codes in a separate texture.
+  *
+  * \sideeffect Triggers rebuilding of shaders and textures.
+  */
+void
+HPMCsetHistoPyramidSeparateCodes( struct HPMCHistoPyramid* h,
+                                  GLboolean                separate );
+
+/** Specify the fan-out of the HistoPyramid traversal.
+  *
+  * By default, every level of the HistoPyramid is built by a separate 4-to-1
+  * reduction pass, and the traversal does one dependent texture fetch per
+  * level. With a fan-out of 16, every second level is skipped: it is neither
+  * built nor read, the levels around it are reduced 16-to-1 in a single
+  * pass, and the traversal fetches the four texels below a skipped level at
+  * once and chooses among their 16 children. This halves both the number of
+  * reduction passes and the chain of dependent fetches per vertex. The
+  * memory use is unchanged. A fan-out of 16 requires OpenGL 3.0.
+  *
+  * \param h        Pointer to an existing HistoPyramid instance.
+  * \param fan_out  Either 4 (the default) or 16.
+  *
+  * \sideeffect Triggers rebuilding of shaders and textures.
+  */
+void
+HPMCsetHistoPyramidFanOut( struct HPMCHistoPyramid* h,
+                           GLuint                   fan_out );
+
+/** Specify whether the HistoPyramid uses the compact layout.
+  *
+  * The base level of the HistoPyramid is a set of tiles, one tile per slice
+  * of the grid. By default, tiles and the HistoPyramid texture are padded to
+  * a square power-of-two, which for some grid sizes is mostly padding. The
+  * compact layout packs tiles of exact size into a rectangular texture,
+  * choosing the arrangement of tiles with the least memory. The width and
+  * height are only padded to a multiple of 2^n, which leaves a top level of
+  * at most 8x8 texels that the traversal scans before descending. The compact
+  * layout requires OpenGL 3.0.
+  *
+  * \param h        Pointer to an existing HistoPyramid instance.
+  * \param compact  GL_TRUE to use the compact layout.
+  *
+  * \sideeffect Triggers rebuilding of shaders and textures.
+  */
+void
+HPMCsetHistoPyramidCompactLayout( struct HPMCHistoPyramid* h,
+                                  GLboolean                compact );
+
+/** Specify whether the HistoPyramid is double buffered.
+  *
+  * A double-buffered HistoPyramid keeps a front and a back HistoPyramid.
+  * Builds write the back one, while traversal handles, HPMCacquireNumberOfVertices
+  * and HPMCpollNumberOfVertices use the front one until HPMCswapHistopyramids
+  * is called. The build of the next frame can then overlap extraction from the
+  * previous one. Double buffering doubles the memory use, rebuilds the whole
+  * field on every build, and cannot be combined with HPMCbuildHistopyramidMulti.
+  *
+  * \param h                Pointer to an existing HistoPyramid instance.
+  * \param double_buffered  GL_TRUE to double buffer.
+  *
+  * \sideeffect Triggers rebuilding of shaders and textures.
+  */
+void
+HPMCsetHistoPyramidDoubleBuffered( struct HPMCHistoPyramid* h,
+                                   GLboolean                double_buffered );
+
+/** Enables indexed extraction, where vertices shared by triangles are extracted once.
+  *
+  * The base level pass also builds an edge HistoPyramid that counts the
+  * intersected edges of the grid, each owned by one cell. The vertices are
+  * then extracted once per edge with HPMCextractUniqueVerticesTransformFeedback,
+  * and three indices per triangle into those vertices with
+  * HPMCextractIndicesTransformFeedback, giving a mesh that can be drawn with
+  * glDrawElements. Cull planes remove triangles, but not the vertices of
+  * their edges.
+  *
+  * Requires OpenGL 3.0, a continuous field and a single surface, and does not
+  * combine with double buffering, mixed precision, separate MC codes or
+  * occlusion culling. Adds one HistoPyramid to the memory use.
+  *
+  * \param h        Pointer to an existing HistoPyramid instance.
+  * \param indexed  GL_TRUE to build the edge HistoPyramid.
+  *
+  * \sideeffect Triggers rebuilding of shaders and textures.
+  */
+void
+HPMCsetIndexedExtraction( struct HPMCHistoPyramid* h,
+                          GLboolean                indexed );
+
+/** Enables per-cell extraction, where each active cell is traversed once.
+  *
+  * The base level pass also builds a cell HistoPyramid that counts the cells
+  * intersected by the surface. The shader functions of
+  * HPMCgetCellTraversalShaderFunctions are called from a geometry shader,
+  * where extractCell locates the cell of the input point, samples its eight
+  * corners and returns its number of vertices, and extractCellVertex returns
+  * each vertex from these samples:
+  * \code
+  * layout(points) in;
+  * layout(triangle_strip, max_vertices=15) out;
+  * void main() {
+  *     int count = extractCell();
+  *     for( int i=0; i<count; i++ ) {
+  *         vec3 p, n;
+  *         extractCellVertex( i, p, n );
+  *         ...
+  *         EmitVertex();
+  *         if( (i%3) == 2 ) {
+  *             EndPrimitive();
+  *         }
+  *     }
+  * }
+  * \endcode
+  * The cells are drawn by HPMCextractCells or HPMCextractCellsTransformFeedback.
+  *
+  * Requires OpenGL 3.2, a continuous field and a single surface, and does not
+  * combine with double buffering, mixed precision or separate MC codes. Adds
+  * one HistoPyramid to the memory use.
+  *
+  * \param h         Pointer to an existing HistoPyramid instance.
+  * \param per_cell  GL_TRUE to build the cell HistoPyramid.
+  *
+  * \sideeffect Triggers rebuilding of shaders and textures.
+  */
+void
+HPMCsetPerCellExtraction( struct HPMCHistoPyramid* h,
+                          GLboolean                per_cell );
+
+/** Returns the texture memory used by the HistoPyramid, in bytes.
+  *
+  * Counts all mipmap levels of the HistoPyramid textures and the MC code
+  * texture for the current configuration, so it can be checked against
+  * available memory before the first build.
+  *
+  * \param h  Pointer to an existing HistoPyramid instance.
+  * \return   Number of bytes, or zero if the configuration is invalid.
+  *
+  * \sideeffect None.
+  */
+GLsizeiptr
+HPMCgetHistoPyramidBytes( struct HPMCHistoPyramid* h );
+
 void
 HPMCsetFieldAsBinary( struct HPMCHistoPyramid* h );
 
@@ -364,12 +661,17 @@ HPMCsetFieldAsContinuous( struct HPMCHistoPyramid* h );
   * faces of the domain. Reducing grid size to lattice size - 2 removes this
   * artefact.
   *
+  * The grid size may be reduced, for instance to crop the volume, without
+  * rebuilding shaders or textures, as long as the grid fits within the
+  * lattice and the HistoPyramid that HPMC has already allocated for it.
+  *
   * \param h       Pointer to an existing HistoPyramid instance.
   * \param x_size  The size of the grid along the x-axis.
   * \param y_size  The size of the grid along the y-axis.
   * \param z_size  The size of the grid along the z-axis.
   *
-  * \sideeffect Triggers rebuilding of shaders and textures.
+  * \sideeffect Triggers rebuilding of shaders and textures if the grid does
+  *             not fit the current HistoPyramid.
   */
 void
 HPMCsetGridSize( struct HPMCHistoPyramid*  h,
@@ -380,13 +682,15 @@ HPMCsetGridSize( struct HPMCHistoPyramid*  h,
 /** Specify the extent of the grid in object space.
   *
   * This specifies the grid size in object space, defaults to (1.0,1.0,1.0).
+  * The extent is a uniform of the build and traversal shaders, so it may be
+  * changed at any time.
   *
   * \param h       Pointer to an existing HistoPyramid instance.
   * \param x_size  The size of the grid along the x-axis.
   * \param y_size  The size of the grid along the y-axis.
   * \param z_size  The size of the grid along the z-axis.
   *
-  * \sideeffect Triggers rebuilding of shaders and textures.
+  * \sideeffect None.
   */
 void
 HPMCsetGridExtent( struct HPMCHistoPyramid*  h,
@@ -443,6 +747,242 @@ HPMCsetFieldCustom( struct HPMCHistoPyramid*  h,
                     GLuint                    builder_texunit,
                     GLboolean                 gradient );
 
+/** Specify whether empty regions of the field are skipped.
+  *
+  * With empty-space skipping, HPMC keeps the min and max of the scalar field
+  * over bricks of 8x8x8 cells. The base level pass looks up the brick of each
+  * set of cells and writes zero vertices, without sampling the field, if the
+  * threshold is outside the range of the brick. The bricks are built by the
+  * first HPMCbuildHistopyramid and must be invalidated with
+  * HPMCinvalidateFieldBricks whenever the field changes. Skipping requires
+  * OpenGL 3.0, a field given by HPMCsetFieldTexture3D and uses texture unit
+  * 2 during construction.
+  *
+  * \param h       Pointer to an existing HistoPyramid instance.
+  * \param enable  GL_TRUE to enable empty-space skipping.
+  *
+  * \sideeffect Triggers rebuilding of shaders and textures.
+  */
+void
+HPMCsetFieldBrickSkipping( struct HPMCHistoPyramid* h,
+                           GLboolean                enable );
+
+/** Tell HPMC that the field has changed, so that the bricks are rebuilt.
+  *
+  * The min/max bricks are rebuilt by the next HPMCbuildHistopyramid. Has no
+  * effect unless empty-space skipping is enabled.
+  *
+  * \param h  Pointer to an existing HistoPyramid instance.
+  *
+  * \sideeffect None.
+  */
+void
+HPMCinvalidateFieldBricks( struct HPMCHistoPyramid* h );
+
+/** Tell HPMC that a box of field samples has changed since the last build.
+  *
+  * If regions have been marked, the next HPMCbuildHistopyramid with the same
+  * threshold as the previous build only reclassifies the cells touching the
+  * marked samples and only updates their ancestors in the upper levels. The
+  * rest of the field must then be unchanged since the previous build. Builds
+  * without marked regions, after a change of threshold, configuration or
+  * field texture, or where the marked regions cover most of the HistoPyramid,
+  * process the whole field. With empty-space skipping, the bricks touching
+  * the marked samples are rebuilt as well. All marked regions are cleared by
+  * the build.
+  *
+  * \param h   Pointer to an existing HistoPyramid instance.
+  * \param x0  First changed sample along x.
+  * \param y0  First changed sample along y.
+  * \param z0  First changed sample along z.
+  * \param x1  Last changed sample along x, inclusive.
+  * \param y1  Last changed sample along y, inclusive.
+  * \param z1  Last changed sample along z, inclusive.
+  *
+  * \sideeffect None.
+  */
+void
+HPMCmarkFieldRegionDirty( struct HPMCHistoPyramid* h,
+                          GLsizei                  x0,
+                          GLsizei                  y0,
+                          GLsizei                  z0,
+                          GLsizei                  x1,
+                          GLsizei                  y1,
+                          GLsizei                  z1 );
+
+/** Only extract the parts of the surface that are inside the view frustum.
+  *
+  * Cells whose bounding box is entirely outside the frustum produce no
+  * vertices, so they are skipped by the traversal and not included in the
+  * vertex count. The frustum is passed to the base level pass as uniforms,
+  * and may be changed every frame without rebuilding shaders or textures.
+  *
+  * \param h    Pointer to an existing HistoPyramid instance.
+  * \param mvp  The 4x4 column-major matrix that takes the object space of
+  *             the grid (see HPMCsetGridExtent) to clip space, or NULL to
+  *             disable frustum culling.
+  *
+  * \sideeffect The next build rebuilds the complete HistoPyramid.
+  */
+void
+HPMCsetCullFrustum( struct HPMCHistoPyramid* h,
+                    const GLfloat*           mvp );
+
+/** Only extract the parts of the surface that are inside an axis-aligned box.
+  *
+  * Cells whose bounding box does not intersect the box produce no vertices.
+  * Can be combined with HPMCsetCullFrustum, and may likewise be changed
+  * every frame without rebuilding shaders or textures.
+  *
+  * \param h    Pointer to an existing HistoPyramid instance.
+  * \param box  The min x, y, z and max x, y, z corners of the box in the
+  *             object space of the grid, or NULL to disable.
+  *
+  * \sideeffect The next build rebuilds the complete HistoPyramid.
+  */
+void
+HPMCsetRegionOfInterest( struct HPMCHistoPyramid* h,
+                         const GLfloat*           box );
+
+/** Specify whether parts of the surface hidden in a previous frame are skipped.
+  *
+  * With occlusion culling, the base level pass projects the bounding box of
+  * each tile of 8x8x8 cells into the depth pyramid given by
+  * HPMCsetOcclusionDepthPyramid, and writes zero vertices, without sampling
+  * the field, for tiles that are behind the depth already drawn there. Since
+  * the depth is from a previous frame, parts of the surface that become
+  * visible appear one frame late. Requires OpenGL 3.0 and uses texture unit
+  * 3 during construction.
+  *
+  * \param h       Pointer to an existing HistoPyramid instance.
+  * \param enable  GL_TRUE to enable occlusion culling.
+  *
+  * \sideeffect Triggers rebuilding of shaders and textures.
+  */
+void
+HPMCsetOcclusionCulling( struct HPMCHistoPyramid* h,
+                         GLboolean                enable );
+
+/** Specify the depth pyramid used by occlusion culling.
+  *
+  * Level 0 of the pyramid holds the window-space depth of a previous frame,
+  * and each texel of the levels above holds the max of the 2x2 texels below
+  * it, in the red channel. May be changed every frame without rebuilding
+  * shaders or textures.
+  *
+  * \param h        Pointer to an existing HistoPyramid instance.
+  * \param texture  A Texture2D with the depth pyramid, or zero to build
+  *                 without occlusion culling.
+  * \param levels   The number of mipmap levels of texture.
+  * \param mvp      The 4x4 column-major matrix that took the object space of
+  *                 the grid to clip space in the frame of the depth.
+  *
+  * \sideeffect The next build rebuilds the complete HistoPyramid.
+  */
+void
+HPMCsetOcclusionDepthPyramid( struct HPMCHistoPyramid* h,
+                              GLuint                   texture,
+                              GLint                    levels,
+                              const GLfloat*           mvp );
+
+/** Specify whether builds are skipped if the field and thresholds are unchanged.
+  *
+  * When enabled, HPMCbuildHistopyramid does nothing if the thresholds are the
+  * same as in the previous build and the field has not changed since. The
+  * field is considered changed by HPMCtouchField, HPMCmarkFieldRegionDirty,
+  * HPMCinvalidateFieldBricks, HPMCsetFieldTexture3D, reconfiguration, and
+  * changed values of uniforms given to HPMCaddFieldUniform. The application
+  * must then report every change of the field contents, for instance after
+  * updating the field texture with glTexSubImage3D. Disabled by default.
+  *
+  * \sideeffect None.
+  */
+void
+HPMCsetSkipUnchangedBuilds( struct HPMCHistoPyramid* h,
+                            GLboolean                enable );
+
+/** Specify whether reconfiguration waits for the shader compiler.
+  *
+  * A reconfigured HistoPyramid needs new build programs. By default, they
+  * are compiled and linked by the next build, which blocks until the
+  * compiler is done. With asynchronous setup, the first build (or
+  * HPMCisReady) after a reconfiguration issues all compiles and links up
+  * front and returns without building. Later builds are skipped until the
+  * driver has linked all programs, the HistoPyramid then keeps its previous
+  * contents and layout, so the previous surface can still be extracted with
+  * the existing traversal program. Use HPMCisReady to find out when builds
+  * resume, and create traversal handles and get the traversal shader
+  * functions of the new configuration after that, as these wait for the
+  * setup.
+  *
+  * With KHR_parallel_shader_compile, the readiness is polled with
+  * GL_COMPLETION_STATUS_KHR. Without it, the programs are assumed ready one
+  * call after they are issued, and the setup waits for any that are not.
+  * Disabled by default.
+  *
+  * \param h       Pointer to an existing HistoPyramid instance.
+  * \param enable  GL_TRUE to enable asynchronous setup.
+  *
+  * \sideeffect With KHR_parallel_shader_compile, the first enable lets the
+  *             driver choose the number of shader compiler threads, using
+  *             glMaxShaderCompilerThreadsKHR.
+  */
+void
+HPMCsetAsynchronousSetup( struct HPMCHistoPyramid* h,
+                          GLboolean                enable );
+
+/** Returns whether the HistoPyramid can be built in its current configuration.
+  *
+  * False while asynchronous setup waits for the programs of a new
+  * configuration, see HPMCsetAsynchronousSetup. The first call after a
+  * reconfiguration issues the programs. Without asynchronous setup, false if
+  * the HistoPyramid is reconfigured and not yet set up by a build. Does not
+  * block.
+  *
+  * \sideeffect None.
+  */
+GLboolean
+HPMCisReady( struct HPMCHistoPyramid* h );
+
+/** Tell HPMC that the contents of the field have changed.
+  *
+  * Only needed if builds are skipped when unchanged, see
+  * HPMCsetSkipUnchangedBuilds.
+  *
+  * \sideeffect None.
+  */
+void
+HPMCtouchField( struct HPMCHistoPyramid* h );
+
+/** Registers a uniform of the custom fetch code as an input of the field.
+  *
+  * If builds are skipped when unchanged, a change of the value of the uniform
+  * in the builder program (see HPMCgetBuilderProgram) since the previous
+  * build makes the next build proceed. Uniforms that are arrays are only
+  * tracked by their first element. The values are read back with
+  * glGetUniformfv at each build, also in stateless mode (see
+  * HPMCsetStateless), so register only uniforms that the field depends on.
+  *
+  * \param name  Name of the uniform in the custom fetch code.
+  *
+  * \sideeffect None.
+  */
+void
+HPMCaddFieldUniform( struct HPMCHistoPyramid* h,
+                     const char*              name );
+
+/** Returns the program that builds the HistoPyramid base level.
+  *
+  * Use this to set uniforms used by a custom fetch function. On OpenGL 4.3
+  * and up, HPMC builds the HistoPyramid using compute shaders, and this is
+  * then a compute program.
+  *
+  * HistoPyramids on the same constants that generate identical shaders and
+  * use the same texture units share their programs, so set the uniforms
+  * before each build if they differ between such HistoPyramids.
+  *
+  * \sideeffect Triggers rebuilding of shaders and textures if needed.
+  */
 GLuint
 HPMCgetBuilderProgram( struct HPMCHistoPyramid*  h );
 
@@ -452,22 +992,139 @@ void
 HPMCdestroyHandle( struct HPMCHistoPyramid* handle );
 
 /** Builds the histopyramid using a volume texture.
+  *
+  * If the target is OpenGL 4.3 or newer, the HistoPyramid is built using
+  * compute shaders that reduce several levels per dispatch. Otherwise, or if
+  * the compute shaders fail to build, one GPGPU pass per level is used.
   *
   * \sideeffect GL_CURRENT_PROGRAM,
   *             GL_TEXTURE_2D_BINDING,
-  *             GL_FRAMEBUFFER_BINDING
+  *             GL_FRAMEBUFFER_BINDING,
+  *             image units 0 to 3 (0 to 4 with separate MC codes) and
+  *             shader storage buffer binding 0
+  *             (compute shader construction only).
   */
 void
 HPMCbuildHistopyramid( struct HPMCHistoPyramid*  h,
                        GLfloat                   threshold );
 
+/** Builds one histopyramid per threshold in a single pass over the field.
+  *
+  * The base level pass fetches the neighbourhood of each cell once and
+  * classifies it against all thresholds, which is cheaper than building the
+  * surfaces one by one when the field fetch dominates. Surface s is extracted
+  * through traversal handles set to it by HPMCsetTraversalHandleSurface, and
+  * its vertex count is given by HPMCacquireNumberOfVerticesOfSurface. Each
+  * surface uses as much memory as a single HistoPyramid. Changing the number
+  * of thresholds triggers rebuilding of shaders and textures.
+  * HPMCbuildHistopyramid is the same as building a single surface.
+  *
+  * Requires OpenGL 3.0 and a continuous field.
+  *
+  * \param thresholds  The iso-values of the surfaces.
+  * \param n           Number of thresholds, from 1 up to and including 4.
+  *
+  * \sideeffect Same as HPMCbuildHistopyramid, with compute shader
+  *             construction using image units 0 to 4n-1 (0 to 5n-1 with
+  *             separate MC codes).
+  */
+void
+HPMCbuildHistopyramidMulti( struct HPMCHistoPyramid* h,
+                            const GLfloat*           thresholds,
+                            GLsizei                  n );
+
+/** Builds the histopyramid and returns a fence signaled when it is built.
+  *
+  * Issues the same passes as HPMCbuildHistopyramid. With a double-buffered
+  * HistoPyramid, the application waits on the fence (or polls it) before
+  * calling HPMCswapHistopyramids, and extraction from the front HistoPyramid
+  * can proceed in the meantime. The application owns the fence and deletes
+  * it with glDeleteSync.
+  *
+  * \return  A fence, or zero if the build failed or fences are unavailable
+  *          (requires OpenGL 3.2 or ARB_sync).
+  *
+  * \sideeffect Same as HPMCbuildHistopyramid.
+  */
+GLsync
+HPMCbuildHistopyramidAsync( struct HPMCHistoPyramid* h,
+                            GLfloat                  threshold );
+
+/** Makes the most recently built HistoPyramid the front one.
+  *
+  * Only valid for double-buffered HistoPyramids. Traversal handles extract
+  * the new front HistoPyramid from the next extraction on, without
+  * relinking. Swapping before the build is complete is allowed, since GL
+  * orders the passes, but then the extraction waits for the build.
+  *
+  * \sideeffect None.
+  */
+void
+HPMCswapHistopyramids( struct HPMCHistoPyramid* h );
+
 /** Returns the number of vertices in the histopyramid.
+  *
+  * This reads the count back from the GPU and may stall the pipeline. With
+  * compute shader construction (OpenGL 4.3 and up), extraction uses a GPU
+  * written draw indirect buffer and does not need the count, so only call
+  * this when the count is actually needed on the CPU.
   *
   * \note Must be called after HPMCbuildHistopyramd*().
   */
 GLuint
 HPMCacquireNumberOfVertices( struct HPMCHistoPyramid* handle );
 
+/** Returns the number of vertices of a surface of HPMCbuildHistopyramidMulti.
+  *
+  * Surface zero is the same as HPMCacquireNumberOfVertices, and reading back
+  * the count may stall the pipeline in the same way.
+  *
+  * \return  The vertex count, or zero if the surface was not built.
+  */
+GLuint
+HPMCacquireNumberOfVerticesOfSurface( struct HPMCHistoPyramid* handle,
+                                      GLsizei                  surface );
+
+/** Returns the number of unique vertices of an indexed HistoPyramid.
+  *
+  * This is the number of intersected edges, and the number of vertices
+  * written by HPMCextractUniqueVerticesTransformFeedback. The number of
+  * indices is HPMCacquireNumberOfVertices. Reading back the count may stall
+  * the pipeline in the same way.
+  *
+  * \return  The vertex count, or zero if indexed extraction is not enabled.
+  */
+GLuint
+HPMCacquireNumberOfUniqueVertices( struct HPMCHistoPyramid* handle );
+
+/** Returns the number of active cells of a per-cell HistoPyramid.
+  *
+  * This is the number of points drawn by HPMCextractCells. Reading back the
+  * count may stall the pipeline like HPMCacquireNumberOfVertices.
+  *
+  * \return  The cell count, or zero if per-cell extraction is not enabled.
+  */
+GLuint
+HPMCacquireNumberOfActiveCells( struct HPMCHistoPyramid* handle );
+
+/** Polls for the number of vertices in the histopyramid without stalling.
+  *
+  * The counts of the last three builds are read back asynchronously, and the
+  * most recent count that has arrived is returned. This is useful for
+  * conservative sizing of buffers using the count of a build one or two
+  * frames back.
+  *
+  * \param count  Set to the most recent count that has arrived, which may be
+  *               from an earlier build. Left untouched if no count has
+  *               arrived yet.
+  * \return       GL_TRUE if count holds the number of vertices of the most
+  *               recent build, GL_FALSE otherwise.
+  * \sideeffect   None.
+  */
+GLboolean
+HPMCpollNumberOfVertices( struct HPMCHistoPyramid* handle,
+                          GLuint*                  count );
+
 
 /** Create a new traversal handle instance.
   *
@@ -485,6 +1142,17 @@ HPMCcreateTraversalHandle( struct HPMCHistoPyramid* handle );
 void
 HPMCdestroyTraversalHandle( struct HPMCTraversalHandle* th );
 
+/** Selects which surface of HPMCbuildHistopyramidMulti a handle extracts.
+  *
+  * Surfaces share configuration, so the traversal shader is the same for all
+  * surfaces, and the handle is switched without relinking. Defaults to zero.
+  *
+  * \sideeffect None.
+  */
+void
+HPMCsetTraversalHandleSurface( struct HPMCTraversalHandle* th,
+                               GLsizei                     surface );
+
 /** Get shader source that implements the traversal and extraction.
   *
   * \return      A fresh copy of the shader source on success, NULL on failure.
@@ -495,6 +1163,20 @@ HPMCdestroyTraversalHandle( struct HPMCTraversalHandle* th );
 char*
 HPMCgetTraversalShaderFunctions( struct HPMCTraversalHandle* th );
 
+/** Get geometry shader source that implements per-cell traversal and extraction.
+  *
+  * Defines extractCell and extractCellVertex, see HPMCsetPerCellExtraction,
+  * and uses the same uniforms as HPMCgetTraversalShaderFunctions, so the
+  * program is associated with the handle by HPMCsetTraversalHandleProgram.
+  *
+  * \return      A fresh copy of the shader source on success, NULL on failure
+  *              or if per-cell extraction is not enabled. It is the
+  *              application's responsibility to free this memory (using free).
+  * \sideeffect  None.
+  */
+char*
+HPMCgetCellTraversalShaderFunctions( struct HPMCTraversalHandle* th );
+
 /** Associates a linked shader program with a traversal handle.
   *
   * \param program         A successfully linked program including the source
@@ -509,7 +1191,7 @@ HPMCgetTraversalShaderFunctions( struct HPMCTraversalHandle* th );
   * \param tex_unit_work3  A unique texture unit that HPMC may use during
   *                        traversal without interfering with the rest of the
   *                        program. Not used with custom scalar field fetch
-  *                        functions.
+  *                        functions, unless indexed extraction is enabled.
   * \return                True on success, false on failure.
   * \sideeffect            None.
   */
@@ -520,6 +1202,38 @@ HPMCsetTraversalHandleProgram( struct  HPMCTraversalHandle *th,
                                GLuint  tex_unit_work2,
                                GLuint  tex_unit_work3 );
 
+/** Specifies the texture unit for the upper levels of a mixed-precision HistoPyramid.
+  *
+  * Must be called before HPMCsetTraversalHandleProgram when the HistoPyramid
+  * uses mixed precision and has more than four levels, that is, when the
+  * traversal code declares the HPMC_histopyramid_upper sampler.
+  *
+  * \param tex_unit_work4  A unique texture unit that HPMC may use during
+  *                        traversal, distinct from the three units passed to
+  *                        HPMCsetTraversalHandleProgram.
+  *
+  * \sideeffect None.
+  */
+void
+HPMCsetTraversalHandleUpperLevelsUnit( struct HPMCTraversalHandle* th,
+                                       GLuint                      tex_unit_work4 );
+
+/** Specifies the texture unit for the MC codes of a HistoPyramid with separate codes.
+  *
+  * Must be called before HPMCsetTraversalHandleProgram when the HistoPyramid
+  * stores MC codes in a separate texture, that is, when the traversal code
+  * declares the HPMC_codes sampler.
+  *
+  * \param tex_unit_work5  A unique texture unit that HPMC may use during
+  *                        traversal, distinct from the other units given to
+  *                        the traversal handle.
+  *
+  * \sideeffect None.
+  */
+void
+HPMCsetTraversalHandleCodeUnit( struct HPMCTraversalHandle* th,
+                                GLuint                      tex_unit_work5 );
+
 /** Extract the triangles of the iso-surface
  *
  * No texture units except those specified in setTraversalHandleProgram will be
@@ -543,6 +1257,132 @@ HPMCextractVerticesTransformFeedbackNV( struct HPMCTraversalHandle* th );
 bool
 HPMCextractVerticesTransformFeedbackEXT( struct HPMCTraversalHandle* th );
 
+/** Extracts one vertex per intersected edge of an indexed HistoPyramid.
+ *
+ * The vertex shader of the program of the handle calls extractUniqueVertex
+ * instead of extractVertex, and the vertices are captured as GL_POINTS by
+ * transform feedback, which must be active or set up by the application as
+ * for HPMCextractVerticesTransformFeedback. The vertex written for the edge
+ * of rank i is the one indexed by i.
+ *
+ * \return                True on success, false on failure.
+ *
+ * \sideeffect None.
+ */
+bool
+HPMCextractUniqueVerticesTransformFeedback( struct HPMCTraversalHandle* th );
+
+/** Extracts three indices per triangle of an indexed HistoPyramid.
+ *
+ * Runs a program of HPMC that writes one GL_UNSIGNED_INT per triangle corner
+ * into the transform feedback buffer bound by the application, indexing the
+ * vertices of HPMCextractUniqueVerticesTransformFeedback of the same build.
+ * Rasterization is discarded while the indices are written. Uses the texture
+ * units of the handle, but not the program of the handle.
+ *
+ * \return                True on success, false on failure.
+ *
+ * \sideeffect None.
+ */
+bool
+HPMCextractIndicesTransformFeedback( struct HPMCTraversalHandle* th );
+
+/** Extracts the triangles of a per-cell HistoPyramid.
+ *
+ * Draws one GL_POINTS primitive per active cell with the program of the
+ * handle, whose geometry shader calls extractCell and emits the triangles of
+ * the cell.
+ *
+ * \return                True on success, false on failure.
+ *
+ * \sideeffect None.
+ */
+bool
+HPMCextractCells( struct HPMCTraversalHandle* th );
+
+/** Extracts the triangles of a per-cell HistoPyramid into a transform feedback buffer.
+ *
+ * Like HPMCextractCells, with the triangles emitted by the geometry shader
+ * captured as GL_TRIANGLES, as for HPMCextractVerticesTransformFeedback.
+ *
+ * \return                True on success, false on failure.
+ *
+ * \sideeffect None.
+ */
+bool
+HPMCextractCellsTransformFeedback( struct HPMCTraversalHandle* th );
+
+/** Extracts the triangles once into a buffer owned by the traversal handle.
+ *
+ * Captures the vertices of HPMCextractVerticesTransformFeedback into a buffer
+ * of HPMC, so that several passes, e.g. shadow, depth prepass and color, can
+ * render the surface with HPMCdrawCachedSurface without traversing the
+ * HistoPyramid again. The varyings of the program of the handle must be set
+ * with glTransformFeedbackVaryings in GL_INTERLEAVED_ATTRIBS mode, and
+ * attribute i of HPMCgetCachedVertexArray sources varying i. If the program
+ * is relinked with other varyings, pass it to HPMCsetTraversalHandleProgram
+ * again before the next extraction. The buffer grows as needed and is not
+ * shrunk. The vertex count is read back to size the buffer, which may stall
+ * the pipeline like HPMCacquireNumberOfVertices.
+ * Rasterization is as for HPMCextractVerticesTransformFeedback, enable
+ * GL_RASTERIZER_DISCARD to capture without rendering.
+ *
+ * Requires an OpenGL 3.0 target. From OpenGL 4.0, the count is kept in the
+ * transform feedback object of HPMCgetCachedTransformFeedback.
+ *
+ * \return                True on success, false on failure.
+ *
+ * \sideeffect None.
+ */
+bool
+HPMCextractToBuffer( struct HPMCTraversalHandle* th );
+
+/** Draws the triangles captured by the last HPMCextractToBuffer.
+ *
+ * Uses the current program, with glDrawTransformFeedback from OpenGL 4.0 and
+ * HPMCgetCachedVertexCount before that.
+ *
+ * \return                True on success, false on failure.
+ *
+ * \sideeffect None.
+ */
+bool
+HPMCdrawCachedSurface( struct HPMCTraversalHandle* th );
+
+/** Returns the vertex array of HPMCextractToBuffer.
+ *
+ * \return      The vertex array, or zero before the first extraction.
+ * \sideeffect  None.
+ */
+GLuint
+HPMCgetCachedVertexArray( struct HPMCTraversalHandle* th );
+
+/** Returns the buffer of HPMCextractToBuffer.
+ *
+ * \return      The buffer, or zero before the first extraction.
+ * \sideeffect  None.
+ */
+GLuint
+HPMCgetCachedBuffer( struct HPMCTraversalHandle* th );
+
+/** Returns the transform feedback object holding the count of HPMCextractToBuffer.
+ *
+ * For use with glDrawTransformFeedback and friends.
+ *
+ * \return      The object, or zero below OpenGL 4.0 and before the first
+ *              extraction.
+ * \sideeffect  None.
+ */
+GLuint
+HPMCgetCachedTransformFeedback( struct HPMCTraversalHandle* th );
+
+/** Returns the number of vertices captured by the last HPMCextractToBuffer.
+ *
+ * \sideeffect  None.
+ */
+GLsizei
+HPMCgetCachedVertexCount( struct HPMCTraversalHandle* th );
+
 
 #ifdef __cplusplus
 } // of extern "C"
@@ -38,6 +38,7 @@
 #include <GL/glew.h>
 #include <string>
 #include <vector>
+#include <map>
 
 /** \addtogroup hpmc_public
   * \{
@@ -62,6 +63,57 @@ enum HPMCTarget {
     HPMC_TARGET_GL43_GLSL430
 };
 
+/** Work group size along x and y of the compute-shader HistoPyramid build. */
+static const GLsizei HPMC_COMPUTE_GROUP_SIZE = 8;
+
+/** Number of HistoPyramid levels written by one compute dispatch.
+  *
+  * One level written directly plus log2(HPMC_COMPUTE_GROUP_SIZE) levels
+  * reduced in shared memory.
+  */
+static const GLsizei HPMC_COMPUTE_LEVELS_PER_DISPATCH = 4;
+
+/** Largest width and height of the top level of a compactly laid out HistoPyramid.
+  *
+  * The traversal scans the top level linearly, which is cheap for a handful
+  * of texels. Larger tops allow less padding of the base level.
+  */
+static const GLsizei HPMC_COMPACT_TOP_MAX_SIZE = 8;
+
+/** Number of HistoPyramid levels stored in 16 bits with mixed precision.
+  *
+  * A texel component of level m holds at most 15*4^m vertices, so levels up
+  * to six fit in 16 bits. The lower levels make up nearly all of the texture
+  * memory. Kept a multiple of HPMC_COMPUTE_LEVELS_PER_DISPATCH, so that no
+  * compute dispatch writes levels of both textures.
+  */
+static const GLsizei HPMC_MIXED_PRECISION_LEVELS = 4;
+
+/** Width, height and depth in cells of the bricks used for empty-space skipping.
+  *
+  * Must be even, so that the 2x2 cells of a base level texel never straddle
+  * two bricks.
+  */
+static const GLsizei HPMC_BRICK_SIZE = 8;
+
+/** Largest number of iso-surfaces built by one base level pass.
+  *
+  * With separate MC codes, the base level pass writes two outputs per
+  * surface, and OpenGL 3.0 guarantees eight draw buffers.
+  */
+static const GLsizei HPMC_MAX_SURFACES = 4;
+
+/** Largest number of components of a field input uniform, a mat4. */
+static const GLsizei HPMC_FIELD_UNIFORM_SIZE = 16;
+
+/** Largest number of planes that cells are culled against, six for the view
+  * frustum and six for the region of interest.
+  */
+static const GLsizei HPMC_MAX_CULL_PLANES = 12;
+
+/** Number of HistoPyramid top element readbacks that may be in flight. */
+static const GLsizei HPMC_TOP_READBACK_RING_SIZE = 3;
+
 // -----------------------------------------------------------------------------
 /** Constant data shared by multiple HistoPyramids. */
 struct HPMCConstants
@@ -73,6 +125,64 @@ struct HPMCConstants
     GLsizei           m_enumerate_vbo_n;
     GLuint            m_gpgpu_quad_vbo;
     HPMCTarget        m_target;
+    /** Use direct state access and skip saving and restoring state. */
+    bool              m_stateless;
+    /** Vertex array object without enabled arrays, for attribute-less draws in
+      * stateless mode and in the core profile.
+      */
+    GLuint            m_empty_vao;
+    /** The context is a core profile context.
+      *
+      * Fixed-function state, attribute stacks, client-side arrays and
+      * compatibility built-ins in GLSL are not available.
+      */
+    bool              m_core;
+    /** Directory of the program binary cache, empty if the cache is disabled. */
+    std::string       m_binary_cache_dir;
+    /** Compile and link without blocking, using KHR_parallel_shader_compile. */
+    bool              m_parallel_compile;
+    /** A program shared by the HistoPyramids that generate the same sources. */
+    struct SharedProgram {
+        GLuint        m_program;
+        GLuint        m_refs;               ///< Number of HistoPyramids using the program.
+        /** Shader objects until the program is checked, zero afterwards. */
+        GLuint        m_shaders[2];
+        bool          m_checked;            ///< Compile and link status have been checked.
+        bool          m_linked;             ///< The program linked, valid if checked.
+    };
+    /** Sources and bindings of a program, and the first texture unit of its samplers. */
+    typedef std::pair<std::string,GLuint>          ProgramKey;
+    typedef std::map<ProgramKey,SharedProgram>     ProgramMap;
+    /** Programs built by HPMCissueProgram and HPMCbuildProgram. */
+    ProgramMap        m_programs;
+};
+
+// -----------------------------------------------------------------------------
+/** State saved by HPMCpushAttribs and restored by HPMCpopAttribs. */
+struct HPMCAttribs
+{
+    /** Saved viewport, only used in the core profile. */
+    GLint             m_viewport[4];
+    /** Saved vertex array object binding, only used in the core profile. */
+    GLint             m_vao;
+    /** The viewport was saved. */
+    bool              m_has_viewport;
+    /** Saved scissor box, only used in the core profile. */
+    GLint             m_scissor_box[4];
+    /** Saved enable of the scissor test, only used in the core profile. */
+    GLboolean         m_scissor_test;
+    /** The scissor box and test were saved. */
+    bool              m_has_scissor;
+};
+
+// -----------------------------------------------------------------------------
+/** A rectangle [m_x0,m_x1) x [m_y0,m_y1) of texels or work groups. */
+struct HPMCRect
+{
+    GLsizei           m_x0;
+    GLsizei           m_y0;
+    GLsizei           m_x1;
+    GLsizei           m_y1;
 };
 
 // -----------------------------------------------------------------------------
@@ -89,6 +199,67 @@ struct HPMCHistoPyramid
     struct HPMCConstants*  m_constants;
     /** Cache to hold the threshold value used to build the HP. */
     GLfloat                m_threshold;
+    /** Number of iso-surfaces built at once, the shaders are built for this. */
+    GLsizei                m_surface_count;
+    /** HistoPyramids of surfaces 1 and up, this HP holds surface 0.
+      *
+      * Each is laid out like this HP and holds its own textures, FBOs,
+      * readbacks and threshold, but no shaders. The base level pass of this
+      * HP writes the base levels of all surfaces, and the reductions of each
+      * surface use the programs of this HP.
+      */
+    std::vector<struct HPMCHistoPyramid*>  m_surfaces;
+    /** Build into a back HistoPyramid, and extract from a front one. */
+    bool                   m_double_buffered;
+    /** The front HistoPyramid if double buffered, NULL otherwise.
+      *
+      * Laid out like this HP, which holds the back HistoPyramid. Swapping
+      * exchanges the m_histopyramid and m_threshold of the two.
+      */
+    struct HPMCHistoPyramid*  m_front;
+    /** The back HistoPyramid holds a build newer than the front one. */
+    bool                   m_back_built;
+
+    // -------------------------------------------------------------------------
+    /** Indexed extraction, where vertices on shared edges are extracted once.
+      *
+      * Every edge of the grid is owned by the cell at its lower end, clamped
+      * to the grid, so that the cells of the last layers also own the edges of
+      * the grid faces. The base level pass writes a second HistoPyramid, m_edges,
+      * that counts the intersected edges each cell owns and stores them as a
+      * 12-bit mask (bit 4*axis+u+2*v is the edge along axis, offset by u and v
+      * along the other two axes). Traversing m_edges yields one vertex per
+      * intersected edge, and the index program finds the rank of the edge of
+      * each triangle corner in m_edges.
+      */
+    struct Indexed {
+        bool                      m_enabled;            ///< Build the edge HistoPyramid.
+        /** The edge HistoPyramid, laid out like this HP, NULL if not enabled. */
+        struct HPMCHistoPyramid*  m_edges;
+        GLuint                    m_index_program;      ///< Writes three indices per triangle by transform feedback.
+        GLint                     m_loc_histopyramid;   ///< Sampler of this HP in m_index_program.
+        GLint                     m_loc_edges;          ///< Sampler of m_edges in m_index_program.
+        GLint                     m_loc_edge_table;     ///< Sampler of the edge table in m_index_program.
+        GLint                     m_loc_grid_cells;     ///< Grid cells uniform of m_index_program.
+    }
+    m_indexed;
+
+    // -------------------------------------------------------------------------
+    /** Per-cell extraction, where one traversal yields all vertices of a cell.
+      *
+      * The base level pass writes a third kind of HistoPyramid, m_cells, that
+      * counts one per active cell. Its base level holds the MC code and the
+      * vertex count of each cell where the vertex HistoPyramid holds the code,
+      * see HPMCgenerateActiveCellFunction. Traversing m_cells from a geometry
+      * shader locates each active cell once, and the vertices of the cell share
+      * its corner samples.
+      */
+    struct PerCell {
+        bool                      m_enabled;            ///< Build the cell HistoPyramid.
+        /** The cell HistoPyramid, laid out like this HP, NULL if not enabled. */
+        struct HPMCHistoPyramid*  m_cells;
+    }
+    m_per_cell;
 
     // -------------------------------------------------------------------------
     /** Specifies how the base level of the HistoPyramid is laid out. */
@@ -97,28 +268,91 @@ struct HPMCHistoPyramid
         GLsizei       m_tile_size[2];
         /** The number of tiles in the base level along the x and y direction. */
         GLsizei       m_layout[2];
+        /** Pack tiles of exact size into a rectangular HP instead of padding
+          * tiles and the HP to powers of two.
+          */
+        bool          m_compact;
     }
     m_tiling;
 
     // -------------------------------------------------------------------------
     /** Information about the HistoPyramid texture. */
     struct HistoPyramid {
-        /** The size of the HP tex.
+        /** The width and height of the base level of the HP tex.
           *
-          * The tex is quadratic, so the size is the same along x and y.
+          * With the default layout, the tex is quadratic and a power-of-two.
+          * With the compact layout, both are multiples of 2^m_size_l2.
           */
-        GLsizei              m_size;
-        /** The two-log of the size of the HP tex.
+        GLsizei              m_size[2];
+        /** The mipmap level of the top of the HP.
           *
-          * The tex size is always a power-of-two, so this is always an integer.
+          * With the default layout, this is the two-log of the size of the HP
+          * tex. Since the base level sizes are multiples of 2^m_size_l2, every
+          * reduction halves the level size exactly.
           */
         GLsizei              m_size_l2;
-        /** Texture name of the HP tex. */
+        /** The width and height of the top level, 1x1 with the default layout. */
+        GLsizei              m_top_size[2];
+        /** Number of bytes of texture memory used by the HP and code texs. */
+        GLsizeiptr           m_bytes;
+        /** Texture name of the HP tex, holds the levels below m_split_level. */
         GLuint               m_tex;
+        /** Texture name of the levels from m_split_level and up, base level
+          * of this tex is level m_split_level of the HP.
+          */
+        GLuint               m_tex_upper;
+        /** Internal format of the HP tex, GL_RGBA32F or GL_RGBA32UI.
+          *
+          * With float storage, the MC codes of the base level are stored in
+          * the fractional part and counts are only exact up to 2^24. With
+          * integer storage, the base level holds count | (code << 4).
+          */
+        GLenum               m_format;
+        /** Store the lower levels as GL_RGBA16UI, requires integer storage. */
+        bool                 m_mixed_precision;
+        /** Store the MC codes of the base level in m_code_tex, requires GL 3.0.
+          *
+          * The HP levels then hold plain vertex counts, and all reductions
+          * use the same program.
+          */
+        bool                 m_separate_codes;
+        /** GL_RGBA8UI tex of the size of the base level holding the MC code of
+          * each cell, zero unless m_separate_codes.
+          */
+        GLuint               m_code_tex;
+        /** Fan-out of the traversal, 4 or 16, see HPMClevelSkipped. */
+        GLuint               m_fan_out;
+        /** First level stored in m_tex_upper, or zero if all levels are in m_tex.
+          *
+          * With mixed precision, the levels below are stored in m_tex as
+          * GL_RGBA16UI, and the levels from here and up in m_tex_upper using
+          * m_format. HPs with too few levels are stored in m_format only.
+          */
+        GLsizei              m_split_level;
         /** A set of FBOs, one FBO per mipmap level in the HP tex. */
         std::vector<GLuint>  m_fbos;
-        /** Pixel pack buffer for async readback of HP top element. */
-        GLuint               m_top_pbo;
+        /** Asynchronous readback of the HP top element of one build. */
+        struct TopReadback {
+            GLuint           m_pbo;       ///< Pixel pack buffer receiving the top element.
+            GLsync           m_fence;     ///< Signaled when the readback is done, zero without ARB_sync.
+            bool             m_pending;   ///< Readback triggered but result not yet consumed.
+        };
+        /** Ring of readbacks, so that counts of earlier builds can be consumed
+          * without stalling on the most recent build.
+          */
+        std::vector<TopReadback>  m_top_readbacks;
+        /** Index in m_top_readbacks of the readback of the most recent build. */
+        GLsizei              m_top_latest;
+        /** The most recently consumed count, possibly from an earlier build,
+          * or -1 if no count has been consumed yet.
+          */
+        GLsizei              m_top_count_arrived;
+        /** Draw indirect buffer with the vertex count of the HP top element.
+          *
+          * Written by the GPU after the compute passes, so that extraction
+          * can draw without reading the count back to the CPU.
+          */
+        GLuint               m_indirect_buffer;
         /** Cache result of readback of the HP top element PBO. */
         GLsizei              m_top_count;
         /** Tag that the cached result is valid, so PBO need not to be consulted. */
@@ -162,23 +396,130 @@ struct HPMCHistoPyramid
     }
     m_fetch;
 
+    // -------------------------------------------------------------------------
+    /** Min/max bricks of the scalar field for empty-space skipping.
+      *
+      * Each brick holds the min and max of the samples touched by a block of
+      * HPMC_BRICK_SIZE^3 cells. The base level pass writes zeros for cells in
+      * bricks whose range does not include the threshold, without sampling
+      * the scalar field.
+      */
+    struct Bricks {
+        /** Skip empty bricks in the base level pass, requires a Texture3D field. */
+        bool          m_enabled;
+        /** The field has changed, so the bricks must be rebuilt before use. */
+        bool          m_dirty;
+        /** The number of bricks along x, y and z. */
+        GLsizei       m_count[3];
+        /** GL_RG32F tex of m_count[0] x m_count[1]*m_count[2] texels, with
+          * the z-slices of bricks stacked along y.
+          */
+        GLuint        m_tex;
+        GLuint        m_fbo;
+        GLuint        m_program;
+        GLint         m_loc_group_offset;   ///< Only used with compute shader construction.
+    }
+    m_bricks;
+
+    // -------------------------------------------------------------------------
+    /** Regions of the field changed since the last build.
+      *
+      * If the HP is otherwise up to date, the next build only redoes the
+      * base level texels of the changed cells and their ancestors.
+      */
+    struct Dirty {
+        /** The HP holds a complete build of the field for m_threshold. */
+        bool                  m_valid;
+        /** Inclusive cell ranges x0,y0,z0,x1,y1,z1 of the changed regions. */
+        std::vector<GLsizei>  m_cells;
+    }
+    m_dirty;
+
+    // -------------------------------------------------------------------------
+    /** Planes that restrict the cells that produce vertices.
+      *
+      * The planes are in the object space of the extracted vertices, and a cell
+      * is kept if its bounding box is on the positive side of all planes. They
+      * are passed to the base level pass as uniforms, so changing them does not
+      * rebuild any shaders.
+      */
+    struct Cull {
+        bool          m_frustum;                ///< Cull against the view frustum.
+        GLfloat       m_frustum_planes[24];     ///< Left, right, bottom, top, near, far.
+        bool          m_region;                 ///< Cull against the region of interest.
+        GLfloat       m_region_planes[24];      ///< The six faces of the box.
+    }
+    m_cull;
+
+    // -------------------------------------------------------------------------
+    /** Occlusion culling against the depth of a previous frame.
+      *
+      * A tile of HPMC_BRICK_SIZE^3 cells produces no vertices if its bounding
+      * box, projected by m_mvp, is behind the farthest depth of the pyramid
+      * texels it covers. The depth pyramid and matrix are passed as uniforms,
+      * only enabling the test rebuilds the shaders.
+      */
+    struct Occlusion {
+        bool          m_enabled;            ///< Compile the test into the base level pass.
+        GLuint        m_tex;                ///< Depth pyramid, zero skips the test.
+        GLint         m_levels;             ///< Number of mipmap levels of m_tex.
+        GLfloat       m_mvp[16];            ///< Takes the grid to the clip space of m_tex.
+    }
+    m_occlusion;
+
+    /** Inputs of the field, used to skip builds that would not change the HP. */
+    struct Changes {
+        bool                      m_skip_unchanged;   ///< Skip builds where no input has changed.
+        GLuint                    m_generation;       ///< Bumped whenever the field changes.
+        GLuint                    m_built_generation; ///< m_generation at the last build.
+        /** Uniforms of the custom fetch code that the field depends on. */
+        std::vector<std::string>  m_uniforms;
+        /** Values of m_uniforms at the last build, HPMC_FIELD_UNIFORM_SIZE each. */
+        std::vector<GLfloat>      m_values;
+        /** Locations of m_uniforms in m_located_program. */
+        std::vector<GLint>        m_locations;
+        GLuint                    m_located_program;  ///< Builder program of m_locations, zero if none.
+    }
+    m_changes;
+
+    /** Asynchronous setup of a new configuration, see HPMCsetAsynchronousSetup. */
+    struct Setup {
+        bool                  m_async;      ///< Builds do not wait for the programs of a new configuration.
+        /** Programs of the new configuration, issued but maybe not linked yet.
+          *
+          * Each holds a reference, released when the setup completes.
+          */
+        std::vector<GLuint>   m_pending;
+    }
+    m_setup;
+
     /** State during HistoPyramid construction */
     struct HistoPyramidBuild {
         GLuint           m_tex_unit_1;          ///< Bound to vertex count in base level pass, bound to HP in other passes.
         GLuint           m_tex_unit_2;          ///< Bound to volume texture if HPMC handles texturing of scalar field.
-        GLuint           m_gpgpu_vertex_shader; ///< Common GPGPU pass-through vertex shader.
+        GLuint           m_tex_unit_3;          ///< Bound to field bricks in base level pass if empty-space skipping.
+        GLuint           m_tex_unit_4;          ///< Bound to depth pyramid in base level pass if occlusion culling.
+
+        /** Uniforms of a base level program that are set for each build. */
+        struct BaseUniforms {
+            GLint             m_threshold;
+            GLint             m_cull_count;
+            GLint             m_cull_planes;
+            GLint             m_hiz_mvp;            ///< Only used with occlusion culling.
+            GLint             m_hiz_max_level;      ///< Only used with occlusion culling.
+            GLint             m_grid_cells;
+            GLint             m_grid_extent;
+        };
 
         /** Base level construction pass. */
         struct BaseConstruction {
-            GLuint            m_fragment_shader;
             GLuint            m_program;
-            GLint             m_loc_threshold;
+            BaseUniforms      m_loc;
         }
         m_base;
 
         /** First pure reduction pass. */
         struct FirstReduction {
-            GLuint            m_fragment_shader;
             GLuint            m_program;
             GLint             m_loc_delta;
             GLint             m_loc_src_level;
@@ -187,13 +528,37 @@ struct HPMCHistoPyramid
 
        /** First pure reduction pass. */
         struct UpperReduction {
-            GLuint            m_fragment_shader;
             GLuint            m_program;
             GLint             m_loc_delta;
             GLint             m_loc_src_level;
         }
         m_upper;
 
+        /** Reduces two levels in one pass, skipping the level in between.
+          *
+          * Only built with a fan-out of 16.
+          */
+        UpperReduction   m_double;
+
+        /** Compute-shader construction, replaces the GPGPU passes on GL 4.3 and up.
+          *
+          * The base level pass classifies the cells and reduces the first
+          * levels in shared memory, each reduction pass then produces
+          * HPMC_COMPUTE_LEVELS_PER_DISPATCH levels. No FBOs are involved.
+          */
+        struct ComputeConstruction {
+            bool              m_enabled;            ///< Use compute passes instead of GPGPU passes.
+            GLuint            m_base_program;
+            BaseUniforms      m_base_loc;
+            GLint             m_base_loc_group_offset;
+            GLuint            m_reduction_program;
+            GLint             m_reduction_loc_dst_level;
+            GLint             m_reduction_loc_src_level;
+            GLint             m_reduction_loc_group_offset;
+            GLuint            m_indirect_program;   ///< Writes the draw indirect command.
+        }
+        m_compute;
+
     }
     m_hp_build;
 };
@@ -205,9 +570,26 @@ struct HPMCTraversalHandle
     GLuint                    m_program;
     GLuint                    m_scalarfield_unit;
     GLuint                    m_histopyramid_unit;
+    GLint                     m_histopyramid_upper_unit; ///< Unit of HP upper levels, -1 if not set.
+    GLint                     m_code_unit;               ///< Unit of MC code tex, -1 if not set.
+    GLsizei                   m_surface;                 ///< Surface extracted from a multi-surface build.
     GLuint                    m_edge_decode_unit;
     GLint                     m_offset_loc;
     GLint                     m_threshold_loc;
+    GLint                     m_grid_cells_loc;
+    GLint                     m_grid_extent_loc;
+
+    /** HPMC-owned buffer filled by HPMCextractToBuffer. */
+    struct Cache {
+        GLuint                m_buffer;
+        GLsizeiptr            m_capacity;   ///< Size of m_buffer in bytes.
+        GLuint                m_vao;        ///< Attribute i sources captured varying i.
+        GLuint                m_program;    ///< Program the layout of m_vao was taken from.
+        GLsizei               m_stride;     ///< Bytes per captured vertex.
+        GLuint                m_feedback;   ///< Transform feedback object, zero below OpenGL 4.0.
+        GLsizei               m_count;      ///< Number of captured vertices.
+    }
+    m_cache;
 };
 
 /** \} */
@@ -227,13 +609,26 @@ extern GLfloat HPMC_midpoint_table[12][3];
 
 
 /** Sets up hp textures and shaders.
+  *
+  * With asynchronous setup and wait false, nothing is done and false is
+  * returned until HPMCsetupReady returns true.
   *
   * \sideeffect GL_CURRENT_PROGRAM,
   *             GL_TEXTURE_2D_BINDING,
   *             GL_FRAMEBUFFER_BINDING
   */
 bool
-HPMCsetup( struct HPMCHistoPyramid* h );
+HPMCsetup( struct HPMCHistoPyramid* h, bool wait = true );
+
+/** Returns true if setup of a tainted HP would not wait for the compiler.
+  *
+  * Issues the programs of the new configuration on the first call, and polls
+  * them on later calls.
+  *
+  * \sideeffect None.
+  */
+bool
+HPMCsetupReady( struct HPMCHistoPyramid* h );
 
 /** Checks field and grid sizes and determine HistoPyramid layout and tiling.
   *
@@ -242,9 +637,50 @@ HPMCsetup( struct HPMCHistoPyramid* h );
 bool
 HPMCdetermineLayout( struct HPMCHistoPyramid* h );
 
+/** Creates, sets up or frees the HistoPyramids of surfaces 1 and up.
+  *
+  * Must run before HPMCsetupTexAndFBOs of h, which attaches their base levels
+  * (and MC code texs) to the base level FBO of h.
+  *
+  * \sideeffect GL_TEXTURE_2D_BINDING, GL_FRAMEBUFFER_BINDING,
+  *             GL_DRAW_INDIRECT_BUFFER_BINDING
+  */
+bool
+HPMCsetupSurfaces( struct HPMCHistoPyramid* h );
+
+/** Creates, sets up or frees the front HistoPyramid of double buffering.
+  *
+  * \sideeffect GL_TEXTURE_2D_BINDING, GL_FRAMEBUFFER_BINDING,
+  *             GL_DRAW_INDIRECT_BUFFER_BINDING
+  */
+bool
+HPMCsetupFrontBuffer( struct HPMCHistoPyramid* h );
+
+/** Creates, sets up or frees the edge HistoPyramid of indexed extraction.
+  *
+  * Must run before HPMCsetupTexAndFBOs of h, which attaches its base level to
+  * the base level FBO of h.
+  *
+  * \sideeffect GL_TEXTURE_2D_BINDING, GL_FRAMEBUFFER_BINDING,
+  *             GL_DRAW_INDIRECT_BUFFER_BINDING
+  */
+bool
+HPMCsetupEdges( struct HPMCHistoPyramid* h );
+
+/** Creates, sets up or frees the cell HistoPyramid of per-cell extraction.
+  *
+  * Must run before HPMCsetupTexAndFBOs of h, like HPMCsetupEdges.
+  *
+  * \sideeffect GL_TEXTURE_2D_BINDING, GL_FRAMEBUFFER_BINDING,
+  *             GL_DRAW_INDIRECT_BUFFER_BINDING
+  */
+bool
+HPMCsetupCells( struct HPMCHistoPyramid* h );
+
 /** Creates the HistoPyramid texture and framebuffer object.
   *
-  * \sideeffect GL_TEXTURE_2D_BINDING, GL_FRAMEBUFFER_BINDING
+  * \sideeffect GL_TEXTURE_2D_BINDING, GL_FRAMEBUFFER_BINDING,
+  *             GL_DRAW_INDIRECT_BUFFER_BINDING
   */
 bool
 HPMCsetupTexAndFBOs( struct HPMCHistoPyramid* h );
@@ -259,18 +695,231 @@ HPMCfreeHPBuildShaders( struct HPMCHistoPyramid* h );
 bool
 HPMCbuildHPBuildShaders( struct HPMCHistoPyramid* h );
 
+/** Issues the build programs of the configuration h is about to be set up for.
+  *
+  * The programs are issued with HPMCissueProgram, so the driver may still be
+  * compiling them on return. h itself is left untouched.
+  *
+  * \param programs  The issued programs are appended, each holds a reference.
+  * \return          False if the configuration is invalid.
+  *
+  * \sideeffect None.
+  */
+bool
+HPMCissueHPBuildShaders( struct HPMCHistoPyramid* h, std::vector<GLuint>& programs );
+
+
+/** Returns true if the HistoPyramid uses integer storage. */
+bool
+HPMCintegerStorage( const struct HPMCHistoPyramid* h );
+
+/** Returns true if the MC codes are stored in a separate texture. */
+bool
+HPMCseparateCodes( const struct HPMCHistoPyramid* h );
+
+/** Returns true if a HP level is neither built nor read.
+  *
+  * With a fan-out of 16, every second level from the top and down is skipped.
+  * The top level and the two lowest levels are always kept, so that the
+  * traversal ends with a 4-to-1 step whenever the number of levels is odd.
+  */
+bool
+HPMClevelSkipped( const struct HPMCHistoPyramid* h, GLsizei level );
+
+/** Returns true if the GPGPU fragment shaders declare HPMC_fragment.
+  *
+  * Integer storage, separate codes (written as an integer output), several
+  * surfaces (written as an output array) and the core profile (which lacks
+  * gl_FragColor) use a user-defined fragment output bound to location 0.
+  */
+bool
+HPMCfragmentOutput( const struct HPMCHistoPyramid* h );
+
+/** Returns the number of HistoPyramids written by the base level pass.
+  *
+  * These are the surfaces, followed by the edge HistoPyramid if indexed and
+  * the cell HistoPyramid if per-cell.
+  */
+GLsizei
+HPMCbaseLevelOutputs( const struct HPMCHistoPyramid* h );
+
+/** Returns a HistoPyramid written by the base level pass, see HPMCbaseLevelOutputs. */
+struct HPMCHistoPyramid*
+HPMCbaseLevelOutput( struct HPMCHistoPyramid* h, GLsizei output );
+
+/** Returns the texture holding a level of the HistoPyramid.
+  *
+  * \param tex_level  Set to the mipmap level of the returned texture holding
+  *                   the HP level.
+  */
+GLuint
+HPMClevelTexture( const struct HPMCHistoPyramid* h, GLsizei level, GLint& tex_level );
+
+/** Returns the HistoPyramid holding a surface, or NULL if out of range. */
+struct HPMCHistoPyramid*
+HPMCsurface( struct HPMCHistoPyramid* h, GLsizei surface );
+
+/** Returns the HistoPyramid extracted from, the front one if double buffered. */
+struct HPMCHistoPyramid*
+HPMCfrontBuffer( struct HPMCHistoPyramid* h );
+
+/** Makes all mipmap levels of the HistoPyramid textures accessible.
+  *
+  * \sideeffect GL_TEXTURE_2D_BINDING (unless stateless), left as m_tex.
+  */
+void
+HPMCsetHistoPyramidLevels( const struct HPMCHistoPyramid* h );
+
+/** Returns the #version line prefixed the GPGPU construction shaders. */
+std::string
+HPMCgpgpuShaderVersion( const struct HPMCHistoPyramid* h );
+
+/** Returns the #version line prefixed the compute construction shaders. */
+std::string
+HPMCcomputeShaderVersion( const struct HPMCHistoPyramid* h );
+
+/** Returns true if the result of a top element readback can be read without stalling.
+  *
+  * Without sync objects, readbacks of earlier builds are assumed to be done.
+  */
+bool
+HPMCtopReadbackReady( struct HPMCHistoPyramid* h, GLsizei slot );
+
+/** Sums the sub-pyramid counts of the top level texels in a readback PBO.
+  *
+  * Forces a GPU-CPU synchronization if the readback isn't done. The readback
+  * and all older readbacks in the ring are marked as consumed.
+  *
+  * \sideeffect GL_PIXEL_PACK_BUFFER binding
+  */
+GLsizei
+HPMCreadTopCount( struct HPMCHistoPyramid* h, GLsizei slot );
 
 bool
 HPMCcheckGL( const std::string& file, const int line );
 
+/** Checks for GL errors, except in stateless mode in release builds.
+  *
+  * In stateless mode, glGetError is kept out of the build and extraction
+  * paths, as it may flush the command stream of threaded drivers.
+  */
+bool
+HPMCcheckGLUnlessStateless( const struct HPMCConstants* s,
+                            const std::string&          file,
+                            const int                   line );
+
+/** Binds a texture to a texture unit.
+  *
+  * Uses direct state access in stateless mode, otherwise the texture unit is
+  * made active.
+  *
+  * \sideeffect Active texture unit (unless stateless), binding of texture unit.
+  */
+void
+HPMCbindTextureUnit( const struct HPMCConstants* s,
+                     GLuint                      unit,
+                     GLenum                      target,
+                     GLuint                      tex );
+
+/** Sets the range of accessible mipmap levels of a 2D texture.
+  *
+  * Uses direct state access in stateless mode, otherwise the texture is bound
+  * to the active texture unit.
+  *
+  * \sideeffect GL_TEXTURE_2D_BINDING (unless stateless).
+  */
+void
+HPMCsetTextureLevels( const struct HPMCConstants* s,
+                      GLuint                      tex,
+                      GLint                       base_level,
+                      GLint                       max_level );
+
+/** Saves the vertex array state and the given server attribute groups.
+  *
+  * Uses the attribute stacks in the compatibility profile. The core profile
+  * has no attribute stacks, so only the vertex array object binding, the
+  * viewport (if GL_VIEWPORT_BIT is given) and the scissor box and test (if
+  * GL_SCISSOR_BIT is given) are saved in a.
+  */
+void
+HPMCpushAttribs( const struct HPMCConstants* s,
+                 struct HPMCAttribs&         a,
+                 GLbitfield                  server_mask );
+
+/** Restores state saved by HPMCpushAttribs. */
+void
+HPMCpopAttribs( const struct HPMCConstants* s,
+                const struct HPMCAttribs&   a );
+
 std::string
 HPMCaddLineNumbers( const std::string& src );
 
+/** Creates a shader and starts compiling it. */
+GLuint
+HPMCcreateShader( const std::string& src, GLuint type );
+
+/** Returns true if the shader compiled, prints the log otherwise. */
+bool
+HPMCcheckShader( GLuint shader );
+
+/** Returns true if the program linked, prints the log otherwise. */
+bool
+HPMCcheckProgram( GLuint program );
+
+/** Sources and fragment output bindings of a program built by HPMC. */
+struct HPMCProgramSource
+{
+    std::string               m_vertex;     ///< Vertex shader source, empty unless m_type is GL_FRAGMENT_SHADER.
+    std::string               m_main;       ///< Fragment, compute or vertex shader source.
+    GLenum                    m_type;       ///< GL_FRAGMENT_SHADER, GL_COMPUTE_SHADER or GL_VERTEX_SHADER.
+    /** Fragment outputs bound to the color numbers given by their indices,
+      * empty names are not bound. For GL_VERTEX_SHADER, the varyings
+      * captured by transform feedback, interleaved in this order.
+      */
+    std::vector<std::string>  m_outputs;
+};
+
+/** Shares an existing program or starts building a new one.
+  *
+  * A program issued or built earlier from the same sources and texture unit
+  * is shared, its reference count is increased. Otherwise, the program is
+  * loaded from the program binary cache, or its shaders are compiled and
+  * linked with a reference count of one. With KHR_parallel_shader_compile,
+  * this does not wait for the compiler, and the status is not checked until
+  * the program is passed to HPMCbuildProgram.
+  *
+  * \param tex_unit    First texture unit of the sampler uniforms the caller
+  *                    sets. Programs are only shared between callers that
+  *                    use the same texture units.
+  * \return            The program, to be released with HPMCreleaseProgram.
+  */
 GLuint
-HPMCcompileShader( const std::string& src, GLuint type );
+HPMCissueProgram( struct HPMCConstants*     s,
+                  const HPMCProgramSource&  src,
+                  GLuint                    tex_unit );
 
+/** Returns true if the driver has finished linking an issued program.
+  *
+  * Does not block. Always true without KHR_parallel_shader_compile.
+  */
 bool
-HPMClinkProgram( GLuint program );
+HPMCprogramCompleted( const struct HPMCConstants* s, GLuint program );
+
+/** Builds a program from generated sources, or shares an existing one.
+  *
+  * Like HPMCissueProgram, but waits for the program and checks that it
+  * linked. The shader objects are deleted once the program is linked.
+  *
+  * \return  The linked program, or zero on failure.
+  */
+GLuint
+HPMCbuildProgram( struct HPMCConstants*     s,
+                  const HPMCProgramSource&  src,
+                  GLuint                    tex_unit );
+
+/** Releases a program from HPMCissueProgram or HPMCbuildProgram, deleting it when unused. */
+void
+HPMCreleaseProgram( struct HPMCConstants* s, GLuint program );
 
 GLint
 HPMCgetUniformLocation( GLuint program, const std::string& name );
@@ -281,23 +930,63 @@ HPMCgenerateDefines( struct HPMCHistoPyramid* h );
 std::string
 HPMCgenerateScalarFieldFetch( struct HPMCHistoPyramid* h );
 
+std::string
+HPMCgenerateBaselevelFunction( struct HPMCHistoPyramid* h );
+
 std::string
 HPMCgenerateBaselevelShader( struct HPMCHistoPyramid* h );
 
+std::string
+HPMCgenerateBaselevelComputeShader( struct HPMCHistoPyramid* h );
+
+std::string
+HPMCgenerateReductionComputeShader( struct HPMCHistoPyramid* h );
+
+std::string
+HPMCgenerateIndirectComputeShader( struct HPMCHistoPyramid* h );
+
 std::string
 HPMCgenerateReductionShader( struct HPMCHistoPyramid* h, const std::string& filter="" );
 
+/** Generates a GPGPU shader that reduces a level directly from two levels below. */
+std::string
+HPMCgenerateDoubleReductionShader( struct HPMCHistoPyramid* h );
+
+/** Generates a GPGPU shader that finds the min and max of the samples of each brick. */
+std::string
+HPMCgenerateBrickShader( struct HPMCHistoPyramid* h );
+
 std::string
 HPMCgenerateGPGPUVertexPassThroughShader( struct HPMCHistoPyramid* h );
 
 std::string
 HPMCgenerateExtractVertexFunction( struct HPMCHistoPyramid* h );
 
+/** Generates the geometry shader functions of per-cell extraction.
+  *
+  * extractCell traverses the cell HistoPyramid by gl_PrimitiveIDIn, samples
+  * the corners of the cell once and returns its number of vertices, which
+  * extractCellVertex then interpolates from the shared corner samples.
+  */
+std::string
+HPMCgenerateExtractCellFunctions( struct HPMCHistoPyramid* h );
+
+/** Generates the vertex shader writing the indices of indexed extraction.
+  *
+  * Captures HPMC_index by transform feedback for each triangle corner, the
+  * rank of its edge in the edge HistoPyramid bound to HPMC_edges.
+  */
+std::string
+HPMCgenerateIndexShader( struct HPMCHistoPyramid* h );
+
 
 /** Trigger computations that build the Histopyramid.
   *
   * Evaluates the scalar field, determines codes and vertex counts and builds the HP base layer.
   *
+  * \param incremental  Only redo the regions in h->m_dirty, the rest of the HP
+  *                     is assumed to be up to date.
+  *
   * \sideeffect Active texture unit,
   *             two texture units (see h->m_base_level,m_tex_units..),
   *             GL_CURRENT_PROGRAM,
@@ -308,10 +997,44 @@ HPMCgenerateExtractVertexFunction( struct HPMCHistoPyramid* h );
   *             GL_VERTEX_ARRAY_TYPE,
   *             GL_VERTEX_ARRAY_STRIDE,
   *             GL_VERTEX_ARRAY_POINTER.
-  *             GL_PIXEL_PACK_BUFFER binding
+  *             GL_PIXEL_PACK_BUFFER binding,
+  *             GL_SCISSOR_BOX (incremental GPGPU passes only).
   */
 bool
-HPMCtriggerHistopyramidBuildPasses( struct HPMCHistoPyramid* h );
+HPMCtriggerHistopyramidBuildPasses( struct HPMCHistoPyramid* h, bool incremental );
+
+/** Trigger the pass that finds the min and max of each field brick.
+  *
+  * A compute dispatch with compute shader construction, otherwise a GPGPU
+  * pass.
+  *
+  * \param rects  The bricks to update, laid out as in the bricks tex, or NULL
+  *               to update all bricks.
+  *
+  * \sideeffect GL_CURRENT_PROGRAM,
+  *             GL_FRAMEBUFFER_BINDING and GL_VIEWPORT (GPGPU pass only),
+  *             GL_SCISSOR_BOX (GPGPU pass over rects only),
+  *             image unit 0 (compute dispatch only),
+  *             texture unit h->m_hp_build.m_tex_unit_2.
+  */
+bool
+HPMCtriggerBrickPass( struct HPMCHistoPyramid* h, const std::vector<HPMCRect>* rects );
+
+/** Trigger the compute-shader passes that build the HistoPyramid.
+  *
+  * Used by HPMCtriggerHistopyramidBuildPasses when m_hp_build.m_compute is
+  * enabled.
+  *
+  * \param rects  The base level texels to redo, or NULL to build everything.
+  *
+  * \sideeffect Active texture unit,
+  *             two texture units (see h->m_base_level,m_tex_units..),
+  *             image units 0 to HPMC_COMPUTE_LEVELS_PER_DISPATCH,
+  *             shader storage buffer binding 0,
+  *             GL_CURRENT_PROGRAM.
+  */
+bool
+HPMCtriggerHistopyramidComputePasses( struct HPMCHistoPyramid* h, const std::vector<HPMCRect>* rects );
 
 
 void
@@ -319,7 +1042,11 @@ HPMCsetLayout( struct HPMCHistoPyramid* h );
 
 /** Renders a GPGPU quad from a VBO.
   *
-  * \sideeffect GL_VERTEX_ARRAY,
+  * In the core profile, a full-screen triangle is generated from gl_VertexID
+  * using the empty vertex array object instead.
+  *
+  * \sideeffect GL_VERTEX_ARRAY_BINDING (core profile),
+  *             GL_VERTEX_ARRAY,
   *             GL_VERTEX_ARRAY_SIZE,
   *             GL_VERTEX_ARRAY_TYPE,
   *             GL_VERTEX_ARRAY_STRIDE,
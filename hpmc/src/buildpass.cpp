@@ -37,28 +37,374 @@
 
 using std::cerr;
 using std::endl;
+using std::min;
+using std::max;
 
 // -----------------------------------------------------------------------------
-bool
-HPMCtriggerHistopyramidBuildPasses( struct HPMCHistoPyramid* h )
+static bool
+HPMCrowOrder( const HPMCRect& a, const HPMCRect& b )
 {
-    if( h == NULL ) {
-        return false;
+    if( a.m_y0 != b.m_y0 ) return a.m_y0 < b.m_y0;
+    if( a.m_y1 != b.m_y1 ) return a.m_y1 < b.m_y1;
+    return a.m_x0 < b.m_x0;
+}
+
+// -----------------------------------------------------------------------------
+static bool
+HPMCcolumnOrder( const HPMCRect& a, const HPMCRect& b )
+{
+    if( a.m_x0 != b.m_x0 ) return a.m_x0 < b.m_x0;
+    if( a.m_x1 != b.m_x1 ) return a.m_x1 < b.m_x1;
+    return a.m_y0 < b.m_y0;
+}
+
+// -----------------------------------------------------------------------------
+/** Merges rects that overlap or touch and span the same rows or columns.
+  *
+  * Rects of neighbouring slices in a row of tiles are merged first, then rows
+  * of equal extent.
+  */
+static void
+HPMCmergeRects( std::vector<HPMCRect>& rects )
+{
+    for( int pass=0; pass<2; pass++ ) {
+        std::sort( rects.begin(), rects.end(), pass == 0 ? HPMCrowOrder : HPMCcolumnOrder );
+        std::vector<HPMCRect> merged;
+        for( size_t i=0; i<rects.size(); i++ ) {
+            const HPMCRect& r = rects[i];
+            if( !merged.empty() ) {
+                HPMCRect& m = merged.back();
+                if( (pass == 0) && (m.m_y0 == r.m_y0) && (m.m_y1 == r.m_y1) && (r.m_x0 <= m.m_x1) ) {
+                    m.m_x1 = max( m.m_x1, r.m_x1 );
+                    continue;
+                }
+                if( (pass == 1) && (m.m_x0 == r.m_x0) && (m.m_x1 == r.m_x1) && (r.m_y0 <= m.m_y1) ) {
+                    m.m_y1 = max( m.m_y1, r.m_y1 );
+                    continue;
+                }
+            }
+            merged.push_back( r );
+        }
+        rects.swap( merged );
+    }
+}
+
+// -----------------------------------------------------------------------------
+/** Finds the rects covering the given rects after dividing coordinates by divisor.
+  *
+  * With a divisor of 2^m, base level rects give the texels of level m that
+  * depend on them, and with a divisor of the work group size, the work groups
+  * that cover them.
+  *
+  * \return dst, or NULL if src is NULL.
+  */
+static const std::vector<HPMCRect>*
+HPMCshrinkRects( const std::vector<HPMCRect>* src,
+                 GLsizei                      divisor,
+                 std::vector<HPMCRect>&       dst )
+{
+    if( src == NULL ) {
+        return NULL;
     }
+    dst.resize( src->size() );
+    for( size_t i=0; i<src->size(); i++ ) {
+        const HPMCRect& r = (*src)[i];
+        dst[i].m_x0 = r.m_x0/divisor;
+        dst[i].m_y0 = r.m_y0/divisor;
+        dst[i].m_x1 = (r.m_x1-1)/divisor + 1;
+        dst[i].m_y1 = (r.m_y1-1)/divisor + 1;
+    }
+    HPMCmergeRects( dst );
+    return &dst;
+}
+
+// -----------------------------------------------------------------------------
+/** Finds the base level texels of the changed cells in h->m_dirty. */
+static void
+HPMCdirtyBaseRects( struct HPMCHistoPyramid* h, std::vector<HPMCRect>& rects )
+{
+    const std::vector<GLsizei>& c = h->m_dirty.m_cells;
+    const HPMCHistoPyramid::Tiling& tiling = h->m_tiling;
+
+    rects.clear();
+    for( size_t i=0; i+6<=c.size(); i+=6 ) {
+        // one rect in the tile of every slice, a texel holds 2x2 cells.
+        for( GLsizei z=c[i+2]; z<=c[i+5]; z++ ) {
+            GLsizei tx = tiling.m_tile_size[0]*(z % tiling.m_layout[0]);
+            GLsizei ty = tiling.m_tile_size[1]*(z / tiling.m_layout[0]);
+            HPMCRect r = { tx + c[i+0]/2,   ty + c[i+1]/2,
+                           tx + c[i+3]/2+1, ty + c[i+4]/2+1 };
+            rects.push_back( r );
+        }
+    }
+    HPMCmergeRects( rects );
+}
+
+// -----------------------------------------------------------------------------
+/** Finds the bricks of the changed cells in h->m_dirty, laid out as in the bricks tex. */
+static void
+HPMCdirtyBrickRects( struct HPMCHistoPyramid* h, std::vector<HPMCRect>& rects )
+{
+    const std::vector<GLsizei>& c = h->m_dirty.m_cells;
+    const GLsizei b = HPMC_BRICK_SIZE;
+    const GLsizei rows = h->m_bricks.m_count[1];
+
+    rects.clear();
+    for( size_t i=0; i+6<=c.size(); i+=6 ) {
+        // the z-slices of bricks are stacked along y.
+        for( GLsizei z=c[i+2]/b; z<=c[i+5]/b; z++ ) {
+            HPMCRect r = { c[i+0]/b,   rows*z + c[i+1]/b,
+                           c[i+3]/b+1, rows*z + c[i+4]/b+1 };
+            rects.push_back( r );
+        }
+    }
+    HPMCmergeRects( rects );
+}
+
+// -----------------------------------------------------------------------------
+/** Renders the GPGPU quad, scissored to each rect unless rects is NULL.
+  *
+  * \sideeffect GL_SCISSOR_BOX (if rects), see HPMCrenderGPGPUQuad.
+  */
+static void
+HPMCrenderGPGPURects( struct HPMCHistoPyramid* h, const std::vector<HPMCRect>* rects )
+{
+    if( rects == NULL ) {
+        HPMCrenderGPGPUQuad( h );
+        return;
+    }
+    for( size_t i=0; i<rects->size(); i++ ) {
+        const HPMCRect& r = (*rects)[i];
+        glScissor( r.m_x0, r.m_y0, r.m_x1-r.m_x0, r.m_y1-r.m_y0 );
+        HPMCrenderGPGPUQuad( h );
+    }
+}
+
+// -----------------------------------------------------------------------------
+/** Dispatches all work groups of a level, or only the work groups of each rect.
+  *
+  * \param loc_group_offset  Location of the HPMC_group_offset uniform of the
+  *                          current program.
+  */
+static void
+HPMCdispatchRects( const std::vector<HPMCRect>* groups,
+                   GLsizei                      groups_x,
+                   GLsizei                      groups_y,
+                   GLint                        loc_group_offset )
+{
+    if( groups == NULL ) {
+        glUniform2i( loc_group_offset, 0, 0 );
+        glDispatchCompute( groups_x, groups_y, 1 );
+        return;
+    }
+    for( size_t i=0; i<groups->size(); i++ ) {
+        const HPMCRect& r = (*groups)[i];
+        glUniform2i( loc_group_offset, r.m_x0, r.m_y0 );
+        glDispatchCompute( r.m_x1-r.m_x0, r.m_y1-r.m_y0, 1 );
+    }
+}
+
+// -----------------------------------------------------------------------------
+/** Starts asynchronous readback of the top level into the top element PBO.
+  *
+  * \sideeffect GL_TEXTURE_2D_BINDING (unless stateless), GL_PIXEL_PACK_BUFFER binding
+  */
+static void
+HPMCtriggerTopReadback( struct HPMCHistoPyramid* h )
+{
     HPMCHistoPyramid::HistoPyramid& hp = h->m_histopyramid;
+
+    // Advance in the ring, dropping the oldest readback if not consumed.
+    hp.m_top_latest = (hp.m_top_latest+1) % HPMC_TOP_READBACK_RING_SIZE;
+    HPMCHistoPyramid::HistoPyramid::TopReadback& rb = hp.m_top_readbacks[ hp.m_top_latest ];
+    if( rb.m_fence != 0 ) {
+        glDeleteSync( rb.m_fence );
+        rb.m_fence = 0;
+    }
+
+    GLenum format = HPMCintegerStorage( h ) ? GL_RGBA_INTEGER : GL_RGBA;
+    GLenum type = HPMCintegerStorage( h ) ? GL_UNSIGNED_INT : GL_FLOAT;
+    GLint top_level;
+    GLuint top_tex = HPMClevelTexture( h, hp.m_size_l2, top_level );
+    glBindBuffer( GL_PIXEL_PACK_BUFFER, rb.m_pbo );
+    HPMCsetTextureLevels( h->m_constants, top_tex, 0, top_level );
+    if( h->m_constants->m_stateless ) {
+        glGetTextureImage( top_tex, top_level, format, type,
+                           sizeof(GLuint)*4*hp.m_top_size[0]*hp.m_top_size[1], NULL );
+    }
+    else {
+        glGetTexImage( GL_TEXTURE_2D, top_level, format, type, NULL );
+    }
+    glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+    if( (h->m_constants->m_target >= HPMC_TARGET_GL32_GLSL150) || GLEW_ARB_sync ) {
+        rb.m_fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+    }
+    rb.m_pending = true;
+    hp.m_top_count_updated = false;
+}
+
+// -----------------------------------------------------------------------------
+/** Sets the threshold uniform of a base level program to the thresholds of all surfaces. */
+static void
+HPMCsetThresholds( struct HPMCHistoPyramid* h, GLint loc_threshold )
+{
+    if( h->m_field.m_binary ) {
+        return;
+    }
+    std::vector<GLfloat> thresholds( h->m_surface_count );
+    for( GLsizei s=0; s<h->m_surface_count; s++ ) {
+        thresholds[s] = HPMCsurface( h, s )->m_threshold;
+    }
+    glUniform1fv( loc_threshold, thresholds.size(), thresholds.data() );
+}
+
+// -----------------------------------------------------------------------------
+/** Sets the grid, cull plane and depth pyramid uniforms of a base level program.
+  *
+  * The extent is only used by the cull tests, and may be optimized away.
+  */
+static void
+HPMCsetBaseUniforms( struct HPMCHistoPyramid*                                  h,
+                     const HPMCHistoPyramid::HistoPyramidBuild::BaseUniforms&  loc )
+{
+    std::vector<GLfloat> planes;
+    if( h->m_cull.m_frustum ) {
+        planes.insert( planes.end(), h->m_cull.m_frustum_planes, h->m_cull.m_frustum_planes + 24 );
+    }
+    if( h->m_cull.m_region ) {
+        planes.insert( planes.end(), h->m_cull.m_region_planes, h->m_cull.m_region_planes + 24 );
+    }
+    const HPMCHistoPyramid::Field& f = h->m_field;
+    glUniform3f( loc.m_grid_cells, f.m_cells[0], f.m_cells[1], f.m_cells[2] );
+    if( loc.m_grid_extent != -1 ) {
+        glUniform3f( loc.m_grid_extent, f.m_extent[0], f.m_extent[1], f.m_extent[2] );
+    }
+    glUniform1i( loc.m_cull_count, planes.size()/4 );
+    if( !planes.empty() ) {
+        glUniform4fv( loc.m_cull_planes, planes.size()/4, planes.data() );
+    }
+    if( h->m_occlusion.m_enabled ) {
+        // without a depth pyramid, a max level of -1 disables the test.
+        const HPMCHistoPyramid::Occlusion& occ = h->m_occlusion;
+        glUniform1i( loc.m_hiz_max_level, occ.m_tex != 0 ? occ.m_levels-1 : -1 );
+        glUniformMatrix4fv( loc.m_hiz_mvp, 1, GL_FALSE, occ.m_mvp );
+    }
+}
+
+// -----------------------------------------------------------------------------
+/** Trigger the GPGPU passes that reduce the base level of a surface.
+  *
+  * \param hs     The HistoPyramid of the surface, reduced by the programs of h.
+  * \param rects  The base level texels to redo, or NULL to build everything.
+  *
+  * \sideeffect Leaves the texture unit m_tex_unit_1 active.
+  */
+static void
+HPMCtriggerHistopyramidGPGPUReductions( struct HPMCHistoPyramid*     h,
+                                        struct HPMCHistoPyramid*     hs,
+                                        const std::vector<HPMCRect>* rects )
+{
+    HPMCHistoPyramid::HistoPyramid& hp = hs->m_histopyramid;
     HPMCHistoPyramid::HistoPyramidBuild& hpb = h->m_hp_build;
-    HPMCHistoPyramid::HistoPyramidBuild::BaseConstruction& base = hpb.m_base;
     HPMCHistoPyramid::HistoPyramidBuild::FirstReduction& first = hpb.m_first;
     HPMCHistoPyramid::HistoPyramidBuild::UpperReduction& upper = hpb.m_upper;
+    HPMCHistoPyramid::HistoPyramidBuild::UpperReduction& dbl = hpb.m_double;
+    std::vector<HPMCRect> level_rects;
+
+    // If HP is only 1x1 texels big, we are finished.
+    if( hp.m_size_l2 < 1 ) {
+        return;
+    }
+
+    // --- first reduction of HP -----------------------------------------------
+    // With separate codes, the base level holds plain counts and the first
+    // level is reduced by the upper levels program below.
+    if( !HPMCseparateCodes( h ) ) {
+        glUseProgram( first.m_program );
+
+        // bind histopyramid to current texture unit (h->m_hp_build.m_tex_unit_1),
+        // max mipmap level is already set to zero.
+        glBindTexture( GL_TEXTURE_2D, hp.m_tex );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0 );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0 );
+
+        // distance between texels in base layer of HP
+        if( h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
+            glUniform2f( first.m_loc_delta, -0.5f/hp.m_size[0], 0.5f/hp.m_size[0] );
+            glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, hp.m_fbos[1] );
+        }
+        else {
+            glBindFramebuffer( GL_FRAMEBUFFER, hp.m_fbos[1] );
+            glUniform1i( first.m_loc_src_level, 0 );
+        }
+        glViewport( 0, 0, hp.m_size[0]/2, hp.m_size[1]/2 );
+        HPMCrenderGPGPURects( h, HPMCshrinkRects( rects, 2, level_rects ) );
+
+        // If HP is only 2x2 texels big, we are finished.
+        if( hp.m_size_l2 < 2 ) {
+            return;
+        }
+    }
+
+    // --- trigger the rest of reductions --------------------------------------
+    glUseProgram( upper.m_program );
+
+    if( h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
+        for(GLsizei m=2; m<=hp.m_size_l2; m++) {
+
+            // set legal mipmap levels to the previous level. The HP is still bound
+            // to the current texture unit, so we don't need to bother with binding.
+            glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, m-1 );
+            glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, m-1 );
+
+            // Distance between texels in the previous level.
+            glUniform2f( upper.m_loc_delta, -0.5f/(1<<(hp.m_size_l2+1-m)), 0.5f/(1<<(hp.m_size_l2+1-m)) );
+
+            // Trigger
+            glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, hp.m_fbos[m] );
+            glViewport( 0, 0, 1<<(hp.m_size_l2-m), 1<<(hp.m_size_l2-m) );
+            HPMCrenderGPGPURects( h, HPMCshrinkRects( rects, 1<<m, level_rects ) );
+        }
+    }
+    else {
+        for(GLsizei m=HPMCseparateCodes( h ) ? 1 : 2; m<=hp.m_size_l2; m++) {
+            if( HPMClevelSkipped( h, m ) ) {
+                continue;
+            }
+            // with a fan-out of 16, reduce directly from below a skipped level.
+            const bool skip = HPMClevelSkipped( h, m-1 );
+            const HPMCHistoPyramid::HistoPyramidBuild::UpperReduction& pass = skip ? dbl : upper;
+            glUseProgram( pass.m_program );
+
+            // with mixed precision, the source level may be in the upper tex.
+            GLint src_level;
+            glBindTexture( GL_TEXTURE_2D, HPMClevelTexture( hs, skip ? m-2 : m-1, src_level ) );
+            glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, src_level );
+            glBindFramebuffer( GL_FRAMEBUFFER, hp.m_fbos[m] );
+            glViewport( 0, 0, hp.m_size[0]>>m, hp.m_size[1]>>m );
+            glUniform1i( pass.m_loc_src_level, src_level );
+            HPMCrenderGPGPURects( h, HPMCshrinkRects( rects, 1<<m, level_rects ) );
+        }
 
-    // --- if we have errors already on state, we fail -------------------------
-    if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
-#ifdef DEBUG
-        cerr << "HPMC error: triggerHistopyramidBuildPasses called with GL errors." << endl;
-#endif
-        return false;
     }
 
+    // --- trigger readback ----------------------------------------------------
+    HPMCtriggerTopReadback( hs );
+}
+
+// -----------------------------------------------------------------------------
+/** Trigger the GPGPU passes that build the HistoPyramid.
+  *
+  * \param rects  The base level texels to redo, or NULL to build everything.
+  *               The scissor test must be enabled if not NULL.
+  */
+static bool
+HPMCtriggerHistopyramidGPGPUPasses( struct HPMCHistoPyramid* h, const std::vector<HPMCRect>* rects )
+{
+    HPMCHistoPyramid::HistoPyramid& hp = h->m_histopyramid;
+    HPMCHistoPyramid::HistoPyramidBuild& hpb = h->m_hp_build;
+    HPMCHistoPyramid::HistoPyramidBuild::BaseConstruction& base = hpb.m_base;
+
     // --- build base level ----------------------------------------------------
     glUseProgram( base.m_program );
 
@@ -69,22 +415,35 @@ HPMCtriggerHistopyramidBuildPasses( struct HPMCHistoPyramid* h )
         glBindTexture( GL_TEXTURE_3D, h->m_fetch.m_tex );
     }
 
+    // With empty-space skipping, the bricks are bound to h->m_hp_build.m_tex_unit_3.
+    if( h->m_bricks.m_enabled ) {
+        glActiveTextureARB( GL_TEXTURE0_ARB + hpb.m_tex_unit_3 );
+        glBindTexture( GL_TEXTURE_2D, h->m_bricks.m_tex );
+    }
+
+    // With occlusion culling, the depth pyramid is bound to h->m_hp_build.m_tex_unit_4.
+    if( h->m_occlusion.m_enabled ) {
+        glActiveTextureARB( GL_TEXTURE0_ARB + hpb.m_tex_unit_4 );
+        glBindTexture( GL_TEXTURE_2D, h->m_occlusion.m_tex );
+    }
+
     // Switch to texture unit given by h->m_hp_build.m_tex_unit_1.
     glActiveTextureARB( GL_TEXTURE0_ARB + hpb.m_tex_unit_1 );
 
     // To avoid getting GL errors when we bind base level FBOs, we set mipmap
-    // levels of the HP texture to zero.
-    glBindTexture( GL_TEXTURE_2D, h->m_histopyramid.m_tex );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0 );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    // levels of the HP textures of all surfaces (and edges) to zero.
+    for( GLsizei i=0; i<HPMCbaseLevelOutputs( h ); i++ ) {
+        glBindTexture( GL_TEXTURE_2D, HPMCbaseLevelOutput( h, i )->m_histopyramid.m_tex );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0 );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    }
 
     // Then bind the vertex count texture to unit h->m_hp_build.m_tex_unit_1.
     glBindTexture( GL_TEXTURE_1D, h->m_constants->m_vertex_count_tex );
 
     // Update the threshold uniform
-    if( !h->m_field.m_binary ) {
-        glUniform1f( base.m_loc_threshold, h->m_threshold );
-    }
+    HPMCsetThresholds( h, base.m_loc.m_threshold );
+    HPMCsetBaseUniforms( h, base.m_loc );
 
     // And trigger computation.
     if( h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
@@ -93,84 +452,258 @@ HPMCtriggerHistopyramidBuildPasses( struct HPMCHistoPyramid* h )
     else {
         glBindFramebuffer( GL_FRAMEBUFFER, hp.m_fbos[0] );
     }
-    glViewport( 0, 0, hp.m_size, hp.m_size );
-    HPMCrenderGPGPUQuad( h );
+    glViewport( 0, 0, hp.m_size[0], hp.m_size[1] );
+    HPMCrenderGPGPURects( h, rects );
 
-    // If HP is only 1x1 texels big, we are finished.
-    if( hp.m_size_l2 < 1 ) {
-        return true;
+    // --- reduce each surface (and the edges) by the programs of h ------------
+    for( GLsizei i=0; i<HPMCbaseLevelOutputs( h ); i++ ) {
+        HPMCtriggerHistopyramidGPGPUReductions( h, HPMCbaseLevelOutput( h, i ), rects );
     }
 
-    // --- first reduction of HP -----------------------------------------------
-    glUseProgram( first.m_program );
+    // --- if we have created errors, we fail ----------------------------------
+    if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: triggerHistopyramidBuildPasses produced GL errors." << endl;
+#endif
+        return false;
+    }
+    return true;
+}
 
-    // bind histopyramid to current texture unit (h->m_hp_build.m_tex_unit_1),
-    // max mipmap level is already set to zero.
-    glBindTexture( GL_TEXTURE_2D, hp.m_tex );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0 );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0 );
+// -----------------------------------------------------------------------------
+bool
+HPMCtriggerHistopyramidBuildPasses( struct HPMCHistoPyramid* h, bool incremental )
+{
+    if( h == NULL ) {
+        return false;
+    }
+    HPMCHistoPyramid::HistoPyramid& hp = h->m_histopyramid;
 
-    // distance between texels in base layer of HP
-    if( h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
-        glUniform2f( first.m_loc_delta, -0.5f/hp.m_size, 0.5f/hp.m_size );
-        glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, h->m_histopyramid.m_fbos[1] );
+    // --- if we have errors already on state, we fail -------------------------
+    if( !HPMCcheckGLUnlessStateless( h->m_constants, __FILE__, __LINE__ ) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: triggerHistopyramidBuildPasses called with GL errors." << endl;
+#endif
+        return false;
+    }
+
+    // --- find the base level texels to redo ----------------------------------
+    std::vector<HPMCRect> base_rects;
+    const std::vector<HPMCRect>* rects = NULL;
+    if( incremental ) {
+        HPMCdirtyBaseRects( h, base_rects );
+        GLsizei area = 0;
+        for( size_t i=0; i<base_rects.size(); i++ ) {
+            area += (base_rects[i].m_x1-base_rects[i].m_x0)*(base_rects[i].m_y1-base_rects[i].m_y0);
+        }
+        // when most of the base level has changed, a full build is cheaper.
+        if( 2*area < hp.m_size[0]*hp.m_size[1] ) {
+            rects = &base_rects;
+        }
+    }
+
+    // --- rebuild min/max bricks if the field has changed ---------------------
+    if( h->m_bricks.m_enabled ) {
+        if( h->m_bricks.m_dirty ) {
+            if( !HPMCtriggerBrickPass( h, NULL ) ) {
+                return false;
+            }
+        }
+        else if( !h->m_dirty.m_cells.empty() ) {
+            std::vector<HPMCRect> brick_rects;
+            HPMCdirtyBrickRects( h, brick_rects );
+            if( !HPMCtriggerBrickPass( h, &brick_rects ) ) {
+                return false;
+            }
+        }
+    }
+
+    // --- compute shader construction, no GPGPU passes needed -----------------
+    if( h->m_hp_build.m_compute.m_enabled ) {
+        return HPMCtriggerHistopyramidComputePasses( h, rects );
+    }
+
+    if( rects != NULL ) {
+        glEnable( GL_SCISSOR_TEST );
+    }
+    bool ok = HPMCtriggerHistopyramidGPGPUPasses( h, rects );
+    if( rects != NULL ) {
+        glDisable( GL_SCISSOR_TEST );
+    }
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCtriggerBrickPass( struct HPMCHistoPyramid* h, const std::vector<HPMCRect>* rects )
+{
+    if( h == NULL ) {
+        return false;
+    }
+    HPMCHistoPyramid::Bricks& bricks = h->m_bricks;
+
+    glUseProgram( bricks.m_program );
+    HPMCbindTextureUnit( h->m_constants, h->m_hp_build.m_tex_unit_2,
+                         GL_TEXTURE_3D, h->m_fetch.m_tex );
+    if( h->m_hp_build.m_compute.m_enabled ) {
+        std::vector<HPMCRect> groups;
+        glBindImageTexture( 0, bricks.m_tex, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG32F );
+        HPMCdispatchRects( HPMCshrinkRects( rects, HPMC_COMPUTE_GROUP_SIZE, groups ),
+                           (bricks.m_count[0] + HPMC_COMPUTE_GROUP_SIZE-1)/HPMC_COMPUTE_GROUP_SIZE,
+                           (bricks.m_count[1]*bricks.m_count[2] + HPMC_COMPUTE_GROUP_SIZE-1)/HPMC_COMPUTE_GROUP_SIZE,
+                           bricks.m_loc_group_offset );
+        // the base level dispatch fetches the bricks.
+        glMemoryBarrier( GL_TEXTURE_FETCH_BARRIER_BIT );
     }
     else {
-        glBindFramebuffer( GL_FRAMEBUFFER, h->m_histopyramid.m_fbos[1] );
-        glUniform1i( first.m_loc_src_level, 0 );
+        glBindFramebuffer( GL_FRAMEBUFFER, bricks.m_fbo );
+        glViewport( 0, 0, bricks.m_count[0], bricks.m_count[1]*bricks.m_count[2] );
+        if( rects != NULL ) {
+            glEnable( GL_SCISSOR_TEST );
+        }
+        HPMCrenderGPGPURects( h, rects );
+        if( rects != NULL ) {
+            glDisable( GL_SCISSOR_TEST );
+        }
     }
-    glViewport( 0, 0, hp.m_size/2, hp.m_size/2 );
-    HPMCrenderGPGPUQuad( h );
 
-    // If HP is only 2x2 texels big, we are finished.
-    if( hp.m_size_l2 < 2 ) {
-        return true;
+    if( h->m_constants->m_stateless && !h->m_hp_build.m_compute.m_enabled ) {
+        // leave the documented bindings in a defined state.
+        glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+        if( h->m_constants->m_core ) {
+            glBindVertexArray( 0 );
+        }
     }
+    bricks.m_dirty = false;
 
-    // --- trigger the rest of reductions --------------------------------------
-    glUseProgram( upper.m_program );
+    if( !HPMCcheckGLUnlessStateless( h->m_constants, __FILE__, __LINE__ ) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: triggerBrickPass produced GL errors." << endl;
+#endif
+        return false;
+    }
+    return true;
+}
 
-    if( h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
-        for(GLsizei m=2; m<=hp.m_size_l2; m++) {
+// -----------------------------------------------------------------------------
+/** Binds the levels written by one compute dispatch to image units.
+  *
+  * \param first_unit  Image unit of level dst_level, the others follow.
+  */
+static void
+HPMCbindDestinationLevels( struct HPMCHistoPyramid* h, GLsizei dst_level, GLuint first_unit )
+{
+    HPMCHistoPyramid::HistoPyramid& hp = h->m_histopyramid;
+    for( GLsizei k=0; k<HPMC_COMPUTE_LEVELS_PER_DISPATCH; k++ ) {
+        // Levels above the top are never written by the shader, but the
+        // image unit must still refer to an existing level.
+        GLsizei level = std::min( dst_level+k, hp.m_size_l2 );
+        GLint tex_level;
+        GLuint tex = HPMClevelTexture( h, level, tex_level );
+        glBindImageTexture( first_unit+k, tex, tex_level, GL_FALSE, 0, GL_WRITE_ONLY,
+                            level < hp.m_split_level ? GL_RGBA16UI : hp.m_format );
+    }
+}
 
-            // set legal mipmap levels to the previous level. The HP is still bound
-            // to the current texture unit, so we don't need to bother with binding.
-            glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, m-1 );
-            glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, m-1 );
+// -----------------------------------------------------------------------------
+bool
+HPMCtriggerHistopyramidComputePasses( struct HPMCHistoPyramid* h, const std::vector<HPMCRect>* rects )
+{
+    if( h == NULL ) {
+        return false;
+    }
+    HPMCHistoPyramid::HistoPyramid& hp = h->m_histopyramid;
+    HPMCHistoPyramid::HistoPyramidBuild& hpb = h->m_hp_build;
+    HPMCHistoPyramid::HistoPyramidBuild::ComputeConstruction& comp = hpb.m_compute;
+    std::vector<HPMCRect> groups;
 
-            // Distance between texels in the previous level.
-            glUniform2f( upper.m_loc_delta, -0.5f/(1<<(hp.m_size_l2+1-m)), 0.5f/(1<<(hp.m_size_l2+1-m)) );
+    // --- build base level and the first levels above it ----------------------
+    glUseProgram( comp.m_base_program );
 
-            // Trigger
-            glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, h->m_histopyramid.m_fbos[m] );
-            glViewport( 0, 0, 1<<(hp.m_size_l2-m), 1<<(hp.m_size_l2-m) );
-            HPMCrenderGPGPUQuad( h );
+    if( h->m_fetch.m_mode == HPMC_VOLUME_LAYOUT_TEXTURE_3D ) {
+        HPMCbindTextureUnit( h->m_constants, hpb.m_tex_unit_2, GL_TEXTURE_3D, h->m_fetch.m_tex );
+    }
+    if( h->m_bricks.m_enabled ) {
+        HPMCbindTextureUnit( h->m_constants, hpb.m_tex_unit_3, GL_TEXTURE_2D, h->m_bricks.m_tex );
+    }
+    if( h->m_occlusion.m_enabled ) {
+        HPMCbindTextureUnit( h->m_constants, hpb.m_tex_unit_4, GL_TEXTURE_2D, h->m_occlusion.m_tex );
+    }
+    HPMCbindTextureUnit( h->m_constants, hpb.m_tex_unit_1, GL_TEXTURE_1D, h->m_constants->m_vertex_count_tex );
+
+    // All levels are read by texelFetch, so the full mipmap chain must be legal.
+    const GLsizei n = h->m_surface_count;
+    const GLsizei outputs = HPMCbaseLevelOutputs( h );
+    for( GLsizei s=0; s<outputs; s++ ) {
+        HPMCsetHistoPyramidLevels( HPMCbaseLevelOutput( h, s ) );
+    }
+
+    HPMCsetThresholds( h, comp.m_base_loc.m_threshold );
+    HPMCsetBaseUniforms( h, comp.m_base_loc );
+
+    // the levels of output s (the surfaces, then the edges) are bound from unit
+    // s*HPMC_COMPUTE_LEVELS_PER_DISPATCH, and the MC codes of all surfaces after these.
+    for( GLsizei s=0; s<outputs; s++ ) {
+        HPMCHistoPyramid* hs = HPMCbaseLevelOutput( h, s );
+        HPMCbindDestinationLevels( hs, 0, s*HPMC_COMPUTE_LEVELS_PER_DISPATCH );
+        if( HPMCseparateCodes( h ) ) {
+            glBindImageTexture( n*HPMC_COMPUTE_LEVELS_PER_DISPATCH + s, hs->m_histopyramid.m_code_tex, 0,
+                                GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8UI );
         }
     }
-    else {
-        for(GLsizei m=2; m<=h->m_histopyramid.m_size_l2; m++) {
-            glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, m-1 );
-            glBindFramebuffer( GL_FRAMEBUFFER, h->m_histopyramid.m_fbos[m] );
-            glViewport( 0, 0, 1<<(hp.m_size_l2-m), 1<<(hp.m_size_l2-m) );
-            glUniform1i( upper.m_loc_src_level, m-1 );
-            HPMCrenderGPGPUQuad( h );
+    HPMCdispatchRects( HPMCshrinkRects( rects, HPMC_COMPUTE_GROUP_SIZE, groups ),
+                       (hp.m_size[0] + HPMC_COMPUTE_GROUP_SIZE-1)/HPMC_COMPUTE_GROUP_SIZE,
+                       (hp.m_size[1] + HPMC_COMPUTE_GROUP_SIZE-1)/HPMC_COMPUTE_GROUP_SIZE,
+                       comp.m_base_loc_group_offset );
+
+    for( GLsizei s=0; s<outputs; s++ ) {
+        HPMCHistoPyramid* hs = HPMCbaseLevelOutput( h, s );
+
+        // --- reduce the remaining levels -------------------------------------
+        glUseProgram( comp.m_reduction_program );
+        for( GLsizei m=HPMC_COMPUTE_LEVELS_PER_DISPATCH; m<=hp.m_size_l2; m+=HPMC_COMPUTE_LEVELS_PER_DISPATCH ) {
+            // the previous dispatch wrote the level we are about to fetch from.
+            glMemoryBarrier( GL_TEXTURE_FETCH_BARRIER_BIT );
+            GLint src_level;
+            HPMCbindTextureUnit( h->m_constants, hpb.m_tex_unit_1, GL_TEXTURE_2D,
+                                 HPMClevelTexture( hs, m-1, src_level ) );
+            HPMCbindDestinationLevels( hs, m, 0 );
+            glUniform1i( comp.m_reduction_loc_dst_level, m );
+            glUniform1i( comp.m_reduction_loc_src_level, src_level );
+            // a work group rewrites all levels above its part of level m.
+            HPMCdispatchRects( HPMCshrinkRects( rects, HPMC_COMPUTE_GROUP_SIZE<<m, groups ),
+                               ((hp.m_size[0]>>m) + HPMC_COMPUTE_GROUP_SIZE-1)/HPMC_COMPUTE_GROUP_SIZE,
+                               ((hp.m_size[1]>>m) + HPMC_COMPUTE_GROUP_SIZE-1)/HPMC_COMPUTE_GROUP_SIZE,
+                               comp.m_reduction_loc_group_offset );
         }
 
+        // --- write the vertex count into the draw indirect buffer ------------
+        glMemoryBarrier( GL_TEXTURE_FETCH_BARRIER_BIT );
+        GLint top_level;
+        HPMCbindTextureUnit( h->m_constants, hpb.m_tex_unit_1, GL_TEXTURE_2D,
+                             HPMClevelTexture( hs, hp.m_size_l2, top_level ) );
+        glUseProgram( comp.m_indirect_program );
+        glBindBufferBase( GL_SHADER_STORAGE_BUFFER, 0, hs->m_histopyramid.m_indirect_buffer );
+        glDispatchCompute( 1, 1, 1 );
+        glBindBufferBase( GL_SHADER_STORAGE_BUFFER, 0, 0 );
     }
 
+    // make the result visible for traversal, indirect draws and readback of
+    // the top element.
+    glMemoryBarrier( GL_TEXTURE_FETCH_BARRIER_BIT |
+                     GL_TEXTURE_UPDATE_BARRIER_BIT |
+                     GL_PIXEL_BUFFER_BARRIER_BIT |
+                     GL_COMMAND_BARRIER_BIT );
+
     // --- trigger readback ----------------------------------------------------
-    glBindBuffer( GL_PIXEL_PACK_BUFFER, hp.m_top_pbo );
-    glBindTexture( GL_TEXTURE_2D, hp.m_tex );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0 );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, hp.m_size_l2 );
-    glGetTexImage( GL_TEXTURE_2D, hp.m_size_l2, GL_RGBA, GL_FLOAT, NULL );
-    glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
-    hp.m_top_count_updated = false;
+    for( GLsizei s=0; s<outputs; s++ ) {
+        HPMCtriggerTopReadback( HPMCbaseLevelOutput( h, s ) );
+    }
 
     // --- if we have created errors, we fail ----------------------------------
-    if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+    if( !HPMCcheckGLUnlessStateless( h->m_constants, __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
-        cerr << "HPMC error: triggerHistopyramidBuildPasses produced GL errors." << endl;
+        cerr << "HPMC error: triggerHistopyramidComputePasses produced GL errors." << endl;
 #endif
         return false;
     }
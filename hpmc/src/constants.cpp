@@ -66,6 +66,14 @@ HPMCcreateConstants( GLint max_gl_major, GLint max_gl_minor )
     glGetIntegerv( GL_MAJOR_VERSION, &gl_major );
     glGetIntegerv( GL_MINOR_VERSION, &gl_minor );
 
+    // Determine profile, the profile mask was introduced in GL 3.2
+    bool core = false;
+    if( (gl_major > 3) || ((gl_major == 3) && (gl_minor >= 2)) ) {
+        GLint profile_mask = 0;
+        glGetIntegerv( GL_CONTEXT_PROFILE_MASK, &profile_mask );
+        core = (profile_mask & GL_CONTEXT_CORE_PROFILE_BIT) != 0;
+    }
+
     if( gl_major > max_gl_major ) {
         gl_major = max_gl_major;
         gl_minor = max_gl_minor;
@@ -108,6 +116,10 @@ HPMCcreateConstants( GLint max_gl_major, GLint max_gl_minor )
     s->m_edge_decode_normal_tex = 0;
     s->m_vertex_count_tex = 0;
     s->m_gpgpu_quad_vbo = 0;
+    s->m_stateless = false;
+    s->m_empty_vao = 0;
+    s->m_core = core;
+    s->m_parallel_compile = false;
 
 
     if( gl_major == 2 ) {
@@ -186,31 +198,42 @@ HPMCcreateConstants( GLint max_gl_major, GLint max_gl_minor )
     default:
         std::cerr << "???";
     }
-    std::cerr << "." << std::endl;
+    std::cerr << (s->m_core ? " core profile." : ".") << std::endl;
 #endif
 
+    if( s->m_core && (s->m_target < HPMC_TARGET_GL33_GLSL330) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: core profile requires at least GL version 3.3." << endl;
+#endif
+        delete s;
+        return NULL;
+    }
 
     // --- store state ---------------------------------------------------------
-    glPushClientAttrib( GL_CLIENT_VERTEX_ARRAY_BIT );
-    glPushAttrib( GL_TEXTURE_BIT );
+    HPMCAttribs attribs;
+    HPMCpushAttribs( s, attribs, GL_TEXTURE_BIT );
 
     // --- build enumeration VBO, used to spawn a batch of vertices  -----------
+    // Only needed before GL 3.0, later targets use gl_VertexID as key and
+    // extract using a single attribute-less draw.
     s->m_enumerate_vbo_n = 3*1000;
-    glGenBuffers( 1, &s->m_enumerate_vbo );
-    glBindBuffer( GL_ARRAY_BUFFER, s->m_enumerate_vbo );
-    glBufferData( GL_ARRAY_BUFFER,
-                  3*sizeof(GLfloat)*s->m_enumerate_vbo_n,
-                  NULL,
-                  GL_STATIC_DRAW );
-    GLfloat* ptr =
-            reinterpret_cast<GLfloat*>( glMapBuffer( GL_ARRAY_BUFFER, GL_WRITE_ONLY ) );
-
-    for(int i=0; i<s->m_enumerate_vbo_n; i++) {
-        *ptr++ = static_cast<GLfloat>( i );
-        *ptr++ = 0.0f;
-        *ptr++ = 0.0f;
-    }
-    glUnmapBuffer( GL_ARRAY_BUFFER );
+    if( s->m_target < HPMC_TARGET_GL30_GLSL130 ) {
+        glGenBuffers( 1, &s->m_enumerate_vbo );
+        glBindBuffer( GL_ARRAY_BUFFER, s->m_enumerate_vbo );
+        glBufferData( GL_ARRAY_BUFFER,
+                      3*sizeof(GLfloat)*s->m_enumerate_vbo_n,
+                      NULL,
+                      GL_STATIC_DRAW );
+        GLfloat* ptr =
+                reinterpret_cast<GLfloat*>( glMapBuffer( GL_ARRAY_BUFFER, GL_WRITE_ONLY ) );
+
+        for(int i=0; i<s->m_enumerate_vbo_n; i++) {
+            *ptr++ = static_cast<GLfloat>( i );
+            *ptr++ = 0.0f;
+            *ptr++ = 0.0f;
+        }
+        glUnmapBuffer( GL_ARRAY_BUFFER );
+    }
 
     // --- build edge decode table ---------------------------------------------
 
@@ -281,8 +304,8 @@ HPMCcreateConstants( GLint max_gl_major, GLint max_gl_minor )
                   GL_RGBA32F_ARB, 16, 256,0,
                   GL_RGBA, GL_FLOAT,
                   edge_decode.data() );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
     glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
     glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
 
@@ -295,8 +318,8 @@ HPMCcreateConstants( GLint max_gl_major, GLint max_gl_minor )
                   GL_RGBA32F_ARB, 16, 256,0,
                   GL_RGBA, GL_FLOAT,
                   edge_decode_normal.data() );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
     glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
     glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
     
@@ -317,22 +340,41 @@ HPMCcreateConstants( GLint max_gl_major, GLint max_gl_minor )
     glBindTexture( GL_TEXTURE_1D, s->m_vertex_count_tex );
     glTexParameteri( GL_TEXTURE_1D, GL_TEXTURE_BASE_LEVEL, 0 );
     glTexParameteri( GL_TEXTURE_1D, GL_TEXTURE_MAX_LEVEL, 0 );
-    glTexImage1D( GL_TEXTURE_1D, 0,
-                  GL_ALPHA32F_ARB, 256, 0,
-                  GL_ALPHA, GL_FLOAT,
-                  &tricount[0] );
-    glTexParameteri( GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+    if( s->m_core ) {
+        // alpha formats are gone, swizzle the red channel into alpha.
+        glTexImage1D( GL_TEXTURE_1D, 0,
+                      GL_R32F, 256, 0,
+                      GL_RED, GL_FLOAT,
+                      &tricount[0] );
+        glTexParameteri( GL_TEXTURE_1D, GL_TEXTURE_SWIZZLE_A, GL_RED );
+    }
+    else {
+        glTexImage1D( GL_TEXTURE_1D, 0,
+                      GL_ALPHA32F_ARB, 256, 0,
+                      GL_ALPHA, GL_FLOAT,
+                      &tricount[0] );
+    }
+    glTexParameteri( GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
     glTexParameteri( GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
     glTexParameteri( GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
 
     // --- build GPGPU quad vbo ------------------------------------------------
-    glGenBuffers( 1, &s->m_gpgpu_quad_vbo );
-    glBindBuffer( GL_ARRAY_BUFFER, s->m_gpgpu_quad_vbo );
-    glBufferData( GL_ARRAY_BUFFER, sizeof(GLfloat)*3*4, &HPMC_gpgpu_quad_vertices[0], GL_STATIC_DRAW );
+    if( s->m_core ) {
+        // GPGPU passes and extraction draw attribute-less, but core requires a VAO.
+        glGenVertexArrays( 1, &s->m_empty_vao );
+    }
+    else {
+        if( s->m_target >= HPMC_TARGET_GL30_GLSL130 ) {
+            // extraction draws attribute-less without touching the application's arrays.
+            glGenVertexArrays( 1, &s->m_empty_vao );
+        }
+        glGenBuffers( 1, &s->m_gpgpu_quad_vbo );
+        glBindBuffer( GL_ARRAY_BUFFER, s->m_gpgpu_quad_vbo );
+        glBufferData( GL_ARRAY_BUFFER, sizeof(GLfloat)*3*4, &HPMC_gpgpu_quad_vertices[0], GL_STATIC_DRAW );
+    }
 
     // --- restore state -------------------------------------------------------
-    glPopClientAttrib();
-    glPopAttrib();
+    HPMCpopAttribs( s, attribs );
 
     if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
@@ -346,6 +388,65 @@ HPMCcreateConstants( GLint max_gl_major, GLint max_gl_minor )
     return s;
 }
 
+// -----------------------------------------------------------------------------
+bool
+HPMCsetStateless( struct HPMCConstants* s, GLboolean stateless )
+{
+    if( s == NULL ) {
+        return false;
+    }
+    if( !stateless ) {
+        s->m_stateless = false;
+        return true;
+    }
+    if( s->m_target < HPMC_TARGET_GL43_GLSL430 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: stateless mode requires an OpenGL 4.3 target." << endl;
+#endif
+        return false;
+    }
+    if( !GLEW_ARB_direct_state_access ) {
+#ifdef DEBUG
+        cerr << "HPMC error: stateless mode requires ARB_direct_state_access." << endl;
+#endif
+        return false;
+    }
+    if( s->m_empty_vao == 0 ) {
+        glCreateVertexArrays( 1, &s->m_empty_vao );
+    }
+    s->m_stateless = true;
+    return HPMCcheckGL( __FILE__, __LINE__ );
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCsetProgramBinaryCache( struct HPMCConstants* s, const char* directory )
+{
+    if( s == NULL ) {
+        return false;
+    }
+    if( directory == NULL ) {
+        s->m_binary_cache_dir.clear();
+        return true;
+    }
+    if( !GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary ) {
+#ifdef DEBUG
+        cerr << "HPMC error: program binary cache requires ARB_get_program_binary." << endl;
+#endif
+        return false;
+    }
+    GLint formats = 0;
+    glGetIntegerv( GL_NUM_PROGRAM_BINARY_FORMATS, &formats );
+    if( formats < 1 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: driver supports no program binary formats." << endl;
+#endif
+        return false;
+    }
+    s->m_binary_cache_dir = directory;
+    return HPMCcheckGL( __FILE__, __LINE__ );
+}
+
 // -----------------------------------------------------------------------------
 void
 HPMCdestroyConstants( struct HPMCConstants* s )
@@ -381,6 +482,21 @@ HPMCdestroyConstants( struct HPMCConstants* s )
         glDeleteBuffers( 1, &s->m_gpgpu_quad_vbo );
     }
 
+    if( s->m_empty_vao != 0u ) {
+        glDeleteVertexArrays( 1, &s->m_empty_vao );
+    }
+
+    // programs still held by HistoPyramids that were not destroyed.
+    for( HPMCConstants::ProgramMap::iterator it = s->m_programs.begin(); it != s->m_programs.end(); ++it ) {
+        for( int i=0; i<2; i++ ) {
+            if( it->second.m_shaders[i] != 0 ) {
+                glDeleteShader( it->second.m_shaders[i] );
+            }
+        }
+        glDeleteProgram( it->second.m_program );
+    }
+    s->m_programs.clear();
+
     if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
         cerr << "HPMC error: destroyConstants introduced GL errors." << endl;
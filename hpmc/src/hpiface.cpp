@@ -56,16 +56,45 @@ HPMCcreateHistoPyramid( struct HPMCConstants* constants )
     h->m_tainted = true;
     h->m_broken = true;
     h->m_constants = constants;
+    h->m_surface_count = 1;
+    h->m_double_buffered = false;
+    h->m_front = NULL;
+    h->m_back_built = false;
+
+    h->m_indexed.m_enabled = false;
+    h->m_indexed.m_edges = NULL;
+    h->m_indexed.m_index_program = 0;
+    h->m_indexed.m_loc_histopyramid = -1;
+    h->m_indexed.m_loc_edges = -1;
+    h->m_indexed.m_loc_edge_table = -1;
+    h->m_indexed.m_loc_grid_cells = -1;
+
+    h->m_per_cell.m_enabled = false;
+    h->m_per_cell.m_cells = NULL;
 
     h->m_tiling.m_tile_size[0] = 0;
     h->m_tiling.m_tile_size[1] = 0;
     h->m_tiling.m_layout[0] = 0;
     h->m_tiling.m_layout[1] = 0;
+    h->m_tiling.m_compact = false;
 
-    h->m_histopyramid.m_size = 0;
+    h->m_histopyramid.m_size[0] = 0;
+    h->m_histopyramid.m_size[1] = 0;
     h->m_histopyramid.m_size_l2 = 0;
+    h->m_histopyramid.m_top_size[0] = 1;
+    h->m_histopyramid.m_top_size[1] = 1;
+    h->m_histopyramid.m_bytes = 0;
     h->m_histopyramid.m_tex = 0;
-    h->m_histopyramid.m_top_pbo = 0;
+    h->m_histopyramid.m_tex_upper = 0;
+    h->m_histopyramid.m_format = GL_RGBA32F;
+    h->m_histopyramid.m_mixed_precision = false;
+    h->m_histopyramid.m_separate_codes = false;
+    h->m_histopyramid.m_fan_out = 4;
+    h->m_histopyramid.m_code_tex = 0;
+    h->m_histopyramid.m_split_level = 0;
+    h->m_histopyramid.m_top_latest = 0;
+    h->m_histopyramid.m_top_count_arrived = -1;
+    h->m_histopyramid.m_indirect_buffer = 0;
 
     h->m_field.m_size[0] = 0;
     h->m_field.m_size[1] = 0;
@@ -83,19 +112,78 @@ HPMCcreateHistoPyramid( struct HPMCConstants* constants )
     h->m_fetch.m_tex = 0;
     h->m_fetch.m_gradient = false;
 
+    h->m_bricks.m_enabled = false;
+    h->m_bricks.m_dirty = true;
+    h->m_bricks.m_tex = 0;
+    h->m_bricks.m_fbo = 0;
+    h->m_bricks.m_program = 0;
+    h->m_bricks.m_loc_group_offset = -1;
+
+    h->m_dirty.m_valid = false;
+
+    h->m_cull.m_frustum = false;
+    h->m_cull.m_region = false;
+
+    h->m_occlusion.m_enabled = false;
+    h->m_occlusion.m_tex = 0;
+    h->m_occlusion.m_levels = 0;
+    for( int i=0; i<16; i++ ) {
+        h->m_occlusion.m_mvp[i] = (i%5)==0 ? 1.0f : 0.0f;
+    }
+
+    h->m_changes.m_skip_unchanged = false;
+    h->m_changes.m_generation = 0;
+    h->m_changes.m_built_generation = 0;
+    h->m_changes.m_located_program = 0;
+
+    h->m_setup.m_async = false;
+
     h->m_hp_build.m_tex_unit_1 = 0;
     h->m_hp_build.m_tex_unit_2 = 1;
-    h->m_hp_build.m_gpgpu_vertex_shader = 0;
-    h->m_hp_build.m_base.m_fragment_shader = 0;
+    h->m_hp_build.m_tex_unit_3 = 2;
+    h->m_hp_build.m_tex_unit_4 = 3;
     h->m_hp_build.m_base.m_program = 0;
-    h->m_hp_build.m_first.m_fragment_shader = 0;
     h->m_hp_build.m_first.m_program = 0;
-    h->m_hp_build.m_upper.m_fragment_shader = 0;
     h->m_hp_build.m_upper.m_program = 0;
+    h->m_hp_build.m_double.m_program = 0;
+    h->m_hp_build.m_compute.m_enabled = false;
+    h->m_hp_build.m_compute.m_base_program = 0;
+    h->m_hp_build.m_compute.m_reduction_program = 0;
+    h->m_hp_build.m_compute.m_indirect_program = 0;
 
     return h;
 }
 
+// -----------------------------------------------------------------------------
+/** Sets the cell grid size, rebuilding only if it does not fit the current setup.
+  *
+  * The cell counts are uniforms, so a grid that fits in the tiling, the
+  * bricks and the lattice of the current setup only needs a new build.
+  */
+static void
+HPMCsetCells( struct HPMCHistoPyramid* h, const GLsizei* cells )
+{
+    bool fits = !h->m_tainted;
+    for( int i=0; i<3; i++ ) {
+        fits = fits && (cells[i] >= 1) && (cells[i] < h->m_field.m_size[i]);
+        fits = fits && ( (cells[i]+HPMC_BRICK_SIZE-1)/HPMC_BRICK_SIZE <= h->m_bricks.m_count[i] );
+    }
+    fits = fits &&
+           (cells[0] <= 2*h->m_tiling.m_tile_size[0]) &&
+           (cells[1] <= 2*h->m_tiling.m_tile_size[1]) &&
+           (cells[2] <= h->m_tiling.m_layout[0]*h->m_tiling.m_layout[1]);
+    for( int i=0; i<3; i++ ) {
+        h->m_field.m_cells[i] = cells[i];
+    }
+    if( fits ) {
+        h->m_dirty.m_valid = false;
+    }
+    else {
+        h->m_tainted = true;
+        h->m_broken = false;
+    }
+}
+
 // -----------------------------------------------------------------------------
 void
 HPMCsetLatticeSize( struct HPMCHistoPyramid*  h,
@@ -103,14 +191,22 @@ HPMCsetLatticeSize( struct HPMCHistoPyramid*  h,
                     GLsizei                   y_size,
                     GLsizei                   z_size )
 {
-    h->m_field.m_size[0] = x_size;
-    h->m_field.m_size[1] = y_size;
-    h->m_field.m_size[2] = z_size;
-    h->m_field.m_cells[0] = max( (GLsizei)1u, h->m_field.m_size[0] )-(GLsizei)1u;
-    h->m_field.m_cells[1] = max( (GLsizei)1u, h->m_field.m_size[1] )-(GLsizei)1u;
-    h->m_field.m_cells[2] = max( (GLsizei)1u, h->m_field.m_size[2] )-(GLsizei)1u;
-    h->m_tainted = true;
-    h->m_broken = false;
+    if( (h->m_field.m_size[0] != x_size) ||
+        (h->m_field.m_size[1] != y_size) ||
+        (h->m_field.m_size[2] != z_size) )
+    {
+        h->m_field.m_size[0] = x_size;
+        h->m_field.m_size[1] = y_size;
+        h->m_field.m_size[2] = z_size;
+        h->m_tainted = true;
+        h->m_broken = false;
+    }
+    GLsizei cells[3] = {
+        max( (GLsizei)1u, x_size )-(GLsizei)1u,
+        max( (GLsizei)1u, y_size )-(GLsizei)1u,
+        max( (GLsizei)1u, z_size )-(GLsizei)1u
+    };
+    HPMCsetCells( h, cells );
 }
 
 // -----------------------------------------------------------------------------
@@ -120,11 +216,135 @@ HPMCsetGridSize( struct HPMCHistoPyramid*  h,
                  GLsizei                   y_size,
                  GLsizei                   z_size )
 {
-    h->m_field.m_cells[0] = x_size;
-    h->m_field.m_cells[1] = y_size;
-    h->m_field.m_cells[2] = z_size;
-    h->m_tainted = true;
-    h->m_broken = false;
+    GLsizei cells[3] = { x_size, y_size, z_size };
+    HPMCsetCells( h, cells );
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetHistoPyramidFormat( struct HPMCHistoPyramid* h,
+                           GLenum                   format )
+{
+    if( (format != GL_RGBA32F) && (format != GL_RGBA32UI) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: unsupported HistoPyramid format." << endl;
+#endif
+        return;
+    }
+    if( h->m_histopyramid.m_format != format ) {
+        h->m_histopyramid.m_format = format;
+        h->m_tainted = true;
+        h->m_broken = false;
+    }
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetHistoPyramidMixedPrecision( struct HPMCHistoPyramid* h,
+                                   GLboolean                mixed )
+{
+    if( h->m_histopyramid.m_mixed_precision != (mixed == GL_TRUE) ) {
+        h->m_histopyramid.m_mixed_precision = (mixed == GL_TRUE);
+        h->m_tainted = true;
+        h->m_broken = false;
+    }
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetHistoPyramidSeparateCodes( struct HPMCHistoPyramid* h,
+                                  GLboolean                separate )
+{
+    if( h->m_histopyramid.m_separate_codes != (separate == GL_TRUE) ) {
+        h->m_histopyramid.m_separate_codes = (separate == GL_TRUE);
+        h->m_tainted = true;
+        h->m_broken = false;
+    }
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetHistoPyramidFanOut( struct HPMCHistoPyramid* h,
+                           GLuint                   fan_out )
+{
+    if( (fan_out != 4) && (fan_out != 16) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: unsupported HistoPyramid fan-out." << endl;
+#endif
+        return;
+    }
+    if( h->m_histopyramid.m_fan_out != fan_out ) {
+        h->m_histopyramid.m_fan_out = fan_out;
+        h->m_tainted = true;
+        h->m_broken = false;
+    }
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetHistoPyramidCompactLayout( struct HPMCHistoPyramid* h,
+                                  GLboolean                compact )
+{
+    if( h->m_tiling.m_compact != (compact == GL_TRUE) ) {
+        h->m_tiling.m_compact = (compact == GL_TRUE);
+        h->m_tainted = true;
+        h->m_broken = false;
+    }
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetHistoPyramidDoubleBuffered( struct HPMCHistoPyramid* h,
+                                   GLboolean                double_buffered )
+{
+    if( h->m_double_buffered != (double_buffered == GL_TRUE) ) {
+        h->m_double_buffered = (double_buffered == GL_TRUE);
+        h->m_tainted = true;
+        h->m_broken = false;
+    }
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetIndexedExtraction( struct HPMCHistoPyramid* h,
+                          GLboolean                indexed )
+{
+    if( h->m_indexed.m_enabled != (indexed == GL_TRUE) ) {
+        h->m_indexed.m_enabled = (indexed == GL_TRUE);
+        h->m_tainted = true;
+        h->m_broken = false;
+    }
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetPerCellExtraction( struct HPMCHistoPyramid* h,
+                          GLboolean                per_cell )
+{
+    if( h->m_per_cell.m_enabled != (per_cell == GL_TRUE) ) {
+        h->m_per_cell.m_enabled = (per_cell == GL_TRUE);
+        h->m_tainted = true;
+        h->m_broken = false;
+    }
+}
+
+// -----------------------------------------------------------------------------
+GLsizeiptr
+HPMCgetHistoPyramidBytes( struct HPMCHistoPyramid* h )
+{
+    if( h == NULL ) {
+        return 0;
+    }
+    if( !h->m_tainted ) {
+        return h->m_histopyramid.m_bytes;
+    }
+    // The layout of the new configuration is determined on a copy, as the
+    // textures and programs of h still use the current layout.
+    HPMCHistoPyramid next = *h;
+    if( !HPMCdetermineLayout( &next ) ) {
+        return 0;
+    }
+    return next.m_histopyramid.m_bytes;
 }
 
 // -----------------------------------------------------------------------------
@@ -151,8 +371,10 @@ HPMCsetGridExtent( struct HPMCHistoPyramid*  h,
     h->m_field.m_extent[0] = x_extent;
     h->m_field.m_extent[1] = y_extent;
     h->m_field.m_extent[2] = z_extent;
-    h->m_tainted = true;
-    h->m_broken = false;
+    // the extent is a uniform, but the cull tests depend on it.
+    if( h->m_cull.m_frustum || h->m_cull.m_region || h->m_occlusion.m_enabled ) {
+        h->m_dirty.m_valid = false;
+    }
 #ifdef DEBUG
     cerr << "HPMC info: grid extent x = " << h->m_field.m_extent[0] << endl;
     cerr << "HPMC info: grid extent y = " << h->m_field.m_extent[1] << endl;
@@ -167,6 +389,8 @@ HPMCsetFieldTexture3D( struct HPMCHistoPyramid*  h,
                        GLboolean                 gradient )
 {
     h->m_fetch.m_tex = texture;
+    // a different texture is a different field.
+    h->m_dirty.m_valid = false;
 
     bool grad = ( gradient==GL_TRUE? true : false );
 
@@ -178,6 +402,8 @@ HPMCsetFieldTexture3D( struct HPMCHistoPyramid*  h,
         h->m_fetch.m_gradient = grad;
         h->m_hp_build.m_tex_unit_1 = 0;
         h->m_hp_build.m_tex_unit_2 = 1;
+        h->m_hp_build.m_tex_unit_3 = 2;
+        h->m_hp_build.m_tex_unit_4 = 3;
         h->m_tainted = true;
         h->m_broken = false;
     }
@@ -195,10 +421,296 @@ HPMCsetFieldCustom( struct HPMCHistoPyramid*  h,
     h->m_fetch.m_gradient = ( gradient==GL_TRUE? true : false );
     h->m_hp_build.m_tex_unit_1 = builder_texunit;
     h->m_hp_build.m_tex_unit_2 = builder_texunit+1;
+    h->m_hp_build.m_tex_unit_3 = builder_texunit+2;
+    h->m_hp_build.m_tex_unit_4 = builder_texunit+3;
     h->m_tainted = true;
     h->m_broken = false;
 }
 
+// -----------------------------------------------------------------------------
+void
+HPMCsetFieldBrickSkipping( struct HPMCHistoPyramid* h,
+                           GLboolean                enable )
+{
+    if( h->m_bricks.m_enabled != (enable == GL_TRUE) ) {
+        h->m_bricks.m_enabled = (enable == GL_TRUE);
+        h->m_tainted = true;
+        h->m_broken = false;
+    }
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCinvalidateFieldBricks( struct HPMCHistoPyramid* h )
+{
+    if( h == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: invalidateFieldBricks called with h == NULL." << endl;
+#endif
+        return;
+    }
+    h->m_bricks.m_dirty = true;
+    h->m_changes.m_generation++;
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetCullFrustum( struct HPMCHistoPyramid* h,
+                    const GLfloat*           mvp )
+{
+    if( h == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: setCullFrustum called with h == NULL." << endl;
+#endif
+        return;
+    }
+    h->m_cull.m_frustum = mvp != NULL;
+    if( mvp != NULL ) {
+        // a point is inside if -w <= x,y,z <= w in clip space, i.e. the
+        // planes are the sum and difference of the last row and each row.
+        for( int i=0; i<3; i++ ) {
+            for( int j=0; j<4; j++ ) {
+                h->m_cull.m_frustum_planes[ 8*i + j     ] = mvp[ 4*j + 3 ] + mvp[ 4*j + i ];
+                h->m_cull.m_frustum_planes[ 8*i + j + 4 ] = mvp[ 4*j + 3 ] - mvp[ 4*j + i ];
+            }
+        }
+    }
+    // the cells that are not culled are not in the HP, a full rebuild is needed.
+    h->m_dirty.m_valid = false;
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetRegionOfInterest( struct HPMCHistoPyramid* h,
+                         const GLfloat*           box )
+{
+    if( h == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: setRegionOfInterest called with h == NULL." << endl;
+#endif
+        return;
+    }
+    h->m_cull.m_region = box != NULL;
+    if( box != NULL ) {
+        for( int i=0; i<3; i++ ) {
+            GLfloat* lower = h->m_cull.m_region_planes + 8*i;
+            GLfloat* upper = lower + 4;
+            for( int j=0; j<3; j++ ) {
+                lower[j] = i==j ? 1.0f : 0.0f;
+                upper[j] = i==j ? -1.0f : 0.0f;
+            }
+            lower[3] = -box[i];
+            upper[3] = box[3+i];
+        }
+    }
+    h->m_dirty.m_valid = false;
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetOcclusionCulling( struct HPMCHistoPyramid* h,
+                         GLboolean                enable )
+{
+    if( h == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: setOcclusionCulling called with h == NULL." << endl;
+#endif
+        return;
+    }
+    if( h->m_occlusion.m_enabled != (enable == GL_TRUE) ) {
+        h->m_occlusion.m_enabled = (enable == GL_TRUE);
+        h->m_tainted = true;
+        h->m_broken = false;
+    }
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetOcclusionDepthPyramid( struct HPMCHistoPyramid* h,
+                              GLuint                   texture,
+                              GLint                    levels,
+                              const GLfloat*           mvp )
+{
+    if( h == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: setOcclusionDepthPyramid called with h == NULL." << endl;
+#endif
+        return;
+    }
+    if( texture != 0 && (levels < 1 || mvp == NULL) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: setOcclusionDepthPyramid requires at least one level and a matrix." << endl;
+#endif
+        return;
+    }
+    h->m_occlusion.m_tex = texture;
+    h->m_occlusion.m_levels = levels;
+    if( mvp != NULL ) {
+        std::copy( mvp, mvp+16, h->m_occlusion.m_mvp );
+    }
+    // tiles culled by the previous depth may be visible now.
+    h->m_dirty.m_valid = false;
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetSkipUnchangedBuilds( struct HPMCHistoPyramid* h,
+                            GLboolean                enable )
+{
+    if( h == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: setSkipUnchangedBuilds called with h == NULL." << endl;
+#endif
+        return;
+    }
+    h->m_changes.m_skip_unchanged = (enable == GL_TRUE);
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetAsynchronousSetup( struct HPMCHistoPyramid* h,
+                          GLboolean                enable )
+{
+    if( h == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: setAsynchronousSetup called with h == NULL." << endl;
+#endif
+        return;
+    }
+    h->m_setup.m_async = (enable == GL_TRUE);
+    HPMCConstants* s = h->m_constants;
+    if( h->m_setup.m_async && !s->m_parallel_compile && GLEW_KHR_parallel_shader_compile ) {
+        // let the driver choose the number of compiler threads.
+        glMaxShaderCompilerThreadsKHR( 0xffffffffu );
+        s->m_parallel_compile = true;
+    }
+}
+
+// -----------------------------------------------------------------------------
+GLboolean
+HPMCisReady( struct HPMCHistoPyramid* h )
+{
+    if( h == NULL || h->m_broken ) {
+        return GL_FALSE;
+    }
+    if( !h->m_tainted ) {
+        return GL_TRUE;
+    }
+    return (h->m_setup.m_async && HPMCsetupReady( h )) ? GL_TRUE : GL_FALSE;
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCtouchField( struct HPMCHistoPyramid* h )
+{
+    if( h == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: touchField called with h == NULL." << endl;
+#endif
+        return;
+    }
+    h->m_changes.m_generation++;
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCaddFieldUniform( struct HPMCHistoPyramid* h,
+                     const char*              name )
+{
+    if( h == NULL || name == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: addFieldUniform called with NULL pointer." << endl;
+#endif
+        return;
+    }
+    h->m_changes.m_uniforms.push_back( name );
+    h->m_changes.m_located_program = 0;
+}
+
+// -----------------------------------------------------------------------------
+/** Reads the current values of the field input uniforms of the builder program.
+  *
+  * Each uniform takes HPMC_FIELD_UNIFORM_SIZE values, and components beyond
+  * the size of its type are left as zero.
+  */
+static void
+HPMCreadFieldUniforms( struct HPMCHistoPyramid* h, std::vector<GLfloat>& values )
+{
+    const HPMCHistoPyramid::HistoPyramidBuild& hpb = h->m_hp_build;
+    GLuint program = hpb.m_compute.m_enabled ? hpb.m_compute.m_base_program : hpb.m_base.m_program;
+    HPMCHistoPyramid::Changes& c = h->m_changes;
+
+    // the locations are looked up once per linked builder program.
+    if( c.m_located_program != program ) {
+        c.m_locations.resize( c.m_uniforms.size() );
+        for( size_t i=0; i<c.m_uniforms.size(); i++ ) {
+            c.m_locations[i] = glGetUniformLocation( program, c.m_uniforms[i].c_str() );
+        }
+        c.m_located_program = program;
+    }
+    values.assign( HPMC_FIELD_UNIFORM_SIZE*c.m_uniforms.size(), 0.0f );
+    for( size_t i=0; i<c.m_uniforms.size(); i++ ) {
+        if( c.m_locations[i] != -1 ) {
+            glGetUniformfv( program, c.m_locations[i], &values[ HPMC_FIELD_UNIFORM_SIZE*i ] );
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+/** Returns true if a build would reproduce the current HistoPyramids. */
+static bool
+HPMCbuildUnchanged( struct HPMCHistoPyramid*    h,
+                    const GLfloat*              thresholds,
+                    GLsizei                     n,
+                    const std::vector<GLfloat>& values )
+{
+    const HPMCHistoPyramid::Changes& c = h->m_changes;
+    if( !c.m_skip_unchanged || h->m_tainted ||
+        !h->m_dirty.m_valid || !h->m_dirty.m_cells.empty() ||
+        (h->m_surface_count != n) ||
+        (c.m_generation != c.m_built_generation) ||
+        (c.m_values != values) )
+    {
+        return false;
+    }
+    for( GLsizei s=0; s<n; s++ ) {
+        if( HPMCsurface( h, s )->m_threshold != thresholds[s] ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCmarkFieldRegionDirty( struct HPMCHistoPyramid* h,
+                          GLsizei                  x0,
+                          GLsizei                  y0,
+                          GLsizei                  z0,
+                          GLsizei                  x1,
+                          GLsizei                  y1,
+                          GLsizei                  z1 )
+{
+    if( h == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: markFieldRegionDirty called with h == NULL." << endl;
+#endif
+        return;
+    }
+    // A sample is shared by the cells on both sides of it, clamp these to the grid.
+    const GLsizei first[3] = { x0, y0, z0 };
+    const GLsizei last[3] = { x1, y1, z1 };
+    GLsizei box[6];
+    for( int i=0; i<3; i++ ) {
+        box[i] = max( first[i]-1, 0 );
+        box[i+3] = min( last[i], h->m_field.m_cells[i]-1 );
+        if( box[i] > box[i+3] ) {
+            return;
+        }
+    }
+    h->m_dirty.m_cells.insert( h->m_dirty.m_cells.end(), box, box+6 );
+}
+
 // -----------------------------------------------------------------------------
 GLuint
 HPMCgetBuilderProgram( struct HPMCHistoPyramid*  h )
@@ -217,6 +729,12 @@ HPMCgetBuilderProgram( struct HPMCHistoPyramid*  h )
     }
     if( h->m_tainted ) {
         HPMCsetup( h );
+        if( h->m_constants->m_stateless ) {
+            glUseProgram( 0 );
+        }
+    }
+    if( h->m_hp_build.m_compute.m_enabled ) {
+        return h->m_hp_build.m_compute.m_base_program;
     }
     return h->m_hp_build.m_base.m_program;
 }
@@ -225,12 +743,43 @@ HPMCgetBuilderProgram( struct HPMCHistoPyramid*  h )
 void
 HPMCbuildHistopyramid( struct   HPMCHistoPyramid* h,
                        GLfloat  threshold )
+{
+    HPMCbuildHistopyramidMulti( h, &threshold, 1 );
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCbuildHistopyramidMulti( struct HPMCHistoPyramid* h,
+                            const GLfloat*           thresholds,
+                            GLsizei                  n )
 {
     if( h == NULL || h->m_broken ) {
         return;
     }
+    if( (thresholds == NULL) || (n < 1) || (HPMC_MAX_SURFACES < n) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: buildHistopyramidMulti called with 1 <= n <= "
+             << HPMC_MAX_SURFACES << " thresholds not given." << endl;
+#endif
+        return;
+    }
+    if( h->m_surface_count != n ) {
+        h->m_surface_count = n;
+        h->m_tainted = true;
+    }
+
+    // --- skip the build if neither field nor thresholds have changed ---------
+    std::vector<GLfloat> values;
+    if( h->m_changes.m_skip_unchanged && !h->m_tainted ) {
+        HPMCreadFieldUniforms( h, values );
+        if( HPMCbuildUnchanged( h, thresholds, n, values ) ) {
+            return;
+        }
+    }
+    const bool stateless = h->m_constants->m_stateless;
+
     // -------------------------------------------------------------------------
-    if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+    if( !HPMCcheckGLUnlessStateless( h->m_constants, __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
         cerr << "HPMC error: buildHistopyramid called with errors on state." << endl;
 #endif
@@ -238,49 +787,76 @@ HPMCbuildHistopyramid( struct   HPMCHistoPyramid* h,
     }
 
     // --- store state ---------------------------------------------------------
-    glPushClientAttrib( GL_CLIENT_VERTEX_ARRAY_BIT );
-    glPushAttrib( GL_VIEWPORT_BIT | GL_TEXTURE_BIT );
-    GLuint old_pbo;
-    GLuint old_prog;
-    GLuint old_fbo;
-    glGetIntegerv( GL_PIXEL_PACK_BUFFER_BINDING,
-                   reinterpret_cast<GLint*>(&old_pbo) );
-    glGetIntegerv( GL_CURRENT_PROGRAM,
-                   reinterpret_cast<GLint*>(&old_prog) );
-    if( h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
-        glGetIntegerv( GL_FRAMEBUFFER_BINDING_EXT, reinterpret_cast<GLint*>(&old_fbo) );
-    }
-    else {
-        glGetIntegerv( GL_FRAMEBUFFER_BINDING, reinterpret_cast<GLint*>(&old_fbo) );
+    GLuint old_pbo = 0;
+    GLuint old_prog = 0;
+    GLuint old_fbo = 0;
+    HPMCAttribs attribs;
+    if( !stateless ) {
+        HPMCpushAttribs( h->m_constants, attribs, GL_VIEWPORT_BIT | GL_SCISSOR_BIT | GL_TEXTURE_BIT );
+        glGetIntegerv( GL_PIXEL_PACK_BUFFER_BINDING,
+                       reinterpret_cast<GLint*>(&old_pbo) );
+        glGetIntegerv( GL_CURRENT_PROGRAM,
+                       reinterpret_cast<GLint*>(&old_prog) );
+        if( h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
+            glGetIntegerv( GL_FRAMEBUFFER_BINDING_EXT, reinterpret_cast<GLint*>(&old_fbo) );
+        }
+        else {
+            glGetIntegerv( GL_FRAMEBUFFER_BINDING, reinterpret_cast<GLint*>(&old_fbo) );
+        }
     }
 
     // --- if HP is reconfigured, setup shaders and fbo's ----------------------
+    // with asynchronous setup, the build is skipped until the programs are ready.
     if( h->m_tainted ) {
-        HPMCsetup( h );
+        HPMCsetup( h, false );
     }
 
     // --- if everything is O.K., do construction pass -------------------------
     if(!h->m_tainted ) {
-        h->m_threshold = threshold;
-        if(! HPMCtriggerHistopyramidBuildPasses( h ) ) {
+        // if only marked regions of the field have changed, only they are redone.
+        // the back HistoPyramid of double buffering is two builds old.
+        bool incremental = h->m_dirty.m_valid && !h->m_dirty.m_cells.empty() &&
+                           !h->m_double_buffered;
+        for( GLsizei s=0; s<n; s++ ) {
+            HPMCHistoPyramid* hs = HPMCsurface( h, s );
+            incremental = incremental && (hs->m_threshold == thresholds[s]);
+            hs->m_threshold = thresholds[s];
+        }
+        if(! HPMCtriggerHistopyramidBuildPasses( h, incremental ) ) {
             h->m_broken = true;
         }
+        h->m_dirty.m_valid = !h->m_broken;
+        h->m_dirty.m_cells.clear();
+        h->m_back_built = true;
+        h->m_changes.m_built_generation = h->m_changes.m_generation;
+        h->m_changes.m_values.swap( values );
     }
 
     // --- restore state -------------------------------------------------------
-    if( h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
-        glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, old_fbo );
+    if( stateless ) {
+        // leave the documented bindings in a defined state.
+        if( !h->m_hp_build.m_compute.m_enabled ) {
+            glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+            if( h->m_constants->m_core ) {
+                glBindVertexArray( 0 );
+            }
+        }
+        glUseProgram( 0 );
     }
     else {
-        glBindFramebuffer( GL_FRAMEBUFFER, old_fbo );
+        if( h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
+            glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, old_fbo );
+        }
+        else {
+            glBindFramebuffer( GL_FRAMEBUFFER, old_fbo );
+        }
+        glUseProgram( old_prog );
+        glBindBuffer( GL_PIXEL_PACK_BUFFER, old_pbo );
+        HPMCpopAttribs( h->m_constants, attribs );
     }
-    glUseProgram( old_prog );
-    glBindBuffer( GL_PIXEL_PACK_BUFFER, old_pbo );
-    glPopAttrib();
-    glPopClientAttrib();
 
     // -------------------------------------------------------------------------
-    if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+    if( !HPMCcheckGLUnlessStateless( h->m_constants, __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
         cerr << "HPMC error: buildHistopyramid produced GL errors." << endl;
 #endif
@@ -289,6 +865,46 @@ HPMCbuildHistopyramid( struct   HPMCHistoPyramid* h,
     }
 }
 
+// -----------------------------------------------------------------------------
+GLsync
+HPMCbuildHistopyramidAsync( struct HPMCHistoPyramid* h,
+                            GLfloat                  threshold )
+{
+    HPMCbuildHistopyramid( h, threshold );
+    if( h == NULL || h->m_broken || h->m_tainted ) {
+        return 0;
+    }
+    if( (h->m_constants->m_target < HPMC_TARGET_GL32_GLSL150) && !GLEW_ARB_sync ) {
+#ifdef DEBUG
+        cerr << "HPMC error: buildHistopyramidAsync requires OpenGL 3.2 or ARB_sync." << endl;
+#endif
+        return 0;
+    }
+    return glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCswapHistopyramids( struct HPMCHistoPyramid* h )
+{
+    if( h == NULL || h->m_broken ) {
+        return;
+    }
+    if( h->m_front == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: swapHistopyramids called on a HistoPyramid that is not double buffered." << endl;
+#endif
+        return;
+    }
+    // the front is up to date if no build has happened since the last swap.
+    if( !h->m_back_built ) {
+        return;
+    }
+    std::swap( h->m_histopyramid, h->m_front->m_histopyramid );
+    std::swap( h->m_threshold, h->m_front->m_threshold );
+    h->m_back_built = false;
+}
+
 // -----------------------------------------------------------------------------
 GLuint
 HPMCacquireNumberOfVertices( struct HPMCHistoPyramid* h )
@@ -296,12 +912,14 @@ HPMCacquireNumberOfVertices( struct HPMCHistoPyramid* h )
     if( h == NULL || h->m_broken ) {
         return 0;
     }
+    // the count of the HistoPyramid that is extracted from.
+    h = HPMCfrontBuffer( h );
 
     // --- retrieve number of vertices -----------------------------------------
     if( !h->m_histopyramid.m_top_count_updated ) {
 
         // ---------------------------------------------------------------------
-        if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+        if( !HPMCcheckGLUnlessStateless( h->m_constants, __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
             cerr << "HPMC error: acquireNumberOfVertices called with GL errors." << endl;
 #endif
@@ -309,22 +927,15 @@ HPMCacquireNumberOfVertices( struct HPMCHistoPyramid* h )
         }
 
         // --- store state -----------------------------------------------------
-        GLuint old_pbo;
-        glGetIntegerv( GL_PIXEL_PACK_BUFFER_BINDING,
-                       reinterpret_cast<GLint*>(&old_pbo) );
+        GLuint old_pbo = 0;
+        if( !h->m_constants->m_stateless ) {
+            glGetIntegerv( GL_PIXEL_PACK_BUFFER_BINDING,
+                           reinterpret_cast<GLint*>(&old_pbo) );
+        }
 
         // --- read values in fbo (forcing a sync) -----------------------------
-        GLfloat mem[4];
-        glBindBuffer( GL_PIXEL_PACK_BUFFER,
-                      h->m_histopyramid.m_top_pbo );
-        glGetBufferSubData( GL_PIXEL_PACK_BUFFER,
-                            0, sizeof(GLfloat)*4,
-                            &mem[0] );
         h->m_histopyramid.m_top_count =
-                static_cast<int>( floorf(mem[0]) +
-                                  floorf(mem[1]) +
-                                  floorf(mem[2]) +
-                                  floorf(mem[3]) );
+                HPMCreadTopCount( h, h->m_histopyramid.m_top_latest );
         h->m_histopyramid.m_top_count_updated = true;
 
         // --- restore state ---------------------------------------------------
@@ -332,7 +943,7 @@ HPMCacquireNumberOfVertices( struct HPMCHistoPyramid* h )
 
 
         // ---------------------------------------------------------------------
-        if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+        if( !HPMCcheckGLUnlessStateless( h->m_constants, __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
             cerr << "HPMC error: acquireNumberOfVertices produced GL errors." << endl;
 #endif
@@ -344,3 +955,119 @@ HPMCacquireNumberOfVertices( struct HPMCHistoPyramid* h )
     return h->m_histopyramid.m_top_count;
 }
 
+// -----------------------------------------------------------------------------
+GLuint
+HPMCacquireNumberOfVerticesOfSurface( struct HPMCHistoPyramid* h,
+                                      GLsizei                  surface )
+{
+    if( h == NULL || h->m_broken ) {
+        return 0;
+    }
+    HPMCHistoPyramid* hs = HPMCsurface( h, surface );
+    if( hs == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: acquireNumberOfVerticesOfSurface called with surface "
+             << surface << " not built." << endl;
+#endif
+        return 0;
+    }
+    return HPMCacquireNumberOfVertices( hs );
+}
+
+// -----------------------------------------------------------------------------
+GLuint
+HPMCacquireNumberOfUniqueVertices( struct HPMCHistoPyramid* h )
+{
+    if( h == NULL || h->m_broken ) {
+        return 0;
+    }
+    if( h->m_indexed.m_edges == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: acquireNumberOfUniqueVertices called without indexed extraction." << endl;
+#endif
+        return 0;
+    }
+    return HPMCacquireNumberOfVertices( h->m_indexed.m_edges );
+}
+
+// -----------------------------------------------------------------------------
+GLuint
+HPMCacquireNumberOfActiveCells( struct HPMCHistoPyramid* h )
+{
+    if( h == NULL || h->m_broken ) {
+        return 0;
+    }
+    if( h->m_per_cell.m_cells == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: acquireNumberOfActiveCells called without per-cell extraction." << endl;
+#endif
+        return 0;
+    }
+    return HPMCacquireNumberOfVertices( h->m_per_cell.m_cells );
+}
+
+// -----------------------------------------------------------------------------
+GLboolean
+HPMCpollNumberOfVertices( struct HPMCHistoPyramid* h, GLuint* count )
+{
+    if( h == NULL || h->m_broken || count == NULL ) {
+        return GL_FALSE;
+    }
+    h = HPMCfrontBuffer( h );
+    HPMCHistoPyramid::HistoPyramid& hp = h->m_histopyramid;
+
+    // --- consume the most recent readback that is done -----------------------
+    if( !hp.m_top_count_updated ) {
+
+        // ---------------------------------------------------------------------
+        if( !HPMCcheckGLUnlessStateless( h->m_constants, __FILE__, __LINE__ ) ) {
+#ifdef DEBUG
+            cerr << "HPMC error: pollNumberOfVertices called with GL errors." << endl;
+#endif
+            return GL_FALSE;
+        }
+
+        // --- store state -----------------------------------------------------
+        GLuint old_pbo = 0;
+        if( !h->m_constants->m_stateless ) {
+            glGetIntegerv( GL_PIXEL_PACK_BUFFER_BINDING,
+                           reinterpret_cast<GLint*>(&old_pbo) );
+        }
+
+        // --- newest first, consuming a readback makes older ones stale -------
+        const GLsizei n = HPMC_TOP_READBACK_RING_SIZE;
+        for( GLsizei age=0; age<n; age++ ) {
+            GLsizei slot = (hp.m_top_latest-age+n)%n;
+            if( HPMCtopReadbackReady( h, slot ) ) {
+                GLsizei c = HPMCreadTopCount( h, slot );
+                if( age == 0 ) {
+                    hp.m_top_count = c;
+                    hp.m_top_count_updated = true;
+                }
+                break;
+            }
+        }
+
+        // --- restore state ---------------------------------------------------
+        glBindBuffer( GL_PIXEL_PACK_BUFFER, old_pbo );
+
+        // ---------------------------------------------------------------------
+        if( !HPMCcheckGLUnlessStateless( h->m_constants, __FILE__, __LINE__ ) ) {
+#ifdef DEBUG
+            cerr << "HPMC error: pollNumberOfVertices produced GL errors." << endl;
+#endif
+            h->m_broken = true;
+            return GL_FALSE;
+        }
+    }
+
+    if( hp.m_top_count_updated ) {
+        *count = hp.m_top_count;
+        return GL_TRUE;
+    }
+    if( hp.m_top_count_arrived >= 0 ) {
+        *count = hp.m_top_count_arrived;
+    }
+    return GL_FALSE;
+}
+
@@ -44,30 +44,159 @@ using std::endl;
 #define log2f(x) (logf(x)*1.4426950408889634f)
 #endif
 
+// -----------------------------------------------------------------------------
+/** Releases the programs issued for asynchronous setup. */
+static void
+HPMCreleasePendingPrograms( struct HPMCHistoPyramid* h )
+{
+    std::vector<GLuint>& pending = h->m_setup.m_pending;
+    for( size_t i=0; i<pending.size(); i++ ) {
+        HPMCreleaseProgram( h->m_constants, pending[i] );
+    }
+    pending.clear();
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCsetupReady( struct HPMCHistoPyramid* h )
+{
+    std::vector<GLuint>& pending = h->m_setup.m_pending;
+    if( pending.empty() ) {
+        // an invalid configuration is left for HPMCsetup to report.
+        return !HPMCissueHPBuildShaders( h, pending ) || pending.empty();
+    }
+    for( size_t i=0; i<pending.size(); i++ ) {
+        if( !HPMCprogramCompleted( h->m_constants, pending[i] ) ) {
+            return false;
+        }
+    }
+    // the configuration may have changed while the programs were compiling.
+    std::vector<GLuint> latest;
+    if( !HPMCissueHPBuildShaders( h, latest ) ) {
+        return true;
+    }
+    const bool same = latest == pending;
+    HPMCreleasePendingPrograms( h );
+    pending.swap( latest );
+    return same;
+}
+
 // -----------------------------------------------------------------------------
 bool
-HPMCsetup( struct HPMCHistoPyramid* h )
+HPMCsetup( struct HPMCHistoPyramid* h, bool wait )
 {
     // not tainted, nothing to do.
     if( !h->m_tainted ) {
         return true;
     }
+    // the current configuration is kept until the new programs are linked.
+    if( h->m_setup.m_async && !wait && !HPMCsetupReady( h ) ) {
+        return false;
+    }
     if( !HPMCdetermineLayout(h) ) {
         return false;
     }
+    if( !HPMCsetupSurfaces(h) ) {
+        return false;
+    }
+    if( !HPMCsetupFrontBuffer(h) ) {
+        return false;
+    }
+    if( !HPMCsetupEdges(h) ) {
+        return false;
+    }
+    if( !HPMCsetupCells(h) ) {
+        return false;
+    }
     if( !HPMCsetupTexAndFBOs(h) ) {
         return false;
     }
     if( !HPMCfreeHPBuildShaders( h ) ) {
         return false;
     }
-    if( !HPMCbuildHPBuildShaders( h ) ) {
+    const bool built = HPMCbuildHPBuildShaders( h );
+    // the build programs hold their own references to the issued programs.
+    HPMCreleasePendingPrograms( h );
+    if( !built ) {
         return false;
     }
     h->m_tainted = false;
     return true;
 }
 
+// -----------------------------------------------------------------------------
+/** Returns the number of bytes of mipmap levels [first,last) from a w x h base level. */
+static GLsizeiptr
+HPMCpyramidBytes( GLsizei w, GLsizei h, GLsizei first, GLsizei last, GLsizei texel_bytes )
+{
+    GLsizeiptr texels = 0;
+    for( GLsizei m=first; m<last; m++ ) {
+        texels += static_cast<GLsizeiptr>( max( 1, w>>m ) ) * max( 1, h>>m );
+    }
+    return texel_bytes*texels;
+}
+
+// -----------------------------------------------------------------------------
+/** Determines the compact layout, tiles of exact size in a rectangular HP.
+  *
+  * Tries every number of tiles per row, and for each, the fewest levels that
+  * give a top level of at most HPMC_COMPACT_TOP_MAX_SIZE texels along each
+  * direction. The base level is padded to a multiple of 2^levels, and the
+  * arrangement using the least memory is chosen.
+  */
+static bool
+HPMCdetermineCompactLayout( struct HPMCHistoPyramid* h )
+{
+    GLint max_size;
+    glGetIntegerv( GL_MAX_TEXTURE_SIZE, &max_size );
+
+    HPMCHistoPyramid::Tiling& tiling = h->m_tiling;
+    HPMCHistoPyramid::HistoPyramid& hp = h->m_histopyramid;
+    tiling.m_tile_size[0] = (h->m_field.m_cells[0]+1)/2;
+    tiling.m_tile_size[1] = (h->m_field.m_cells[1]+1)/2;
+
+    hp.m_bytes = 0;
+    const GLsizei slices = h->m_field.m_cells[2];
+    for( GLsizei lx=1; lx<=slices; lx++ ) {
+        GLsizei ly = (slices+lx-1)/lx;
+        // more tiles per row without fewer rows only adds padding.
+        if( (lx > 1) && ((slices+lx-2)/(lx-1) == ly) ) {
+            continue;
+        }
+        GLsizei w = lx*tiling.m_tile_size[0];
+        GLsizei hh = ly*tiling.m_tile_size[1];
+        GLsizei l2 = 1;
+        while( ( ((w+(1<<l2)-1)>>l2) > HPMC_COMPACT_TOP_MAX_SIZE ) ||
+               ( ((hh+(1<<l2)-1)>>l2) > HPMC_COMPACT_TOP_MAX_SIZE ) )
+        {
+            l2++;
+        }
+        GLsizei pw = ((w+(1<<l2)-1)>>l2)<<l2;
+        GLsizei ph = ((hh+(1<<l2)-1)>>l2)<<l2;
+        if( (pw > max_size) || (ph > max_size) ) {
+            continue;
+        }
+        GLsizeiptr bytes = HPMCpyramidBytes( pw, ph, 0, l2+1, 4*sizeof(GLuint) );
+        if( (hp.m_bytes == 0) || (bytes < hp.m_bytes) ) {
+            tiling.m_layout[0] = lx;
+            tiling.m_layout[1] = ly;
+            hp.m_size[0] = pw;
+            hp.m_size[1] = ph;
+            hp.m_size_l2 = l2;
+            hp.m_top_size[0] = pw>>l2;
+            hp.m_top_size[1] = ph>>l2;
+            hp.m_bytes = bytes;
+        }
+    }
+    if( hp.m_bytes == 0 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: compact HistoPyramid layout exceeds max texture size." << endl;
+#endif
+        return false;
+    }
+    return true;
+}
+
 // -----------------------------------------------------------------------------
 bool
 HPMCdetermineLayout( struct HPMCHistoPyramid* h )
@@ -101,33 +230,165 @@ HPMCdetermineLayout( struct HPMCHistoPyramid* h )
     {
         return false;
     }
+    if( HPMCintegerStorage( h ) &&
+        (h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130) )
+    {
+#ifdef DEBUG
+        cerr << "HPMC error: integer HistoPyramid storage requires OpenGL 3.0." << endl;
+#endif
+        return false;
+    }
+    if( h->m_histopyramid.m_mixed_precision && !HPMCintegerStorage( h ) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: mixed-precision HistoPyramid requires GL_RGBA32UI format." << endl;
+#endif
+        return false;
+    }
+    if( h->m_histopyramid.m_separate_codes &&
+        (h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130) )
+    {
+#ifdef DEBUG
+        cerr << "HPMC error: separate MC codes require OpenGL 3.0." << endl;
+#endif
+        return false;
+    }
+    if( (h->m_histopyramid.m_fan_out != 4) &&
+        (h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130) )
+    {
+#ifdef DEBUG
+        cerr << "HPMC error: HistoPyramid fan-out of 16 requires OpenGL 3.0." << endl;
+#endif
+        return false;
+    }
+    if( h->m_bricks.m_enabled &&
+        ( (h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130) ||
+          (h->m_fetch.m_mode != HPMC_VOLUME_LAYOUT_TEXTURE_3D) ) )
+    {
+#ifdef DEBUG
+        cerr << "HPMC error: empty-space skipping requires OpenGL 3.0 and a Texture3D field." << endl;
+#endif
+        return false;
+    }
+    if( h->m_occlusion.m_enabled &&
+        (h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130) )
+    {
+#ifdef DEBUG
+        cerr << "HPMC error: occlusion culling requires OpenGL 3.0." << endl;
+#endif
+        return false;
+    }
+    if( h->m_tiling.m_compact &&
+        (h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130) )
+    {
+#ifdef DEBUG
+        cerr << "HPMC error: compact HistoPyramid layout requires OpenGL 3.0." << endl;
+#endif
+        return false;
+    }
+    if( (h->m_surface_count > 1) &&
+        ( (h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130) || h->m_field.m_binary ) )
+    {
+#ifdef DEBUG
+        cerr << "HPMC error: building several surfaces at once requires OpenGL 3.0 and a continuous field." << endl;
+#endif
+        return false;
+    }
+    if( h->m_double_buffered && (h->m_surface_count > 1) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: double-buffered HistoPyramids build a single surface." << endl;
+#endif
+        return false;
+    }
+    if( h->m_indexed.m_enabled &&
+        ( (h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130) ||
+          h->m_field.m_binary || (h->m_surface_count > 1) || h->m_double_buffered ||
+          h->m_histopyramid.m_mixed_precision || h->m_histopyramid.m_separate_codes ||
+          h->m_occlusion.m_enabled ) )
+    {
+#ifdef DEBUG
+        cerr << "HPMC error: indexed extraction requires OpenGL 3.0, a continuous field and a single surface, "
+             << "and does not combine with double buffering, mixed precision, separate codes or occlusion culling." << endl;
+#endif
+        return false;
+    }
+    if( h->m_per_cell.m_enabled &&
+        ( (h->m_constants->m_target < HPMC_TARGET_GL32_GLSL150) ||
+          h->m_field.m_binary || (h->m_surface_count > 1) || h->m_double_buffered ||
+          h->m_histopyramid.m_mixed_precision || h->m_histopyramid.m_separate_codes ) )
+    {
+#ifdef DEBUG
+        cerr << "HPMC error: per-cell extraction requires OpenGL 3.2, a continuous field and a single surface, "
+             << "and does not combine with double buffering, mixed precision or separate codes." << endl;
+#endif
+        return false;
+    }
 
     // --- determine tiling ----------------------------------------------------
-    h->m_tiling.m_tile_size[0] =
-            1u<<(GLsizei)ceilf( log2f(
-                    static_cast<float>(h->m_field.m_cells[0])/2.0f ) );
-    h->m_tiling.m_tile_size[1] =
-            1u<<(GLsizei)ceilf( log2f(
-                    static_cast<float>(h->m_field.m_cells[1])/2.0f ) );
-    float aspect =
-            static_cast<float>(h->m_tiling.m_tile_size[0]) /
-            static_cast<float>(h->m_tiling.m_tile_size[1]);
-
-    h->m_tiling.m_layout[0] =
-            1u<<(GLsizei)max( 0.0f,
-                              ceilf( log2f( sqrt(
-                                      static_cast<float>(h->m_field.m_cells[2])/aspect ) ) ) );
-    h->m_tiling.m_layout[1] =
-            (h->m_field.m_cells[2]+h->m_tiling.m_layout[0]-1)/h->m_tiling.m_layout[0];
-
-    h->m_histopyramid.m_size_l2 =
-            (GLsizei)ceilf( log2f(
-                    static_cast<float>(
-                            max( h->m_tiling.m_tile_size[0]*h->m_tiling.m_layout[0],
-                                 h->m_tiling.m_tile_size[1]*h->m_tiling.m_layout[1] ) ) ) );
-    h->m_histopyramid.m_size = 1<<h->m_histopyramid.m_size_l2;
-    h->m_tiling.m_layout[0] = h->m_histopyramid.m_size / h->m_tiling.m_tile_size[0];
-    h->m_tiling.m_layout[1] = h->m_histopyramid.m_size / h->m_tiling.m_tile_size[1];
+    if( h->m_tiling.m_compact ) {
+        if( !HPMCdetermineCompactLayout( h ) ) {
+            return false;
+        }
+    }
+    else {
+        h->m_tiling.m_tile_size[0] =
+                1u<<(GLsizei)ceilf( log2f(
+                        static_cast<float>(h->m_field.m_cells[0])/2.0f ) );
+        h->m_tiling.m_tile_size[1] =
+                1u<<(GLsizei)ceilf( log2f(
+                        static_cast<float>(h->m_field.m_cells[1])/2.0f ) );
+        float aspect =
+                static_cast<float>(h->m_tiling.m_tile_size[0]) /
+                static_cast<float>(h->m_tiling.m_tile_size[1]);
+
+        h->m_tiling.m_layout[0] =
+                1u<<(GLsizei)max( 0.0f,
+                                  ceilf( log2f( sqrt(
+                                          static_cast<float>(h->m_field.m_cells[2])/aspect ) ) ) );
+        h->m_tiling.m_layout[1] =
+                (h->m_field.m_cells[2]+h->m_tiling.m_layout[0]-1)/h->m_tiling.m_layout[0];
+
+        h->m_histopyramid.m_size_l2 =
+                (GLsizei)ceilf( log2f(
+                        static_cast<float>(
+                                max( h->m_tiling.m_tile_size[0]*h->m_tiling.m_layout[0],
+                                     h->m_tiling.m_tile_size[1]*h->m_tiling.m_layout[1] ) ) ) );
+        h->m_histopyramid.m_size[0] = 1<<h->m_histopyramid.m_size_l2;
+        h->m_histopyramid.m_size[1] = 1<<h->m_histopyramid.m_size_l2;
+        h->m_histopyramid.m_top_size[0] = 1;
+        h->m_histopyramid.m_top_size[1] = 1;
+        h->m_tiling.m_layout[0] = h->m_histopyramid.m_size[0] / h->m_tiling.m_tile_size[0];
+        h->m_tiling.m_layout[1] = h->m_histopyramid.m_size[1] / h->m_tiling.m_tile_size[1];
+    }
+
+    // --- split levels between 16-bit and 32-bit storage ----------------------
+    HPMCHistoPyramid::HistoPyramid& hp = h->m_histopyramid;
+    if( hp.m_mixed_precision && (HPMC_MIXED_PRECISION_LEVELS <= hp.m_size_l2) ) {
+        hp.m_split_level = HPMC_MIXED_PRECISION_LEVELS;
+    }
+    else {
+        hp.m_split_level = 0;
+    }
+    hp.m_bytes = HPMCpyramidBytes( hp.m_size[0], hp.m_size[1],
+                                   0, hp.m_split_level, 4*sizeof(GLushort) )
+               + HPMCpyramidBytes( hp.m_size[0], hp.m_size[1],
+                                   hp.m_split_level, hp.m_size_l2+1, 4*sizeof(GLuint) );
+    if( hp.m_separate_codes ) {
+        hp.m_bytes += HPMCpyramidBytes( hp.m_size[0], hp.m_size[1], 0, 1, 4*sizeof(GLubyte) );
+    }
+    // every surface has a HistoPyramid of its own, and a front one if double
+    // buffered. Indexed extraction adds the edge HistoPyramid, and per-cell
+    // extraction the cell HistoPyramid.
+    hp.m_bytes *= h->m_surface_count * (h->m_double_buffered ? 2 : 1) +
+                  (h->m_indexed.m_enabled ? 1 : 0) +
+                  (h->m_per_cell.m_enabled ? 1 : 0);
+
+    // --- bricks for empty-space skipping ------------------------------------
+    for( int i=0; i<3; i++ ) {
+        h->m_bricks.m_count[i] = (h->m_field.m_cells[i]+HPMC_BRICK_SIZE-1)/HPMC_BRICK_SIZE;
+    }
+    h->m_bricks.m_dirty = true;
+    h->m_dirty.m_valid = false;
+    h->m_dirty.m_cells.clear();
 
 #ifdef DEBUG
     cerr << "HPMC info: m_tiling.m_tile_size = ["
@@ -138,8 +399,13 @@ HPMCdetermineLayout( struct HPMCHistoPyramid* h )
          << h->m_tiling.m_layout[1] << "]." << endl;
     cerr << "HPMC info: m_histopyramid_size_l2 = "
          << h->m_histopyramid.m_size_l2 << "." << endl;
-    cerr << "HPMC info: m_histopyramid_size = "
-         << h->m_histopyramid.m_size << "." << endl;
+    cerr << "HPMC info: m_histopyramid_size = ["
+         << h->m_histopyramid.m_size[0] << "x"
+         << h->m_histopyramid.m_size[1] << "]." << endl;
+    cerr << "HPMC info: m_histopyramid_split_level = "
+         << h->m_histopyramid.m_split_level << "." << endl;
+    cerr << "HPMC info: m_histopyramid_bytes = "
+         << h->m_histopyramid.m_bytes << "." << endl;
 #endif
 
     // --- initialize vertex count to zero -------------------------------------
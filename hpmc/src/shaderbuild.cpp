@@ -56,35 +56,47 @@ HPMCfreeHPBuildShaders( struct HPMCHistoPyramid* h )
     }
     // --- base level construction ---------------------------------------------
     if( h->m_hp_build.m_base.m_program != 0 ) {
-        glDeleteProgram( h->m_hp_build.m_base.m_program );
+        HPMCreleaseProgram( h->m_constants, h->m_hp_build.m_base.m_program );
         h->m_hp_build.m_base.m_program = 0;
     }
-    if( h->m_hp_build.m_base.m_fragment_shader != 0 ) {
-        glDeleteShader( h->m_hp_build.m_base.m_fragment_shader );
-        h->m_hp_build.m_base.m_fragment_shader = 0;
-    }
     // --- first pass ----------------------------------------------------------
     if( h->m_hp_build.m_first.m_program != 0 ) {
-        glDeleteProgram( h->m_hp_build.m_first.m_program );
+        HPMCreleaseProgram( h->m_constants, h->m_hp_build.m_first.m_program );
         h->m_hp_build.m_first.m_program = 0;
     }
-    if( h->m_hp_build.m_first.m_fragment_shader != 0 ) {
-        glDeleteShader( h->m_hp_build.m_first.m_fragment_shader );
-        h->m_hp_build.m_first.m_fragment_shader = 0;
-    }
     // --- upper levels pass ---------------------------------------------------
     if( h->m_hp_build.m_upper.m_program != 0 ) {
-        glDeleteProgram( h->m_hp_build.m_upper.m_program );
+        HPMCreleaseProgram( h->m_constants, h->m_hp_build.m_upper.m_program );
         h->m_hp_build.m_upper.m_program = 0;
     }
-    if( h->m_hp_build.m_upper.m_fragment_shader != 0 ) {
-        glDeleteShader( h->m_hp_build.m_upper.m_fragment_shader );
-        h->m_hp_build.m_upper.m_fragment_shader = 0;
+    // --- double reduction pass -----------------------------------------------
+    if( h->m_hp_build.m_double.m_program != 0 ) {
+        HPMCreleaseProgram( h->m_constants, h->m_hp_build.m_double.m_program );
+        h->m_hp_build.m_double.m_program = 0;
+    }
+    // --- field bricks pass ---------------------------------------------------
+    if( h->m_bricks.m_program != 0 ) {
+        HPMCreleaseProgram( h->m_constants, h->m_bricks.m_program );
+        h->m_bricks.m_program = 0;
+    }
+    // --- compute shader construction -----------------------------------------
+    if( h->m_hp_build.m_compute.m_base_program != 0 ) {
+        HPMCreleaseProgram( h->m_constants, h->m_hp_build.m_compute.m_base_program );
+        h->m_hp_build.m_compute.m_base_program = 0;
     }
-    // --- common gpgpu vertex shader ------------------------------------------
-    if( h->m_hp_build.m_gpgpu_vertex_shader != 0 ) {
-        glDeleteShader( h->m_hp_build.m_gpgpu_vertex_shader );
-        h->m_hp_build.m_gpgpu_vertex_shader = 0;
+    if( h->m_hp_build.m_compute.m_reduction_program != 0 ) {
+        HPMCreleaseProgram( h->m_constants, h->m_hp_build.m_compute.m_reduction_program );
+        h->m_hp_build.m_compute.m_reduction_program = 0;
+    }
+    if( h->m_hp_build.m_compute.m_indirect_program != 0 ) {
+        HPMCreleaseProgram( h->m_constants, h->m_hp_build.m_compute.m_indirect_program );
+        h->m_hp_build.m_compute.m_indirect_program = 0;
+    }
+    h->m_hp_build.m_compute.m_enabled = false;
+    // --- indexed extraction --------------------------------------------------
+    if( h->m_indexed.m_index_program != 0 ) {
+        HPMCreleaseProgram( h->m_constants, h->m_indexed.m_index_program );
+        h->m_indexed.m_index_program = 0;
     }
 
     if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
@@ -97,66 +109,196 @@ HPMCfreeHPBuildShaders( struct HPMCHistoPyramid* h )
 }
 
 // -----------------------------------------------------------------------------
-bool
-HPMCbuildHPBuildShaders( struct HPMCHistoPyramid* h )
+/** Sources of a GPGPU program that runs the given fragment shader code. */
+static HPMCProgramSource
+HPMCgpgpuProgramSource( struct HPMCHistoPyramid* h, const std::string& fragment )
 {
-    if( h == NULL ) {
-        return false;
+    const std::string version = HPMCgpgpuShaderVersion( h );
+    HPMCProgramSource src;
+    src.m_vertex = version +
+                   HPMCgenerateDefines( h ) +
+                   HPMCgenerateGPGPUVertexPassThroughShader( h );
+    src.m_main = version +
+                 HPMCgenerateDefines( h ) +
+                 fragment;
+    src.m_type = GL_FRAGMENT_SHADER;
+    if( HPMCfragmentOutput( h ) ) {
+        src.m_outputs.push_back( "HPMC_fragment" );
     }
-    HPMCHistoPyramid::HistoPyramidBuild& hpb = h->m_hp_build;
-    HPMCHistoPyramid::HistoPyramidBuild::BaseConstruction& base = hpb.m_base;
-    HPMCHistoPyramid::HistoPyramidBuild::FirstReduction& first = hpb.m_first;
-    HPMCHistoPyramid::HistoPyramidBuild::UpperReduction& upper = hpb.m_upper;
+    return src;
+}
 
-    if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
-#ifdef DEBUG
-        cerr << "HPMC warning: buildHPBuildShaders called with GL errors." << endl;
-#endif
-        return false;
-    }
+// -----------------------------------------------------------------------------
+/** Sources of a compute program that runs the given compute shader code. */
+static HPMCProgramSource
+HPMCcomputeProgramSource( struct HPMCHistoPyramid* h, const std::string& compute )
+{
+    HPMCProgramSource src;
+    src.m_main = HPMCcomputeShaderVersion( h ) +
+                 HPMCgenerateDefines( h ) +
+                 compute;
+    src.m_type = GL_COMPUTE_SHADER;
+    return src;
+}
 
-    // --- build base level construction shader --------------------------------
-    hpb.m_gpgpu_vertex_shader = HPMCcompileShader( HPMCgenerateDefines( h ) +
-                                                   HPMCgenerateGPGPUVertexPassThroughShader( h ),
-                                                   GL_VERTEX_SHADER );
-    if( hpb.m_gpgpu_vertex_shader == 0 ) {
-#ifdef DEBUG
-        cerr << "HPMC error: Failed to build base level gpgpu vertex shader." << endl;
-#endif
-        return false;
-    }
+// -----------------------------------------------------------------------------
+/** Sources of the field bricks program. */
+static HPMCProgramSource
+HPMCbrickProgramSource( struct HPMCHistoPyramid* h, bool compute )
+{
+    const std::string code = HPMCgenerateScalarFieldFetch( h ) +
+                             HPMCgenerateBrickShader( h );
+    return compute ? HPMCcomputeProgramSource( h, code ) : HPMCgpgpuProgramSource( h, code );
+}
 
-    // --- build base level construction shader --------------------------------
-    base.m_fragment_shader = HPMCcompileShader( HPMCgenerateDefines( h ) +
-                                                HPMCgenerateScalarFieldFetch( h ) +
-                                                HPMCgenerateBaselevelShader( h ),
-                                                GL_FRAGMENT_SHADER );
-    if( base.m_fragment_shader == 0 ) {
-#ifdef DEBUG
-        cerr << "HPMC error: Failed to build base level construction fragment shader." << endl;
-#endif
-        return false;
+// -----------------------------------------------------------------------------
+/** Sources of the base level construction GPGPU program. */
+static HPMCProgramSource
+HPMCbaseProgramSource( struct HPMCHistoPyramid* h )
+{
+    HPMCProgramSource src = HPMCgpgpuProgramSource( h,
+                                                    HPMCgenerateScalarFieldFetch( h ) +
+                                                    HPMCgenerateBaselevelShader( h ) );
+    if( HPMCseparateCodes( h ) ) {
+        // the codes follow the counts of all surfaces.
+        src.m_outputs.resize( h->m_surface_count + 1 );
+        src.m_outputs[ h->m_surface_count ] = "HPMC_codes";
+    }
+    if( h->m_indexed.m_enabled ) {
+        // the edge HistoPyramid follows the single surface.
+        src.m_outputs.push_back( "HPMC_edges" );
+    }
+    if( h->m_per_cell.m_enabled ) {
+        // the cell HistoPyramid comes last.
+        src.m_outputs.push_back( "HPMC_cells" );
     }
+    return src;
+}
+
+// -----------------------------------------------------------------------------
+/** Sources of the index program of indexed extraction. */
+static HPMCProgramSource
+HPMCindexProgramSource( struct HPMCHistoPyramid* h )
+{
+    HPMCProgramSource src;
+    src.m_main = HPMCgpgpuShaderVersion( h ) +
+                 HPMCgenerateDefines( h ) +
+                 HPMCgenerateIndexShader( h );
+    src.m_type = GL_VERTEX_SHADER;
+    src.m_outputs.push_back( "HPMC_index" );
+    return src;
+}
+
+// -----------------------------------------------------------------------------
+/** Sources of the first pure reduction GPGPU program. */
+static HPMCProgramSource
+HPMCfirstProgramSource( struct HPMCHistoPyramid* h )
+{
+    const std::string first_filter = HPMCintegerStorage( h ) ? "HPMC_stripCodes" : "floor";
+    return HPMCgpgpuProgramSource( h, HPMCgenerateReductionShader( h, first_filter ) );
+}
+
+// -----------------------------------------------------------------------------
+/** Sources of the upper levels reduction GPGPU program. */
+static HPMCProgramSource
+HPMCupperProgramSource( struct HPMCHistoPyramid* h )
+{
+    return HPMCgpgpuProgramSource( h, HPMCgenerateReductionShader( h ) );
+}
+
+// -----------------------------------------------------------------------------
+/** Sources of the double reduction GPGPU program. */
+static HPMCProgramSource
+HPMCdoubleProgramSource( struct HPMCHistoPyramid* h )
+{
+    return HPMCgpgpuProgramSource( h, HPMCgenerateDoubleReductionShader( h ) );
+}
+
+// -----------------------------------------------------------------------------
+/** Sources of the base level construction compute program. */
+static HPMCProgramSource
+HPMCbaseComputeProgramSource( struct HPMCHistoPyramid* h )
+{
+    return HPMCcomputeProgramSource( h,
+                                     HPMCgenerateScalarFieldFetch( h ) +
+                                     HPMCgenerateBaselevelComputeShader( h ) );
+}
 
-    base.m_program = glCreateProgram();
-    glAttachShader( base.m_program, hpb.m_gpgpu_vertex_shader );
-    glAttachShader( base.m_program, base.m_fragment_shader );
-    if(! HPMClinkProgram( base.m_program ) ) {
+// -----------------------------------------------------------------------------
+/** Sources of the reduction compute program. */
+static HPMCProgramSource
+HPMCreductionComputeProgramSource( struct HPMCHistoPyramid* h )
+{
+    return HPMCcomputeProgramSource( h, HPMCgenerateReductionComputeShader( h ) );
+}
+
+// -----------------------------------------------------------------------------
+/** Sources of the draw indirect command compute program. */
+static HPMCProgramSource
+HPMCindirectComputeProgramSource( struct HPMCHistoPyramid* h )
+{
+    return HPMCcomputeProgramSource( h, HPMCgenerateIndirectComputeShader( h ) );
+}
+
+// -----------------------------------------------------------------------------
+/** Returns true if the image units suffice for compute shader construction.
+  *
+  * The base level pass writes the levels and codes of all surfaces, and the
+  * levels of the edge HistoPyramid if indexed.
+  */
+static bool
+HPMCcomputeImageUnitsSuffice( struct HPMCHistoPyramid* h )
+{
+    GLint max_images, max_units;
+    glGetIntegerv( GL_MAX_COMPUTE_IMAGE_UNIFORMS, &max_images );
+    glGetIntegerv( GL_MAX_IMAGE_UNITS, &max_units );
+    GLint images = HPMCbaseLevelOutputs( h )*HPMC_COMPUTE_LEVELS_PER_DISPATCH +
+                   h->m_surface_count*(HPMCseparateCodes( h ) ? 1 : 0);
+    if( (max_images < images) || (max_units < images) ) {
 #ifdef DEBUG
-        cerr << "HPMC error: Failed to link base level construction program." << endl;
+        cerr << "HPMC error: base level construction compute shader needs "
+             << images << " image units." << endl;
 #endif
         return false;
     }
+    return true;
+}
 
-    // --- configure base level construction program ---------------------------
-    glUseProgram( base.m_program );
+// -----------------------------------------------------------------------------
+/** Sets the sampler uniforms of a base level construction program.
+  *
+  * Also locates the uniforms that are set for each build.
+  *
+  * \sideeffect GL_CURRENT_PROGRAM
+  */
+static bool
+HPMCconfigureBaselevelProgram( struct HPMCHistoPyramid*                               h,
+                               GLuint                                                 program,
+                               HPMCHistoPyramid::HistoPyramidBuild::BaseUniforms&     loc )
+{
+    HPMCHistoPyramid::HistoPyramidBuild& hpb = h->m_hp_build;
+
+    glUseProgram( program );
     if( h->m_field.m_binary ) {
-        base.m_loc_threshold = -1;
+        loc.m_threshold = -1;
+    }
+    else if( h->m_surface_count > 1 ) {
+        loc.m_threshold = HPMCgetUniformLocation( program, "HPMC_thresholds" );
     }
     else {
-        base.m_loc_threshold = HPMCgetUniformLocation( base.m_program, "HPMC_threshold" );
+        loc.m_threshold = HPMCgetUniformLocation( program, "HPMC_threshold" );
+    }
+    loc.m_cull_count = HPMCgetUniformLocation( program, "HPMC_cull_count" );
+    loc.m_cull_planes = HPMCgetUniformLocation( program, "HPMC_cull_planes" );
+    loc.m_grid_cells = HPMCgetUniformLocation( program, "HPMC_grid_cells" );
+    loc.m_grid_extent = HPMCgetUniformLocation( program, "HPMC_grid_extent" );
+    if( loc.m_cull_count == -1 || loc.m_cull_planes == -1 || loc.m_grid_cells == -1 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: Failed to locate grid and cull plane uniforms in base level construction program." << endl;
+#endif
+        return false;
     }
-    GLint loc_vertex_count = HPMCgetUniformLocation( base.m_program, "HPMC_vertex_count" );
+    GLint loc_vertex_count = HPMCgetUniformLocation( program, "HPMC_vertex_count" );
     if( loc_vertex_count != -1 ) {
         glUniform1i( loc_vertex_count, hpb.m_tex_unit_1 );
     }
@@ -167,8 +309,38 @@ HPMCbuildHPBuildShaders( struct HPMCHistoPyramid* h )
         return false;
     }
 
+    if( h->m_bricks.m_enabled ) {
+        GLint loc_bricks = HPMCgetUniformLocation( program, "HPMC_bricks" );
+        if( loc_bricks != -1 ) {
+            glUniform1i( loc_bricks, hpb.m_tex_unit_3 );
+        }
+        else {
+#ifdef DEBUG
+            cerr << "HPMC error: Failed to locate bricks texture uniform in base level construction program." << endl;
+#endif
+            return false;
+        }
+    }
+    if( h->m_occlusion.m_enabled ) {
+        GLint loc_hiz = HPMCgetUniformLocation( program, "HPMC_hiz" );
+        loc.m_hiz_mvp = HPMCgetUniformLocation( program, "HPMC_hiz_mvp" );
+        loc.m_hiz_max_level = HPMCgetUniformLocation( program, "HPMC_hiz_max_level" );
+        if( loc_hiz != -1 && loc.m_hiz_mvp != -1 && loc.m_hiz_max_level != -1 ) {
+            glUniform1i( loc_hiz, hpb.m_tex_unit_4 );
+        }
+        else {
+#ifdef DEBUG
+            cerr << "HPMC error: Failed to locate depth pyramid uniforms in base level construction program." << endl;
+#endif
+            return false;
+        }
+    }
+    else {
+        loc.m_hiz_mvp = -1;
+        loc.m_hiz_max_level = -1;
+    }
     if( h->m_fetch.m_mode != HPMC_VOLUME_LAYOUT_CUSTOM ) {
-        GLint loc_field = HPMCgetUniformLocation( base.m_program, "HPMC_scalarfield" );
+        GLint loc_field = HPMCgetUniformLocation( program, "HPMC_scalarfield" );
         if( loc_field != -1 ) {
             glUniform1i( loc_field, hpb.m_tex_unit_2 );
         }
@@ -185,58 +357,309 @@ HPMCbuildHPBuildShaders( struct HPMCHistoPyramid* h )
 #endif
         return false;
     }
+    return true;
+}
 
-    // --- build first pure reduction pass program -----------------------------
-    first.m_fragment_shader = HPMCcompileShader( HPMCgenerateDefines( h ) +
-                                                 HPMCgenerateReductionShader( h, "floor" ),
-                                                 GL_FRAGMENT_SHADER );
-    if( first.m_fragment_shader == 0 ) {
+// -----------------------------------------------------------------------------
+/** Builds the program that finds the min and max of each field brick.
+  *
+  * A compute program if the HistoPyramid is built by compute shaders,
+  * otherwise a GPGPU program.
+  *
+  * \sideeffect GL_CURRENT_PROGRAM
+  */
+static bool
+HPMCbuildBrickShaders( struct HPMCHistoPyramid* h )
+{
+    HPMCHistoPyramid::Bricks& bricks = h->m_bricks;
+    if( !bricks.m_enabled ) {
+        return true;
+    }
+    const bool compute = h->m_hp_build.m_compute.m_enabled;
+    bricks.m_program = HPMCbuildProgram( h->m_constants,
+                                         HPMCbrickProgramSource( h, compute ),
+                                         h->m_hp_build.m_tex_unit_1 );
+    if( bricks.m_program == 0 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: Failed to build field bricks program." << endl;
+#endif
+        return false;
+    }
+    glUseProgram( bricks.m_program );
+    GLint loc_field = HPMCgetUniformLocation( bricks.m_program, "HPMC_scalarfield" );
+    glUniform1i( loc_field, h->m_hp_build.m_tex_unit_2 );
+    if( compute ) {
+        bricks.m_loc_group_offset = HPMCgetUniformLocation( bricks.m_program, "HPMC_group_offset" );
+    }
+
+    if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: GL errors building field bricks program." << endl;
+#endif
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+/** Builds the index program of indexed extraction.
+  *
+  * The sampler uniforms are set for each extraction, to the texture units
+  * of the traversal handle.
+  */
+static bool
+HPMCbuildIndexShaders( struct HPMCHistoPyramid* h )
+{
+    HPMCHistoPyramid::Indexed& indexed = h->m_indexed;
+    if( !indexed.m_enabled ) {
+        return true;
+    }
+    indexed.m_index_program = HPMCbuildProgram( h->m_constants,
+                                                HPMCindexProgramSource( h ),
+                                                h->m_hp_build.m_tex_unit_1 );
+    if( indexed.m_index_program == 0 ) {
 #ifdef DEBUG
-        cerr << "HPMC error: Failed to build first reduction fragment shader." << endl;
+        cerr << "HPMC error: Failed to build index program." << endl;
 #endif
         return false;
     }
-    first.m_program = glCreateProgram();
-    glAttachShader( first.m_program, hpb.m_gpgpu_vertex_shader );
-    glAttachShader( first.m_program, first.m_fragment_shader );
-    if(! HPMClinkProgram( first.m_program ) ) {
+    indexed.m_loc_histopyramid = HPMCgetUniformLocation( indexed.m_index_program, "HPMC_histopyramid" );
+    indexed.m_loc_edges = HPMCgetUniformLocation( indexed.m_index_program, "HPMC_edges" );
+    indexed.m_loc_edge_table = HPMCgetUniformLocation( indexed.m_index_program, "HPMC_edge_table" );
+    indexed.m_loc_grid_cells = HPMCgetUniformLocation( indexed.m_index_program, "HPMC_grid_cells" );
+    if( (indexed.m_loc_histopyramid == -1) ||
+        (indexed.m_loc_edges == -1) ||
+        (indexed.m_loc_edge_table == -1) ||
+        (indexed.m_loc_grid_cells == -1) )
+    {
 #ifdef DEBUG
-        cerr << "HPMC error: Failed to link first reduction program." << endl;
+        cerr << "HPMC error: Can't find uniforms in index program." << endl;
 #endif
         return false;
     }
+    return true;
+}
 
-    // --- configure first pure reduction pass program -------------------------
-    glUseProgram( first.m_program );
-    first.m_loc_src_level = glGetUniformLocation( first.m_program, "HPMC_src_level" );
-    first.m_loc_delta = glGetUniformLocation( first.m_program, "HPMC_delta" );
-    GLint fr_hp_loc = HPMCgetUniformLocation( first.m_program, "HPMC_histopyramid" );
-    glUniform1i( fr_hp_loc, hpb.m_tex_unit_1 );
+// -----------------------------------------------------------------------------
+/** Build compute-shader construction programs.
+  *
+  * \sideeffect GL_CURRENT_PROGRAM
+  */
+static bool
+HPMCbuildHPComputeShaders( struct HPMCHistoPyramid* h )
+{
+    HPMCHistoPyramid::HistoPyramidBuild& hpb = h->m_hp_build;
+    HPMCHistoPyramid::HistoPyramidBuild::ComputeConstruction& comp = hpb.m_compute;
+
+    if( !HPMCcomputeImageUnitsSuffice( h ) ) {
+        return false;
+    }
+
+    // --- build base level construction compute shader ------------------------
+    comp.m_base_program = HPMCbuildProgram( h->m_constants,
+                                            HPMCbaseComputeProgramSource( h ),
+                                            hpb.m_tex_unit_1 );
+    if( comp.m_base_program == 0 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: Failed to build base level construction compute program." << endl;
+#endif
+        return false;
+    }
+    if( !HPMCconfigureBaselevelProgram( h, comp.m_base_program, comp.m_base_loc ) ) {
+        return false;
+    }
+    comp.m_base_loc_group_offset = HPMCgetUniformLocation( comp.m_base_program, "HPMC_group_offset" );
+    if( comp.m_base_loc_group_offset == -1 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: Can't find uniforms in base level construction compute program." << endl;
+#endif
+        return false;
+    }
+
+    // --- build reduction compute shader --------------------------------------
+    comp.m_reduction_program = HPMCbuildProgram( h->m_constants,
+                                                 HPMCreductionComputeProgramSource( h ),
+                                                 hpb.m_tex_unit_1 );
+    if( comp.m_reduction_program == 0 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: Failed to build reduction compute program." << endl;
+#endif
+        return false;
+    }
+    glUseProgram( comp.m_reduction_program );
+    comp.m_reduction_loc_dst_level = HPMCgetUniformLocation( comp.m_reduction_program, "HPMC_dst_level" );
+    comp.m_reduction_loc_src_level = HPMCgetUniformLocation( comp.m_reduction_program, "HPMC_src_level" );
+    comp.m_reduction_loc_group_offset = HPMCgetUniformLocation( comp.m_reduction_program, "HPMC_group_offset" );
+    GLint hp_loc = HPMCgetUniformLocation( comp.m_reduction_program, "HPMC_histopyramid" );
+    if( (hp_loc == -1) ||
+        (comp.m_reduction_loc_dst_level == -1 ) ||
+        (comp.m_reduction_loc_src_level == -1 ) ||
+        (comp.m_reduction_loc_group_offset == -1 ) )
+    {
+#ifdef DEBUG
+        cerr << "HPMC error: Can't find uniforms in reduction compute program." << endl;
+#endif
+        return false;
+    }
+    glUniform1i( hp_loc, hpb.m_tex_unit_1 );
+
+    // --- build draw indirect command compute shader --------------------------
+    comp.m_indirect_program = HPMCbuildProgram( h->m_constants,
+                                                HPMCindirectComputeProgramSource( h ),
+                                                hpb.m_tex_unit_1 );
+    if( comp.m_indirect_program == 0 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: Failed to build draw indirect compute program." << endl;
+#endif
+        return false;
+    }
+    glUseProgram( comp.m_indirect_program );
+    hp_loc = HPMCgetUniformLocation( comp.m_indirect_program, "HPMC_histopyramid" );
+    if( hp_loc == -1 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: Can't find uniforms in draw indirect compute program." << endl;
+#endif
+        return false;
+    }
+    glUniform1i( hp_loc, hpb.m_tex_unit_1 );
 
     if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
-        cerr << "HPMC error: GL errors building first reduction program." << endl;
+        cerr << "HPMC error: GL errors building compute construction programs." << endl;
 #endif
         return false;
     }
+    return true;
+}
 
-    // --- build upper levels reduction pass program ---------------------------
-    upper.m_fragment_shader =  HPMCcompileShader( HPMCgenerateDefines( h ) +
-                                                  HPMCgenerateReductionShader( h ),
-                                                  GL_FRAGMENT_SHADER );
-    if( upper.m_fragment_shader == 0 ) {
+// -----------------------------------------------------------------------------
+bool
+HPMCissueHPBuildShaders( struct HPMCHistoPyramid* h, std::vector<GLuint>& programs )
+{
+    // The sources depend on the layout of the new configuration, which is
+    // determined on a copy, so that h stays usable until the setup completes.
+    HPMCHistoPyramid next = *h;
+    if( !HPMCdetermineLayout( &next ) ) {
+        return false;
+    }
+    HPMCHistoPyramid::HistoPyramidBuild& hpb = next.m_hp_build;
+    hpb.m_compute.m_enabled = (next.m_constants->m_target >= HPMC_TARGET_GL43_GLSL430) &&
+                              HPMCcomputeImageUnitsSuffice( &next );
+
+    std::vector<HPMCProgramSource> sources;
+    if( hpb.m_compute.m_enabled ) {
+        sources.push_back( HPMCbaseComputeProgramSource( &next ) );
+        sources.push_back( HPMCreductionComputeProgramSource( &next ) );
+        sources.push_back( HPMCindirectComputeProgramSource( &next ) );
+    }
+    else {
+        sources.push_back( HPMCbaseProgramSource( &next ) );
+        if( !HPMCseparateCodes( &next ) ) {
+            sources.push_back( HPMCfirstProgramSource( &next ) );
+        }
+        sources.push_back( HPMCupperProgramSource( &next ) );
+        if( next.m_histopyramid.m_fan_out == 16 ) {
+            sources.push_back( HPMCdoubleProgramSource( &next ) );
+        }
+    }
+    if( next.m_bricks.m_enabled ) {
+        sources.push_back( HPMCbrickProgramSource( &next, hpb.m_compute.m_enabled ) );
+    }
+    if( next.m_indexed.m_enabled ) {
+        sources.push_back( HPMCindexProgramSource( &next ) );
+    }
+    for( size_t i=0; i<sources.size(); i++ ) {
+        programs.push_back( HPMCissueProgram( next.m_constants, sources[i], hpb.m_tex_unit_1 ) );
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCbuildHPBuildShaders( struct HPMCHistoPyramid* h )
+{
+    if( h == NULL ) {
+        return false;
+    }
+    HPMCHistoPyramid::HistoPyramidBuild& hpb = h->m_hp_build;
+    HPMCHistoPyramid::HistoPyramidBuild::BaseConstruction& base = hpb.m_base;
+    HPMCHistoPyramid::HistoPyramidBuild::FirstReduction& first = hpb.m_first;
+    HPMCHistoPyramid::HistoPyramidBuild::UpperReduction& upper = hpb.m_upper;
+    HPMCHistoPyramid::HistoPyramidBuild::UpperReduction& dbl = hpb.m_double;
+
+    if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
-        cerr << "HPMC error: Failed to build upper levels reduction fragment shader." << endl;
+        cerr << "HPMC warning: buildHPBuildShaders called with GL errors." << endl;
 #endif
         return false;
     }
 
-    upper.m_program = glCreateProgram();
-    glAttachShader( upper.m_program, hpb.m_gpgpu_vertex_shader );
-    glAttachShader( upper.m_program, upper.m_fragment_shader );
-    if(! HPMClinkProgram( upper.m_program ) ) {
+    // --- on GL 4.3 and up, try compute shader construction first ------------
+    if( h->m_constants->m_target >= HPMC_TARGET_GL43_GLSL430 ) {
+        if( HPMCbuildHPComputeShaders( h ) ) {
+            hpb.m_compute.m_enabled = true;
+            return HPMCbuildBrickShaders( h ) && HPMCbuildIndexShaders( h );
+        }
+#ifdef DEBUG
+        cerr << "HPMC warning: Falling back to GPGPU construction passes." << endl;
+#endif
+        if( !HPMCfreeHPBuildShaders( h ) ) {
+            return false;
+        }
+    }
+
+    // --- build base level construction program -------------------------------
+    base.m_program = HPMCbuildProgram( h->m_constants,
+                                       HPMCbaseProgramSource( h ),
+                                       hpb.m_tex_unit_1 );
+    if( base.m_program == 0 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: Failed to build base level construction program." << endl;
+#endif
+        return false;
+    }
+
+    // --- configure base level construction program ---------------------------
+    if( !HPMCconfigureBaselevelProgram( h, base.m_program, base.m_loc ) ) {
+        return false;
+    }
+
+    // --- build first pure reduction pass program -----------------------------
+    // With separate codes, the base level holds plain counts and the upper
+    // levels reduction program reduces the first level as well.
+    if( !HPMCseparateCodes( h ) ) {
+        first.m_program = HPMCbuildProgram( h->m_constants,
+                                            HPMCfirstProgramSource( h ),
+                                            hpb.m_tex_unit_1 );
+        if( first.m_program == 0 ) {
 #ifdef DEBUG
-        cerr << "HPMC error: Failed to link upper levels reduction program." << endl;
+            cerr << "HPMC error: Failed to build first reduction program." << endl;
+#endif
+            return false;
+        }
+
+        // --- configure first pure reduction pass program ---------------------
+        glUseProgram( first.m_program );
+        first.m_loc_src_level = glGetUniformLocation( first.m_program, "HPMC_src_level" );
+        first.m_loc_delta = glGetUniformLocation( first.m_program, "HPMC_delta" );
+        GLint fr_hp_loc = HPMCgetUniformLocation( first.m_program, "HPMC_histopyramid" );
+        glUniform1i( fr_hp_loc, hpb.m_tex_unit_1 );
+
+        if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+#ifdef DEBUG
+            cerr << "HPMC error: GL errors building first reduction program." << endl;
+#endif
+            return false;
+        }
+    }
+
+    // --- build upper levels reduction pass program ---------------------------
+    upper.m_program = HPMCbuildProgram( h->m_constants,
+                                        HPMCupperProgramSource( h ),
+                                        hpb.m_tex_unit_1 );
+    if( upper.m_program == 0 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: Failed to build upper levels reduction program." << endl;
 #endif
         return false;
     }
@@ -262,5 +685,32 @@ HPMCbuildHPBuildShaders( struct HPMCHistoPyramid* h )
 #endif
         return false;
     }
-    return true;
+
+    // --- build double reduction pass program ---------------------------------
+    if( h->m_histopyramid.m_fan_out == 16 ) {
+        dbl.m_program = HPMCbuildProgram( h->m_constants,
+                                          HPMCdoubleProgramSource( h ),
+                                          hpb.m_tex_unit_1 );
+        if( dbl.m_program == 0 ) {
+#ifdef DEBUG
+            cerr << "HPMC error: Failed to build double reduction program." << endl;
+#endif
+            return false;
+        }
+
+        // --- configure double reduction pass program -------------------------
+        glUseProgram( dbl.m_program );
+        dbl.m_loc_delta = -1;
+        dbl.m_loc_src_level = glGetUniformLocation( dbl.m_program, "HPMC_src_level" );
+        GLint dr_hp_loc = HPMCgetUniformLocation( dbl.m_program, "HPMC_histopyramid" );
+        glUniform1i( dr_hp_loc, hpb.m_tex_unit_1 );
+
+        if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+#ifdef DEBUG
+            cerr << "HPMC error: GL errors building double reduction program." << endl;
+#endif
+            return false;
+        }
+    }
+    return HPMCbuildBrickShaders( h ) && HPMCbuildIndexShaders( h );
 }
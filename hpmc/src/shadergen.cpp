@@ -41,6 +41,18 @@ using std::string;
 using std::stringstream;
 using std::cerr;
 
+// -----------------------------------------------------------------------------
+/** Returns the name of a texture lookup function.
+  *
+  * The core profile only has the overloaded texture(), dimension-specific
+  * lookups like texture3D are compatibility built-ins.
+  */
+static std::string
+HPMCtextureLookup( struct HPMCHistoPyramid* h, const std::string& compat )
+{
+    return h->m_constants->m_core ? "texture" : compat;
+}
+
 // -----------------------------------------------------------------------------
 std::string
 HPMCgenerateDefines( struct HPMCHistoPyramid* h )
@@ -55,17 +67,16 @@ HPMCgenerateDefines( struct HPMCHistoPyramid* h )
     src << "#define HPMC_FUNC_Y_F      float(HPMC_FUNC_Y)" << endl;
     src << "#define HPMC_FUNC_Z        " << h->m_field.m_size[2] << endl;
     src << "#define HPMC_FUNC_Z_F      float(HPMC_FUNC_Z)" << endl;
-    //      cell grid dimension
-    src << "#define HPMC_CELLS_X       " << h->m_field.m_cells[0] << endl;
-    src << "#define HPMC_CELLS_X_F     float(HPMC_CELLS_X)" << endl;
-    src << "#define HPMC_CELLS_Y       " << h->m_field.m_cells[1] << endl;
-    src << "#define HPMC_CELLS_Y_F     float(HPMC_CELLS_Y)" << endl;
-    src << "#define HPMC_CELLS_Z       " << h->m_field.m_cells[2] << endl;
-    src << "#define HPMC_CELLS_Z_F     float(HPMC_CELLS_Z)" << endl;
-    //      cell grid extent
-    src << "#define HPMC_GRID_EXT_X_F  float("<<h->m_field.m_extent[0]<<")"<<endl;
-    src << "#define HPMC_GRID_EXT_Y_F  float("<<h->m_field.m_extent[1]<<")"<<endl;
-    src << "#define HPMC_GRID_EXT_Z_F  float("<<h->m_field.m_extent[2]<<")"<<endl;
+    //      cell grid dimension and extent, uniforms so that they can be
+    //      changed within the tiling without rebuilding shaders
+    src << "uniform vec3       HPMC_grid_cells;" << endl;
+    src << "uniform vec3       HPMC_grid_extent;" << endl;
+    src << "#define HPMC_CELLS_X_F     HPMC_grid_cells.x" << endl;
+    src << "#define HPMC_CELLS_Y_F     HPMC_grid_cells.y" << endl;
+    src << "#define HPMC_CELLS_Z_F     HPMC_grid_cells.z" << endl;
+    src << "#define HPMC_GRID_EXT_X_F  HPMC_grid_extent.x" << endl;
+    src << "#define HPMC_GRID_EXT_Y_F  HPMC_grid_extent.y" << endl;
+    src << "#define HPMC_GRID_EXT_Z_F  HPMC_grid_extent.z" << endl;
     //      tiling in base layer
     src << "#define HPMC_TILES_X       " << h->m_tiling.m_layout[0] << endl;
     src << "#define HPMC_TILES_X_F     float(HPMC_TILES_X)" << endl;
@@ -77,33 +88,260 @@ HPMCgenerateDefines( struct HPMCHistoPyramid* h )
     src << "#define HPMC_TILE_SIZE_Y   " << h->m_tiling.m_tile_size[1] << endl;
     src << "#define HPMC_TILE_SIZE_Y_F float(HPMC_TILE_SIZE_Y)" << endl;
     //      histopyramid size
-    src << "#define HPMC_HP_SIZE_L2  " << h->m_histopyramid.m_size_l2 << endl;
+    src << "#define HPMC_HP_SIZE_L2    " << h->m_histopyramid.m_size_l2 << endl;
+    src << "#define HPMC_HP_SIZE_X     " << h->m_histopyramid.m_size[0] << endl;
+    src << "#define HPMC_HP_SIZE_X_F   float(HPMC_HP_SIZE_X)" << endl;
+    src << "#define HPMC_HP_SIZE_Y     " << h->m_histopyramid.m_size[1] << endl;
+    src << "#define HPMC_HP_SIZE_Y_F   float(HPMC_HP_SIZE_Y)" << endl;
+    //      size of top level of histopyramid
+    src << "#define HPMC_HP_TOP_X      " << h->m_histopyramid.m_top_size[0] << endl;
+    src << "#define HPMC_HP_TOP_Y      " << h->m_histopyramid.m_top_size[1] << endl;
+    //      first level stored in the upper levels tex, zero if none
+    src << "#define HPMC_HP_SPLIT_LEVEL " << h->m_histopyramid.m_split_level << endl;
+    //      bricks for empty-space skipping, also the tiles of occlusion culling
+    if( h->m_bricks.m_enabled || h->m_occlusion.m_enabled ) {
+        src << "#define HPMC_BRICK_SIZE    " << HPMC_BRICK_SIZE << endl;
+    }
+    if( h->m_bricks.m_enabled ) {
+        src << "#define HPMC_BRICKS_Y      " << h->m_bricks.m_count[1] << endl;
+    }
 
     return src.str();
 }
 
 // -----------------------------------------------------------------------------
-std::string
-HPMCgenerateBaselevelShader( struct HPMCHistoPyramid* h )
+/** Generates the statements declaring the MC codes and vertex counts of a texel.
+  *
+  * Expects l0, l1 and l2 to hold the partial MC codes of the 3x3x2 corners.
+  */
+static std::string
+HPMCgenerateCellCounts( struct HPMCHistoPyramid* h, const std::string& indent )
 {
     stringstream src;
 
-    src << "// generated by HPMCgenerateBaselevelShader" << endl;
-    src << "uniform sampler1D  HPMC_vertex_count;" << endl;
-    if( !h->m_field.m_binary ) {
-        src << "uniform float      HPMC_threshold;" << endl;
+    if( HPMCintegerStorage( h ) ) {
+        //          build codes for 2x2x1 set of voxels
+        src << indent << "uvec4 codes = uvec4(" << endl;
+        src << indent << "    l0.x+2.0*l0.y+4.0*l1.x +8.0*l1.y," << endl;
+        src << indent << "    l0.y+2.0*l0.z+4.0*l1.y +8.0*l1.z," << endl;
+        src << indent << "    l1.x+2.0*l1.y+4.0*l2.x +8.0*l2.y," << endl;
+        src << indent << "    l1.y+2.0*l1.z+4.0*l2.y +8.0*l2.z" << endl;
+        src << indent << ");" << endl;
+        //          fetch the triangle count for the 2x2x1 set of voxels
+        src << indent << "uvec4 counts = uvec4(" << endl;
+        src << indent << "    texelFetch( HPMC_vertex_count, int(codes.x), 0 ).a," << endl;
+        src << indent << "    texelFetch( HPMC_vertex_count, int(codes.y), 0 ).a," << endl;
+        src << indent << "    texelFetch( HPMC_vertex_count, int(codes.z), 0 ).a," << endl;
+        src << indent << "    texelFetch( HPMC_vertex_count, int(codes.w), 0 ).a" << endl;
+        src << indent << ");" << endl;
     }
-    src << "void" << endl;
-    src << "main()" << endl;
+    else {
+        //          build codes for 2x2x1 set of voxels,
+        //          store code in fractional part
+        src << indent << "vec4 codes = (1.0/256.0)*vec4(" << endl;
+        src << indent << "    l0.x+2.0*l0.y+4.0*l1.x +8.0*l1.y+0.5," << endl;
+        src << indent << "    l0.y+2.0*l0.z+4.0*l1.y +8.0*l1.z+0.5," << endl;
+        src << indent << "    l1.x+2.0*l1.y+4.0*l2.x +8.0*l2.y+0.5," << endl;
+        src << indent << "    l1.y+2.0*l1.z+4.0*l2.y +8.0*l2.z+0.5" << endl;
+        src << indent << ");" << endl;
+        //          fetch the triangle count for the 2x2x1 set of voxels
+        src << indent << "vec4 counts = vec4(" << endl;
+        const std::string lookup = HPMCtextureLookup( h, "texture1D" );
+        src << indent << "    " << lookup << "( HPMC_vertex_count, codes.x ).a," << endl;
+        src << indent << "    " << lookup << "( HPMC_vertex_count, codes.y ).a," << endl;
+        src << indent << "    " << lookup << "( HPMC_vertex_count, codes.z ).a," << endl;
+        src << indent << "    " << lookup << "( HPMC_vertex_count, codes.w ).a" << endl;
+        src << indent << ");" << endl;
+    }
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates the depth pyramid uniforms and a function that tests a tile against them.
+  *
+  * The tile is the brick of the cells of the texel at stp and slice. The
+  * corners of its bounding box are projected, and the tile is occluded if
+  * its nearest depth is beyond the farthest depth of the at most 2x2 texels
+  * of the first pyramid level where the projection is at most one texel.
+  */
+static std::string
+HPMCgenerateOcclusionFunction( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    src << "uniform sampler2D  HPMC_hiz;" << endl;
+    src << "uniform mat4       HPMC_hiz_mvp;" << endl;
+    src << "uniform int        HPMC_hiz_max_level;" << endl;
+    src << "bool" << endl;
+    src << "HPMC_tileVisible( vec2 stp, float slice )" << endl;
     src << "{" << endl;
-    if( h->m_field.m_binary ) {
-        src << "    const float HPMC_threshold = 0.5;" << endl;
+    src << "    if( HPMC_hiz_max_level < 0 ) {" << endl;
+    src << "        return true;" << endl;
+    src << "    }" << endl;
+    src << "    ivec2 cell = 2*ivec2( fract( stp )*vec2( HPMC_TILE_SIZE_X_F, HPMC_TILE_SIZE_Y_F ) );" << endl;
+    src << "    vec3 tile = vec3( ( ivec3( cell, int( slice ) ) / HPMC_BRICK_SIZE ) * HPMC_BRICK_SIZE );" << endl;
+    src << "    vec3 s = vec3( HPMC_GRID_EXT_X_F / HPMC_CELLS_X_F," << endl;
+    src << "                   HPMC_GRID_EXT_Y_F / HPMC_CELLS_Y_F," << endl;
+    src << "                   HPMC_GRID_EXT_Z_F / HPMC_CELLS_Z_F );" << endl;
+    src << "    vec3 lo = s*tile;" << endl;
+    src << "    vec3 hi = min( s*( tile + vec3( float( HPMC_BRICK_SIZE ) ) )," << endl;
+    src << "                   vec3( HPMC_GRID_EXT_X_F, HPMC_GRID_EXT_Y_F, HPMC_GRID_EXT_Z_F ) );" << endl;
+    //      bounding box of the projected corners in window coordinates
+    src << "    vec3 wmin = vec3( 1.0 );" << endl;
+    src << "    vec3 wmax = vec3( 0.0 );" << endl;
+    src << "    float wlow = 1.0;" << endl;
+    src << "    for( int i=0; i<8; i++ ) {" << endl;
+    src << "        vec4 q = HPMC_hiz_mvp * vec4( mix( lo, hi, vec3( ivec3( i, i>>1, i>>2 ) & ivec3( 1 ) ) ), 1.0 );" << endl;
+    src << "        vec3 w = clamp( 0.5*(q.xyz/q.w) + vec3( 0.5 ), vec3( 0.0 ), vec3( 1.0 ) );" << endl;
+    src << "        wmin = min( wmin, w );" << endl;
+    src << "        wmax = max( wmax, w );" << endl;
+    src << "        wlow = min( wlow, q.w );" << endl;
+    src << "    }" << endl;
+    //      a corner behind the eye, the projection is unbounded
+    src << "    if( wlow <= 0.0 ) {" << endl;
+    src << "        return true;" << endl;
+    src << "    }" << endl;
+    //      the level where the projection covers at most one texel
+    src << "    vec2 extent = ( wmax.xy - wmin.xy )*vec2( textureSize( HPMC_hiz, 0 ) );" << endl;
+    src << "    int level = clamp( int( ceil( log2( max( max( extent.x, extent.y ), 1.0 ) ) ) ), 0, HPMC_hiz_max_level );" << endl;
+    src << "    ivec2 size = textureSize( HPMC_hiz, level );" << endl;
+    src << "    ivec2 a = clamp( ivec2( wmin.xy*vec2( size ) ), ivec2( 0 ), size-ivec2( 1 ) );" << endl;
+    src << "    ivec2 b = clamp( ivec2( wmax.xy*vec2( size ) ), ivec2( 0 ), size-ivec2( 1 ) );" << endl;
+    src << "    float depth = max( max( texelFetch( HPMC_hiz, a, level ).r," << endl;
+    src << "                            texelFetch( HPMC_hiz, ivec2( b.x, a.y ), level ).r )," << endl;
+    src << "                       max( texelFetch( HPMC_hiz, ivec2( a.x, b.y ), level ).r," << endl;
+    src << "                            texelFetch( HPMC_hiz, b, level ).r ) );" << endl;
+    src << "    return wmin.z <= depth;" << endl;
+    src << "}" << endl;
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates the cull plane uniforms and a function that tests a cell against them.
+  *
+  * The cell with lower corner c, in cells, is visible if its bounding box in
+  * object space reaches the positive side of all HPMC_cull_count planes.
+  */
+static std::string
+HPMCgenerateCullFunction( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    src << "uniform int        HPMC_cull_count;" << endl;
+    src << "uniform vec4       HPMC_cull_planes[" << HPMC_MAX_CULL_PLANES << "];" << endl;
+    src << "bool" << endl;
+    src << "HPMC_cellVisible( vec3 c )" << endl;
+    src << "{" << endl;
+    src << "    vec3 s = vec3( HPMC_GRID_EXT_X_F / HPMC_CELLS_X_F," << endl;
+    src << "                   HPMC_GRID_EXT_Y_F / HPMC_CELLS_Y_F," << endl;
+    src << "                   HPMC_GRID_EXT_Z_F / HPMC_CELLS_Z_F );" << endl;
+    src << "    vec3 lo = s*c;" << endl;
+    src << "    vec3 hi = lo + s;" << endl;
+    src << "    for( int i=0; i<HPMC_cull_count; i++ ) {" << endl;
+    //          the corner of the box furthest along the plane normal
+    src << "        vec4 plane = HPMC_cull_planes[i];" << endl;
+    src << "        vec3 p = mix( lo, hi, step( vec3(0.0), plane.xyz ) );" << endl;
+    src << "        if( dot( plane.xyz, p ) + plane.w < 0.0 ) {" << endl;
+    src << "            return false;" << endl;
+    src << "        }" << endl;
+    src << "    }" << endl;
+    src << "    return true;" << endl;
+    src << "}" << endl;
+    if( h->m_occlusion.m_enabled ) {
+        src << HPMCgenerateOcclusionFunction( h );
+    }
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates the functions that find the intersected edges owned by a cell.
+  *
+  * Bit 4*axis+u+2*v of the mask returned by HPMC_ownedEdges is the edge along
+  * axis offset by u and v along the other two axes, in order. The edges at
+  * offset zero are owned by the cell, the others only by cells in the last
+  * layer along the axes they are offset along, given by last.
+  */
+static std::string
+HPMCgenerateEdgeFunctions()
+{
+    stringstream src;
+
+    src << "uint" << endl;
+    src << "HPMC_bitCount( uint bits )" << endl;
+    src << "{" << endl;
+    src << "    uint count = 0u;" << endl;
+    src << "    for( int i=0; i<12; i++ ) {" << endl;
+    src << "        count += (bits >> uint(i)) & 1u;" << endl;
+    src << "    }" << endl;
+    src << "    return count;" << endl;
+    src << "}" << endl;
+    src << "uint" << endl;
+    src << "HPMC_ownedEdges( uint code, bvec3 last )" << endl;
+    src << "{" << endl;
+    src << "    uint edges = 0u;" << endl;
+    const char* xyz = "xyz";
+    for( int axis=0; axis<3; axis++ ) {
+        const int b0 = axis == 0 ? 1 : 0;
+        const int b1 = axis == 2 ? 1 : 2;
+        for( int e=0; e<4; e++ ) {
+            int offset[3] = { 0, 0, 0 };
+            offset[b0] = e & 1;
+            offset[b1] = e >> 1;
+            //  code bit i is the corner at (i&1, (i>>1)&1, i>>2)
+            const int i = offset[0] + 2*offset[1] + 4*offset[2];
+            const int j = i + (1<<axis);
+            std::string indent = "    ";
+            std::string guard;
+            if( offset[b0] ) {
+                guard = std::string( "last." ) + xyz[b0];
+            }
+            if( offset[b1] ) {
+                guard += (guard.empty() ? "" : " && ") + std::string( "last." ) + xyz[b1];
+            }
+            if( !guard.empty() ) {
+                src << "    if( " << guard << " ) {" << endl;
+                indent = "        ";
+            }
+            src << indent << "edges |= (((code >> " << i << "u) ^ (code >> " << j << "u)) & 1u) << "
+                << (4*axis+e) << "u;" << endl;
+            if( !guard.empty() ) {
+                src << "    }" << endl;
+            }
+        }
     }
+    src << "    return edges;" << endl;
+    src << "}" << endl;
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates the cell bounds of the texel at texcoord in the scalar field.
+  *
+  * Opens a scope, closed by the caller, that is entered for texels holding
+  * cells, with tp, mask and delta declared.
+  */
+static std::string
+HPMCgenerateBaselevelCells( struct HPMCHistoPyramid* h, const std::string& brick_active )
+{
+    stringstream src;
+
     //          determine which tile we're in, and thus which slice
-    src << "    vec2 stp = vec2( HPMC_TILES_X, HPMC_TILES_Y ) * gl_TexCoord[0].xy;"<< endl;
+    src << "    vec2 stp = vec2( HPMC_HP_SIZE_X_F / HPMC_TILE_SIZE_X_F," << endl;
+    src << "                     HPMC_HP_SIZE_Y_F / HPMC_TILE_SIZE_Y_F ) * texcoord;"<< endl;
     src << "    float slice = dot( vec2( 1.0, HPMC_TILES_X ), floor( stp ) );"<<endl;
-    //          skip slices that don't contain cells
-    src << "    if( slice < float(HPMC_CELLS_Z) ) {"<<endl;
+    //          skip slices that don't contain cells, and padding right of the tiles
+    src << "    if( (slice < HPMC_CELLS_Z_F) && (stp.x < HPMC_TILES_X_F)";
+    if( h->m_bricks.m_enabled ) {
+        //      and cells in bricks that cannot contain the threshold
+        src << " &&" << endl;
+        src << "        " << brick_active;
+    }
+    if( h->m_occlusion.m_enabled ) {
+        //      and cells in tiles hidden in the depth pyramid
+        src << " &&" << endl;
+        src << "        HPMC_tileVisible( stp, slice )";
+    }
+    src << " ) {" << endl;
     src << "        vec3 tp = vec3( fract(stp), slice );"<<endl;
     //              scale texcoord from tile parameterization to func parameterization
     src << "        tp.xy *= vec2( 2.0 * HPMC_TILE_SIZE_X_F / HPMC_FUNC_X_F,"   << endl;
@@ -123,10 +361,243 @@ HPMCgenerateBaselevelShader( struct HPMCHistoPyramid* h )
     src << "                          xmask.y && ymask.x,"  << endl;
     src << "                          xmask.x && ymask.y,"  << endl;
     src << "                          xmask.y && ymask.y );"<< endl;
+    if( h->m_indexed.m_enabled ) {
+        //          culled cells still own the edges of their neighbours.
+        src << "        vec4 grid_mask = mask;" << endl;
+    }
+    //              and cells outside the cull planes, tp.xy is the center
+    //              of the first of the 2x2 cells.
+    src << "        if( HPMC_cull_count > 0 ) {" << endl;
+    src << "            vec3 c = vec3( floor( tp.xy*vec2( HPMC_FUNC_X_F, HPMC_FUNC_Y_F ) - vec2( 0.5 ) ), slice );" << endl;
+    src << "            mask *= vec4( HPMC_cellVisible( c )," << endl;
+    src << "                          HPMC_cellVisible( c + vec3( 1.0, 0.0, 0.0 ) )," << endl;
+    src << "                          HPMC_cellVisible( c + vec3( 0.0, 1.0, 0.0 ) )," << endl;
+    src << "                          HPMC_cellVisible( c + vec3( 1.0, 1.0, 0.0 ) ) );" << endl;
+    src << "        }" << endl;
     //              shift distance between voxels in func parameterization
     src << "        const vec3 delta = vec3( 1.0/HPMC_FUNC_X_F," << endl;
     src << "                                 1.0/HPMC_FUNC_Y_F," << endl;
     src << "                                 1.0 );" << endl;
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates the base level function of a build of several surfaces.
+  *
+  * The 3x3x2 neighbourhood is fetched once, and the counts (and codes) of
+  * each surface are written to the corresponding element of the out arrays.
+  */
+static std::string
+HPMCgenerateMultiBaselevelFunction( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    const std::string vec4_type = HPMCintegerStorage( h ) ? "uvec4" : "vec4";
+    src << "// generated by HPMCgenerateMultiBaselevelFunction" << endl;
+    src << "#define HPMC_SURFACES      " << h->m_surface_count << endl;
+    src << "uniform sampler1D  HPMC_vertex_count;" << endl;
+    src << "uniform float      HPMC_thresholds[HPMC_SURFACES];" << endl;
+    src << HPMCgenerateCullFunction( h );
+    if( h->m_bricks.m_enabled ) {
+        //  true if the brick of the cells of a texel may contain any threshold.
+        src << "uniform sampler2D  HPMC_bricks;" << endl;
+        src << "bool" << endl;
+        src << "HPMC_brickActive( vec2 stp, float slice )" << endl;
+        src << "{" << endl;
+        src << "    ivec2 cell = 2*ivec2( fract( stp )*vec2( HPMC_TILE_SIZE_X_F, HPMC_TILE_SIZE_Y_F ) );" << endl;
+        src << "    ivec3 brick = ivec3( cell, int( slice ) ) / HPMC_BRICK_SIZE;" << endl;
+        src << "    vec2 range = texelFetch( HPMC_bricks, ivec2( brick.x, brick.y + HPMC_BRICKS_Y*brick.z ), 0 ).xy;" << endl;
+        src << "    bool inside = false;" << endl;
+        src << "    for( int s=0; s<HPMC_SURFACES; s++ ) {" << endl;
+        src << "        inside = inside || ( (range.x <= HPMC_thresholds[s]) && (HPMC_thresholds[s] <= range.y) );" << endl;
+        src << "    }" << endl;
+        src << "    return inside;" << endl;
+        src << "}" << endl;
+    }
+    src << "void" << endl;
+    if( HPMCseparateCodes( h ) ) {
+        src << "HPMC_baselevel( vec2 texcoord, out " << vec4_type << " surface_counts[HPMC_SURFACES], out uvec4 cell_codes[HPMC_SURFACES] )" << endl;
+    }
+    else {
+        src << "HPMC_baselevel( vec2 texcoord, out " << vec4_type << " surface_counts[HPMC_SURFACES] )" << endl;
+    }
+    src << "{" << endl;
+    src << "    for( int s=0; s<HPMC_SURFACES; s++ ) {" << endl;
+    if( HPMCseparateCodes( h ) ) {
+        src << "        cell_codes[s] = uvec4(0u);" << endl;
+        src << "        surface_counts[s] = " << vec4_type << "(0);" << endl;
+    }
+    else if( HPMCintegerStorage( h ) ) {
+        src << "        surface_counts[s] = uvec4(0u);" << endl;
+    }
+    else {
+        src << "        surface_counts[s] = vec4(0.0, 0.0, 0.4, 0.0);" << endl;
+    }
+    src << "    }" << endl;
+    src << HPMCgenerateBaselevelCells( h, "HPMC_brickActive( stp, slice )" );
+    //              fetch 3x3x2 neighbourhood from scalar field, the near
+    //              z-layer of corners of each row in fa and the far in fb
+    for(int c=0; c<3; c++) {
+        for(int k=0; k<2; k++) {
+            src << "        vec3 f" << (k==0?"a":"b") << c << " = vec3( " << endl;
+            for(int i=0; i<3; i++) {
+                src << "            HPMC_sample( tp + delta*vec3( "
+                    << (i-0.5) << ", "
+                    << (c-0.5) << ", "
+                    << (float)k << ") )"
+                    << (i<2?",":"") << endl;
+            }
+            src << "        );" << endl;
+        }
+    }
+    src << "        for( int s=0; s<HPMC_SURFACES; s++ ) {" << endl;
+    //                  build partial MC codes of this surface
+    src << "            vec3 t = vec3( HPMC_thresholds[s] );" << endl;
+    for(int c=0; c<3; c++) {
+        src << "            vec3 l" << c << " = vec3( lessThan( fa" << c << ", t ) )"
+            << " + 16.0*vec3( lessThan( fb" << c << ", t ) );" << endl;
+    }
+    src << HPMCgenerateCellCounts( h, "            " );
+    if( HPMCseparateCodes( h ) ) {
+        if( HPMCintegerStorage( h ) ) {
+            src << "            cell_codes[s] = uvec4(mask)*codes;" << endl;
+            src << "            surface_counts[s] = uvec4(mask)*counts;" << endl;
+        }
+        else {
+            src << "            cell_codes[s] = uvec4( (256.0*mask)*codes );" << endl;
+            src << "            surface_counts[s] = mask*counts;" << endl;
+        }
+    }
+    else if( HPMCintegerStorage( h ) ) {
+        src << "            surface_counts[s] = uvec4(mask)*( counts + 16u*codes );" << endl;
+    }
+    else {
+        src << "            surface_counts[s] = mask*( counts + codes );" << endl;
+    }
+    src << "        }" << endl;
+    src << "    }" << endl;
+    src << "}" << endl;
+
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates the statements declaring the intersected edges owned by the 2x2x1 cells.
+  *
+  * Expects codes and grid_mask of the texel, and declares owned and edge_counts.
+  */
+static std::string
+HPMCgenerateOwnedEdges( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    src << "        ivec3 cell = ivec3( ivec2( floor( tp.xy*vec2( HPMC_FUNC_X_F, HPMC_FUNC_Y_F ) - vec2( 0.5 ) ) ), int( slice ) );" << endl;
+    src << "        ivec3 last_cell = ivec3( HPMC_grid_cells ) - ivec3( 1 );" << endl;
+    if( HPMCintegerStorage( h ) ) {
+        src << "        uvec4 edge_codes = codes;" << endl;
+    }
+    else {
+        //      codes holds (code+0.5)/256, conversion to uint truncates.
+        src << "        uvec4 edge_codes = uvec4( 256.0*codes );" << endl;
+    }
+    src << "        uvec4 owned = uvec4(" << endl;
+    src << "            HPMC_ownedEdges( edge_codes.x, equal( cell, last_cell ) )," << endl;
+    src << "            HPMC_ownedEdges( edge_codes.y, equal( cell + ivec3( 1, 0, 0 ), last_cell ) )," << endl;
+    src << "            HPMC_ownedEdges( edge_codes.z, equal( cell + ivec3( 0, 1, 0 ), last_cell ) )," << endl;
+    src << "            HPMC_ownedEdges( edge_codes.w, equal( cell + ivec3( 1, 1, 0 ), last_cell ) )" << endl;
+    src << "        );" << endl;
+    src << "        uvec4 edge_counts = uvec4(" << endl;
+    src << "            HPMC_bitCount( owned.x )," << endl;
+    src << "            HPMC_bitCount( owned.y )," << endl;
+    src << "            HPMC_bitCount( owned.z )," << endl;
+    src << "            HPMC_bitCount( owned.w )" << endl;
+    src << "        );" << endl;
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates HPMC_activeCells, the cell HistoPyramid base level of a texel.
+  *
+  * Each active cell counts one, and the MC code and vertex count of the cell
+  * are stored above the count, as code+256*vertices. With integer storage,
+  * this is shifted above the lower four bits like the code, otherwise it is
+  * stored as (code+256*vertices+0.5)/4096 in the fractional part.
+  */
+static std::string
+HPMCgenerateActiveCellFunction( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    if( HPMCintegerStorage( h ) ) {
+        src << "uvec4" << endl;
+        src << "HPMC_activeCells( uvec4 raw )" << endl;
+        src << "{" << endl;
+        src << "    uvec4 counts = raw & uvec4(15u);" << endl;
+        src << "    return min( counts, uvec4(1u) ) + 16u*( (raw >> 4u) + 256u*counts );" << endl;
+        src << "}" << endl;
+    }
+    else {
+        //  raw holds the code as (code+0.5)/256 in the fractional part.
+        src << "vec4" << endl;
+        src << "HPMC_activeCells( vec4 raw )" << endl;
+        src << "{" << endl;
+        src << "    vec4 counts = floor( raw );" << endl;
+        src << "    return min( counts, vec4(1.0) ) + (1.0/16.0)*( fract( raw ) + counts );" << endl;
+        src << "}" << endl;
+    }
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+std::string
+HPMCgenerateBaselevelFunction( struct HPMCHistoPyramid* h )
+{
+    if( h->m_surface_count > 1 ) {
+        return HPMCgenerateMultiBaselevelFunction( h );
+    }
+    stringstream src;
+
+    src << "// generated by HPMCgenerateBaselevelFunction" << endl;
+    src << "uniform sampler1D  HPMC_vertex_count;" << endl;
+    if( !h->m_field.m_binary ) {
+        src << "uniform float      HPMC_threshold;" << endl;
+    }
+    src << HPMCgenerateCullFunction( h );
+    if( h->m_bricks.m_enabled ) {
+        //  true if the brick of the cells of a texel may contain the threshold.
+        src << "uniform sampler2D  HPMC_bricks;" << endl;
+        src << "bool" << endl;
+        src << "HPMC_brickActive( vec2 stp, float slice, float threshold )" << endl;
+        src << "{" << endl;
+        src << "    ivec2 cell = 2*ivec2( fract( stp )*vec2( HPMC_TILE_SIZE_X_F, HPMC_TILE_SIZE_Y_F ) );" << endl;
+        src << "    ivec3 brick = ivec3( cell, int( slice ) ) / HPMC_BRICK_SIZE;" << endl;
+        src << "    vec2 range = texelFetch( HPMC_bricks, ivec2( brick.x, brick.y + HPMC_BRICKS_Y*brick.z ), 0 ).xy;" << endl;
+        src << "    return (range.x <= threshold) && (threshold <= range.y);" << endl;
+        src << "}" << endl;
+    }
+    if( h->m_indexed.m_enabled ) {
+        src << HPMCgenerateEdgeFunctions();
+    }
+    if( h->m_per_cell.m_enabled ) {
+        src << HPMCgenerateActiveCellFunction( h );
+    }
+    src << (HPMCintegerStorage( h ) ? "uvec4" : "vec4") << endl;
+    if( HPMCseparateCodes( h ) ) {
+        //  the counts are returned, and the MC codes are passed separately.
+        src << "HPMC_baselevel( vec2 texcoord, out uvec4 cell_codes )" << endl;
+    }
+    else if( h->m_indexed.m_enabled ) {
+        //  the owned edges are stored like the codes, with their count below.
+        src << "HPMC_baselevel( vec2 texcoord, out " << (HPMCintegerStorage( h ) ? "uvec4" : "vec4") << " edges )" << endl;
+    }
+    else {
+        src << "HPMC_baselevel( vec2 texcoord )" << endl;
+    }
+    src << "{" << endl;
+    if( h->m_field.m_binary ) {
+        src << "    const float HPMC_threshold = 0.5;" << endl;
+    }
+    src << HPMCgenerateBaselevelCells( h, "HPMC_brickActive( stp, slice, HPMC_threshold )" );
     //              fetch 3x3x2 neighbourhood from scalar field
     //              and build partial MC codes
     for(int c=0; c<3; c++) {
@@ -143,28 +614,480 @@ HPMCgenerateBaselevelShader( struct HPMCHistoPyramid* h )
         }
         src << "        );" << endl;
     }
-    //              build codes for 2x2x1 set of voxels,
-    //              store code in fractional part
-    src << "        vec4 codes = (1.0/256.0)*vec4(" << endl;
-    src << "            l0.x+2.0*l0.y+4.0*l1.x +8.0*l1.y+0.5," << endl;
-    src << "            l0.y+2.0*l0.z+4.0*l1.y +8.0*l1.z+0.5," << endl;
-    src << "            l1.x+2.0*l1.y+4.0*l2.x +8.0*l2.y+0.5," << endl;
-    src << "            l1.y+2.0*l1.z+4.0*l2.y +8.0*l2.z+0.5" << endl;
-    src << "        );" << endl;
-    //              fetch the triangle count for the 2x2x1 set of voxels
-    src << "        vec4 counts = vec4(" << endl;
-    src << "            texture1D( HPMC_vertex_count, codes.x ).a," << endl;
-    src << "            texture1D( HPMC_vertex_count, codes.y ).a," << endl;
-    src << "            texture1D( HPMC_vertex_count, codes.z ).a," << endl;
-    src << "            texture1D( HPMC_vertex_count, codes.w ).a" << endl;
+    if( HPMCintegerStorage( h ) ) {
+        src << HPMCgenerateCellCounts( h, "        " );
+        if( h->m_indexed.m_enabled ) {
+            src << HPMCgenerateOwnedEdges( h );
+            src << "        edges = uvec4(grid_mask)*( edge_counts + 16u*owned );" << endl;
+        }
+        if( HPMCseparateCodes( h ) ) {
+            src << "        cell_codes = uvec4(mask)*codes;" << endl;
+            src << "        return uvec4(mask)*counts;" << endl;
+        }
+        else {
+            // encode the vertex count in the lower four bits and the code above.
+            src << "        return uvec4(mask)*( counts + 16u*codes );" << endl;
+        }
+        src << "    } " << endl;
+        src << "    else {" << endl;
+        if( HPMCseparateCodes( h ) ) {
+            src << "        cell_codes = uvec4(0u);" << endl;
+        }
+        if( h->m_indexed.m_enabled ) {
+            src << "        edges = uvec4(0u);" << endl;
+        }
+        src << "        return uvec4(0u);" << endl;
+        src << "    }" << endl;
+        src << "}" << endl;
+    }
+    else {
+        src << HPMCgenerateCellCounts( h, "        " );
+        if( h->m_indexed.m_enabled ) {
+            //      the owned edges are stored as (edges+0.5)/4096 in the fractional part.
+            src << HPMCgenerateOwnedEdges( h );
+            src << "        edges = grid_mask*( vec4(edge_counts) + (1.0/4096.0)*(vec4(owned)+vec4(0.5)) );" << endl;
+        }
+        if( HPMCseparateCodes( h ) ) {
+            //      codes holds (code+0.5)/256, conversion to uint truncates.
+            src << "        cell_codes = uvec4( (256.0*mask)*codes );" << endl;
+            src << "        return mask*counts;" << endl;
+        }
+        else {
+            // encode the vertex count in the integer part and the code in the fractional part.
+            src << "        return mask*( counts + codes);" << endl;
+        }
+        src << "    } " << endl;
+        src << "    else {" << endl;
+        if( HPMCseparateCodes( h ) ) {
+            src << "        cell_codes = uvec4(0u);" << endl;
+            src << "        return vec4(0.0);" << endl;
+        }
+        else {
+            if( h->m_indexed.m_enabled ) {
+                src << "        edges = vec4(0.0);" << endl;
+            }
+            src << "        return vec4(0.0, 0.0, 0.4, 0.0);" << endl;
+        }
+        src << "    }" << endl;
+        src << "}" << endl;
+    }
+
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+std::string
+HPMCgenerateBaselevelShader( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    src << HPMCgenerateBaselevelFunction( h );
+    src << "// generated by HPMCgenerateBaselevelShader" << endl;
+    const std::string texcoord = h->m_constants->m_core ? "HPMC_texcoord" : "gl_TexCoord[0].xy";
+    if( h->m_constants->m_core ) {
+        src << "in vec2 HPMC_texcoord;" << endl;
+    }
+    //      one output per surface
+    const std::string outputs = (h->m_surface_count > 1) ? "[HPMC_SURFACES]" : "";
+    if( HPMCfragmentOutput( h ) ) {
+        src << "out " << (HPMCintegerStorage( h ) ? "uvec4" : "vec4") << " HPMC_fragment" << outputs << ";" << endl;
+    }
+    if( HPMCseparateCodes( h ) ) {
+        src << "out uvec4 HPMC_codes" << outputs << ";" << endl;
+    }
+    if( h->m_indexed.m_enabled ) {
+        src << "out " << (HPMCintegerStorage( h ) ? "uvec4" : "vec4") << " HPMC_edges;" << endl;
+    }
+    if( h->m_per_cell.m_enabled ) {
+        src << "out " << (HPMCintegerStorage( h ) ? "uvec4" : "vec4") << " HPMC_cells;" << endl;
+    }
+    src << "void" << endl;
+    src << "main()" << endl;
+    src << "{" << endl;
+    if( h->m_surface_count > 1 ) {
+        src << "    HPMC_baselevel( " << texcoord << ", HPMC_fragment"
+            << (HPMCseparateCodes( h ) ? ", HPMC_codes" : "") << " );" << endl;
+    }
+    else if( HPMCseparateCodes( h ) ) {
+        src << "    HPMC_fragment = HPMC_baselevel( " << texcoord << ", HPMC_codes );" << endl;
+    }
+    else if( h->m_indexed.m_enabled ) {
+        src << "    HPMC_fragment = HPMC_baselevel( " << texcoord << ", HPMC_edges );" << endl;
+    }
+    else if( HPMCfragmentOutput( h ) ) {
+        src << "    HPMC_fragment = HPMC_baselevel( " << texcoord << " );" << endl;
+    }
+    else {
+        src << "    gl_FragColor = HPMC_baselevel( " << texcoord << " );" << endl;
+    }
+    if( h->m_per_cell.m_enabled ) {
+        src << "    HPMC_cells = HPMC_activeCells( HPMC_fragment );" << endl;
+    }
+    src << "}" << endl;
+
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Returns the name of an image in a compute shader, suffixed by the surface unless zero. */
+static std::string
+HPMCcomputeImageName( const std::string& image, GLsizei surface )
+{
+    stringstream name;
+    name << image;
+    if( surface > 0 ) {
+        name << "_" << surface;
+    }
+    return name.str();
+}
+
+/** Returns the name of the image of a destination level in a compute shader. */
+static std::string
+HPMCcomputeLevelName( int level, GLsizei surface )
+{
+    stringstream name;
+    name << "HPMC_dst_" << level;
+    return HPMCcomputeImageName( name.str(), surface );
+}
+
+// -----------------------------------------------------------------------------
+/** Generates the part of a compute shader that reduces further levels in shared memory.
+  *
+  * On entry, each invocation holds the value it has written to level
+  * dst_level in sums. Each step halves the active part of the work group and
+  * writes the next level, so a work group of 2^n x 2^n invocations produces
+  * n additional levels without leaving the dispatch.
+  */
+static std::string
+HPMCgenerateComputeReductionCascade( struct HPMCHistoPyramid* h, const std::string& dst_level, GLsizei surface )
+{
+    stringstream src;
+
+    const int n = HPMC_COMPUTE_GROUP_SIZE;
+    const std::string vec4_type = HPMCintegerStorage( h ) ? "uvec4" : "vec4";
+    src << "    HPMC_sums[ " << n << "*l.y + l.x ] = HPMC_total( sums );" << endl;
+    for( int k=1; (n>>k) > 0; k++ ) {
+        int w = n>>k;
+        src << "    memoryBarrierShared();" << endl;
+        src << "    barrier();" << endl;
+        src << "    if( all( lessThan( l, ivec2(" << w << ") ) ) ) {" << endl;
+        src << "        ivec2 c = 2*l;" << endl;
+        src << "        sums = " << vec4_type << "( HPMC_sums[ " << n << "*(c.y+0) + c.x+0 ]," << endl;
+        src << "                     HPMC_sums[ " << n << "*(c.y+0) + c.x+1 ]," << endl;
+        src << "                     HPMC_sums[ " << n << "*(c.y+1) + c.x+0 ]," << endl;
+        src << "                     HPMC_sums[ " << n << "*(c.y+1) + c.x+1 ] );" << endl;
+        src << "        ivec2 q = " << w << "*g + l;" << endl;
+        src << "        if( (" << dst_level << "+" << k << " <= HPMC_HP_SIZE_L2) &&" << endl;
+        src << "            all( lessThan( q, ivec2( HPMC_HP_SIZE_X, HPMC_HP_SIZE_Y ) >> (" << dst_level << "+" << k << ") ) ) )" << endl;
+        src << "        {" << endl;
+        src << "            imageStore( " << HPMCcomputeLevelName( k, surface ) << ", q, sums );" << endl;
+        src << "        }" << endl;
+        src << "    }" << endl;
+        if( (n>>(k+1)) > 0 ) {
+            src << "    memoryBarrierShared();" << endl;
+            src << "    barrier();" << endl;
+            src << "    if( all( lessThan( l, ivec2(" << w << ") ) ) ) {" << endl;
+            src << "        HPMC_sums[ " << n << "*l.y + l.x ] = HPMC_total( sums );" << endl;
+            src << "    }" << endl;
+        }
+    }
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates the declarations common to the compute-shader build passes.
+  *
+  * \param lower     The destination levels are stored as GL_RGBA16UI.
+  * \param surfaces  Number of HistoPyramids written, level k of HistoPyramid
+  *                  s is bound to image unit HPMC_COMPUTE_LEVELS_PER_DISPATCH*s+k.
+  */
+static std::string
+HPMCgenerateComputeDeclarations( struct HPMCHistoPyramid* h, bool lower, GLsizei surfaces )
+{
+    stringstream src;
+
+    const int n = HPMC_COMPUTE_GROUP_SIZE;
+    src << "layout(local_size_x=" << n << ", local_size_y=" << n << ") in;" << endl;
+    //      first work group of a dispatch covering only part of the level
+    src << "uniform ivec2      HPMC_group_offset;" << endl;
+    for( GLsizei s=0; s<surfaces; s++ ) {
+        for( int k=0; k<HPMC_COMPUTE_LEVELS_PER_DISPATCH; k++ ) {
+            const int binding = HPMC_COMPUTE_LEVELS_PER_DISPATCH*s + k;
+            const std::string name = HPMCcomputeLevelName( k, s );
+            if( lower ) {
+                src << "layout(rgba16ui, binding=" << binding << ") writeonly uniform uimage2D " << name << ";" << endl;
+            }
+            else if( HPMCintegerStorage( h ) ) {
+                src << "layout(rgba32ui, binding=" << binding << ") writeonly uniform uimage2D " << name << ";" << endl;
+            }
+            else {
+                src << "layout(rgba32f, binding=" << binding << ") writeonly uniform image2D " << name << ";" << endl;
+            }
+        }
+    }
+    if( HPMCintegerStorage( h ) ) {
+        src << "shared uint HPMC_sums[" << (n*n) << "];" << endl;
+        src << "uint" << endl;
+        src << "HPMC_total( uvec4 v )" << endl;
+        src << "{" << endl;
+        src << "    return v.x + v.y + v.z + v.w;" << endl;
+        src << "}" << endl;
+    }
+    else {
+        src << "shared float HPMC_sums[" << (n*n) << "];" << endl;
+        src << "float" << endl;
+        src << "HPMC_total( vec4 v )" << endl;
+        src << "{" << endl;
+        src << "    return dot( v, vec4(1.0) );" << endl;
+        src << "}" << endl;
+    }
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates the body of the base level compute shader of several surfaces.
+  *
+  * The shared memory of the reduction cascade is reused by the surfaces in
+  * turn, so the work group synchronizes between the cascades.
+  */
+static std::string
+HPMCgenerateMultiBaselevelComputeMain( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    const GLsizei n = h->m_surface_count;
+    const std::string vec4_type = HPMCintegerStorage( h ) ? "uvec4" : "vec4";
+    src << "    " << vec4_type << " raw[HPMC_SURFACES];" << endl;
+    if( HPMCseparateCodes( h ) ) {
+        src << "    uvec4 codes[HPMC_SURFACES];" << endl;
+    }
+    src << "    for( int s=0; s<HPMC_SURFACES; s++ ) {" << endl;
+    src << "        raw[s] = " << vec4_type << "(0);" << endl;
+    src << "    }" << endl;
+    src << "    if( all( lessThan( p, ivec2( HPMC_HP_SIZE_X, HPMC_HP_SIZE_Y ) ) ) ) {" << endl;
+    //          same texel center parameterization as the GPGPU quad.
+    src << "        HPMC_baselevel( (vec2(p)+vec2(0.5))/vec2( HPMC_HP_SIZE_X_F, HPMC_HP_SIZE_Y_F ), raw"
+        << (HPMCseparateCodes( h ) ? ", codes" : "") << " );" << endl;
+    for( GLsizei s=0; s<n; s++ ) {
+        src << "        imageStore( " << HPMCcomputeLevelName( 0, s ) << ", p, raw[" << s << "] );" << endl;
+        if( HPMCseparateCodes( h ) ) {
+            src << "        imageStore( " << HPMCcomputeImageName( "HPMC_codes", s ) << ", p, codes[" << s << "] );" << endl;
+        }
+    }
+    src << "    }" << endl;
+    src << "    " << vec4_type << " sums;" << endl;
+    for( GLsizei s=0; s<n; s++ ) {
+        if( s > 0 ) {
+            src << "    memoryBarrierShared();" << endl;
+            src << "    barrier();" << endl;
+        }
+        if( HPMCseparateCodes( h ) ) {
+            src << "    sums = raw[" << s << "];" << endl;
+        }
+        else if( HPMCintegerStorage( h ) ) {
+            src << "    sums = raw[" << s << "] & uvec4(15u);" << endl;
+        }
+        else {
+            src << "    sums = floor( raw[" << s << "] );" << endl;
+        }
+        src << HPMCgenerateComputeReductionCascade( h, "0", s );
+    }
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+std::string
+HPMCgenerateBaselevelComputeShader( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    src << HPMCgenerateBaselevelFunction( h );
+    src << "// generated by HPMCgenerateBaselevelComputeShader" << endl;
+    //      the base dispatch writes the levels below the split level.
+    const GLsizei n = h->m_surface_count;
+    src << HPMCgenerateComputeDeclarations( h, h->m_histopyramid.m_split_level > 0, HPMCbaseLevelOutputs( h ) );
+    if( HPMCseparateCodes( h ) ) {
+        //  the codes of surface s are bound after the levels of all surfaces.
+        for( GLsizei s=0; s<n; s++ ) {
+            src << "layout(rgba8ui, binding=" << (HPMC_COMPUTE_LEVELS_PER_DISPATCH*n+s) << ") writeonly uniform uimage2D "
+                << HPMCcomputeImageName( "HPMC_codes", s ) << ";" << endl;
+        }
+    }
+    src << "void" << endl;
+    src << "main()" << endl;
+    src << "{" << endl;
+    src << "    ivec2 g = ivec2( gl_WorkGroupID.xy ) + HPMC_group_offset;" << endl;
+    src << "    ivec2 l = ivec2( gl_LocalInvocationID.xy );" << endl;
+    src << "    ivec2 p = " << HPMC_COMPUTE_GROUP_SIZE << "*g + l;" << endl;
+    if( n > 1 ) {
+        src << HPMCgenerateMultiBaselevelComputeMain( h );
+        src << "}" << endl;
+        return src.str();
+    }
+    const bool indexed = h->m_indexed.m_enabled;
+    const bool per_cell = h->m_per_cell.m_enabled;
+    if( HPMCintegerStorage( h ) ) {
+        src << "    uvec4 sums = uvec4(0u);" << endl;
+        if( indexed ) {
+            src << "    uvec4 edges = uvec4(0u);" << endl;
+        }
+        if( per_cell ) {
+            src << "    uvec4 cells = uvec4(0u);" << endl;
+        }
+    }
+    else {
+        src << "    vec4 sums = vec4(0.0);" << endl;
+        if( indexed ) {
+            src << "    vec4 edges = vec4(0.0);" << endl;
+        }
+        if( per_cell ) {
+            src << "    vec4 cells = vec4(0.0);" << endl;
+        }
+    }
+    src << "    if( all( lessThan( p, ivec2( HPMC_HP_SIZE_X, HPMC_HP_SIZE_Y ) ) ) ) {" << endl;
+    //          same texel center parameterization as the GPGPU quad.
+    const std::string edges = indexed ? ", edges" : "";
+    if( HPMCseparateCodes( h ) ) {
+        src << "        uvec4 codes;" << endl;
+        src << "        sums = HPMC_baselevel( (vec2(p)+vec2(0.5))/vec2( HPMC_HP_SIZE_X_F, HPMC_HP_SIZE_Y_F ), codes );" << endl;
+        src << "        imageStore( HPMC_dst_0, p, sums );" << endl;
+        src << "        imageStore( HPMC_codes, p, codes );" << endl;
+    }
+    else if( HPMCintegerStorage( h ) ) {
+        src << "        uvec4 raw = HPMC_baselevel( (vec2(p)+vec2(0.5))/vec2( HPMC_HP_SIZE_X_F, HPMC_HP_SIZE_Y_F )" << edges << " );" << endl;
+        src << "        imageStore( HPMC_dst_0, p, raw );" << endl;
+        //              MC codes are stored above the lower four bits.
+        src << "        sums = raw & uvec4(15u);" << endl;
+    }
+    else {
+        src << "        vec4 raw = HPMC_baselevel( (vec2(p)+vec2(0.5))/vec2( HPMC_HP_SIZE_X_F, HPMC_HP_SIZE_Y_F )" << edges << " );" << endl;
+        src << "        imageStore( HPMC_dst_0, p, raw );" << endl;
+        //              MC codes are stored in the fractional part, floor extracts the vertex count.
+        src << "        sums = floor( raw );" << endl;
+    }
+    if( indexed ) {
+        src << "        imageStore( " << HPMCcomputeLevelName( 0, 1 ) << ", p, edges );" << endl;
+    }
+    //      the cell HistoPyramid is the last output.
+    const GLsizei cells_output = HPMCbaseLevelOutputs( h ) - 1;
+    if( per_cell ) {
+        src << "        cells = HPMC_activeCells( raw );" << endl;
+        src << "        imageStore( " << HPMCcomputeLevelName( 0, cells_output ) << ", p, cells );" << endl;
+    }
+    src << "    }" << endl;
+    src << HPMCgenerateComputeReductionCascade( h, "0", 0 );
+    if( indexed ) {
+        //  the edge HistoPyramid reuses the shared memory of the cascade.
+        src << "    memoryBarrierShared();" << endl;
+        src << "    barrier();" << endl;
+        if( HPMCintegerStorage( h ) ) {
+            src << "    sums = edges & uvec4(15u);" << endl;
+        }
+        else {
+            src << "    sums = floor( edges );" << endl;
+        }
+        src << HPMCgenerateComputeReductionCascade( h, "0", 1 );
+    }
+    if( per_cell ) {
+        src << "    memoryBarrierShared();" << endl;
+        src << "    barrier();" << endl;
+        if( HPMCintegerStorage( h ) ) {
+            src << "    sums = cells & uvec4(15u);" << endl;
+        }
+        else {
+            src << "    sums = floor( cells );" << endl;
+        }
+        src << HPMCgenerateComputeReductionCascade( h, "0", cells_output );
+    }
+    src << "}" << endl;
+
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+std::string
+HPMCgenerateReductionComputeShader( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    src << "// generated by HPMCgenerateReductionComputeShader" << endl;
+    src << HPMCgenerateComputeDeclarations( h, false, 1 );
+    if( HPMCintegerStorage( h ) ) {
+        src << "uniform usampler2D HPMC_histopyramid;" << endl;
+    }
+    else {
+        src << "uniform sampler2D  HPMC_histopyramid;" << endl;
+    }
+    src << "uniform int        HPMC_dst_level;" << endl;
+    //      level of the bound HP tex holding level HPMC_dst_level-1
+    src << "uniform int        HPMC_src_level;" << endl;
+    src << "void" << endl;
+    src << "main()" << endl;
+    src << "{" << endl;
+    src << "    ivec2 g = ivec2( gl_WorkGroupID.xy ) + HPMC_group_offset;" << endl;
+    src << "    ivec2 l = ivec2( gl_LocalInvocationID.xy );" << endl;
+    src << "    ivec2 p = " << HPMC_COMPUTE_GROUP_SIZE << "*g + l;" << endl;
+    if( HPMCintegerStorage( h ) ) {
+        src << "    uvec4 sums = uvec4(0u);" << endl;
+    }
+    else {
+        src << "    vec4 sums = vec4(0.0);" << endl;
+    }
+    src << "    if( all( lessThan( p, ivec2( HPMC_HP_SIZE_X, HPMC_HP_SIZE_Y ) >> HPMC_dst_level ) ) ) {" << endl;
+    src << "        ivec2 tp = 2*p;" << endl;
+    //          The base level pass has reduced the levels holding MC codes,
+    //          so the source level holds plain counts.
+    src << "        sums = " << (HPMCintegerStorage( h ) ? "uvec4" : "vec4") << "(" << endl;
+    src << "            HPMC_total( texelFetch( HPMC_histopyramid, tp + ivec2(0,0), HPMC_src_level ) )," << endl;
+    src << "            HPMC_total( texelFetch( HPMC_histopyramid, tp + ivec2(1,0), HPMC_src_level ) )," << endl;
+    src << "            HPMC_total( texelFetch( HPMC_histopyramid, tp + ivec2(0,1), HPMC_src_level ) )," << endl;
+    src << "            HPMC_total( texelFetch( HPMC_histopyramid, tp + ivec2(1,1), HPMC_src_level ) )" << endl;
     src << "        );" << endl;
+    src << "        imageStore( HPMC_dst_0, p, sums );" << endl;
+    src << "    }" << endl;
+    src << HPMCgenerateComputeReductionCascade( h, "HPMC_dst_level", 0 );
+    src << "}" << endl;
+
+    return src.str();
+}
 
-    // encode the vertex count in the integer part and the code in the fractional part.
-    src << "        gl_FragColor = mask*( counts + codes);" << endl;
-    src << "    } " << endl;
-    src << "    else {" << endl;
-    src << "        gl_FragColor = vec4(0.0, 0.0, 0.4, 0.0);" << endl;
+// -----------------------------------------------------------------------------
+std::string
+HPMCgenerateIndirectComputeShader( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    src << "// generated by HPMCgenerateIndirectComputeShader" << endl;
+    src << "layout(local_size_x=1) in;" << endl;
+    if( HPMCintegerStorage( h ) ) {
+        src << "uniform usampler2D HPMC_histopyramid;" << endl;
+    }
+    else {
+        src << "uniform sampler2D  HPMC_histopyramid;" << endl;
+    }
+    //      laid out as DrawArraysIndirectCommand
+    src << "layout(std430, binding=0) writeonly buffer HPMC_indirect {" << endl;
+    src << "    uint HPMC_draw_command[4];" << endl;
+    src << "};" << endl;
+    src << "void" << endl;
+    src << "main()" << endl;
+    src << "{" << endl;
+    src << "    uint count = 0u;" << endl;
+    src << "    for( int j=0; j<HPMC_HP_TOP_Y; j++ ) {" << endl;
+    src << "        for( int i=0; i<HPMC_HP_TOP_X; i++ ) {" << endl;
+    if( HPMCintegerStorage( h ) ) {
+        src << "            uvec4 top = texelFetch( HPMC_histopyramid, ivec2(i,j), HPMC_HP_SIZE_L2-HPMC_HP_SPLIT_LEVEL );" << endl;
+    }
+    else {
+        src << "            uvec4 top = uvec4( floor( texelFetch( HPMC_histopyramid, ivec2(i,j), HPMC_HP_SIZE_L2 ) ) );" << endl;
+    }
+    src << "            count += top.x + top.y + top.z + top.w;" << endl;
+    src << "        }" << endl;
     src << "    }" << endl;
+    src << "    HPMC_draw_command[0] = count;" << endl;
+    src << "    HPMC_draw_command[1] = 1u;" << endl;
+    src << "    HPMC_draw_command[2] = 0u;" << endl;
+    src << "    HPMC_draw_command[3] = 0u;" << endl;
     src << "}" << endl;
 
     return src.str();
@@ -202,11 +1125,42 @@ HPMCgenerateReductionShader( struct HPMCHistoPyramid* h, const std::string& filt
         src << "    gl_FragColor = sums;" << endl;
         src << "}" << endl;
     }
+    else if( HPMCintegerStorage( h ) ) {
+        src << "// generated by HPMCgenerateReductionShader with filter=\""<<filter<<"\"" << endl;
+        src << "uniform usampler2D HPMC_histopyramid;" << endl;
+        src << "uniform int        HPMC_src_level;" << endl;
+        src << "out uvec4          HPMC_fragment;" << endl;
+        //      strips the MC codes from base level texels
+        src << "uvec4" << endl;
+        src << "HPMC_stripCodes( uvec4 v )" << endl;
+        src << "{" << endl;
+        src << "    return v & uvec4(15u);" << endl;
+        src << "}" << endl;
+        src << "uint" << endl;
+        src << "HPMC_total( uvec4 v )" << endl;
+        src << "{" << endl;
+        src << "    return v.x + v.y + v.z + v.w;" << endl;
+        src << "}" << endl;
+        src << "void" << endl;
+        src << "main()" << endl;
+        src << "{" << endl;
+        src << "    ivec2 tp = 2*ivec2( gl_FragCoord.xy );" << std::endl;
+        src << "    HPMC_fragment = uvec4(" << endl;
+        src << "        HPMC_total( " << filter << "( texelFetch( HPMC_histopyramid, tp + ivec2(0,0), HPMC_src_level ) ) )," << std::endl;
+        src << "        HPMC_total( " << filter << "( texelFetch( HPMC_histopyramid, tp + ivec2(1,0), HPMC_src_level ) ) )," << std::endl;
+        src << "        HPMC_total( " << filter << "( texelFetch( HPMC_histopyramid, tp + ivec2(0,1), HPMC_src_level ) ) )," << std::endl;
+        src << "        HPMC_total( " << filter << "( texelFetch( HPMC_histopyramid, tp + ivec2(1,1), HPMC_src_level ) ) )" << std::endl;
+        src << "    );" << endl;
+        src << "}" << endl;
+    }
     else {
         src << "// generated by HPMCgenerateReductionShader with filter=\""<<filter<<"\"" << endl;
         src << "uniform sampler2D  HPMC_histopyramid;" << endl;
         src << "uniform int        HPMC_src_level;" << endl;
         src << "uniform vec2       HPMC_delta;" << endl;
+        if( HPMCfragmentOutput( h ) ) {
+            src << "out vec4           HPMC_fragment;" << endl;
+        }
         src << "void" << endl;
         src << "main()" << endl;
         src << "{" << endl;
@@ -217,13 +1171,114 @@ HPMCgenerateReductionShader( struct HPMCHistoPyramid* h, const std::string& filt
         src << "        dot( vec4(1.0), " << filter << "( texelFetch( HPMC_histopyramid, tp + ivec2(0,1), HPMC_src_level ) ) )," << std::endl;
         src << "        dot( vec4(1.0), " << filter << "( texelFetch( HPMC_histopyramid, tp + ivec2(1,1), HPMC_src_level ) ) )" << std::endl;
         src << "    );" << endl;
-        src << "    gl_FragColor = sums;" << endl;
+        src << "    " << (HPMCfragmentOutput( h ) ? "HPMC_fragment" : "gl_FragColor") << " = sums;" << endl;
         src << "}" << endl;
     }
 
     return src.str();
 }
 
+// -----------------------------------------------------------------------------
+std::string
+HPMCgenerateDoubleReductionShader( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    // Each output texel covers a 4x4 block of texels of the source level, one
+    // 2x2 block per channel. The source is never the base level.
+    const bool integer = HPMCintegerStorage( h );
+    const std::string key_type = integer ? "uint" : "float";
+    const std::string vec4_type = integer ? "uvec4" : "vec4";
+
+    src << "// generated by HPMCgenerateDoubleReductionShader" << endl;
+    src << "uniform " << (integer ? "usampler2D" : "sampler2D ") << " HPMC_histopyramid;" << endl;
+    src << "uniform int        HPMC_src_level;" << endl;
+    if( HPMCfragmentOutput( h ) ) {
+        src << "out " << vec4_type << "          HPMC_fragment;" << endl;
+    }
+    src << key_type << endl;
+    src << "HPMC_total( " << vec4_type << " v )" << endl;
+    src << "{" << endl;
+    src << "    return v.x + v.y + v.z + v.w;" << endl;
+    src << "}" << endl;
+    src << key_type << endl;
+    src << "HPMC_block( ivec2 tp )" << endl;
+    src << "{" << endl;
+    src << "    return HPMC_total( texelFetch( HPMC_histopyramid, tp + ivec2(0,0), HPMC_src_level ) )" << endl;
+    src << "         + HPMC_total( texelFetch( HPMC_histopyramid, tp + ivec2(1,0), HPMC_src_level ) )" << endl;
+    src << "         + HPMC_total( texelFetch( HPMC_histopyramid, tp + ivec2(0,1), HPMC_src_level ) )" << endl;
+    src << "         + HPMC_total( texelFetch( HPMC_histopyramid, tp + ivec2(1,1), HPMC_src_level ) );" << endl;
+    src << "}" << endl;
+    src << "void" << endl;
+    src << "main()" << endl;
+    src << "{" << endl;
+    src << "    ivec2 tp = 4*ivec2( gl_FragCoord.xy );" << endl;
+    src << "    " << (HPMCfragmentOutput( h ) ? "HPMC_fragment" : "gl_FragColor") << " = " << vec4_type << "(" << endl;
+    src << "        HPMC_block( tp + ivec2(0,0) )," << endl;
+    src << "        HPMC_block( tp + ivec2(2,0) )," << endl;
+    src << "        HPMC_block( tp + ivec2(0,2) )," << endl;
+    src << "        HPMC_block( tp + ivec2(2,2) )" << endl;
+    src << "    );" << endl;
+    src << "}" << endl;
+
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+std::string
+HPMCgenerateBrickShader( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+    const bool compute = h->m_hp_build.m_compute.m_enabled;
+
+    // A brick covers the samples from its first cell up to and including the
+    // far corners of its last cells, clamped to the lattice.
+    src << "// generated by HPMCgenerateBrickShader" << endl;
+    if( compute ) {
+        src << "layout(local_size_x=" << HPMC_COMPUTE_GROUP_SIZE
+            << ", local_size_y=" << HPMC_COMPUTE_GROUP_SIZE << ") in;" << endl;
+        src << "layout(rg32f, binding=0) writeonly uniform image2D HPMC_bricks;" << endl;
+        src << "uniform ivec2      HPMC_group_offset;" << endl;
+    }
+    else if( HPMCfragmentOutput( h ) ) {
+        src << "out vec4           HPMC_fragment;" << endl;
+    }
+    src << "void" << endl;
+    src << "main()" << endl;
+    src << "{" << endl;
+    if( compute ) {
+        src << "    ivec2 bp = ivec2( gl_GlobalInvocationID.xy ) + " << HPMC_COMPUTE_GROUP_SIZE << "*HPMC_group_offset;" << endl;
+        src << "    if( any( greaterThanEqual( bp, imageSize( HPMC_bricks ) ) ) ) {" << endl;
+        src << "        return;" << endl;
+        src << "    }" << endl;
+    }
+    else {
+        src << "    ivec2 bp = ivec2( gl_FragCoord.xy );" << endl;
+    }
+    src << "    ivec3 first = HPMC_BRICK_SIZE*ivec3( bp.x, bp.y % HPMC_BRICKS_Y, bp.y / HPMC_BRICKS_Y );" << endl;
+    src << "    ivec3 last = min( first + ivec3(HPMC_BRICK_SIZE), ivec3( HPMC_FUNC_X-1, HPMC_FUNC_Y-1, HPMC_FUNC_Z-1 ) );" << endl;
+    src << "    float lo = HPMC_sample( vec3( (vec2(first.xy)+vec2(0.5))/vec2( HPMC_FUNC_X_F, HPMC_FUNC_Y_F ), float(first.z) ) );" << endl;
+    src << "    float hi = lo;" << endl;
+    src << "    for(int k=first.z; k<=last.z; k++) {" << endl;
+    src << "        for(int j=first.y; j<=last.y; j++) {" << endl;
+    src << "            for(int i=first.x; i<=last.x; i++) {" << endl;
+    src << "                float v = HPMC_sample( vec3( (vec2(i,j)+vec2(0.5))/vec2( HPMC_FUNC_X_F, HPMC_FUNC_Y_F ), float(k) ) );" << endl;
+    src << "                lo = min( lo, v );" << endl;
+    src << "                hi = max( hi, v );" << endl;
+    src << "            }" << endl;
+    src << "        }" << endl;
+    src << "    }" << endl;
+    if( compute ) {
+        src << "    imageStore( HPMC_bricks, bp, vec4( lo, hi, 0.0, 0.0 ) );" << endl;
+    }
+    else {
+        src << "    " << (HPMCfragmentOutput( h ) ? "HPMC_fragment" : "gl_FragColor") << " = vec4( lo, hi, 0.0, 0.0 );" << endl;
+    }
+    src << "}" << endl;
+
+    return src.str();
+}
+
 // -----------------------------------------------------------------------------
 std::string
 HPMCgenerateGPGPUVertexPassThroughShader( struct HPMCHistoPyramid* h )
@@ -231,6 +1286,19 @@ HPMCgenerateGPGPUVertexPassThroughShader( struct HPMCHistoPyramid* h )
     stringstream src;
 
     src << "// generated by HPMCgenerateGPGPUVertexPassThroughShader" << endl;
+    if( h->m_constants->m_core ) {
+        //      full-screen triangle (-1,-1), (3,-1), (-1,3) from the vertex id.
+        src << "out vec2 HPMC_texcoord;" << endl;
+        src << "void" << endl;
+        src << "main()" << endl;
+        src << "{" << endl;
+        src << "    vec2 p = vec2( float( (gl_VertexID & 1) << 2 ) - 1.0," << endl;
+        src << "                   float( (gl_VertexID & 2) << 1 ) - 1.0 );" << endl;
+        src << "    HPMC_texcoord = 0.5*p+vec2(0.5);" << endl;
+        src << "    gl_Position   = vec4( p, 0.0, 1.0 );" << endl;
+        src << "}" << endl;
+        return src.str();
+    }
     src << "void" << endl;
     src << "main()" << endl;
     src << "{" << endl;
@@ -255,14 +1323,14 @@ HPMCgenerateScalarFieldFetch( struct HPMCHistoPyramid* h )
         src << "HPMC_sample( vec3 p )" << endl;
         src << "{" << endl;
         src << "    p.z = (p.z+0.5)*(1.0/float(HPMC_FUNC_Z));" << endl;
-        src << "    return texture3D( HPMC_scalarfield, p ).a;" << endl;
+        src << "    return " << HPMCtextureLookup( h, "texture3D" ) << "( HPMC_scalarfield, p ).a;" << endl;
         src << "}" << endl;
         if( h->m_fetch.m_gradient ) {
             src << "vec4" << endl;
             src << "HPMC_sampleGrad( vec3 p )" << endl;
             src << "{" << endl;
             src << "    p.z = (p.z+0.5)*(1.0/float(HPMC_FUNC_Z));" << endl;
-            src << "    return texture3D( HPMC_scalarfield, p );" << endl;
+            src << "    return " << HPMCtextureLookup( h, "texture3D" ) << "( HPMC_scalarfield, p );" << endl;
             src << "}" << endl;
         }
     }
@@ -294,6 +1362,449 @@ HPMCgenerateScalarFieldFetch( struct HPMCHistoPyramid* h )
     return src.str();
 }
 
+// -----------------------------------------------------------------------------
+/** Generates the choice of one of four children by the counts xyz of counts.
+  *
+  * Moves texpos to the chosen child. If select is non-empty, the variable
+  * sums is also set to select0 to select3 for the chosen child.
+  */
+static std::string
+HPMCgenerateSelectChild( const std::string& indent,
+                         const std::string& counts,
+                         const std::string& select )
+{
+    stringstream src;
+    src << indent << "if( " << counts << ".x <= key_ix ) {"                  << endl;
+    src << indent << "    key_ix -= " << counts << ".x;"                     << endl;
+    src << indent << "    if( " << counts << ".y <= key_ix ) {"              << endl;
+    src << indent << "        key_ix -= " << counts << ".y;"                 << endl;
+    src << indent << "        if( " << counts << ".z <= key_ix ) {"          << endl;
+    src << indent << "            key_ix -= " << counts << ".z;"             << endl;
+    src << indent << "            texpos += ivec2(1,1);"                     << endl;
+    if( !select.empty() ) {
+        src << indent << "            sums = " << select << "3;"             << endl;
+    }
+    src << indent << "        }"                                             << endl;
+    src << indent << "        else {"                                        << endl;
+    src << indent << "            texpos += ivec2(0,1);"                     << endl;
+    if( !select.empty() ) {
+        src << indent << "            sums = " << select << "2;"             << endl;
+    }
+    src << indent << "        }"                                             << endl;
+    src << indent << "    }"                                                 << endl;
+    src << indent << "    else {"                                            << endl;
+    src << indent << "        texpos += ivec2(1,0);"                         << endl;
+    if( !select.empty() ) {
+        src << indent << "        sums = " << select << "1;"                 << endl;
+    }
+    src << indent << "    }"                                                 << endl;
+    src << indent << "}"                                                     << endl;
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates a traversal loop descending from HP level first to HP level last.
+  *
+  * Levels are GLSL expressions of the HP level i, where tex_level gives the
+  * mipmap level of sampler that holds HP level i.
+  */
+static std::string
+HPMCgenerateTraversalLevels( const std::string& vec3_type,
+                             const std::string& sampler,
+                             const std::string& first,
+                             const std::string& last,
+                             const std::string& tex_level )
+{
+    stringstream src;
+    src << "    for(int i=" << first << "; i>=" << last << "; i--) {"       << endl;
+    src << "        " << vec3_type << " sums = texelFetch( " << sampler << ", texpos, " << tex_level << " ).xyz;"<< endl;
+    src << "        texpos = 2*texpos;"                                     << endl;
+    src << HPMCgenerateSelectChild( "        ", "sums", "" );
+    src << "    }"                                                          << endl;
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates a 16-to-1 traversal loop reading HP levels first, first-2, ..., last.
+  *
+  * Each step fetches the 2x2 texels of level i below the current texel of
+  * the skipped level i+1, chooses one of them by their totals and then one
+  * of its children, descending two levels. The four fetches are independent,
+  * so the chain of dependent fetches is halved.
+  */
+static std::string
+HPMCgenerateWideTraversalLevels( const std::string& vec4_type,
+                                 const std::string& sampler,
+                                 GLsizei            first,
+                                 GLsizei            last,
+                                 const std::string& tex_level )
+{
+    const bool integer = vec4_type == "uvec4";
+    stringstream src;
+    src << "    for(int i=" << first << "; i>=" << last << "; i-=2) {"      << endl;
+    src << "        texpos = 2*texpos;"                                     << endl;
+    for( int k=0; k<4; k++ ) {
+        src << "        " << vec4_type << " q" << k << " = texelFetch( " << sampler
+            << ", texpos + ivec2(" << (k&1) << "," << (k>>1) << "), " << tex_level << " );" << endl;
+    }
+    if( integer ) {
+        src << "        uvec3 totals = uvec3( q0.x+q0.y+q0.z+q0.w,"         << endl;
+        src << "                              q1.x+q1.y+q1.z+q1.w,"         << endl;
+        src << "                              q2.x+q2.y+q2.z+q2.w );"       << endl;
+    }
+    else {
+        src << "        vec3 totals = vec3( dot( vec4(1.0), q0 ),"          << endl;
+        src << "                            dot( vec4(1.0), q1 ),"          << endl;
+        src << "                            dot( vec4(1.0), q2 ) );"        << endl;
+    }
+    src << "        " << vec4_type << " sums = q0;"                         << endl;
+    src << HPMCgenerateSelectChild( "        ", "totals", "q" );
+    src << "        texpos = 2*texpos;"                                     << endl;
+    src << HPMCgenerateSelectChild( "        ", "sums", "" );
+    src << "    }"                                                          << endl;
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates the traversal of the HistoPyramid down to the cell of a vertex.
+  *
+  * The key index is given by the int expression key. Declares texpos, the
+  * cell at cell resolution of the base level, key_ix, the index of the vertex
+  * among the vertices of the cell, and nib, the base level value (or MC code)
+  * of the cell.
+  */
+static std::string
+HPMCgenerateTraversal( struct HPMCHistoPyramid* h, const std::string& key )
+{
+    stringstream src;
+
+    // With integer storage, keys and sums are exact unsigned integers.
+    const bool integer = HPMCintegerStorage( h );
+    const std::string key_type = integer ? "uint" : "float";
+    const std::string vec3_type = integer ? "uvec3" : "vec3";
+    const std::string vec4_type = integer ? "uvec4" : "vec4";
+
+    // With mixed precision, the levels from the split level and up are
+    // in a separate tex.
+    const bool split = h->m_histopyramid.m_split_level > 0;
+    const std::string top_sampler = split ? "HPMC_histopyramid_upper" : "HPMC_histopyramid";
+
+    if( integer ) {
+        src << "    uint key_ix = uint(" << key << ");"                         << endl;
+    }
+    else {
+        src << "    float key_ix = float(" << key << ");"                       << endl;
+    }
+    src << "    ivec2 texpos = ivec2(0,0);"                                     << endl;
+    // --- Scan the top level, if it is larger than one texel ------------------
+    if( (h->m_histopyramid.m_top_size[0] > 1) || (h->m_histopyramid.m_top_size[1] > 1) ) {
+        src << "    bool found = false;"                                        << endl;
+        src << "    for(int j=0; j<HPMC_HP_TOP_Y && !found; j++) {"             << endl;
+        src << "        for(int i=0; i<HPMC_HP_TOP_X && !found; i++) {"         << endl;
+        src << "            " << vec4_type << " top = texelFetch( " << top_sampler << ", ivec2(i,j), HPMC_HP_SIZE_L2-HPMC_HP_SPLIT_LEVEL );" << endl;
+        src << "            " << key_type << " total = top.x + top.y + top.z + top.w;" << endl;
+        src << "            if( key_ix < total ) {"                             << endl;
+        src << "                texpos = ivec2(i,j);"                           << endl;
+        src << "                found = true;"                                  << endl;
+        src << "            }"                                                  << endl;
+        src << "            else {"                                             << endl;
+        src << "                key_ix -= total;"                               << endl;
+        src << "            }"                                                  << endl;
+        src << "        }"                                                      << endl;
+        src << "    }"                                                          << endl;
+    }
+    // --- Traverse upper levels of histopyramid -------------------------------
+    if( h->m_histopyramid.m_fan_out == 16 ) {
+        // Read every second level from the top, see HPMClevelSkipped,
+        // and finish with a 4-to-1 step on level 1 if the number of
+        // levels is odd.
+        const GLsizei top = h->m_histopyramid.m_size_l2;
+        const GLsizei last = 1 + (top % 2);
+        GLsizei lower_first = top-1;
+        if( split ) {
+            const GLsizei s = h->m_histopyramid.m_split_level;
+            const GLsizei upper_last = s + ((s-last) % 2);
+            if( upper_last <= top-1 ) {
+                src << HPMCgenerateWideTraversalLevels( vec4_type,
+                                                        "HPMC_histopyramid_upper",
+                                                        top-1,
+                                                        upper_last,
+                                                        "i-HPMC_HP_SPLIT_LEVEL" );
+                lower_first = upper_last-2;
+            }
+        }
+        if( last <= lower_first ) {
+            src << HPMCgenerateWideTraversalLevels( vec4_type,
+                                                    "HPMC_histopyramid",
+                                                    lower_first,
+                                                    last,
+                                                    "i" );
+        }
+        if( (top % 2) == 1 ) {
+            src << HPMCgenerateTraversalLevels( vec3_type,
+                                                "HPMC_histopyramid",
+                                                "1",
+                                                "1",
+                                                "i" );
+        }
+    }
+    else if( split ) {
+        src << HPMCgenerateTraversalLevels( vec3_type,
+                                            "HPMC_histopyramid_upper",
+                                            "HPMC_HP_SIZE_L2",
+                                            "HPMC_HP_SPLIT_LEVEL",
+                                            "i-HPMC_HP_SPLIT_LEVEL" );
+        src << HPMCgenerateTraversalLevels( vec3_type,
+                                            "HPMC_histopyramid",
+                                            "HPMC_HP_SPLIT_LEVEL-1",
+                                            "1",
+                                            "i" );
+    }
+    else {
+        src << HPMCgenerateTraversalLevels( vec3_type,
+                                            "HPMC_histopyramid",
+                                            "HPMC_HP_SIZE_L2",
+                                            "1",
+                                            "i" );
+    }
+    // --- Traverse base level of histopyramid ---------------------------------
+    const bool separate = HPMCseparateCodes( h );
+    const std::string nib_src = separate ? "cell_codes" : "raw";
+    src << "    " << vec4_type << " raw = texelFetch( HPMC_histopyramid, texpos, 0 );" << endl;
+    if( separate ) {
+        //      The base level holds plain counts, codes are in their own tex.
+        src << "    uvec4 cell_codes = texelFetch( HPMC_codes, texpos, 0 );" << endl;
+        src << "    " << vec3_type << " sums = raw.xyz;"                        << endl;
+    }
+    else if( integer ) {
+        //      MC codes are stored above the lower four bits.
+        src << "    uvec3 sums = raw.xyz & uvec3(15u);"                         << endl;
+    }
+    else {
+        src << "    vec3 sums = floor(raw.xyz);"                                << endl;
+    }
+    src << "    texpos = 2*texpos;"                                             << endl;
+    src << "    " << (separate ? "uint" : key_type) << " nib;"                  << endl;
+    src << "    if( sums.x <= key_ix ) {"                                       << endl;
+    src << "        key_ix -= sums.x;"                                          << endl;
+    src << "        if( sums.y <= key_ix ) {"                                   << endl;
+    src << "            key_ix -= sums.y;"                                      << endl;
+    src << "            if( sums.z <= key_ix ) {"                               << endl;
+    src << "                key_ix -= sums.z;"                                  << endl;
+    src << "                texpos += ivec2(1,1);"                              << endl;
+    src << "                nib = " << nib_src << ".w;"                        << endl;
+    src << "            }"                                                      << endl;
+    src << "            else {"                                                 << endl;
+    src << "                texpos += ivec2(0,1);"                              << endl;
+    src << "                nib = " << nib_src << ".z;"                        << endl;
+    src << "            }"                                                      << endl;
+    src << "        }"                                                          << endl;
+    src << "        else {"                                                     << endl;
+    src << "            texpos += ivec2(1,0);"                                  << endl;
+    src << "            nib = " << nib_src << ".y;"                            << endl;
+    src << "        }"                                                          << endl;
+    src << "    }"                                                              << endl;
+    src << "    else {"                                                         << endl;
+    src << "        nib = " << nib_src << ".x;"                                << endl;
+    src << "    }"                                                              << endl;
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates the MC code of the cell found by HPMCgenerateTraversal. */
+static std::string
+HPMCgenerateTraversalCode( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    if( HPMCseparateCodes( h ) ) {
+        src << "    int code = int(nib);"                                       << endl;
+    }
+    else if( HPMCintegerStorage( h ) ) {
+        src << "    int code = int(nib >> 4u);"                                 << endl;
+    }
+    else {
+        //      The code is stored as (code+0.5)/256 in the fractional part.
+        src << "    int code = int(256.0*fract(nib));"                          << endl;
+    }
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates tp and slice, the field position of the cell found by HPMCgenerateTraversal. */
+static std::string
+HPMCgenerateCellPosition()
+{
+    stringstream src;
+
+    src << "    vec2 baz = vec2(texpos) + vec2(0.5);"                           << endl;
+    src << "    vec2 foo = vec2( 0.5/HPMC_TILE_SIZE_X_F, 0.5/HPMC_TILE_SIZE_Y_F )*baz;" << endl;
+    //          Scale tp from tile parameterization to scalar field parameterization
+    src << "    vec2 tp = vec2( (2.0*HPMC_TILE_SIZE_X_F)/HPMC_FUNC_X_F," << endl;
+    src << "                    (2.0*HPMC_TILE_SIZE_Y_F)/HPMC_FUNC_Y_F ) * fract(foo);" << endl;
+    src << "    float slice = dot( vec2(1.0,HPMC_TILES_X_F), floor(foo));" << endl;
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates the rescaling of p and n from field positions to the grid extent. */
+static std::string
+HPMCgenerateVertexRescale()
+{
+    stringstream src;
+
+    //          p.xy is in normalized texture coordinates, but z is an integer slice number.
+    //          First, remove texel center offset
+    src << "    p.xy -= vec2(0.5/HPMC_FUNC_X_F, 0.5/HPMC_FUNC_Y_F );"           << endl;
+    //          And rescale such that domain fits extent.
+    src << "    p *= vec3( HPMC_GRID_EXT_X_F * HPMC_FUNC_X_F/(HPMC_CELLS_X_F-0.0)," << endl;
+    src << "               HPMC_GRID_EXT_Y_F * HPMC_FUNC_Y_F/(HPMC_CELLS_Y_F-0.0)," << endl;
+    src << "               HPMC_GRID_EXT_Z_F * 1.0/(HPMC_CELLS_Z_F) );"         << endl;
+    src << "    n *= vec3( HPMC_GRID_EXT_X_F/HPMC_CELLS_X_F,"                   << endl;
+    src << "               HPMC_GRID_EXT_Y_F/HPMC_CELLS_Y_F,"                   << endl;
+    src << "               HPMC_GRID_EXT_Z_F/HPMC_CELLS_Z_F );"                 << endl;
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates the vertex on an edge of the cell found by HPMCgenerateTraversal.
+  *
+  * Expects edge to hold the sample offset of the lower end of the edge in xyz
+  * and the axis of the edge in w, like the edge table, and sets a, b, p and n.
+  */
+static std::string
+HPMCgenerateEdgeVertex( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    // --- Determine position --------------------------------------------------
+    src << HPMCgenerateCellPosition();
+
+    if( h->m_field.m_binary ) {
+        src << "n = 2.0*fract(edge.xyz)-vec3(1.0);" << endl;
+        src << "edge = floor(edge);" << endl;
+    }
+    
+    src << "    vec3 shift = edge.xyz;"                                         << endl;
+    src << "    vec3 axis = vec3( equal(vec3(0.0, 1.0, 2.0), vec3(edge.w)) );" << endl;
+    //          Calculate sample positions of the two end-points of the edge.
+    src << "    vec3 pa = vec3(tp, slice)"                                      << endl;
+    src << "            + vec3(1.0/HPMC_FUNC_X_F, 1.0/HPMC_FUNC_Y_F, 1.0)*shift;" << endl;
+    src << "    vec3 pb = pa"                                                   << endl;
+    src << "            + vec3(1.0/HPMC_FUNC_X_F, 1.0/HPMC_FUNC_Y_F, 1.0)*axis;" << endl;
+    src << "    a = vec3(pa.x, pa.y, (pa.z+0.5)*(1.0/float(HPMC_FUNC_Z)) );" << endl;
+    src << "    b = vec3(pb.x, pb.y, (pb.z+0.5)*(1.0/float(HPMC_FUNC_Z)) );" << endl;
+    if( h->m_field.m_binary ) {
+        src << "    p = 0.5*(pa+pb);" << endl;
+    }
+    else {
+        if( !h->m_fetch.m_gradient ) {
+            //          If we don't have gradient info, we approximate the gradient using forward
+            //          differences. The sample at pb is one of the forward samples at pa, so we
+            //          save one texture lookup.
+            src << "    float va = HPMC_sample( pa );"                              << endl;
+            src << "    vec3 na = vec3( HPMC_sample( pa + vec3( 1.0/HPMC_FUNC_X_F, 0.0, 0.0 ) )," << endl;
+            src << "                    HPMC_sample( pa + vec3( 0.0, 1.0/HPMC_FUNC_Y_F, 0.0 ) )," << endl;
+            src << "                    HPMC_sample( pa + vec3( 0.0, 0.0, 1.0 ) ) );" << endl;
+            src << "    vec3 nb = vec3( HPMC_sample( pb + vec3( 1.0/HPMC_FUNC_X_F, 0.0, 0.0 ) )," << endl;
+            src << "                    HPMC_sample( pb + vec3( 0.0, 1.0/HPMC_FUNC_Y_F, 0.0 ) )," << endl;
+            src << "                    HPMC_sample( pb + vec3( 0.0, 0.0, 1.0 ) ) );" << endl;
+            //          Solve linear equation to approximate point that edge pierces iso-surface.
+            src << "    float t = (va-HPMC_threshold)/(va-dot(na,axis));"           << endl;
+        }
+        else {
+            //          If we have gradient info, sample pa and pb.
+            src << "    vec4 fa = HPMC_sampleGrad( pa );"                           << endl;
+            src << "    vec3 na = fa.xyz;"                                          << endl;
+            src << "    float va = fa.w;"                                           << endl;
+            src << "    vec4 fb = HPMC_sampleGrad( pb );"                           << endl;
+            src << "    vec3 nb = fb.xyz;"                                          << endl;
+            src << "    float vb = fb.w;"                                           << endl;
+            //          Solve linear equation to approximate point that edge pierces iso-surface.
+            src << "    float t = (va-HPMC_threshold)/(va-vb);"                     << endl;
+        }
+        src << "    p = mix(pa, pb, t );"                                           << endl;
+        src << "    n = vec3(HPMC_threshold)-mix(na, nb,t);"                        << endl;
+    }
+    src << HPMCgenerateVertexRescale();
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates extractUniqueVertex, the vertex of an intersected edge.
+  *
+  * Traverses the edge HistoPyramid, bound to HPMC_histopyramid, and the key
+  * index left at the cell picks one of the set bits of the edges it owns.
+  */
+static std::string
+HPMCgenerateExtractUniqueVertexFunction( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    src << "void" << endl;
+    src << "extractUniqueVertex( out vec3 a, out vec3 b, out vec3 p, out vec3 n )" << endl;
+    src << "{" << endl;
+    src << HPMCgenerateTraversal( h, "gl_VertexID" );
+    if( HPMCintegerStorage( h ) ) {
+        src << "    uint owned = nib >> 4u;"                                    << endl;
+    }
+    else {
+        //      The edges are stored as (edges+0.5)/4096 in the fractional part.
+        src << "    uint owned = uint(4096.0*fract(nib));"                      << endl;
+    }
+    //          The key_ix'th set bit is the edge of this vertex.
+    src << "    int slot = 0;"                                                  << endl;
+    src << "    for( int rank=int(key_ix); (slot < 11) && ((rank > 0) || (((owned >> uint(slot)) & 1u) == 0u)); slot++ ) {" << endl;
+    src << "        rank -= int( (owned >> uint(slot)) & 1u );"                 << endl;
+    src << "    }"                                                              << endl;
+    //          Bit 4*axis+u+2*v is the edge along axis, offset by u and v.
+    src << "    int dir = slot >> 2;"                                           << endl;
+    src << "    float u = float( slot & 1 );"                                   << endl;
+    src << "    float v = float( (slot >> 1) & 1 );"                            << endl;
+    src << "    vec4 edge = vec4( dir == 0 ? vec3( 0.0, u, v ) : ( dir == 1 ? vec3( u, 0.0, v ) : vec3( u, v, 0.0 ) )," << endl;
+    src << "                      float( dir ) );"                              << endl;
+    src << HPMCgenerateEdgeVertex( h );
+    src << "}"                                                                  << endl;
+    src << "void"                                                               << endl;
+    src << "extractUniqueVertex( out vec3 p, out vec3 n )"                      << endl;
+    src << "{"                                                                  << endl;
+    src << "    vec3 a, b;"                                                     << endl;
+    src << "    extractUniqueVertex( a, b, p, n );"                             << endl;
+    src << "}"                                                                  << endl;
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Generates the uniforms used by the GLSL 1.30 traversal functions. */
+static std::string
+HPMCgenerateTraversalUniforms( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    // With integer storage, keys and sums are exact unsigned integers.
+    const bool integer = HPMCintegerStorage( h );
+
+    // With mixed precision, the levels from the split level and up are
+    // in a separate tex.
+    const bool split = h->m_histopyramid.m_split_level > 0;
+
+    if( integer ) {
+        src << "uniform usampler2D HPMC_histopyramid;" << endl;
+        if( split ) {
+            src << "uniform usampler2D HPMC_histopyramid_upper;" << endl;
+        }
+    }
+    else {
+        src << "uniform sampler2D  HPMC_histopyramid;" << endl;
+    }
+    if( HPMCseparateCodes( h ) ) {
+        src << "uniform usampler2D HPMC_codes;" << endl;
+    }
+    src << "uniform sampler2D  HPMC_edge_table;" << endl;
+    src << "uniform float      HPMC_threshold;" << endl;
+    return src.str();
+}
+
 // -----------------------------------------------------------------------------
 std::string
 HPMCgenerateExtractVertexFunction( struct HPMCHistoPyramid* h )
@@ -435,132 +1946,15 @@ HPMCgenerateExtractVertexFunction( struct HPMCHistoPyramid* h )
     }
     else {
         src << "// generated by HPMCgenerateExtractShaderFunctions" << endl;
-        src << "uniform sampler2D  HPMC_histopyramid;" << endl;
-        src << "uniform sampler2D  HPMC_edge_table;" << endl;
-        src << "uniform float      HPMC_key_offset;" << endl;
-        src << "uniform float      HPMC_threshold;" << endl;
+        src << HPMCgenerateTraversalUniforms( h );
         src << "void" << endl;
         src << "extractVertex( out vec3 a, out vec3 b, out vec3 p, out vec3 n )" << endl;
         src << "{" << endl;
-        src << "    float key_ix = gl_VertexID + HPMC_key_offset;"              << endl;
-        src << "    ivec2 texpos = ivec2(0,0);"                                 << endl;
-        // --- Traverse upper levels of histopyramid ---------------------------
-        src << "    for(int i=HPMC_HP_SIZE_L2; i>0; i--) {"                     << endl;
-        src << "        vec3 sums = texelFetch( HPMC_histopyramid, texpos, i ).xyz;"<< endl;
-        src << "        texpos = 2*texpos;"                                     << endl;
-        src << "        if( sums.x <= key_ix ) {"                               << endl;
-        src << "            key_ix -= sums.x;"                                  << endl;
-        src << "            if( sums.y <= key_ix ) {"                           << endl;
-        src << "                key_ix -= sums.y;"                              << endl;
-        src << "                if( sums.z <= key_ix ) {"                       << endl;
-        src << "                    key_ix -= sums.z;"                          << endl;
-        src << "                    texpos += ivec2(1,1);"                      << endl;
-        src << "                }"                                              << endl;
-        src << "                else {"                                         << endl;
-        src << "                    texpos += ivec2(0,1);"                      << endl;
-        src << "                }"                                              << endl;
-        src << "            }"                                                  << endl;
-        src << "            else {"                                             << endl;
-        src << "                texpos += ivec2(1,0);"                          << endl;
-        src << "            }"                                                  << endl;
-        src << "        }"                                                      << endl;
-        src << "    }"                                                          << endl;
-        // --- Traverse base level of histopyramid -----------------------------
-        src << "    vec4 raw = texelFetch( HPMC_histopyramid, texpos, 0 );"     << endl;
-        src << "    vec3 sums = floor(raw.xyz);"                                << endl;
-        src << "    texpos = 2*texpos;"                                         << endl;
-        src << "    float nib;"                                                 << endl;
-        src << "    if( sums.x <= key_ix ) {"                                   << endl;
-        src << "        key_ix -= sums.x;"                                      << endl;
-        src << "        if( sums.y <= key_ix ) {"                               << endl;
-        src << "            key_ix -= sums.y;"                                  << endl;
-        src << "            if( sums.z <= key_ix ) {"                           << endl;
-        src << "                key_ix -= sums.z;"                              << endl;
-        src << "                texpos += ivec2(1,1);"                          << endl;
-        src << "                nib = raw.w;"                                   << endl;
-        src << "            }"                                                  << endl;
-        src << "            else {"                                             << endl;
-        src << "                texpos += ivec2(0,1);"                          << endl;
-        src << "                nib = raw.z;"                                   << endl;
-        src << "            }"                                                  << endl;
-        src << "        }"                                                      << endl;
-        src << "        else {"                                                 << endl;
-        src << "            texpos += ivec2(1,0);"                              << endl;
-        src << "            nib = raw.y;"                                       << endl;
-        src << "        }"                                                      << endl;
-        src << "    }"                                                          << endl;
-        src << "    else {"                                                     << endl;
-        src << "        nib = raw.x;"                                           << endl;
-        src << "    }"                                                          << endl;
-        src << "    float val = fract(nib);"                                    << endl;
-        // --- Determine position ----------------------------------------------
-        src << "    vec2 baz = vec2(texpos) + vec2(0.5);"                       << endl;
-        src << "    vec2 bar = " << (0.5f/(h->m_histopyramid.m_size)) << "*baz;"<<endl;
-        src << "    vec2 foo = vec2(HPMC_TILES_X_F,HPMC_TILES_Y_F)*bar;"        << endl;
-        //          Scale tp from tile parameterization to scalar field parameterization
-        src << "    vec2 tp = vec2( (2.0*HPMC_TILE_SIZE_X_F)/HPMC_FUNC_X_F," << endl;
-        src << "                    (2.0*HPMC_TILE_SIZE_Y_F)/HPMC_FUNC_Y_F ) * fract(foo);" << endl;
-        src << "    float slice = dot( vec2(1.0,HPMC_TILES_X_F), floor(foo));" << endl;
+        src << HPMCgenerateTraversal( h, "gl_VertexID" );
+        src << HPMCgenerateTraversalCode( h );
         //          Now we have found the MC cell, next find which edge that this vertex lies on
-        src << "    vec4 edge = texture2D( HPMC_edge_table, vec2((1.0/16.0)*(key_ix+0.5), val ) );" << endl;
-
-        if( h->m_field.m_binary ) {
-            src << "n = 2.0*fract(edge.xyz)-vec3(1.0);" << endl;
-            src << "edge = floor(edge);" << endl;
-        }
-        
-        src << "    vec3 shift = edge.xyz;"                                     << endl;
-        src << "    vec3 axis = vec3( equal(vec3(0.0, 1.0, 2.0), vec3(edge.w)) );" << endl;
-        //          Calculate sample positions of the two end-points of the edge.
-        src << "    vec3 pa = vec3(tp, slice)"                                  << endl;
-        src << "            + vec3(1.0/HPMC_FUNC_X_F, 1.0/HPMC_FUNC_Y_F, 1.0)*shift;" << endl;
-        src << "    vec3 pb = pa"                                               << endl;
-        src << "            + vec3(1.0/HPMC_FUNC_X_F, 1.0/HPMC_FUNC_Y_F, 1.0)*axis;" << endl;
-        src << "    a = vec3(pa.x, pa.y, (pa.z+0.5)*(1.0/float(HPMC_FUNC_Z)) );" << endl;
-        src << "    b = vec3(pb.x, pb.y, (pb.z+0.5)*(1.0/float(HPMC_FUNC_Z)) );" << endl;
-        if( h->m_field.m_binary ) {
-            src << "    p = 0.5*(pa+pb);" << endl;
-        }
-        else {
-            if( !h->m_fetch.m_gradient ) {
-                //          If we don't have gradient info, we approximate the gradient using forward
-                //          differences. The sample at pb is one of the forward samples at pa, so we
-                //          save one texture lookup.
-                src << "    float va = HPMC_sample( pa );"                          << endl;
-                src << "    vec3 na = vec3( HPMC_sample( pa + vec3( 1.0/HPMC_FUNC_X_F, 0.0, 0.0 ) )," << endl;
-                src << "                    HPMC_sample( pa + vec3( 0.0, 1.0/HPMC_FUNC_Y_F, 0.0 ) )," << endl;
-                src << "                    HPMC_sample( pa + vec3( 0.0, 0.0, 1.0 ) ) );" << endl;
-                src << "    vec3 nb = vec3( HPMC_sample( pb + vec3( 1.0/HPMC_FUNC_X_F, 0.0, 0.0 ) )," << endl;
-                src << "                    HPMC_sample( pb + vec3( 0.0, 1.0/HPMC_FUNC_Y_F, 0.0 ) )," << endl;
-                src << "                    HPMC_sample( pb + vec3( 0.0, 0.0, 1.0 ) ) );" << endl;
-                //          Solve linear equation to approximate point that edge pierces iso-surface.
-                src << "    float t = (va-HPMC_threshold)/(va-dot(na,axis));"       << endl;
-            }
-            else {
-                //          If we have gradient info, sample pa and pb.
-                src << "    vec4 fa = HPMC_sampleGrad( pa );"                       << endl;
-                src << "    vec3 na = fa.xyz;"                                      << endl;
-                src << "    float va = fa.w;"                                       << endl;
-                src << "    vec4 fb = HPMC_sampleGrad( pb );"                       << endl;
-                src << "    vec3 nb = fb.xyz;"                                      << endl;
-                src << "    float vb = fb.w;"                                       << endl;
-                //          Solve linear equation to approximate point that edge pierces iso-surface.
-                src << "    float t = (va-HPMC_threshold)/(va-vb);"                 << endl;
-            }
-            src << "    p = mix(pa, pb, t );"                                       << endl;
-            src << "    n = vec3(HPMC_threshold)-mix(na, nb,t);"                    << endl;
-        }
-        
-        //          p.xy is in normalized texture coordinates, but z is an integer slice number.
-        //          First, remove texel center offset
-        src << "    p.xy -= vec2(0.5/HPMC_FUNC_X_F, 0.5/HPMC_FUNC_Y_F );"       << endl;
-        //          And rescale such that domain fits extent.
-        src << "    p *= vec3( HPMC_GRID_EXT_X_F * HPMC_FUNC_X_F/(HPMC_CELLS_X_F-0.0)," << endl;
-        src << "               HPMC_GRID_EXT_Y_F * HPMC_FUNC_Y_F/(HPMC_CELLS_Y_F-0.0)," << endl;
-        src << "               HPMC_GRID_EXT_Z_F * 1.0/(HPMC_CELLS_Z_F) );"     << endl;
-        src << "    n *= vec3( HPMC_GRID_EXT_X_F/HPMC_CELLS_X_F,"               << endl;
-        src << "               HPMC_GRID_EXT_Y_F/HPMC_CELLS_Y_F,"               << endl;
-        src << "               HPMC_GRID_EXT_Z_F/HPMC_CELLS_Z_F );"             << endl;
+        src << "    vec4 edge = texelFetch( HPMC_edge_table, ivec2(int(key_ix), code), 0 );" << endl;
+        src << HPMCgenerateEdgeVertex( h );
         src << "}"                                                              << endl;
 
     }
@@ -570,5 +1964,201 @@ HPMCgenerateExtractVertexFunction( struct HPMCHistoPyramid* h )
     src << "    vec3 a, b;"                                                 << endl;
     src << "    extractVertex( a, b, p, n );"                               << endl;
     src << "}"                                                              << endl;
+    if( h->m_indexed.m_enabled ) {
+        src << HPMCgenerateExtractUniqueVertexFunction( h );
+    }
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+std::string
+HPMCgenerateExtractCellFunctions( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    src << "// generated by HPMCgenerateExtractCellFunctions" << endl;
+    src << HPMCgenerateTraversalUniforms( h );
+    //      the cell found by extractCell, shared by the vertices of the cell.
+    src << "vec3  HPMC_cell_origin;" << endl;
+    src << "int   HPMC_cell_code;" << endl;
+    //      the forward samples along x, y and z in xyz (or the gradient) and
+    //      the sample in w, of each corner.
+    src << "vec4  HPMC_cell_corners[8];" << endl;
+    src << "int" << endl;
+    src << "extractCell()" << endl;
+    src << "{" << endl;
+    //          the cell HistoPyramid is drawn as points, one per active cell.
+    src << HPMCgenerateTraversal( h, "gl_PrimitiveIDIn" );
+    if( HPMCintegerStorage( h ) ) {
+        src << "    uint cell = nib >> 4u;"                                     << endl;
+    }
+    else {
+        //      The cell is stored as (code+256*vertices+0.5)/4096 in the fractional part.
+        src << "    uint cell = uint(4096.0*fract(nib));"                       << endl;
+    }
+    src << "    HPMC_cell_code = int( cell & 255u );"                           << endl;
+    src << HPMCgenerateCellPosition();
+    src << "    HPMC_cell_origin = vec3(tp, slice);"                            << endl;
+    if( h->m_fetch.m_gradient ) {
+        for( int c=0; c<8; c++ ) {
+            src << "    HPMC_cell_corners[" << c << "] = HPMC_sampleGrad( HPMC_cell_origin + vec3( "
+                << (c&1) << ".0/HPMC_FUNC_X_F, "
+                << ((c>>1)&1) << ".0/HPMC_FUNC_Y_F, "
+                << (c>>2) << ".0 ) );" << endl;
+        }
+    }
+    else {
+        //      The forward differences of the 8 corners need 20 samples of the
+        //      3x3x3 neighbourhood, sample s_ijk is at offset (i,j,k).
+        for( int k=0; k<3; k++ ) {
+            for( int j=0; j<3; j++ ) {
+                for( int i=0; i<3; i++ ) {
+                    if( (i==2) + (j==2) + (k==2) > 1 ) {
+                        continue;
+                    }
+                    src << "    float s_" << i << j << k << " = HPMC_sample( HPMC_cell_origin + vec3( "
+                        << i << ".0/HPMC_FUNC_X_F, "
+                        << j << ".0/HPMC_FUNC_Y_F, "
+                        << k << ".0 ) );" << endl;
+                }
+            }
+        }
+        for( int c=0; c<8; c++ ) {
+            const int i = c&1;
+            const int j = (c>>1)&1;
+            const int k = c>>2;
+            src << "    HPMC_cell_corners[" << c << "] = vec4( "
+                << "s_" << (i+1) << j << k << ", "
+                << "s_" << i << (j+1) << k << ", "
+                << "s_" << i << j << (k+1) << ", "
+                << "s_" << i << j << k << " );" << endl;
+        }
+    }
+    src << "    return int( cell >> 8u );"                                      << endl;
+    src << "}" << endl;
+
+    src << "void" << endl;
+    src << "extractCellVertex( int i, out vec3 a, out vec3 b, out vec3 p, out vec3 n )" << endl;
+    src << "{" << endl;
+    src << "    vec4 edge = texelFetch( HPMC_edge_table, ivec2(i, HPMC_cell_code), 0 );" << endl;
+    src << "    vec3 shift = edge.xyz;"                                         << endl;
+    src << "    vec3 axis = vec3( equal(vec3(0.0, 1.0, 2.0), vec3(edge.w)) );" << endl;
+    src << "    vec3 pa = HPMC_cell_origin"                                     << endl;
+    src << "            + vec3(1.0/HPMC_FUNC_X_F, 1.0/HPMC_FUNC_Y_F, 1.0)*shift;" << endl;
+    src << "    vec3 pb = pa"                                                   << endl;
+    src << "            + vec3(1.0/HPMC_FUNC_X_F, 1.0/HPMC_FUNC_Y_F, 1.0)*axis;" << endl;
+    src << "    a = vec3(pa.x, pa.y, (pa.z+0.5)*(1.0/float(HPMC_FUNC_Z)) );" << endl;
+    src << "    b = vec3(pb.x, pb.y, (pb.z+0.5)*(1.0/float(HPMC_FUNC_Z)) );" << endl;
+    //          Corner c is at offset (c&1, (c>>1)&1, c>>2), like the bits of the MC code.
+    src << "    int ia = int( dot( shift, vec3(1.0, 2.0, 4.0) ) );"             << endl;
+    src << "    int ib = ia + int( dot( axis, vec3(1.0, 2.0, 4.0) ) );"         << endl;
+    src << "    vec4 fa = HPMC_cell_corners[ia];"                               << endl;
+    src << "    vec4 fb = HPMC_cell_corners[ib];"                               << endl;
+    src << "    float t = (fa.w-HPMC_threshold)/(fa.w-fb.w);"                   << endl;
+    src << "    p = mix(pa, pb, t );"                                           << endl;
+    src << "    n = vec3(HPMC_threshold)-mix(fa.xyz, fb.xyz, t);"               << endl;
+    src << HPMCgenerateVertexRescale();
+    src << "}" << endl;
+    src << "void" << endl;
+    src << "extractCellVertex( int i, out vec3 p, out vec3 n )" << endl;
+    src << "{" << endl;
+    src << "    vec3 a, b;" << endl;
+    src << "    extractCellVertex( i, a, b, p, n );" << endl;
+    src << "}" << endl;
+    return src.str();
+}
+
+// -----------------------------------------------------------------------------
+std::string
+HPMCgenerateIndexShader( struct HPMCHistoPyramid* h )
+{
+    stringstream src;
+
+    const bool integer = HPMCintegerStorage( h );
+    const std::string sampler = integer ? "usampler2D" : "sampler2D ";
+    src << "// generated by HPMCgenerateIndexShader" << endl;
+    src << "uniform " << sampler << " HPMC_histopyramid;" << endl;
+    src << "uniform " << sampler << " HPMC_edges;" << endl;
+    src << "uniform sampler2D  HPMC_edge_table;" << endl;
+    src << "flat out uint      HPMC_index;" << endl;
+    src << HPMCgenerateEdgeFunctions();
+    //      the edges of the children before child k.
+    src << "uint" << endl;
+    src << "HPMC_preceding( uvec4 counts, int k )" << endl;
+    src << "{" << endl;
+    src << "    return (k > 0 ? counts.x : 0u) + (k > 1 ? counts.y : 0u) + (k > 2 ? counts.z : 0u);" << endl;
+    src << "}" << endl;
+    src << "uint" << endl;
+    if( integer ) {
+        src << "HPMC_total( uvec4 v )" << endl;
+        src << "{" << endl;
+        src << "    return v.x + v.y + v.z + v.w;" << endl;
+    }
+    else {
+        src << "HPMC_total( vec4 v )" << endl;
+        src << "{" << endl;
+        src << "    return uint( dot( v, vec4(1.0) ) );" << endl;
+    }
+    src << "}" << endl;
+    src << "void" << endl;
+    src << "main()" << endl;
+    src << "{" << endl;
+    src << HPMCgenerateTraversal( h, "gl_VertexID" );
+    src << HPMCgenerateTraversalCode( h );
+    src << "    vec4 edge = texelFetch( HPMC_edge_table, ivec2(int(key_ix), code), 0 );" << endl;
+    //      the sample at the lower end of the edge, texpos is the cell.
+    src << "    ivec2 tile_size = 2*ivec2( HPMC_TILE_SIZE_X, HPMC_TILE_SIZE_Y );" << endl;
+    src << "    ivec2 tile = texpos / tile_size;" << endl;
+    src << "    ivec3 start = ivec3( texpos - tile*tile_size, tile.x + HPMC_TILES_X*tile.y ) + ivec3( edge.xyz );" << endl;
+    //      the edge is owned by the cell at its lower end, clamped to the grid.
+    src << "    int dir = int( edge.w );" << endl;
+    src << "    ivec3 owner = min( start, ivec3( HPMC_grid_cells ) - ivec3( 1 ) );" << endl;
+    src << "    ivec3 offset = start - owner;" << endl;
+    src << "    ivec2 uv = dir == 0 ? offset.yz : ( dir == 1 ? offset.xz : offset.xy );" << endl;
+    src << "    int slot = 4*dir + uv.x + 2*uv.y;" << endl;
+    //      the rank of the edge among the edges of the owner, ...
+    src << "    ivec2 q = owner.xy + tile_size*ivec2( owner.z % HPMC_TILES_X, owner.z / HPMC_TILES_X );" << endl;
+    src << "    " << (integer ? "uvec4" : "vec4") << " base = texelFetch( HPMC_edges, q >> 1, 0 );" << endl;
+    src << "    int k = (q.x & 1) + 2*(q.y & 1);" << endl;
+    if( integer ) {
+        src << "    uint owned = base[k] >> 4u;" << endl;
+        src << "    uint index = HPMC_preceding( base & uvec4(15u), k );" << endl;
+    }
+    else {
+        src << "    uint owned = uint( 4096.0*fract( base[k] ) );" << endl;
+        src << "    uint index = HPMC_preceding( uvec4( base ), k );" << endl;
+    }
+    src << "    index += HPMC_bitCount( owned & ((1u << uint(slot)) - 1u) );" << endl;
+    //      ... plus the edges of the cells before the owner in traversal order.
+    const std::string counts = integer ? "" : "uvec4";
+    for( GLsizei m=1; m<=h->m_histopyramid.m_size_l2; m++ ) {
+        src << "    k = ((q.x >> " << m << ") & 1) + 2*((q.y >> " << m << ") & 1);" << endl;
+        if( HPMClevelSkipped( h, m ) ) {
+            //  the totals of the children in the level below.
+            src << "    index += HPMC_preceding( uvec4( "
+                << "HPMC_total( texelFetch( HPMC_edges, 2*(q >> " << (m+1) << "), " << (m-1) << " ) )," << endl;
+            src << "                                    "
+                << "HPMC_total( texelFetch( HPMC_edges, 2*(q >> " << (m+1) << ") + ivec2(1,0), " << (m-1) << " ) )," << endl;
+            src << "                                    "
+                << "HPMC_total( texelFetch( HPMC_edges, 2*(q >> " << (m+1) << ") + ivec2(0,1), " << (m-1) << " ) )," << endl;
+            src << "                                    0u ), k );" << endl;
+        }
+        else {
+            src << "    index += HPMC_preceding( " << counts << "( texelFetch( HPMC_edges, q >> " << (m+1) << ", " << m << " ) ), k );" << endl;
+        }
+    }
+    if( (h->m_histopyramid.m_top_size[0] > 1) || (h->m_histopyramid.m_top_size[1] > 1) ) {
+        //  the top level is scanned in rows.
+        src << "    ivec2 top = q >> (HPMC_HP_SIZE_L2+1);" << endl;
+        src << "    for(int j=0; j<=top.y; j++) {" << endl;
+        src << "        for(int i=0; i<HPMC_HP_TOP_X && (j<top.y || i<top.x); i++) {" << endl;
+        src << "            index += HPMC_total( texelFetch( HPMC_edges, ivec2(i,j), HPMC_HP_SIZE_L2 ) );" << endl;
+        src << "        }" << endl;
+        src << "    }" << endl;
+    }
+    src << "    HPMC_index = index;" << endl;
+    // Rasterization is discarded, but older GLSL versions require a position.
+    src << "    gl_Position = vec4( 0.0 );" << endl;
+    src << "}" << endl;
     return src.str();
 }
@@ -44,6 +44,265 @@ using std::endl;
 #define log2f(x) (logf(x)*1.4426950408889634f)
 #endif
 
+// -----------------------------------------------------------------------------
+/** Creates or respecifies a mipmapped texture holding levels of the HP.
+  *
+  * \sideeffect GL_TEXTURE_2D_BINDING (unless stateless)
+  */
+static void
+HPMCcreateHistoPyramidTexture( struct HPMCHistoPyramid* h,
+                               GLuint&                  tex,
+                               GLenum                   format,
+                               GLsizei                  width,
+                               GLsizei                  height,
+                               GLsizei                  levels )
+{
+    HPMCTarget target = h->m_constants->m_target;
+
+    if( h->m_constants->m_stateless ) {
+        // Immutable storage can't be respecified, so we create a new texture.
+        if( tex != 0 ) {
+            glDeleteTextures( 1, &tex );
+        }
+        glCreateTextures( GL_TEXTURE_2D, 1, &tex );
+        glTextureStorage2D( tex, levels, format, width, height );
+        glTextureParameteri( tex, GL_TEXTURE_BASE_LEVEL, 0 );
+        glTextureParameteri( tex, GL_TEXTURE_MAX_LEVEL, levels-1 );
+        glTextureParameteri( tex, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+        glTextureParameteri( tex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+        glTextureParameteri( tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST );
+        glTextureParameteri( tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    }
+    else if( h->m_constants->m_core &&
+             ( (target >= HPMC_TARGET_GL42_GLSL420) || GLEW_ARB_texture_storage ) )
+    {
+        // Immutable storage lets the driver skip mipmap completeness checks.
+        if( tex != 0 ) {
+            glDeleteTextures( 1, &tex );
+        }
+        glGenTextures( 1, &tex );
+        glBindTexture( GL_TEXTURE_2D, tex );
+        glTexStorage2D( GL_TEXTURE_2D, levels, format, width, height );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0 );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels-1 );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    }
+    else {
+        if( tex == 0 ) {
+            glGenTextures( 1, &tex );
+        }
+        glBindTexture( GL_TEXTURE_2D, tex );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0 );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels-1 );
+        GLsizei w = width;
+        GLsizei hh = height;
+        for( GLsizei i=0; i<levels; i++ ) {
+            if( target < HPMC_TARGET_GL30_GLSL130 ) {
+                glTexImage2D( GL_TEXTURE_2D, i,
+                              GL_RGBA32F_ARB,
+                              w, hh, 0,
+                              GL_RGBA, GL_FLOAT,
+                              NULL );
+            }
+            else if( format == GL_RGBA32UI ) {
+                glTexImage2D( GL_TEXTURE_2D, i,
+                              GL_RGBA32UI,
+                              w, hh, 0,
+                              GL_RGBA_INTEGER, GL_UNSIGNED_INT,
+                              NULL );
+            }
+            else if( format == GL_RGBA16UI ) {
+                glTexImage2D( GL_TEXTURE_2D, i,
+                              GL_RGBA16UI,
+                              w, hh, 0,
+                              GL_RGBA_INTEGER, GL_UNSIGNED_SHORT,
+                              NULL );
+            }
+            else if( format == GL_RGBA8UI ) {
+                glTexImage2D( GL_TEXTURE_2D, i,
+                              GL_RGBA8UI,
+                              w, hh, 0,
+                              GL_RGBA_INTEGER, GL_UNSIGNED_BYTE,
+                              NULL );
+            }
+            else if( format == GL_RG32F ) {
+                glTexImage2D( GL_TEXTURE_2D, i,
+                              GL_RG32F,
+                              w, hh, 0,
+                              GL_RG, GL_FLOAT,
+                              NULL );
+            }
+            else {
+                glTexImage2D( GL_TEXTURE_2D, i,
+                              GL_RGBA32F,
+                              w, hh, 0,
+                              GL_RGBA, GL_FLOAT,
+                              NULL );
+            }
+            w = std::max(1,w/2);
+            hh = std::max(1,hh/2);
+        }
+        //glGenerateMipmapEXT( GL_TEXTURE_2D );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    }
+}
+
+// -----------------------------------------------------------------------------
+/** Frees the GL resources of a HistoPyramid built through another and deletes it. */
+static void
+HPMCdestroySibling( struct HPMCHistoPyramid* s )
+{
+    HPMCHistoPyramid::HistoPyramid& hp = s->m_histopyramid;
+    GLuint texs[3] = { hp.m_tex, hp.m_tex_upper, hp.m_code_tex };
+    for( int i=0; i<3; i++ ) {
+        if( texs[i] != 0 ) {
+            glDeleteTextures( 1, &texs[i] );
+        }
+    }
+    if( !hp.m_fbos.empty() ) {
+        if( s->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
+            glDeleteFramebuffersEXT( hp.m_fbos.size(), hp.m_fbos.data() );
+        }
+        else {
+            glDeleteFramebuffers( hp.m_fbos.size(), hp.m_fbos.data() );
+        }
+    }
+    for( size_t i=0; i<hp.m_top_readbacks.size(); i++ ) {
+        if( hp.m_top_readbacks[i].m_fence != 0 ) {
+            glDeleteSync( hp.m_top_readbacks[i].m_fence );
+        }
+        glDeleteBuffers( 1, &hp.m_top_readbacks[i].m_pbo );
+    }
+    if( hp.m_indirect_buffer != 0 ) {
+        glDeleteBuffers( 1, &hp.m_indirect_buffer );
+    }
+    delete s;
+}
+
+// -----------------------------------------------------------------------------
+/** Lays out a HistoPyramid built through h like h, and creates its textures. */
+static bool
+HPMCsetupSibling( struct HPMCHistoPyramid* h, struct HPMCHistoPyramid* s )
+{
+    s->m_tiling.m_compact = h->m_tiling.m_compact;
+    s->m_field = h->m_field;
+    s->m_fetch = h->m_fetch;
+    s->m_histopyramid.m_format = h->m_histopyramid.m_format;
+    s->m_histopyramid.m_mixed_precision = h->m_histopyramid.m_mixed_precision;
+    s->m_histopyramid.m_separate_codes = h->m_histopyramid.m_separate_codes;
+    s->m_histopyramid.m_fan_out = h->m_histopyramid.m_fan_out;
+    if( !HPMCdetermineLayout( s ) || !HPMCsetupTexAndFBOs( s ) ) {
+        return false;
+    }
+    // the sibling is built through h and never set up on its own.
+    s->m_tainted = false;
+    s->m_broken = false;
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCsetupSurfaces( struct HPMCHistoPyramid* h )
+{
+    // --- free surfaces no longer built ---------------------------------------
+    const size_t n = std::max( 1, h->m_surface_count ) - 1;
+    while( h->m_surfaces.size() > n ) {
+        HPMCdestroySibling( h->m_surfaces.back() );
+        h->m_surfaces.pop_back();
+    }
+
+    // --- lay out the remaining surfaces like h -------------------------------
+    for( size_t i=0; i<n; i++ ) {
+        if( i == h->m_surfaces.size() ) {
+            h->m_surfaces.push_back( HPMCcreateHistoPyramid( h->m_constants ) );
+        }
+        if( !HPMCsetupSibling( h, h->m_surfaces[i] ) ) {
+#ifdef DEBUG
+            cerr << "HPMC error: Failed to set up HistoPyramid of surface " << (i+1) << "." << endl;
+#endif
+            return false;
+        }
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCsetupFrontBuffer( struct HPMCHistoPyramid* h )
+{
+    if( !h->m_double_buffered ) {
+        if( h->m_front != NULL ) {
+            HPMCdestroySibling( h->m_front );
+            h->m_front = NULL;
+        }
+        return true;
+    }
+    if( h->m_front == NULL ) {
+        h->m_front = HPMCcreateHistoPyramid( h->m_constants );
+    }
+    if( !HPMCsetupSibling( h, h->m_front ) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: Failed to set up front HistoPyramid." << endl;
+#endif
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCsetupEdges( struct HPMCHistoPyramid* h )
+{
+    HPMCHistoPyramid::Indexed& indexed = h->m_indexed;
+    if( !indexed.m_enabled ) {
+        if( indexed.m_edges != NULL ) {
+            HPMCdestroySibling( indexed.m_edges );
+            indexed.m_edges = NULL;
+        }
+        return true;
+    }
+    if( indexed.m_edges == NULL ) {
+        indexed.m_edges = HPMCcreateHistoPyramid( h->m_constants );
+    }
+    if( !HPMCsetupSibling( h, indexed.m_edges ) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: Failed to set up edge HistoPyramid." << endl;
+#endif
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCsetupCells( struct HPMCHistoPyramid* h )
+{
+    HPMCHistoPyramid::PerCell& per_cell = h->m_per_cell;
+    if( !per_cell.m_enabled ) {
+        if( per_cell.m_cells != NULL ) {
+            HPMCdestroySibling( per_cell.m_cells );
+            per_cell.m_cells = NULL;
+        }
+        return true;
+    }
+    if( per_cell.m_cells == NULL ) {
+        per_cell.m_cells = HPMCcreateHistoPyramid( h->m_constants );
+    }
+    if( !HPMCsetupSibling( h, per_cell.m_cells ) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: Failed to set up cell HistoPyramid." << endl;
+#endif
+        return false;
+    }
+    return true;
+}
+
 // -----------------------------------------------------------------------------
 bool
 HPMCsetupTexAndFBOs( struct HPMCHistoPyramid* h )
@@ -63,38 +322,37 @@ HPMCsetupTexAndFBOs( struct HPMCHistoPyramid* h )
     }
     HPMCTarget target = h->m_constants->m_target;
     HPMCHistoPyramid::HistoPyramid& hp = h->m_histopyramid;
+    const bool stateless = h->m_constants->m_stateless;
 
-    // --- create hp texture ---------------------------------------------------
-    if( h->m_histopyramid.m_tex == 0 ) {
-        glGenTextures( 1, &h->m_histopyramid.m_tex );
+    // --- create hp textures --------------------------------------------------
+    if( hp.m_split_level > 0 ) {
+        HPMCcreateHistoPyramidTexture( h, hp.m_tex, GL_RGBA16UI,
+                                       hp.m_size[0], hp.m_size[1],
+                                       hp.m_split_level );
+        HPMCcreateHistoPyramidTexture( h, hp.m_tex_upper, hp.m_format,
+                                       hp.m_size[0]>>hp.m_split_level,
+                                       hp.m_size[1]>>hp.m_split_level,
+                                       hp.m_size_l2-hp.m_split_level+1 );
     }
-
-    glBindTexture( GL_TEXTURE_2D, hp.m_tex );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0 );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, hp.m_size_l2);
-    GLsizei w = hp.m_size;
-    for( GLsizei i=0; i<=h->m_histopyramid.m_size_l2; i++ ) {
-        if( target < HPMC_TARGET_GL30_GLSL130 ) {
-            glTexImage2D( GL_TEXTURE_2D, i,
-                          GL_RGBA32F_ARB,
-                          w, w, 0,
-                          GL_RGBA, GL_FLOAT,
-                          NULL );
-        }
-        else {
-            glTexImage2D( GL_TEXTURE_2D, i,
-                          GL_RGBA32F,
-                          w, w, 0,
-                          GL_RGBA, GL_FLOAT,
-                          NULL );
+    else {
+        HPMCcreateHistoPyramidTexture( h, hp.m_tex, hp.m_format,
+                                       hp.m_size[0], hp.m_size[1],
+                                       hp.m_size_l2+1 );
+        if( hp.m_tex_upper != 0 ) {
+            glDeleteTextures( 1, &hp.m_tex_upper );
+            hp.m_tex_upper = 0;
         }
-        w = std::max(1,w/2);
     }
-    //glGenerateMipmapEXT( GL_TEXTURE_2D );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+
+    // --- create tex holding the MC codes of the base level -------------------
+    if( hp.m_separate_codes ) {
+        HPMCcreateHistoPyramidTexture( h, hp.m_code_tex, GL_RGBA8UI,
+                                       hp.m_size[0], hp.m_size[1], 1 );
+    }
+    else if( hp.m_code_tex != 0 ) {
+        glDeleteTextures( 1, &hp.m_code_tex );
+        hp.m_code_tex = 0;
+    }
 
     // --- create hp framebuffer objects, one fbo per level --------------------
     if( target < HPMC_TARGET_GL30_GLSL130 ) {   // Pre GL 3.0 path
@@ -151,13 +409,53 @@ HPMCsetupTexAndFBOs( struct HPMCHistoPyramid* h )
             glDeleteFramebuffers( hp.m_fbos.size(), hp.m_fbos.data() );
         }
         hp.m_fbos.resize( hp.m_size_l2+1 );
-        glGenFramebuffers( hp.m_fbos.size(), hp.m_fbos.data() );
+        if( stateless ) {
+            glCreateFramebuffers( hp.m_fbos.size(), hp.m_fbos.data() );
+        }
+        else {
+            glGenFramebuffers( hp.m_fbos.size(), hp.m_fbos.data() );
+        }
+        // The base level pass writes the base level of output i (the surfaces
+        // and then the edges, see HPMCbaseLevelOutput) to attachment i, and
+        // the MC codes of surface s to attachment s + number of outputs.
+        const GLsizei n = h->m_surface_count;
         for( GLuint m=0; m<hp.m_fbos.size(); m++) {
-            glBindFramebuffer( GL_FRAMEBUFFER, hp.m_fbos[m] );
-            glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                                    GL_TEXTURE_2D, hp.m_tex, m );
-            glDrawBuffer( GL_COLOR_ATTACHMENT0 );
-            GLenum status = glCheckFramebufferStatus( GL_FRAMEBUFFER );
+            std::vector<GLuint> texs( 1 );
+            std::vector<GLint> tex_levels( 1 );
+            texs[0] = HPMClevelTexture( h, m, tex_levels[0] );
+            if( m == 0 ) {
+                for( GLsizei i=1; i<HPMCbaseLevelOutputs( h ); i++ ) {
+                    texs.push_back( HPMCbaseLevelOutput( h, i )->m_histopyramid.m_tex );
+                    tex_levels.push_back( 0 );
+                }
+                if( hp.m_separate_codes ) {
+                    for( GLsizei s=0; s<n; s++ ) {
+                        texs.push_back( HPMCsurface( h, s )->m_histopyramid.m_code_tex );
+                        tex_levels.push_back( 0 );
+                    }
+                }
+            }
+            std::vector<GLenum> draw_buffers( texs.size() );
+            for( size_t i=0; i<texs.size(); i++ ) {
+                draw_buffers[i] = GL_COLOR_ATTACHMENT0 + i;
+            }
+            GLenum status;
+            if( stateless ) {
+                for( size_t i=0; i<texs.size(); i++ ) {
+                    glNamedFramebufferTexture( hp.m_fbos[m], draw_buffers[i], texs[i], tex_levels[i] );
+                }
+                glNamedFramebufferDrawBuffers( hp.m_fbos[m], draw_buffers.size(), draw_buffers.data() );
+                status = glCheckNamedFramebufferStatus( hp.m_fbos[m], GL_FRAMEBUFFER );
+            }
+            else {
+                glBindFramebuffer( GL_FRAMEBUFFER, hp.m_fbos[m] );
+                for( size_t i=0; i<texs.size(); i++ ) {
+                    glFramebufferTexture2D( GL_FRAMEBUFFER, draw_buffers[i],
+                                            GL_TEXTURE_2D, texs[i], tex_levels[i] );
+                }
+                glDrawBuffers( draw_buffers.size(), draw_buffers.data() );
+                status = glCheckFramebufferStatus( GL_FRAMEBUFFER );
+            }
             if( status != GL_FRAMEBUFFER_COMPLETE ) {
 #ifdef DEBUG
                 std::string error;
@@ -197,14 +495,108 @@ HPMCsetupTexAndFBOs( struct HPMCHistoPyramid* h )
         }
     }
 
-    // --- setup pbo to for async readback of top element ----------------------
-    glGenBuffers( 1, &h->m_histopyramid.m_top_pbo );
-    glBindBuffer( GL_PIXEL_PACK_BUFFER, h->m_histopyramid.m_top_pbo );
-    glBufferData( GL_PIXEL_PACK_BUFFER,
-                  sizeof(GLfloat)*4,
-                  NULL,
-                  GL_DYNAMIC_READ );
-    glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+    // --- create tex and fbo holding the min/max bricks of the field ----------
+    HPMCHistoPyramid::Bricks& bricks = h->m_bricks;
+    if( bricks.m_enabled ) {
+        HPMCcreateHistoPyramidTexture( h, bricks.m_tex, GL_RG32F,
+                                       bricks.m_count[0],
+                                       bricks.m_count[1]*bricks.m_count[2], 1 );
+        GLenum status;
+        if( stateless ) {
+            if( bricks.m_fbo == 0 ) {
+                glCreateFramebuffers( 1, &bricks.m_fbo );
+            }
+            glNamedFramebufferTexture( bricks.m_fbo, GL_COLOR_ATTACHMENT0, bricks.m_tex, 0 );
+            glNamedFramebufferDrawBuffer( bricks.m_fbo, GL_COLOR_ATTACHMENT0 );
+            status = glCheckNamedFramebufferStatus( bricks.m_fbo, GL_FRAMEBUFFER );
+        }
+        else {
+            if( bricks.m_fbo == 0 ) {
+                glGenFramebuffers( 1, &bricks.m_fbo );
+            }
+            glBindFramebuffer( GL_FRAMEBUFFER, bricks.m_fbo );
+            glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                    GL_TEXTURE_2D, bricks.m_tex, 0 );
+            glDrawBuffer( GL_COLOR_ATTACHMENT0 );
+            status = glCheckFramebufferStatus( GL_FRAMEBUFFER );
+        }
+        if( status != GL_FRAMEBUFFER_COMPLETE ) {
+#ifdef DEBUG
+            cerr << "HPMC error: field bricks framebuffer is incomplete." << endl;
+#endif
+            return false;
+        }
+    }
+    else {
+        if( bricks.m_fbo != 0 ) {
+            glDeleteFramebuffers( 1, &bricks.m_fbo );
+            bricks.m_fbo = 0;
+        }
+        if( bricks.m_tex != 0 ) {
+            glDeleteTextures( 1, &bricks.m_tex );
+            bricks.m_tex = 0;
+        }
+    }
+
+    // --- setup ring of pbos for async readback of top element ----------------
+    if( hp.m_top_readbacks.empty() ) {
+        hp.m_top_readbacks.resize( HPMC_TOP_READBACK_RING_SIZE );
+        for( size_t i=0; i<hp.m_top_readbacks.size(); i++ ) {
+            if( stateless ) {
+                glCreateBuffers( 1, &hp.m_top_readbacks[i].m_pbo );
+            }
+            else {
+                glGenBuffers( 1, &hp.m_top_readbacks[i].m_pbo );
+            }
+            hp.m_top_readbacks[i].m_fence = 0;
+        }
+    }
+    const GLsizeiptr top_bytes = sizeof(GLuint)*4*hp.m_top_size[0]*hp.m_top_size[1];
+    for( size_t i=0; i<hp.m_top_readbacks.size(); i++ ) {
+        HPMCHistoPyramid::HistoPyramid::TopReadback& rb = hp.m_top_readbacks[i];
+        if( rb.m_fence != 0 ) {
+            glDeleteSync( rb.m_fence );
+            rb.m_fence = 0;
+        }
+        rb.m_pending = false;
+        if( stateless ) {
+            glNamedBufferData( rb.m_pbo, top_bytes, NULL, GL_DYNAMIC_READ );
+        }
+        else {
+            glBindBuffer( GL_PIXEL_PACK_BUFFER, rb.m_pbo );
+            glBufferData( GL_PIXEL_PACK_BUFFER,
+                          top_bytes,
+                          NULL,
+                          GL_DYNAMIC_READ );
+        }
+    }
+    if( !stateless ) {
+        glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+    }
+    hp.m_top_latest = 0;
+    hp.m_top_count_arrived = -1;
+
+    // --- setup draw indirect buffer written by the compute passes ------------
+    // Starts out drawing nothing, as extraction may precede the first build
+    // of a front HistoPyramid.
+    const GLuint no_draw[4] = { 0, 0, 0, 0 };
+    if( stateless ) {
+        if( hp.m_indirect_buffer == 0 ) {
+            glCreateBuffers( 1, &hp.m_indirect_buffer );
+        }
+        glNamedBufferData( hp.m_indirect_buffer, sizeof(GLuint)*4, no_draw, GL_DYNAMIC_COPY );
+    }
+    else if( target >= HPMC_TARGET_GL43_GLSL430 ) {
+        if( h->m_histopyramid.m_indirect_buffer == 0 ) {
+            glGenBuffers( 1, &h->m_histopyramid.m_indirect_buffer );
+        }
+        glBindBuffer( GL_DRAW_INDIRECT_BUFFER, h->m_histopyramid.m_indirect_buffer );
+        glBufferData( GL_DRAW_INDIRECT_BUFFER,
+                      sizeof(GLuint)*4,
+                      no_draw,
+                      GL_DYNAMIC_COPY );
+        glBindBuffer( GL_DRAW_INDIRECT_BUFFER, 0 );
+    }
 
     // --- if we have created errors, we fail ----------------------------------
     if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
@@ -51,7 +51,7 @@ HPMCcreateTraversalHandle( struct HPMCHistoPyramid* h )
     }
 
     // --- if errors on state, we fail -----------------------------------------
-    if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+    if( !HPMCcheckGLUnlessStateless( h->m_constants, __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
         cerr << "HPMC error: createTraversalHandle called with GL errors." << endl;
 #endif
@@ -59,20 +59,23 @@ HPMCcreateTraversalHandle( struct HPMCHistoPyramid* h )
     }
 
     // --- store state ---------------------------------------------------------
-    glPushClientAttrib( GL_CLIENT_VERTEX_ARRAY_BIT );
-    glPushAttrib( GL_VIEWPORT_BIT | GL_TEXTURE_BIT );
-    GLuint old_pbo;
-    GLuint old_prog;
-    GLuint old_fbo;
-    glGetIntegerv( GL_PIXEL_PACK_BUFFER_BINDING,
-                   reinterpret_cast<GLint*>(&old_pbo) );
-    glGetIntegerv( GL_CURRENT_PROGRAM,
-                   reinterpret_cast<GLint*>(&old_prog) );
-    if( h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
-        glGetIntegerv( GL_FRAMEBUFFER_BINDING_EXT, reinterpret_cast<GLint*>(&old_fbo) );
-    }
-    else {
-        glGetIntegerv( GL_FRAMEBUFFER_BINDING, reinterpret_cast<GLint*>(&old_fbo) );
+    const bool stateless = h->m_constants->m_stateless;
+    GLuint old_pbo = 0;
+    GLuint old_prog = 0;
+    GLuint old_fbo = 0;
+    HPMCAttribs attribs;
+    if( !stateless ) {
+        HPMCpushAttribs( h->m_constants, attribs, GL_VIEWPORT_BIT | GL_TEXTURE_BIT );
+        glGetIntegerv( GL_PIXEL_PACK_BUFFER_BINDING,
+                       reinterpret_cast<GLint*>(&old_pbo) );
+        glGetIntegerv( GL_CURRENT_PROGRAM,
+                       reinterpret_cast<GLint*>(&old_prog) );
+        if( h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
+            glGetIntegerv( GL_FRAMEBUFFER_BINDING_EXT, reinterpret_cast<GLint*>(&old_fbo) );
+        }
+        else {
+            glGetIntegerv( GL_FRAMEBUFFER_BINDING, reinterpret_cast<GLint*>(&old_fbo) );
+        }
     }
 
     if( !HPMCsetup( h ) ) {
@@ -83,19 +86,23 @@ HPMCcreateTraversalHandle( struct HPMCHistoPyramid* h )
     }
 
     // --- restore state -------------------------------------------------------
-    if( h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
-        glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, old_fbo );
+    if( stateless ) {
+        glUseProgram( 0 );
     }
     else {
-        glBindFramebuffer( GL_FRAMEBUFFER, old_fbo );
+        if( h->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
+            glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, old_fbo );
+        }
+        else {
+            glBindFramebuffer( GL_FRAMEBUFFER, old_fbo );
+        }
+        glUseProgram( old_prog );
+        glBindBuffer( GL_PIXEL_PACK_BUFFER, old_pbo );
+        HPMCpopAttribs( h->m_constants, attribs );
     }
-    glUseProgram( old_prog );
-    glBindBuffer( GL_PIXEL_PACK_BUFFER, old_pbo );
-    glPopAttrib();
-    glPopClientAttrib();
 
     // --- if errors on state, we fail -----------------------------------------
-    if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+    if( !HPMCcheckGLUnlessStateless( h->m_constants, __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
         cerr << "HPMC error: createTraversalHandle produced GL errors." << endl;
 #endif
@@ -105,9 +112,39 @@ HPMCcreateTraversalHandle( struct HPMCHistoPyramid* h )
     struct HPMCTraversalHandle* th = new HPMCTraversalHandle;
     th->m_handle = h;
     th->m_program = 0;
+    th->m_histopyramid_upper_unit = -1;
+    th->m_code_unit = -1;
+    th->m_surface = 0;
+    th->m_cache.m_buffer = 0;
+    th->m_cache.m_capacity = 0;
+    th->m_cache.m_vao = 0;
+    th->m_cache.m_program = 0;
+    th->m_cache.m_stride = 0;
+    th->m_cache.m_feedback = 0;
+    th->m_cache.m_count = 0;
     return th;
 }
 
+// -----------------------------------------------------------------------------
+void
+HPMCsetTraversalHandleSurface( struct HPMCTraversalHandle* th,
+                               GLsizei                     surface )
+{
+    if( th == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: setTraversalHandleSurface called with th == NULL." << endl;
+#endif
+        return;
+    }
+    if( (surface < 0) || (HPMC_MAX_SURFACES <= surface) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: setTraversalHandleSurface called with surface out of range." << endl;
+#endif
+        return;
+    }
+    th->m_surface = surface;
+}
+
 // -----------------------------------------------------------------------------
 void
 HPMCdestroyTraversalHandle( struct HPMCTraversalHandle* th )
@@ -118,12 +155,26 @@ HPMCdestroyTraversalHandle( struct HPMCTraversalHandle* th )
 #endif
         return;
     }
+    if( th->m_cache.m_feedback != 0 ) {
+        glDeleteTransformFeedbacks( 1, &th->m_cache.m_feedback );
+    }
+    if( th->m_cache.m_vao != 0 ) {
+        glDeleteVertexArrays( 1, &th->m_cache.m_vao );
+    }
+    if( th->m_cache.m_buffer != 0 ) {
+        glDeleteBuffers( 1, &th->m_cache.m_buffer );
+    }
     delete th;
 }
 
 // -----------------------------------------------------------------------------
-char*
-HPMCgetTraversalShaderFunctions( struct HPMCTraversalHandle* th )
+/** Sets up the HistoPyramid of a traversal handle and generates its traversal functions.
+  *
+  * \param per_cell  Generate the geometry shader functions of per-cell
+  *                  extraction instead of the vertex shader functions.
+  */
+static char*
+HPMCgetTraversalShaderFunctionsHelper( struct HPMCTraversalHandle* th, bool per_cell )
 {
     if( th == NULL ) {
 #ifdef DEBUG
@@ -133,7 +184,7 @@ HPMCgetTraversalShaderFunctions( struct HPMCTraversalHandle* th )
     }
 
     // --- if errors on state, we fail -----------------------------------------
-    if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+    if( !HPMCcheckGLUnlessStateless( th->m_handle->m_constants, __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
         cerr << "HPMC error: getTraversalShaderFunctions called with GL errors." << endl;
 #endif
@@ -141,20 +192,23 @@ HPMCgetTraversalShaderFunctions( struct HPMCTraversalHandle* th )
     }
 
     // --- store state ---------------------------------------------------------
-    glPushClientAttrib( GL_CLIENT_VERTEX_ARRAY_BIT );
-    glPushAttrib( GL_VIEWPORT_BIT | GL_TEXTURE_BIT );
-    GLuint old_pbo;
-    GLuint old_prog;
-    GLuint old_fbo;
-    glGetIntegerv( GL_PIXEL_PACK_BUFFER_BINDING,
-                   reinterpret_cast<GLint*>(&old_pbo) );
-    glGetIntegerv( GL_CURRENT_PROGRAM,
-                   reinterpret_cast<GLint*>(&old_prog) );
-    if( th->m_handle->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
-        glGetIntegerv( GL_FRAMEBUFFER_BINDING_EXT, reinterpret_cast<GLint*>(&old_fbo) );
-    }
-    else {
-        glGetIntegerv( GL_FRAMEBUFFER_BINDING, reinterpret_cast<GLint*>(&old_fbo) );
+    const bool stateless = th->m_handle->m_constants->m_stateless;
+    GLuint old_pbo = 0;
+    GLuint old_prog = 0;
+    GLuint old_fbo = 0;
+    HPMCAttribs attribs;
+    if( !stateless ) {
+        HPMCpushAttribs( th->m_handle->m_constants, attribs, GL_VIEWPORT_BIT | GL_TEXTURE_BIT );
+        glGetIntegerv( GL_PIXEL_PACK_BUFFER_BINDING,
+                       reinterpret_cast<GLint*>(&old_pbo) );
+        glGetIntegerv( GL_CURRENT_PROGRAM,
+                       reinterpret_cast<GLint*>(&old_prog) );
+        if( th->m_handle->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
+            glGetIntegerv( GL_FRAMEBUFFER_BINDING_EXT, reinterpret_cast<GLint*>(&old_fbo) );
+        }
+        else {
+            glGetIntegerv( GL_FRAMEBUFFER_BINDING, reinterpret_cast<GLint*>(&old_fbo) );
+        }
     }
 
     if( !HPMCsetup( th->m_handle ) ) {
@@ -165,32 +219,74 @@ HPMCgetTraversalShaderFunctions( struct HPMCTraversalHandle* th )
     }
 
     // --- restore state -------------------------------------------------------
-    if( th->m_handle->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
-        glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, old_fbo );
+    if( stateless ) {
+        glUseProgram( 0 );
     }
     else {
-        glBindFramebuffer( GL_FRAMEBUFFER, old_fbo );
+        if( th->m_handle->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
+            glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, old_fbo );
+        }
+        else {
+            glBindFramebuffer( GL_FRAMEBUFFER, old_fbo );
+        }
+        glUseProgram( old_prog );
+        glBindBuffer( GL_PIXEL_PACK_BUFFER, old_pbo );
+        HPMCpopAttribs( th->m_handle->m_constants, attribs );
     }
-    glUseProgram( old_prog );
-    glBindBuffer( GL_PIXEL_PACK_BUFFER, old_pbo );
-    glPopAttrib();
-    glPopClientAttrib();
 
     // --- if errors on state, we fail -----------------------------------------
-    if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+    if( !HPMCcheckGLUnlessStateless( th->m_handle->m_constants, __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
         cerr << "HPMC error: getTraversalShaderFunctions produced GL errors." << endl;
 #endif
         return NULL;
     }
 
+    if( per_cell && !th->m_handle->m_per_cell.m_enabled ) {
+#ifdef DEBUG
+        cerr << "HPMC error: per-cell extraction is not enabled." << endl;
+#endif
+        return NULL;
+    }
+
     // -------------------------------------------------------------------------
     std::string ret = HPMCgenerateDefines( th->m_handle )
                     + HPMCgenerateScalarFieldFetch( th->m_handle )
-                    + HPMCgenerateExtractVertexFunction( th->m_handle );
+                    + ( per_cell ? HPMCgenerateExtractCellFunctions( th->m_handle )
+                                 : HPMCgenerateExtractVertexFunction( th->m_handle ) );
     return strdup( ret.c_str() );
 }
 
+// -----------------------------------------------------------------------------
+char*
+HPMCgetTraversalShaderFunctions( struct HPMCTraversalHandle* th )
+{
+    return HPMCgetTraversalShaderFunctionsHelper( th, false );
+}
+
+// -----------------------------------------------------------------------------
+char*
+HPMCgetCellTraversalShaderFunctions( struct HPMCTraversalHandle* th )
+{
+    return HPMCgetTraversalShaderFunctionsHelper( th, true );
+}
+
+// -----------------------------------------------------------------------------
+/** Checks that an optional extra tex unit is set and not used for anything else. */
+static bool
+HPMCisExtraUnitFree( const struct HPMCTraversalHandle* th,
+                     GLint                             u,
+                     GLuint                            tex_unit_work1,
+                     GLuint                            tex_unit_work2,
+                     GLuint                            tex_unit_work3 )
+{
+    return (u >= 0) &&
+           (u != static_cast<GLint>(tex_unit_work1)) &&
+           (u != static_cast<GLint>(tex_unit_work2)) &&
+           ( (th->m_handle->m_fetch.m_mode == HPMC_VOLUME_LAYOUT_CUSTOM) ||
+             (u != static_cast<GLint>(tex_unit_work3)) );
+}
+
 // -----------------------------------------------------------------------------
 bool
 HPMCsetTraversalHandleProgram( struct  HPMCTraversalHandle *th,
@@ -236,8 +332,10 @@ HPMCsetTraversalHandleProgram( struct  HPMCTraversalHandle *th,
 #endif
         return false;
     }
+    // A program that only extracts unique vertices of an indexed extraction
+    // doesn't need the edge table.
     GLint et_loc = glGetUniformLocation( program, "HPMC_edge_table" );
-    if( et_loc == -1 ) {
+    if( (et_loc == -1) && !th->m_handle->m_indexed.m_enabled ) {
 #ifdef DEBUG
         cerr << "HPMC error: cannot find edge table sampler uniform." << endl;
 #endif
@@ -251,6 +349,47 @@ HPMCsetTraversalHandleProgram( struct  HPMCTraversalHandle *th,
         return false;
     }
 
+    // --- mixed precision checks ----------------------------------------------
+    GLint hpu_loc = -1;
+    if( th->m_handle->m_histopyramid.m_split_level > 0 ) {
+        if( !HPMCisExtraUnitFree( th, th->m_histopyramid_upper_unit,
+                                  tex_unit_work1, tex_unit_work2, tex_unit_work3 ) )
+        {
+#ifdef DEBUG
+            cerr << "HPMC error: mixed precision needs a unique upper levels tex unit." << endl;
+#endif
+            return false;
+        }
+        hpu_loc = glGetUniformLocation( program, "HPMC_histopyramid_upper" );
+        if( hpu_loc == -1 ) {
+#ifdef DEBUG
+            cerr << "HPMC error: cannot find histopyramid upper levels sampler uniform." << endl;
+#endif
+            return false;
+        }
+    }
+
+    // --- separate MC codes checks --------------------------------------------
+    GLint code_loc = -1;
+    if( HPMCseparateCodes( th->m_handle ) ) {
+        if( !HPMCisExtraUnitFree( th, th->m_code_unit,
+                                  tex_unit_work1, tex_unit_work2, tex_unit_work3 ) ||
+            (th->m_code_unit == th->m_histopyramid_upper_unit) )
+        {
+#ifdef DEBUG
+            cerr << "HPMC error: separate MC codes need a unique code tex unit." << endl;
+#endif
+            return false;
+        }
+        code_loc = glGetUniformLocation( program, "HPMC_codes" );
+        if( code_loc == -1 ) {
+#ifdef DEBUG
+            cerr << "HPMC error: cannot find MC codes sampler uniform." << endl;
+#endif
+            return false;
+        }
+    }
+
     // --- non-custom fetch checks ---------------------------------------------
     GLint sf_loc;
     if( th->m_handle->m_fetch.m_mode != HPMC_VOLUME_LAYOUT_CUSTOM ) {
@@ -274,14 +413,29 @@ HPMCsetTraversalHandleProgram( struct  HPMCTraversalHandle *th,
             return false;
         }
     }
+    else if( th->m_handle->m_indexed.m_enabled &&
+             ( (tex_unit_work1 == tex_unit_work3) ||
+               (tex_unit_work2 == tex_unit_work3) ) )
+    {
+        // Index extraction binds the edge HistoPyramid on unit 3.
+#ifdef DEBUG
+        cerr << "HPMC error: indexed extraction needs a unique tex unit 3." << endl;
+#endif
+        return false;
+    }
 
     // --- get locations of uniform variables ----------------------------------
-    th->m_offset_loc = glGetUniformLocation( program, "HPMC_key_offset" );
-    if( th->m_offset_loc == -1 ) {
+    if( th->m_handle->m_constants->m_target < HPMC_TARGET_GL30_GLSL130 ) {
+        th->m_offset_loc = glGetUniformLocation( program, "HPMC_key_offset" );
+        if( th->m_offset_loc == -1 ) {
 #ifdef DEBUG
-        cerr << "HPMC error: cannot find key offset uniform variable." << endl;
+            cerr << "HPMC error: cannot find key offset uniform variable." << endl;
 #endif
-        return false;
+            return false;
+        }
+    }
+    else {
+        th->m_offset_loc = -1;
     }
     if( th->m_handle->m_field.m_binary ) {
         th->m_threshold_loc = -1;
@@ -295,27 +449,64 @@ HPMCsetTraversalHandleProgram( struct  HPMCTraversalHandle *th,
             return false;
         }
     }
+    th->m_grid_cells_loc = glGetUniformLocation( program, "HPMC_grid_cells" );
+    th->m_grid_extent_loc = glGetUniformLocation( program, "HPMC_grid_extent" );
+    if( th->m_grid_cells_loc == -1 || th->m_grid_extent_loc == -1 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: cannot find grid uniform variables." << endl;
+#endif
+        return false;
+    }
 
     // --- store info in handle ------------------------------------------------
     th->m_program = program;
+    // the program may be relinked with other varyings, so the layout of the
+    // cache is taken from it again.
+    th->m_cache.m_program = 0;
     th->m_histopyramid_unit = tex_unit_work1;
     th->m_edge_decode_unit = tex_unit_work2;
     th->m_scalarfield_unit = tex_unit_work3;
 
-    // --- store state ---------------------------------------------------------
-    GLint prog;
-    glGetIntegerv( GL_CURRENT_PROGRAM, &prog );
-
-    // --- Configure program ---------------------------------------------------
-    glUseProgram( th->m_program );
-    glUniform1i( et_loc, th->m_edge_decode_unit );
-    glUniform1i( hp_loc, th->m_histopyramid_unit );
-    if( th->m_handle->m_fetch.m_mode != HPMC_VOLUME_LAYOUT_CUSTOM ) {
-        glUniform1i( sf_loc, th->m_scalarfield_unit );
+    if( th->m_handle->m_constants->m_stateless ) {
+        // --- Configure program without binding it ----------------------------
+        if( et_loc != -1 ) {
+            glProgramUniform1i( th->m_program, et_loc, th->m_edge_decode_unit );
+        }
+        glProgramUniform1i( th->m_program, hp_loc, th->m_histopyramid_unit );
+        if( hpu_loc != -1 ) {
+            glProgramUniform1i( th->m_program, hpu_loc, th->m_histopyramid_upper_unit );
+        }
+        if( code_loc != -1 ) {
+            glProgramUniform1i( th->m_program, code_loc, th->m_code_unit );
+        }
+        if( th->m_handle->m_fetch.m_mode != HPMC_VOLUME_LAYOUT_CUSTOM ) {
+            glProgramUniform1i( th->m_program, sf_loc, th->m_scalarfield_unit );
+        }
     }
+    else {
+        // --- store state -----------------------------------------------------
+        GLint prog;
+        glGetIntegerv( GL_CURRENT_PROGRAM, &prog );
 
-    // --- restore state -------------------------------------------------------
-    glUseProgram( prog );
+        // --- Configure program -----------------------------------------------
+        glUseProgram( th->m_program );
+        if( et_loc != -1 ) {
+            glUniform1i( et_loc, th->m_edge_decode_unit );
+        }
+        glUniform1i( hp_loc, th->m_histopyramid_unit );
+        if( hpu_loc != -1 ) {
+            glUniform1i( hpu_loc, th->m_histopyramid_upper_unit );
+        }
+        if( code_loc != -1 ) {
+            glUniform1i( code_loc, th->m_code_unit );
+        }
+        if( th->m_handle->m_fetch.m_mode != HPMC_VOLUME_LAYOUT_CUSTOM ) {
+            glUniform1i( sf_loc, th->m_scalarfield_unit );
+        }
+
+        // --- restore state ---------------------------------------------------
+        glUseProgram( prog );
+    }
 
     if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
@@ -328,20 +519,65 @@ HPMCsetTraversalHandleProgram( struct  HPMCTraversalHandle *th,
 
 
 
+// -----------------------------------------------------------------------------
+void
+HPMCsetTraversalHandleUpperLevelsUnit( struct HPMCTraversalHandle* th,
+                                       GLuint                      tex_unit_work4 )
+{
+    if( th == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: setTraversalHandleUpperLevelsUnit called with th == NULL." << endl;
+#endif
+        return;
+    }
+    th->m_histopyramid_upper_unit = tex_unit_work4;
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetTraversalHandleCodeUnit( struct HPMCTraversalHandle* th,
+                                GLuint                      tex_unit_work5 )
+{
+    if( th == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: setTraversalHandleCodeUnit called with th == NULL." << endl;
+#endif
+        return;
+    }
+    th->m_code_unit = tex_unit_work5;
+}
+
+// -----------------------------------------------------------------------------
+/** What a traversal pass emits. */
+enum HPMCExtraction {
+    /** Three vertices per triangle, using the handle's program. */
+    HPMC_EXTRACT_TRIANGLES,
+    /** One vertex per unique vertex of an indexed extraction, using the
+      * handle's program traversing the edge HistoPyramid. */
+    HPMC_EXTRACT_UNIQUE_VERTICES,
+    /** Three vertex indices per triangle, using HPMC's index program. */
+    HPMC_EXTRACT_INDICES,
+    /** One point per active cell, using the handle's program with a geometry
+      * shader emitting the triangles of the cell. */
+    HPMC_EXTRACT_CELLS
+};
+
 // -----------------------------------------------------------------------------
 static bool
 HPMCextractVerticesHelper( struct HPMCTraversalHandle*  th,
-                           int                          transform_feedback_mode )
+                           int                          transform_feedback_mode,
+                           HPMCExtraction               extraction )
 {
-    if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+    if( th == NULL ) {
 #ifdef DEBUG
-        cerr << "HPMC error: extractVertices called with GL errors." << endl;
+        cerr << "HPMC error: passed NULL traversal handle." << endl;
 #endif
         return false;
     }
-    if( th == NULL ) {
+    const struct HPMCConstants* s = th->m_handle->m_constants;
+    if( !HPMCcheckGLUnlessStateless( s, __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
-        cerr << "HPMC error: passed NULL traversal handle." << endl;
+        cerr << "HPMC error: extractVertices called with GL errors." << endl;
 #endif
         return false;
     }
@@ -352,79 +588,198 @@ HPMCextractVerticesHelper( struct HPMCTraversalHandle*  th,
         return false;
     }
 
+    // The surface has its own HistoPyramid, configured like the handle's, and
+    // is extracted from its front HistoPyramid if double buffered.
+    struct HPMCHistoPyramid* hs = HPMCsurface( th->m_handle, th->m_surface );
+    if( hs != NULL ) {
+        hs = HPMCfrontBuffer( hs );
+    }
+    if( hs == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: traversal handle surface " << th->m_surface << " not built." << endl;
+#endif
+        return false;
+    }
+
+    // Unique vertices are enumerated by the edge HistoPyramid, indices by the
+    // surface's HistoPyramid, with the edge HistoPyramid giving the rank of
+    // each intersected edge. Cells are enumerated by the cell HistoPyramid,
+    // and the geometry shader of the program emits their triangles.
+    struct HPMCHistoPyramid* he = NULL;
+    GLuint program = th->m_program;
+    GLenum primitive = GL_TRIANGLES;
+    GLenum feedback_primitive = GL_TRIANGLES;
+    if( extraction == HPMC_EXTRACT_CELLS ) {
+        he = th->m_handle->m_per_cell.m_cells;
+        if( he == NULL ) {
+#ifdef DEBUG
+            cerr << "HPMC error: per-cell extraction is not enabled." << endl;
+#endif
+            return false;
+        }
+        primitive = GL_POINTS;
+    }
+    else if( extraction != HPMC_EXTRACT_TRIANGLES ) {
+        he = th->m_handle->m_indexed.m_edges;
+        if( he == NULL ) {
+#ifdef DEBUG
+            cerr << "HPMC error: indexed extraction is not enabled." << endl;
+#endif
+            return false;
+        }
+        if( extraction == HPMC_EXTRACT_INDICES ) {
+            program = th->m_handle->m_indexed.m_index_program;
+        }
+        primitive = GL_POINTS;
+        feedback_primitive = GL_POINTS;
+    }
+    if( program == 0 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: indexed extraction has zero program." << endl;
+#endif
+        return false;
+    }
+    struct HPMCHistoPyramid* traversed =
+            ( (extraction == HPMC_EXTRACT_UNIQUE_VERTICES) ||
+              (extraction == HPMC_EXTRACT_CELLS) ) ? he : hs;
+
+    // With compute shader construction, the vertex count is written to a draw
+    // indirect buffer by the GPU, and we draw without reading it back.
+    bool indirect = th->m_handle->m_hp_build.m_compute.m_enabled;
+
     // --- store current state -------------------------------------------------
-    GLint curr_prog;
-    glGetIntegerv( GL_CURRENT_PROGRAM, &curr_prog );
-    glPushClientAttrib( GL_CLIENT_VERTEX_ARRAY_BIT );
-    glPushAttrib( GL_TEXTURE_BIT );
+    GLint curr_prog = 0;
+    GLint curr_indirect = 0;
+    GLboolean curr_discard = GL_FALSE;
+    GLint curr_vao = 0;
+    HPMCAttribs attribs;
+    if( !s->m_stateless ) {
+        glGetIntegerv( GL_CURRENT_PROGRAM, &curr_prog );
+        if( !s->m_core && (s->m_target >= HPMC_TARGET_GL30_GLSL130) ) {
+            glGetIntegerv( GL_VERTEX_ARRAY_BINDING, &curr_vao );
+        }
+        if( indirect ) {
+            glGetIntegerv( GL_DRAW_INDIRECT_BUFFER_BINDING, &curr_indirect );
+        }
+        if( extraction == HPMC_EXTRACT_INDICES ) {
+            curr_discard = glIsEnabled( GL_RASTERIZER_DISCARD );
+        }
+        HPMCpushAttribs( s, attribs, GL_TEXTURE_BIT );
+    }
 
     // --- retrieve number of vertices -----------------------------------------
-    if( !th->m_handle->m_histopyramid.m_top_count_updated ) {
-        GLfloat mem[4];
-        glBindBuffer( GL_PIXEL_PACK_BUFFER,
-                      th->m_handle->m_histopyramid.m_top_pbo );
-        glGetBufferSubData( GL_PIXEL_PACK_BUFFER,
-                            0, sizeof(GLfloat)*4,
-                            &mem[0] );
-        glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
-
-        th->m_handle->m_histopyramid.m_top_count =
-                static_cast<int>( floorf(mem[0]) +
-                                  floorf(mem[1]) +
-                                  floorf(mem[2]) +
-                                  floorf(mem[3]) );
-        th->m_handle->m_histopyramid.m_top_count_updated = true;
+    if( !indirect && !traversed->m_histopyramid.m_top_count_updated ) {
+        traversed->m_histopyramid.m_top_count =
+                HPMCreadTopCount( traversed, traversed->m_histopyramid.m_top_latest );
+        traversed->m_histopyramid.m_top_count_updated = true;
     }
 
     // --- setup state ---------------------------------------------------------
-    glUseProgram( th->m_program );
+    glUseProgram( program );
 
-    glActiveTextureARB( GL_TEXTURE0_ARB + th->m_histopyramid_unit );
-    glBindTexture( GL_TEXTURE_2D, th->m_handle->m_histopyramid.m_tex );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0 );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL,
-                                    th->m_handle->m_histopyramid.m_size_l2 );
+    if( extraction == HPMC_EXTRACT_INDICES ) {
+        // The index program is HPMC's own, so its samplers are assigned here.
+        const HPMCHistoPyramid::Indexed& indexed = th->m_handle->m_indexed;
+        glUniform1i( indexed.m_loc_histopyramid, th->m_histopyramid_unit );
+        glUniform1i( indexed.m_loc_edge_table, th->m_edge_decode_unit );
+        glUniform1i( indexed.m_loc_edges, th->m_scalarfield_unit );
 
-    glActiveTextureARB( GL_TEXTURE0_ARB + th->m_scalarfield_unit );
-    glBindTexture( GL_TEXTURE_3D, th->m_handle->m_fetch.m_tex );
+        HPMCbindTextureUnit( s, th->m_histopyramid_unit,
+                             GL_TEXTURE_2D, hs->m_histopyramid.m_tex );
+        HPMCsetHistoPyramidLevels( hs );
+        HPMCbindTextureUnit( s, th->m_edge_decode_unit,
+                             GL_TEXTURE_2D, s->m_edge_decode_tex );
+        HPMCbindTextureUnit( s, th->m_scalarfield_unit,
+                             GL_TEXTURE_2D, he->m_histopyramid.m_tex );
+        HPMCsetHistoPyramidLevels( he );
 
-    if( th->m_handle->m_field.m_binary ) {
-        glActiveTextureARB( GL_TEXTURE0_ARB + th->m_edge_decode_unit );
-        glBindTexture( GL_TEXTURE_2D, th->m_handle->m_constants->m_edge_decode_normal_tex );
+        const HPMCHistoPyramid::Field& f = th->m_handle->m_field;
+        glUniform3f( indexed.m_loc_grid_cells, f.m_cells[0], f.m_cells[1], f.m_cells[2] );
     }
     else {
-        glUniform1f( th->m_threshold_loc, th->m_handle->m_threshold );
-        glActiveTextureARB( GL_TEXTURE0_ARB + th->m_edge_decode_unit );
-        glBindTexture( GL_TEXTURE_2D, th->m_handle->m_constants->m_edge_decode_tex );
+        if( HPMCseparateCodes( th->m_handle ) ) {
+            HPMCbindTextureUnit( s, th->m_code_unit,
+                                 GL_TEXTURE_2D, hs->m_histopyramid.m_code_tex );
+        }
+        if( hs->m_histopyramid.m_split_level > 0 ) {
+            HPMCbindTextureUnit( s, th->m_histopyramid_upper_unit,
+                                 GL_TEXTURE_2D, hs->m_histopyramid.m_tex_upper );
+        }
+        HPMCbindTextureUnit( s, th->m_histopyramid_unit,
+                             GL_TEXTURE_2D, traversed->m_histopyramid.m_tex );
+        HPMCsetHistoPyramidLevels( traversed );
+
+        // A custom fetch samples the application's textures, so the unit is
+        // left alone.
+        if( th->m_handle->m_fetch.m_mode == HPMC_VOLUME_LAYOUT_TEXTURE_3D ) {
+            HPMCbindTextureUnit( s, th->m_scalarfield_unit,
+                                 GL_TEXTURE_3D, th->m_handle->m_fetch.m_tex );
+        }
+
+        const HPMCHistoPyramid::Field& f = th->m_handle->m_field;
+        glUniform3f( th->m_grid_cells_loc, f.m_cells[0], f.m_cells[1], f.m_cells[2] );
+        glUniform3f( th->m_grid_extent_loc, f.m_extent[0], f.m_extent[1], f.m_extent[2] );
+
+        if( th->m_handle->m_field.m_binary ) {
+            HPMCbindTextureUnit( s, th->m_edge_decode_unit,
+                                 GL_TEXTURE_2D, s->m_edge_decode_normal_tex );
+        }
+        else {
+            glUniform1f( th->m_threshold_loc, hs->m_threshold );
+            HPMCbindTextureUnit( s, th->m_edge_decode_unit,
+                                 GL_TEXTURE_2D, s->m_edge_decode_tex );
+        }
     }
 
-    glBindBuffer( GL_ARRAY_BUFFER, th->m_handle->m_constants->m_enumerate_vbo );
-    glVertexPointer( 3, GL_FLOAT, 0, NULL );
-    glEnableClientState( GL_VERTEX_ARRAY );
+    if( s->m_target < HPMC_TARGET_GL30_GLSL130 ) {
+        glBindBuffer( GL_ARRAY_BUFFER, th->m_handle->m_constants->m_enumerate_vbo );
+        glVertexPointer( 3, GL_FLOAT, 0, NULL );
+        glEnableClientState( GL_VERTEX_ARRAY );
+    }
+    else {
+        // The traversal keys off gl_VertexID, so the whole key range is spawned
+        // by a single attribute-less draw, without touching the application's
+        // arrays.
+        glBindVertexArray( s->m_empty_vao );
+    }
 
 
     // --- render triangles ----------------------------------------------------
+    // Indices are only of interest as transform feedback output, and the index
+    // program has no position to rasterize.
+    if( extraction == HPMC_EXTRACT_INDICES ) {
+        glEnable( GL_RASTERIZER_DISCARD );
+    }
     if( transform_feedback_mode == 1 ) {
 #ifdef GL_VERSION_3_0
-        glBeginTransformFeedback( GL_TRIANGLES );
+        glBeginTransformFeedback( feedback_primitive );
 #endif
     }
     else if( transform_feedback_mode == 2 ) {
 #ifdef GL_NV_transform_feedback
-        glBeginTransformFeedbackNV( GL_TRIANGLES );
+        glBeginTransformFeedbackNV( feedback_primitive );
 #endif
     }
     else if( transform_feedback_mode == 3 ) {
 #ifdef GL_EXT_transform_feedback
-        glBeginTransformFeedbackEXT( GL_TRIANGLES );
+        glBeginTransformFeedbackEXT( feedback_primitive );
 #endif
     }
 
-    GLsizei N = th->m_handle->m_histopyramid.m_top_count;
-    for(GLsizei i=0; i<N; i+= th->m_handle->m_constants->m_enumerate_vbo_n) {
-        glUniform1f( th->m_offset_loc, static_cast<GLfloat>( i ) );
-        glDrawArrays( GL_TRIANGLES, 0, min( N-i,
-                                            th->m_handle->m_constants->m_enumerate_vbo_n ) );
+    GLsizei N = traversed->m_histopyramid.m_top_count;
+    if( indirect ) {
+        glBindBuffer( GL_DRAW_INDIRECT_BUFFER, traversed->m_histopyramid.m_indirect_buffer );
+        glDrawArraysIndirect( primitive, NULL );
+    }
+    else if( th->m_handle->m_constants->m_target >= HPMC_TARGET_GL30_GLSL130 ) {
+        glDrawArrays( primitive, 0, N );
+    }
+    else {
+        for(GLsizei i=0; i<N; i+= th->m_handle->m_constants->m_enumerate_vbo_n) {
+            glUniform1f( th->m_offset_loc, static_cast<GLfloat>( i ) );
+            glDrawArrays( GL_TRIANGLES, 0, min( N-i,
+                                                th->m_handle->m_constants->m_enumerate_vbo_n ) );
+        }
     }
     if( transform_feedback_mode == 1 ) {
 #ifdef GL_VERSION_3_0
@@ -443,11 +798,26 @@ HPMCextractVerticesHelper( struct HPMCTraversalHandle*  th,
     }
 
     // --- restore state -------------------------------------------------------
-    glPopAttrib();
-    glPopClientAttrib();
+    // Stateless mode leaves rasterizer discard disabled, as documented.
+    if( (extraction == HPMC_EXTRACT_INDICES) && !curr_discard ) {
+        glDisable( GL_RASTERIZER_DISCARD );
+    }
+    if( s->m_stateless ) {
+        // leave the documented bindings in a defined state.
+        glBindVertexArray( 0 );
+    }
+    else {
+        HPMCpopAttribs( s, attribs );
+        if( !s->m_core && (s->m_target >= HPMC_TARGET_GL30_GLSL130) ) {
+            glBindVertexArray( curr_vao );
+        }
+    }
+    if( indirect ) {
+        glBindBuffer( GL_DRAW_INDIRECT_BUFFER, curr_indirect );
+    }
     glUseProgram( curr_prog );
 
-    if( !HPMCcheckGL( __FILE__, __LINE__ ) ) {
+    if( !HPMCcheckGLUnlessStateless( s, __FILE__, __LINE__ ) ) {
 #ifdef DEBUG
         cerr << "HPMC error: extractVertices produced OpenGL errors." << endl;
 #endif
@@ -460,7 +830,7 @@ HPMCextractVerticesHelper( struct HPMCTraversalHandle*  th,
 bool
 HPMCextractVertices( struct HPMCTraversalHandle* th )
 {
-    return HPMCextractVerticesHelper( th, 0 );
+    return HPMCextractVerticesHelper( th, 0, HPMC_EXTRACT_TRIANGLES );
 }
 
 // -----------------------------------------------------------------------------
@@ -468,7 +838,7 @@ bool
 HPMCextractVerticesTransformFeedback( struct HPMCTraversalHandle* th )
 {
 #ifdef GL_VERSION_3_0
-    return HPMCextractVerticesHelper( th, 1 );
+    return HPMCextractVerticesHelper( th, 1, HPMC_EXTRACT_TRIANGLES );
 #else
     cerr << "HPMC error: compiled with old GLEW not defining OpenGL 3.0 interface." << endl;
     return false;
@@ -480,7 +850,7 @@ bool
 HPMCextractVerticesTransformFeedbackNV( struct HPMCTraversalHandle* th )
 {
 #ifdef GL_NV_transform_feedback
-    return HPMCextractVerticesHelper( th, 2 );
+    return HPMCextractVerticesHelper( th, 2, HPMC_EXTRACT_TRIANGLES );
 #else
     cerr << "HPMC error: compiled with old GLEW not defining GL_NV_transform_feedback." << endl;
     return false;
@@ -492,9 +862,422 @@ bool
 HPMCextractVerticesTransformFeedbackEXT( struct HPMCTraversalHandle* th )
 {
 #ifdef GL_EXT_transform_feedback
-    return HPMCextractVerticesHelper( th, 3 );
+    return HPMCextractVerticesHelper( th, 3, HPMC_EXTRACT_TRIANGLES );
 #else
     cerr << "HPMC error: compiled with old GLEW not defining GL_EXT_transform_feedback." << endl;
     return false;
 #endif
 }
+
+// -----------------------------------------------------------------------------
+bool
+HPMCextractUniqueVerticesTransformFeedback( struct HPMCTraversalHandle* th )
+{
+#ifdef GL_VERSION_3_0
+    return HPMCextractVerticesHelper( th, 1, HPMC_EXTRACT_UNIQUE_VERTICES );
+#else
+    cerr << "HPMC error: compiled with old GLEW not defining OpenGL 3.0 interface." << endl;
+    return false;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCextractIndicesTransformFeedback( struct HPMCTraversalHandle* th )
+{
+#ifdef GL_VERSION_3_0
+    return HPMCextractVerticesHelper( th, 1, HPMC_EXTRACT_INDICES );
+#else
+    cerr << "HPMC error: compiled with old GLEW not defining OpenGL 3.0 interface." << endl;
+    return false;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCextractCells( struct HPMCTraversalHandle* th )
+{
+    return HPMCextractVerticesHelper( th, 0, HPMC_EXTRACT_CELLS );
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCextractCellsTransformFeedback( struct HPMCTraversalHandle* th )
+{
+#ifdef GL_VERSION_3_0
+    return HPMCextractVerticesHelper( th, 1, HPMC_EXTRACT_CELLS );
+#else
+    cerr << "HPMC error: compiled with old GLEW not defining OpenGL 3.0 interface." << endl;
+    return false;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+/** Splits the type of a transform feedback varying into components and base type.
+  *
+  * \return  False if the type cannot be sourced as a single vertex attribute.
+  */
+static bool
+HPMCvaryingFormat( GLenum type, GLint& components, GLenum& base )
+{
+    switch( type ) {
+    case GL_FLOAT:             components = 1; base = GL_FLOAT; break;
+    case GL_FLOAT_VEC2:        components = 2; base = GL_FLOAT; break;
+    case GL_FLOAT_VEC3:        components = 3; base = GL_FLOAT; break;
+    case GL_FLOAT_VEC4:        components = 4; base = GL_FLOAT; break;
+    case GL_INT:               components = 1; base = GL_INT; break;
+    case GL_INT_VEC2:          components = 2; base = GL_INT; break;
+    case GL_INT_VEC3:          components = 3; base = GL_INT; break;
+    case GL_INT_VEC4:          components = 4; base = GL_INT; break;
+    case GL_UNSIGNED_INT:      components = 1; base = GL_UNSIGNED_INT; break;
+    case GL_UNSIGNED_INT_VEC2: components = 2; base = GL_UNSIGNED_INT; break;
+    case GL_UNSIGNED_INT_VEC3: components = 3; base = GL_UNSIGNED_INT; break;
+    case GL_UNSIGNED_INT_VEC4: components = 4; base = GL_UNSIGNED_INT; break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+/** Sets up the vertex array of the cache from the varyings of the handle's program.
+  *
+  * Attribute i sources varying i, and array varyings use one attribute per
+  * element.
+  */
+static bool
+HPMCsetupCacheLayout( struct HPMCTraversalHandle* th )
+{
+    const struct HPMCConstants* s = th->m_handle->m_constants;
+    HPMCTraversalHandle::Cache& cache = th->m_cache;
+
+    GLint mode = 0;
+    GLint varyings = 0;
+    glGetProgramiv( th->m_program, GL_TRANSFORM_FEEDBACK_BUFFER_MODE, &mode );
+    glGetProgramiv( th->m_program, GL_TRANSFORM_FEEDBACK_VARYINGS, &varyings );
+    if( (mode != GL_INTERLEAVED_ATTRIBS) || (varyings < 1) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: extractToBuffer requires interleaved transform feedback varyings." << endl;
+#endif
+        return false;
+    }
+
+    std::vector<GLint> components;
+    std::vector<GLenum> bases;
+    for( GLint i=0; i<varyings; i++ ) {
+        GLchar name[64];
+        GLsizei size = 0;
+        GLenum type = GL_NONE;
+        glGetTransformFeedbackVarying( th->m_program, i, sizeof(name), NULL, &size, &type, name );
+        GLint c;
+        GLenum b;
+        if( !HPMCvaryingFormat( type, c, b ) ) {
+#ifdef DEBUG
+            cerr << "HPMC error: extractToBuffer cannot source varying " << name
+                 << " as a vertex attribute." << endl;
+#endif
+            return false;
+        }
+        for( GLsizei j=0; j<size; j++ ) {
+            components.push_back( c );
+            bases.push_back( b );
+        }
+    }
+    // all supported types have four byte components.
+    GLsizei stride = 0;
+    for( size_t i=0; i<components.size(); i++ ) {
+        stride += 4*components[i];
+    }
+
+    // --- rebuild vertex array ------------------------------------------------
+    if( cache.m_vao != 0 ) {
+        glDeleteVertexArrays( 1, &cache.m_vao );
+        cache.m_vao = 0;
+    }
+    if( s->m_stateless ) {
+        glCreateVertexArrays( 1, &cache.m_vao );
+        glVertexArrayVertexBuffer( cache.m_vao, 0, cache.m_buffer, 0, stride );
+        GLuint offset = 0;
+        for( size_t i=0; i<components.size(); i++ ) {
+            glEnableVertexArrayAttrib( cache.m_vao, i );
+            if( bases[i] == GL_FLOAT ) {
+                glVertexArrayAttribFormat( cache.m_vao, i, components[i], bases[i], GL_FALSE, offset );
+            }
+            else {
+                glVertexArrayAttribIFormat( cache.m_vao, i, components[i], bases[i], offset );
+            }
+            glVertexArrayAttribBinding( cache.m_vao, i, 0 );
+            offset += 4*components[i];
+        }
+    }
+    else {
+        // --- store state -----------------------------------------------------
+        GLint curr_vao = 0;
+        GLint curr_array_buffer = 0;
+        glGetIntegerv( GL_VERTEX_ARRAY_BINDING, &curr_vao );
+        glGetIntegerv( GL_ARRAY_BUFFER_BINDING, &curr_array_buffer );
+
+        glGenVertexArrays( 1, &cache.m_vao );
+        glBindVertexArray( cache.m_vao );
+        glBindBuffer( GL_ARRAY_BUFFER, cache.m_buffer );
+        GLsizeiptr offset = 0;
+        for( size_t i=0; i<components.size(); i++ ) {
+            glEnableVertexAttribArray( i );
+            if( bases[i] == GL_FLOAT ) {
+                glVertexAttribPointer( i, components[i], bases[i], GL_FALSE, stride,
+                                       reinterpret_cast<GLvoid*>( offset ) );
+            }
+            else {
+                glVertexAttribIPointer( i, components[i], bases[i], stride,
+                                        reinterpret_cast<GLvoid*>( offset ) );
+            }
+            offset += 4*components[i];
+        }
+
+        // --- restore state ---------------------------------------------------
+        glBindBuffer( GL_ARRAY_BUFFER, curr_array_buffer );
+        glBindVertexArray( curr_vao );
+    }
+    cache.m_program = th->m_program;
+    cache.m_stride = stride;
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCextractToBuffer( struct HPMCTraversalHandle* th )
+{
+#ifdef GL_VERSION_3_0
+    if( th == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: extractToBuffer called with th == NULL." << endl;
+#endif
+        return false;
+    }
+    const struct HPMCConstants* s = th->m_handle->m_constants;
+    HPMCTraversalHandle::Cache& cache = th->m_cache;
+    if( s->m_target < HPMC_TARGET_GL30_GLSL130 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: extractToBuffer requires an OpenGL 3.0 target." << endl;
+#endif
+        return false;
+    }
+    if( th->m_program == 0 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: traversal handle has zero program." << endl;
+#endif
+        return false;
+    }
+    if( !HPMCcheckGLUnlessStateless( s, __FILE__, __LINE__ ) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: extractToBuffer called with GL errors." << endl;
+#endif
+        return false;
+    }
+
+    // From OpenGL 4.0, a transform feedback object records the number of
+    // captured vertices, and the cache is drawn without knowing the count.
+    const bool feedback_object = s->m_target >= HPMC_TARGET_GL40_GLSL400;
+
+    // --- store current state -------------------------------------------------
+    GLint curr_feedback = 0;
+    GLint curr_buffer = 0;
+    GLint curr_buffer0 = 0;
+    GLint curr_start0 = 0;
+    GLint curr_size0 = 0;
+    if( !s->m_stateless ) {
+        if( feedback_object ) {
+            glGetIntegerv( GL_TRANSFORM_FEEDBACK_BINDING, &curr_feedback );
+        }
+        else {
+            glGetIntegeri_v( GL_TRANSFORM_FEEDBACK_BUFFER_BINDING, 0, &curr_buffer0 );
+            glGetIntegeri_v( GL_TRANSFORM_FEEDBACK_BUFFER_START, 0, &curr_start0 );
+            glGetIntegeri_v( GL_TRANSFORM_FEEDBACK_BUFFER_SIZE, 0, &curr_size0 );
+        }
+        glGetIntegerv( GL_TRANSFORM_FEEDBACK_BUFFER_BINDING, &curr_buffer );
+    }
+
+    // --- create objects on first use -----------------------------------------
+    if( cache.m_buffer == 0 ) {
+        if( s->m_stateless ) {
+            glCreateBuffers( 1, &cache.m_buffer );
+        }
+        else {
+            glGenBuffers( 1, &cache.m_buffer );
+        }
+    }
+    if( feedback_object && (cache.m_feedback == 0) ) {
+        if( s->m_stateless ) {
+            glCreateTransformFeedbacks( 1, &cache.m_feedback );
+        }
+        else {
+            glGenTransformFeedbacks( 1, &cache.m_feedback );
+        }
+    }
+    bool ok = true;
+    if( cache.m_program != th->m_program ) {
+        ok = HPMCsetupCacheLayout( th );
+    }
+
+    // --- grow buffer ---------------------------------------------------------
+    // The count is read back to size the buffer. The buffer never shrinks, and
+    // grows with headroom to avoid reallocating on every small increase.
+    GLsizei N = 0;
+    if( ok ) {
+        N = static_cast<GLsizei>( HPMCacquireNumberOfVerticesOfSurface( th->m_handle,
+                                                                        th->m_surface ) );
+        GLsizeiptr needed = static_cast<GLsizeiptr>( std::max( N, 3 ) )*cache.m_stride;
+        if( cache.m_capacity < needed ) {
+            cache.m_capacity = needed + needed/4;
+            if( s->m_stateless ) {
+                glNamedBufferData( cache.m_buffer, cache.m_capacity, NULL, GL_DYNAMIC_COPY );
+            }
+            else {
+                glBindBuffer( GL_TRANSFORM_FEEDBACK_BUFFER, cache.m_buffer );
+                glBufferData( GL_TRANSFORM_FEEDBACK_BUFFER, cache.m_capacity, NULL, GL_DYNAMIC_COPY );
+            }
+        }
+    }
+
+    // --- capture -------------------------------------------------------------
+    if( ok ) {
+        if( feedback_object ) {
+            glBindTransformFeedback( GL_TRANSFORM_FEEDBACK, cache.m_feedback );
+        }
+        if( s->m_stateless ) {
+            glTransformFeedbackBufferBase( cache.m_feedback, 0, cache.m_buffer );
+        }
+        else {
+            glBindBufferBase( GL_TRANSFORM_FEEDBACK_BUFFER, 0, cache.m_buffer );
+        }
+        ok = HPMCextractVerticesHelper( th, 1, HPMC_EXTRACT_TRIANGLES );
+        cache.m_count = ok ? N : 0;
+    }
+
+    // --- restore state -------------------------------------------------------
+    if( feedback_object ) {
+        glBindTransformFeedback( GL_TRANSFORM_FEEDBACK, curr_feedback );
+    }
+    if( !s->m_stateless ) {
+        if( !feedback_object ) {
+            if( curr_size0 > 0 ) {
+                glBindBufferRange( GL_TRANSFORM_FEEDBACK_BUFFER, 0, curr_buffer0,
+                                   curr_start0, curr_size0 );
+            }
+            else {
+                glBindBufferBase( GL_TRANSFORM_FEEDBACK_BUFFER, 0, curr_buffer0 );
+            }
+        }
+        glBindBuffer( GL_TRANSFORM_FEEDBACK_BUFFER, curr_buffer );
+    }
+
+    if( !HPMCcheckGLUnlessStateless( s, __FILE__, __LINE__ ) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: extractToBuffer produced GL errors." << endl;
+#endif
+        return false;
+    }
+    return ok;
+#else
+    cerr << "HPMC error: compiled with old GLEW not defining OpenGL 3.0 interface." << endl;
+    return false;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCdrawCachedSurface( struct HPMCTraversalHandle* th )
+{
+    if( th == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: drawCachedSurface called with th == NULL." << endl;
+#endif
+        return false;
+    }
+    const struct HPMCConstants* s = th->m_handle->m_constants;
+    const HPMCTraversalHandle::Cache& cache = th->m_cache;
+    if( cache.m_vao == 0 ) {
+#ifdef DEBUG
+        cerr << "HPMC error: drawCachedSurface called before extractToBuffer." << endl;
+#endif
+        return false;
+    }
+
+    // --- store current state -------------------------------------------------
+    GLint curr_vao = 0;
+    if( !s->m_stateless ) {
+        glGetIntegerv( GL_VERTEX_ARRAY_BINDING, &curr_vao );
+    }
+
+    // --- render triangles ----------------------------------------------------
+    glBindVertexArray( cache.m_vao );
+    if( cache.m_feedback != 0 ) {
+        glDrawTransformFeedback( GL_TRIANGLES, cache.m_feedback );
+    }
+    else {
+        glDrawArrays( GL_TRIANGLES, 0, cache.m_count );
+    }
+
+    // --- restore state -------------------------------------------------------
+    glBindVertexArray( curr_vao );
+
+    if( !HPMCcheckGLUnlessStateless( s, __FILE__, __LINE__ ) ) {
+#ifdef DEBUG
+        cerr << "HPMC error: drawCachedSurface produced GL errors." << endl;
+#endif
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+GLuint
+HPMCgetCachedVertexArray( struct HPMCTraversalHandle* th )
+{
+    if( th == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: th == NULL." << endl;
+#endif
+        return 0;
+    }
+    return th->m_cache.m_vao;
+}
+
+// -----------------------------------------------------------------------------
+GLuint
+HPMCgetCachedBuffer( struct HPMCTraversalHandle* th )
+{
+    if( th == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: th == NULL." << endl;
+#endif
+        return 0;
+    }
+    return th->m_cache.m_buffer;
+}
+
+// -----------------------------------------------------------------------------
+GLuint
+HPMCgetCachedTransformFeedback( struct HPMCTraversalHandle* th )
+{
+    if( th == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: th == NULL." << endl;
+#endif
+        return 0;
+    }
+    return th->m_cache.m_feedback;
+}
+
+// -----------------------------------------------------------------------------
+GLsizei
+HPMCgetCachedVertexCount( struct HPMCTraversalHandle* th )
+{
+    if( th == NULL ) {
+#ifdef DEBUG
+        cerr << "HPMC error: th == NULL." << endl;
+#endif
+        return 0;
+    }
+    return th->m_cache.m_count;
+}
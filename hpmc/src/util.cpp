@@ -27,8 +27,10 @@
  *********************************************************************/
 
 #include <cstdlib>
+#include <cstdio>
 #include <cmath>
 #include <iostream>
+#include <fstream>
 #include <algorithm>
 #include <string>
 #include <sstream>
@@ -44,6 +46,296 @@ using std::setw;
 using std::cerr;
 using std::endl;
 
+// -----------------------------------------------------------------------------
+bool
+HPMCintegerStorage( const struct HPMCHistoPyramid* h )
+{
+    return h->m_histopyramid.m_format == GL_RGBA32UI;
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCseparateCodes( const struct HPMCHistoPyramid* h )
+{
+    return h->m_histopyramid.m_separate_codes;
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMClevelSkipped( const struct HPMCHistoPyramid* h, GLsizei level )
+{
+    const GLsizei top = h->m_histopyramid.m_size_l2;
+    return (h->m_histopyramid.m_fan_out == 16) &&
+           (2 <= level) && (level < top) && (((top-level) % 2) == 0);
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCfragmentOutput( const struct HPMCHistoPyramid* h )
+{
+    return HPMCintegerStorage( h ) || HPMCseparateCodes( h ) ||
+           (h->m_surface_count > 1) || h->m_indexed.m_enabled ||
+           h->m_per_cell.m_enabled || h->m_constants->m_core;
+}
+
+// -----------------------------------------------------------------------------
+GLuint
+HPMClevelTexture( const struct HPMCHistoPyramid* h, GLsizei level, GLint& tex_level )
+{
+    const HPMCHistoPyramid::HistoPyramid& hp = h->m_histopyramid;
+    if( (hp.m_split_level > 0) && (hp.m_split_level <= level) ) {
+        tex_level = level - hp.m_split_level;
+        return hp.m_tex_upper;
+    }
+    tex_level = level;
+    return hp.m_tex;
+}
+
+// -----------------------------------------------------------------------------
+struct HPMCHistoPyramid*
+HPMCsurface( struct HPMCHistoPyramid* h, GLsizei surface )
+{
+    if( surface == 0 ) {
+        return h;
+    }
+    if( (surface < 0) || (static_cast<GLsizei>( h->m_surfaces.size() ) < surface) ) {
+        return NULL;
+    }
+    return h->m_surfaces[ surface-1 ];
+}
+
+// -----------------------------------------------------------------------------
+GLsizei
+HPMCbaseLevelOutputs( const struct HPMCHistoPyramid* h )
+{
+    return h->m_surface_count + (h->m_indexed.m_enabled ? 1 : 0) +
+           (h->m_per_cell.m_enabled ? 1 : 0);
+}
+
+// -----------------------------------------------------------------------------
+struct HPMCHistoPyramid*
+HPMCbaseLevelOutput( struct HPMCHistoPyramid* h, GLsizei output )
+{
+    if( output < h->m_surface_count ) {
+        return HPMCsurface( h, output );
+    }
+    if( h->m_indexed.m_enabled && (output == h->m_surface_count) ) {
+        return h->m_indexed.m_edges;
+    }
+    return h->m_per_cell.m_cells;
+}
+
+// -----------------------------------------------------------------------------
+struct HPMCHistoPyramid*
+HPMCfrontBuffer( struct HPMCHistoPyramid* h )
+{
+    return h->m_front != NULL ? h->m_front : h;
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetHistoPyramidLevels( const struct HPMCHistoPyramid* h )
+{
+    const HPMCHistoPyramid::HistoPyramid& hp = h->m_histopyramid;
+    if( hp.m_split_level > 0 ) {
+        HPMCsetTextureLevels( h->m_constants, hp.m_tex_upper, 0, hp.m_size_l2-hp.m_split_level );
+        HPMCsetTextureLevels( h->m_constants, hp.m_tex, 0, hp.m_split_level-1 );
+    }
+    else {
+        HPMCsetTextureLevels( h->m_constants, hp.m_tex, 0, hp.m_size_l2 );
+    }
+}
+
+// -----------------------------------------------------------------------------
+std::string
+HPMCgpgpuShaderVersion( const struct HPMCHistoPyramid* h )
+{
+    if( h->m_constants->m_core ) {
+        return "#version 330 core\n";
+    }
+    // Integer storage and separate codes need integer fragment outputs,
+    // several surfaces and edge or cell HistoPyramids need several outputs, and brick
+    // and depth pyramid lookups need texelFetch, available from GLSL 1.30.
+    else if( HPMCintegerStorage( h ) || HPMCseparateCodes( h ) ||
+             (h->m_surface_count > 1) || h->m_indexed.m_enabled ||
+             h->m_per_cell.m_enabled || h->m_bricks.m_enabled ||
+             h->m_occlusion.m_enabled ) {
+        return "#version 130\n";
+    }
+    return "";
+}
+
+// -----------------------------------------------------------------------------
+std::string
+HPMCcomputeShaderVersion( const struct HPMCHistoPyramid* h )
+{
+    if( h->m_constants->m_core ) {
+        return "#version 430 core\n";
+    }
+    return "#version 430 compatibility\n";
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCtopReadbackReady( struct HPMCHistoPyramid* h, GLsizei slot )
+{
+    HPMCHistoPyramid::HistoPyramid& hp = h->m_histopyramid;
+    HPMCHistoPyramid::HistoPyramid::TopReadback& rb = hp.m_top_readbacks[ slot ];
+    if( !rb.m_pending ) {
+        return false;
+    }
+    if( rb.m_fence == 0 ) {
+        return slot != hp.m_top_latest;
+    }
+    GLenum status = glClientWaitSync( rb.m_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0 );
+    return (status == GL_ALREADY_SIGNALED) || (status == GL_CONDITION_SATISFIED);
+}
+
+// -----------------------------------------------------------------------------
+GLsizei
+HPMCreadTopCount( struct HPMCHistoPyramid* h, GLsizei slot )
+{
+    HPMCHistoPyramid::HistoPyramid& hp = h->m_histopyramid;
+    GLsizei count = 0;
+    const GLsizei n_values = 4*hp.m_top_size[0]*hp.m_top_size[1];
+    glBindBuffer( GL_PIXEL_PACK_BUFFER, hp.m_top_readbacks[ slot ].m_pbo );
+    if( HPMCintegerStorage( h ) ) {
+        vector<GLuint> mem( n_values );
+        glGetBufferSubData( GL_PIXEL_PACK_BUFFER,
+                            0, sizeof(GLuint)*n_values,
+                            &mem[0] );
+        for( GLsizei i=0; i<n_values; i++ ) {
+            count += static_cast<GLsizei>( mem[i] );
+        }
+    }
+    else {
+        vector<GLfloat> mem( n_values );
+        glGetBufferSubData( GL_PIXEL_PACK_BUFFER,
+                            0, sizeof(GLfloat)*n_values,
+                            &mem[0] );
+        for( GLsizei i=0; i<n_values; i++ ) {
+            count += static_cast<GLsizei>( floorf(mem[i]) );
+        }
+    }
+    glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+
+    // --- this readback and older ones are no longer of interest --------------
+    const GLsizei n = HPMC_TOP_READBACK_RING_SIZE;
+    for( GLsizei age=(hp.m_top_latest-slot+n)%n; age<n; age++ ) {
+        HPMCHistoPyramid::HistoPyramid::TopReadback& rb =
+                hp.m_top_readbacks[ (hp.m_top_latest-age+n)%n ];
+        if( rb.m_fence != 0 ) {
+            glDeleteSync( rb.m_fence );
+            rb.m_fence = 0;
+        }
+        rb.m_pending = false;
+    }
+    hp.m_top_count_arrived = count;
+    return count;
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCcheckGLUnlessStateless( const struct HPMCConstants* s,
+                            const std::string&          file,
+                            const int                   line )
+{
+#ifndef DEBUG
+    if( s->m_stateless ) {
+        return true;
+    }
+#endif
+    return HPMCcheckGL( file, line );
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCbindTextureUnit( const struct HPMCConstants* s,
+                     GLuint                      unit,
+                     GLenum                      target,
+                     GLuint                      tex )
+{
+    if( s->m_stateless ) {
+        glBindTextureUnit( unit, tex );
+    }
+    else {
+        glActiveTextureARB( GL_TEXTURE0_ARB + unit );
+        glBindTexture( target, tex );
+    }
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCsetTextureLevels( const struct HPMCConstants* s,
+                      GLuint                      tex,
+                      GLint                       base_level,
+                      GLint                       max_level )
+{
+    if( s->m_stateless ) {
+        glTextureParameteri( tex, GL_TEXTURE_BASE_LEVEL, base_level );
+        glTextureParameteri( tex, GL_TEXTURE_MAX_LEVEL, max_level );
+    }
+    else {
+        glBindTexture( GL_TEXTURE_2D, tex );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, base_level );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, max_level );
+    }
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCpushAttribs( const struct HPMCConstants* s,
+                 struct HPMCAttribs&         a,
+                 GLbitfield                  server_mask )
+{
+    a.m_has_viewport = false;
+    a.m_has_scissor = false;
+    if( s->m_core ) {
+        glGetIntegerv( GL_VERTEX_ARRAY_BINDING, &a.m_vao );
+        if( server_mask & GL_VIEWPORT_BIT ) {
+            glGetIntegerv( GL_VIEWPORT, a.m_viewport );
+            a.m_has_viewport = true;
+        }
+        if( server_mask & GL_SCISSOR_BIT ) {
+            glGetIntegerv( GL_SCISSOR_BOX, a.m_scissor_box );
+            a.m_scissor_test = glIsEnabled( GL_SCISSOR_TEST );
+            a.m_has_scissor = true;
+        }
+    }
+    else {
+        glPushClientAttrib( GL_CLIENT_VERTEX_ARRAY_BIT );
+        glPushAttrib( server_mask );
+    }
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCpopAttribs( const struct HPMCConstants* s,
+                const struct HPMCAttribs&   a )
+{
+    if( s->m_core ) {
+        glBindVertexArray( a.m_vao );
+        if( a.m_has_viewport ) {
+            glViewport( a.m_viewport[0], a.m_viewport[1],
+                        a.m_viewport[2], a.m_viewport[3] );
+        }
+        if( a.m_has_scissor ) {
+            glScissor( a.m_scissor_box[0], a.m_scissor_box[1],
+                       a.m_scissor_box[2], a.m_scissor_box[3] );
+            if( a.m_scissor_test ) {
+                glEnable( GL_SCISSOR_TEST );
+            }
+            else {
+                glDisable( GL_SCISSOR_TEST );
+            }
+        }
+    }
+    else {
+        glPopAttrib();
+        glPopClientAttrib();
+    }
+}
+
 // -----------------------------------------------------------------------------
 #define HELPER(a) case a: error = #a; break
 
@@ -104,7 +396,7 @@ HPMCaddLineNumbers( const std::string& src )
 
 // -----------------------------------------------------------------------------
 GLuint
-HPMCcompileShader( const std::string& src, GLuint type )
+HPMCcreateShader( const std::string& src, GLuint type )
 {
     GLuint shader = glCreateShader( type );
 
@@ -112,20 +404,30 @@ HPMCcompileShader( const std::string& src, GLuint type )
     const char* p = src.c_str();
     glShaderSource( shader, 1, &p, NULL );
     glCompileShader( shader );
+    return shader;
+}
 
+// -----------------------------------------------------------------------------
+bool
+HPMCcheckShader( GLuint shader )
+{
     // check if everything is ok
     GLint status;
     glGetShaderiv( shader, GL_COMPILE_STATUS, &status );
     if( status == GL_TRUE ) {
         // successful compilation
-        return shader;
+        return true;
     }
 
     // compilation failed
 #ifdef DEBUG
+    GLint srcsize;
+    glGetShaderiv( shader, GL_SHADER_SOURCE_LENGTH, &srcsize );
+    vector<GLchar> src( srcsize+1 );
+    glGetShaderSource( shader, srcsize+1, NULL, &src[0] );
     cerr << "HPMC error: compilation of shader failed." << endl;
     cerr << "HPMC error: *** shader source code ***" << endl;
-    cerr << HPMCaddLineNumbers( src );
+    cerr << HPMCaddLineNumbers( &src[0] );
     cerr << "HPMC error: *** shader build log ***" << endl;
 
     // get size of build log
@@ -142,17 +444,13 @@ HPMCcompileShader( const std::string& src, GLuint type )
         cerr << string( infolog.begin(), infolog.end() ) << endl;
     }
 #endif
-
-    glDeleteShader( shader );
-    return 0u;
+    return false;
 }
 
 // -----------------------------------------------------------------------------
 bool
-HPMClinkProgram( GLuint program )
+HPMCcheckProgram( GLuint program )
 {
-    glLinkProgram( program );
-
     GLint linkstatus;
     glGetProgramiv( program, GL_LINK_STATUS, &linkstatus );
     if( linkstatus == GL_TRUE ) {
@@ -183,6 +481,295 @@ HPMClinkProgram( GLuint program )
     return false;
 }
 
+// -----------------------------------------------------------------------------
+/** Prefixes a program cache key with the driver identification strings. */
+static string
+HPMCprogramCacheKey( const char* key )
+{
+    stringstream o;
+    const GLubyte* vendor = glGetString( GL_VENDOR );
+    const GLubyte* renderer = glGetString( GL_RENDERER );
+    const GLubyte* version = glGetString( GL_VERSION );
+    o << (vendor != NULL ? reinterpret_cast<const char*>( vendor ) : "") << endl
+      << (renderer != NULL ? reinterpret_cast<const char*>( renderer ) : "") << endl
+      << (version != NULL ? reinterpret_cast<const char*>( version ) : "") << endl
+      << key;
+    return o.str();
+}
+
+// -----------------------------------------------------------------------------
+/** The cache file of a full program cache key, named by its 64-bit FNV-1a hash. */
+static string
+HPMCprogramCachePath( const struct HPMCConstants* s, const string& full_key )
+{
+    unsigned long long hash = 14695981039346656037ull;
+    for( size_t i=0; i<full_key.size(); i++ ) {
+        hash = (hash ^ static_cast<unsigned char>( full_key[i] ))*1099511628211ull;
+    }
+    stringstream o;
+    o << s->m_binary_cache_dir << "/hpmc-"
+      << std::hex << std::setfill( '0' ) << setw(16) << hash << ".bin";
+    return o.str();
+}
+
+// The cache file holds a header of four GLuints (magic, binary format, key
+// size and binary size), the full key, and the program binary. The key is
+// compared on load, so hash collisions only cause misses.
+static const GLuint HPMC_PROGRAM_CACHE_MAGIC = 0x48504d43u;
+
+// -----------------------------------------------------------------------------
+GLuint
+HPMCloadCachedProgram( struct HPMCConstants* s, const char* key )
+{
+    if( (s == NULL) || (key == NULL) || s->m_binary_cache_dir.empty() ) {
+        return 0u;
+    }
+    const string full_key = HPMCprogramCacheKey( key );
+    std::ifstream file( HPMCprogramCachePath( s, full_key ).c_str(), std::ios::in | std::ios::binary );
+    if( !file ) {
+        return 0u;
+    }
+    GLuint header[4];
+    if( !file.read( reinterpret_cast<char*>( header ), sizeof(header) ) ||
+        (header[0] != HPMC_PROGRAM_CACHE_MAGIC) ||
+        (header[2] != full_key.size()) ||
+        (header[3] == 0) )
+    {
+        return 0u;
+    }
+    vector<char> stored_key( header[2] );
+    vector<char> binary( header[3] );
+    if( !file.read( &stored_key[0], stored_key.size() ) ||
+        !std::equal( stored_key.begin(), stored_key.end(), full_key.begin() ) ||
+        !file.read( &binary[0], binary.size() ) )
+    {
+        return 0u;
+    }
+
+    GLuint program = glCreateProgram();
+    glProgramBinary( program, header[1], &binary[0], static_cast<GLsizei>( binary.size() ) );
+    GLint linkstatus;
+    glGetProgramiv( program, GL_LINK_STATUS, &linkstatus );
+    if( linkstatus != GL_TRUE ) {
+        // The driver rejected the binary, the program is rebuilt from source.
+#ifdef DEBUG
+        cerr << "HPMC warning: rejected cached program binary." << endl;
+#endif
+        glDeleteProgram( program );
+        return 0u;
+    }
+    return program;
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCstoreCachedProgram( struct HPMCConstants* s, const char* key, GLuint program )
+{
+    if( (s == NULL) || (key == NULL) || s->m_binary_cache_dir.empty() ) {
+        return false;
+    }
+    GLint length = 0;
+    glGetProgramiv( program, GL_PROGRAM_BINARY_LENGTH, &length );
+    if( length <= 0 ) {
+        return false;
+    }
+    vector<char> binary( length );
+    GLenum format = 0;
+    glGetProgramBinary( program, length, &length, &format, &binary[0] );
+    if( !HPMCcheckGL( __FILE__, __LINE__ ) || (length <= 0) ) {
+#ifdef DEBUG
+        cerr << "HPMC warning: failed to get program binary." << endl;
+#endif
+        return false;
+    }
+
+    // Write to a temporary file and rename it, so that concurrent runs never
+    // see a partial file.
+    const string full_key = HPMCprogramCacheKey( key );
+    const string path = HPMCprogramCachePath( s, full_key );
+    const string tmp_path = path + ".tmp";
+    {
+        std::ofstream file( tmp_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+        GLuint header[4] = { HPMC_PROGRAM_CACHE_MAGIC,
+                             format,
+                             static_cast<GLuint>( full_key.size() ),
+                             static_cast<GLuint>( length ) };
+        file.write( reinterpret_cast<const char*>( header ), sizeof(header) );
+        file.write( full_key.data(), full_key.size() );
+        file.write( &binary[0], length );
+        if( !file ) {
+#ifdef DEBUG
+            cerr << "HPMC warning: failed to write \"" << tmp_path << "\"." << endl;
+#endif
+            file.close();
+            std::remove( tmp_path.c_str() );
+            return false;
+        }
+    }
+    if( std::rename( tmp_path.c_str(), path.c_str() ) != 0 ) {
+        // rename does not replace existing files on all platforms.
+        std::remove( path.c_str() );
+        if( std::rename( tmp_path.c_str(), path.c_str() ) != 0 ) {
+            std::remove( tmp_path.c_str() );
+            return false;
+        }
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+/** The key of a program in the program binary cache.
+  *
+  * The output bindings are baked into the binary, so they are part of the key.
+  */
+static string
+HPMCprogramSourceKey( const HPMCProgramSource& src )
+{
+    stringstream key;
+    key << src.m_vertex << src.m_main;
+    for( size_t i=0; i<src.m_outputs.size(); i++ ) {
+        key << "// output " << i << " " << src.m_outputs[i] << endl;
+    }
+    return key.str();
+}
+
+// -----------------------------------------------------------------------------
+/** Shares or starts building a program, see HPMCissueProgram. */
+static HPMCConstants::ProgramMap::iterator
+HPMCissueSharedProgram( struct HPMCConstants*     s,
+                        const HPMCProgramSource&  src,
+                        GLuint                    tex_unit )
+{
+    // the sampler uniforms are set once per program, so a program is only
+    // shared between users of the same texture units.
+    const HPMCConstants::ProgramKey shared_key( HPMCprogramSourceKey( src ), tex_unit );
+    HPMCConstants::ProgramMap::iterator it = s->m_programs.find( shared_key );
+    if( it != s->m_programs.end() ) {
+        it->second.m_refs++;
+        return it;
+    }
+
+    HPMCConstants::SharedProgram shared;
+    shared.m_refs = 1;
+    shared.m_shaders[0] = 0;
+    shared.m_shaders[1] = 0;
+    shared.m_program = HPMCloadCachedProgram( s, shared_key.first.c_str() );
+    shared.m_checked = shared.m_program != 0;
+    shared.m_linked = shared.m_program != 0;
+    if( !shared.m_checked ) {
+        // with KHR_parallel_shader_compile, these calls return without waiting
+        // for the compiler, the status is checked by HPMCbuildProgram.
+        GLuint n = 0;
+        if( !src.m_vertex.empty() ) {
+            shared.m_shaders[n++] = HPMCcreateShader( src.m_vertex, GL_VERTEX_SHADER );
+        }
+        shared.m_shaders[n++] = HPMCcreateShader( src.m_main, src.m_type );
+
+        shared.m_program = glCreateProgram();
+        for( GLuint i=0; i<n; i++ ) {
+            glAttachShader( shared.m_program, shared.m_shaders[i] );
+        }
+        if( src.m_type == GL_VERTEX_SHADER ) {
+            std::vector<const GLchar*> varyings;
+            for( size_t i=0; i<src.m_outputs.size(); i++ ) {
+                varyings.push_back( src.m_outputs[i].c_str() );
+            }
+            glTransformFeedbackVaryings( shared.m_program,
+                                         static_cast<GLsizei>( varyings.size() ),
+                                         varyings.empty() ? NULL : &varyings[0],
+                                         GL_INTERLEAVED_ATTRIBS );
+        }
+        else {
+            for( size_t i=0; i<src.m_outputs.size(); i++ ) {
+                if( !src.m_outputs[i].empty() ) {
+                    glBindFragDataLocation( shared.m_program, static_cast<GLuint>( i ), src.m_outputs[i].c_str() );
+                }
+            }
+        }
+        if( !s->m_binary_cache_dir.empty() ) {
+            glProgramParameteri( shared.m_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE );
+        }
+        glLinkProgram( shared.m_program );
+    }
+    return s->m_programs.insert( std::make_pair( shared_key, shared ) ).first;
+}
+
+// -----------------------------------------------------------------------------
+GLuint
+HPMCissueProgram( struct HPMCConstants*     s,
+                  const HPMCProgramSource&  src,
+                  GLuint                    tex_unit )
+{
+    return HPMCissueSharedProgram( s, src, tex_unit )->second.m_program;
+}
+
+// -----------------------------------------------------------------------------
+bool
+HPMCprogramCompleted( const struct HPMCConstants* s, GLuint program )
+{
+    if( !s->m_parallel_compile ) {
+        return true;
+    }
+    GLint completed = GL_TRUE;
+    glGetProgramiv( program, GL_COMPLETION_STATUS_KHR, &completed );
+    return completed == GL_TRUE;
+}
+
+// -----------------------------------------------------------------------------
+GLuint
+HPMCbuildProgram( struct HPMCConstants*     s,
+                  const HPMCProgramSource&  src,
+                  GLuint                    tex_unit )
+{
+    HPMCConstants::ProgramMap::iterator it = HPMCissueSharedProgram( s, src, tex_unit );
+    HPMCConstants::SharedProgram& shared = it->second;
+    const GLuint program = shared.m_program;
+    if( !shared.m_checked ) {
+        bool compiled = true;
+        for( GLuint i=0; i<2; i++ ) {
+            if( shared.m_shaders[i] != 0 ) {
+                compiled = HPMCcheckShader( shared.m_shaders[i] ) && compiled;
+                // the linked program does not need the shader objects.
+                glDetachShader( program, shared.m_shaders[i] );
+                glDeleteShader( shared.m_shaders[i] );
+                shared.m_shaders[i] = 0;
+            }
+        }
+        shared.m_linked = compiled && HPMCcheckProgram( program );
+        shared.m_checked = true;
+        if( shared.m_linked ) {
+            HPMCstoreCachedProgram( s, it->first.first.c_str(), program );
+        }
+    }
+    if( !shared.m_linked ) {
+        HPMCreleaseProgram( s, program );
+        return 0u;
+    }
+    return program;
+}
+
+// -----------------------------------------------------------------------------
+void
+HPMCreleaseProgram( struct HPMCConstants* s, GLuint program )
+{
+    for( HPMCConstants::ProgramMap::iterator it = s->m_programs.begin(); it != s->m_programs.end(); ++it ) {
+        if( it->second.m_program == program ) {
+            if( --it->second.m_refs == 0 ) {
+                for( GLuint i=0; i<2; i++ ) {
+                    if( it->second.m_shaders[i] != 0 ) {
+                        glDeleteShader( it->second.m_shaders[i] );
+                    }
+                }
+                glDeleteProgram( program );
+                s->m_programs.erase( it );
+            }
+            return;
+        }
+    }
+#ifdef DEBUG
+    cerr << "HPMC warning: released program " << program << " is not shared." << endl;
+#endif
+}
 // -----------------------------------------------------------------------------
 GLint
 HPMCgetUniformLocation( GLuint program, const std::string& name )
@@ -200,6 +787,11 @@ HPMCgetUniformLocation( GLuint program, const std::string& name )
 void
 HPMCrenderGPGPUQuad( struct HPMCHistoPyramid* h )
 {
+    if( h->m_constants->m_core ) {
+        glBindVertexArray( h->m_constants->m_empty_vao );
+        glDrawArrays( GL_TRIANGLES, 0, 3 );
+        return;
+    }
     glBindBuffer( GL_ARRAY_BUFFER, h->m_constants->m_gpgpu_quad_vbo );
     glVertexPointer( 3, GL_FLOAT, 0, NULL );
     glEnableClientState( GL_VERTEX_ARRAY );